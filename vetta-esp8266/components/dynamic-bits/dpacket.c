@@ -54,7 +54,7 @@ char RegisterPacket(packet_id_t packet_id, int *packet_format, size_t format_siz
 
 int *GetPacketFormat(packet_id_t packet_id, size_t *out_size)
 {
-    if (packet_id > PACKET_TABLE_SIZE || out_size == NULL)
+    if (packet_id >= PACKET_TABLE_SIZE || out_size == NULL)
     {
         return NULL;
     }
@@ -0,0 +1,102 @@
+#include <stdio.h>
+#include <string.h>
+#include "mdns.h"
+#include "discovery.h"
+#include "listener.h"
+#include "advertise.h"
+
+static unsigned char is_initialized = 0;
+
+// Last advertised TXT values
+static uint8_t advertisedState = 0;
+static uint8_t advertisedManaged = 0;
+
+static char hostname[ADVERTISE_NAME_BUFFER_SIZE];
+static char instanceName[ADVERTISE_NAME_BUFFER_SIZE];
+static char seedValue[11];
+static char modelValue[4];
+static char stateValue[4];
+static char managedValue[2];
+
+esp_err_t init_service_advertise(uint32_t lamp_seed){
+
+    static esp_err_t _err;
+
+    if (is_initialized)
+    {
+        return ESP_OK;
+    }
+
+    snprintf(hostname, ADVERTISE_NAME_BUFFER_SIZE, ADVERTISE_HOSTNAME_PREFIX "%08x", lamp_seed);
+    snprintf(instanceName, ADVERTISE_NAME_BUFFER_SIZE, ADVERTISE_INSTANCE_PREFIX "%08x", lamp_seed);
+    snprintf(seedValue, sizeof(seedValue), "%u", lamp_seed);
+    snprintf(modelValue, sizeof(modelValue), "%u", LAMP_MODEL_INTEGER);
+    snprintf(stateValue, sizeof(stateValue), "%u", 0);
+    snprintf(managedValue, sizeof(managedValue), "%u", 0);
+
+    advertisedState = 0;
+    advertisedManaged = 0;
+
+    mdns_txt_item_t txtData[] = {
+        {"seed", seedValue},
+        {"model", modelValue},
+        {"state", stateValue},
+        {"managed", managedValue}};
+
+    // Adding the service announces it to the network
+    if (ESP_OK != (_err = mdns_init()))
+    {
+        return _err;
+    }
+
+    if (ESP_OK != (_err = mdns_hostname_set(hostname)) ||
+        ESP_OK != (_err = mdns_instance_name_set(instanceName)) ||
+        ESP_OK != (_err = mdns_service_add(NULL, ADVERTISE_SERVICE_TYPE, ADVERTISE_SERVICE_PROTO,
+                                           LISTENER_SERVER_PORT, txtData, sizeof(txtData) / sizeof(txtData[0]))))
+    {
+        mdns_free();
+        return _err;
+    }
+
+    is_initialized = 1;
+    return ESP_OK;
+}
+
+void close_service_advertise(void){
+    if (is_initialized)
+    {
+        mdns_free();
+    }
+    is_initialized = 0;
+}
+
+esp_err_t service_advertise_update(uint8_t current_lamp_state, uint8_t is_managed){
+
+    if (!is_initialized)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    // Each TXT change is announced unsolicited
+    if (current_lamp_state != advertisedState)
+    {
+        snprintf(stateValue, sizeof(stateValue), "%u", current_lamp_state);
+        if (ESP_OK != mdns_service_txt_item_set(ADVERTISE_SERVICE_TYPE, ADVERTISE_SERVICE_PROTO, "state", stateValue))
+        {
+            return ESP_FAIL;
+        }
+        advertisedState = current_lamp_state;
+    }
+
+    if (is_managed != advertisedManaged)
+    {
+        snprintf(managedValue, sizeof(managedValue), "%u", is_managed ? 1 : 0);
+        if (ESP_OK != mdns_service_txt_item_set(ADVERTISE_SERVICE_TYPE, ADVERTISE_SERVICE_PROTO, "managed", managedValue))
+        {
+            return ESP_FAIL;
+        }
+        advertisedManaged = is_managed;
+    }
+
+    return ESP_OK;
+}
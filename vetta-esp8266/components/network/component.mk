@@ -2,7 +2,3 @@
 # "main" pseudo-component makefile.
 #
 # (Uses default behaviour of compiling all source files in directory, adding 'include' to include path.)
-
-COMPONENT_EMBED_TXTFILES := ca.pem
-COMPONENT_EMBED_TXTFILES += lamp.pem
-COMPONENT_EMBED_TXTFILES += lamp.key
@@ -9,21 +9,33 @@
 #include "packets.h"
 #include "discovery.h"
 
-static in_addr_t ipAddress = 0;
-static uint32_t lampSeed = 0;
+static unsigned char take_rate_token(discovery_server_t *server){
 
-static int server_socket = -1;
+    TickType_t now = xTaskGetTickCount();
+    TickType_t refill = (now - server->rate_refill_ticks) * portTICK_PERIOD_MS / DISCOVERY_RATE_REFILL_MILLIS;
+    if(refill > 0){
+        server->rate_tokens = (server->rate_tokens + refill > DISCOVERY_RATE_BURST) ? DISCOVERY_RATE_BURST : server->rate_tokens + refill;
+        server->rate_refill_ticks += refill * DISCOVERY_RATE_REFILL_MILLIS / portTICK_PERIOD_MS;
+    }
 
-static unsigned char recvBuffer[DISCOVERY_SERVER_BUFFER_SIZE];
-static unsigned char sendBuffer[DISCOVERY_SERVER_BUFFER_SIZE];
+    if(server->rate_tokens == 0){
+        return 0;
+    }
+    server->rate_tokens--;
+    return 1;
+}
 
-esp_err_t init_discovery_server(in_addr_t ip, uint32_t lamp_seed){
+esp_err_t init_discovery_server(discovery_server_t *server, in_addr_t ip, uint32_t lamp_seed){
 
-    ipAddress = ip;
-    lampSeed = lamp_seed;
+    server->ip = ip;
+    server->lamp_seed = lamp_seed;
+    server->ack_frame_size = 0;
 
-    server_socket = socket(AF_INET, SOCK_DGRAM, 0);
-    if (server_socket < 0)
+    server->rate_tokens = DISCOVERY_RATE_BURST;
+    server->rate_refill_ticks = xTaskGetTickCount();
+
+    server->server_socket = socket(AF_INET, SOCK_DGRAM, 0);
+    if (server->server_socket < 0)
     {
         return ESP_FAIL;
     }
@@ -32,99 +44,116 @@ esp_err_t init_discovery_server(in_addr_t ip, uint32_t lamp_seed){
     memset(&serverAddr, 0, sizeof(serverAddr));
 
     serverAddr.sin_family = AF_INET;
-    serverAddr.sin_addr.s_addr = ipAddress;
+    serverAddr.sin_addr.s_addr = server->ip;
     serverAddr.sin_port = htons(DISCOVERY_SERVER_PORT);
 
-    if(0 > bind(server_socket, (struct sockaddr *)&serverAddr, sizeof(serverAddr)))
+    if(0 > bind(server->server_socket, (struct sockaddr *)&serverAddr, sizeof(serverAddr)))
     {
-        close(server_socket);
-        server_socket = -1;
+        close(server->server_socket);
+        server->server_socket = -1;
         return ESP_FAIL;
     }
 
     return ESP_OK;
 }
 
-void close_discovery_server(void){
-    if (server_socket != -1)
+void close_discovery_server(discovery_server_t *server){
+    if (server->server_socket != -1)
     {
-        close(server_socket);
-        server_socket = -1;
+        close(server->server_socket);
+        server->server_socket = -1;
     }
 }
 
-static esp_err_t send_discovery_response(u32_t networkAddr, uint8_t current_lamp_state, uint8_t is_managed){
+static esp_err_t encode_discovery_ack(discovery_server_t *server, uint8_t current_lamp_state, uint8_t is_managed){
 
-    int client_socket = socket(AF_INET, SOCK_DGRAM, 0);
-    if (client_socket < 0)
+    if(server->ack_frame_size > 0 &&
+        server->ack_frame_state == current_lamp_state &&
+        server->ack_frame_managed == is_managed)
     {
-        return ESP_FAIL;
+        // Cached frame is up to date
+        return ESP_OK;
     }
-
-    struct sockaddr_in destAddr;
-    memset(&destAddr, 0, sizeof(destAddr));
-
-    destAddr.sin_family = AF_INET;
-    destAddr.sin_addr.s_addr = networkAddr;
-    destAddr.sin_port = htons(BROKER_DISCOVERY_SERVER_PORT);
+    server->ack_frame_size = 0;
 
     dpacket_struct_t dpacket;
     if(!NewPacket(&dpacket, BROKER_DISCOVERY_ACK_PACKET_ID)){
-        close(client_socket);
         return ESP_FAIL;
     }
 
-    if(!AddSerializable(&dpacket, UINT32_STYPE, (data_union_t){.decimal_v.u32_v = ipAddress}) ||
-        !AddSerializable(&dpacket, UINT32_STYPE, (data_union_t){.decimal_v.u32_v = lampSeed}) ||
+    if(!AddSerializable(&dpacket, UINT32_STYPE, (data_union_t){.decimal_v.u32_v = server->ip}) ||
+        !AddSerializable(&dpacket, UINT32_STYPE, (data_union_t){.decimal_v.u32_v = server->lamp_seed}) ||
         !AddSerializable(&dpacket, UINT8_STYPE, (data_union_t){.decimal_v.u8_v = LAMP_MODEL_INTEGER}) ||
         !AddSerializable(&dpacket, UINT8_STYPE, (data_union_t){.decimal_v.u8_v = current_lamp_state}) ||
         !AddSerializable(&dpacket, BOOLEAN_STYPE, (data_union_t){.boolean_v = is_managed}))
     {
         FreePacket(&dpacket);
-        close(client_socket);
         return ESP_FAIL;
     }
 
     size_t packet_size = 0;
-    memset(sendBuffer, 0, sizeof(unsigned char)*DISCOVERY_SERVER_BUFFER_SIZE);
-    if(!SerializePacket(sendBuffer, DISCOVERY_SERVER_BUFFER_SIZE - 1, &dpacket, &packet_size) ||
+    memset(server->send_buffer, 0, sizeof(unsigned char)*DISCOVERY_SERVER_BUFFER_SIZE);
+    if(!SerializePacket(server->send_buffer, DISCOVERY_SERVER_BUFFER_SIZE - 1, &dpacket, &packet_size) ||
         packet_size == 0 || packet_size >= DISCOVERY_SERVER_BUFFER_SIZE)
     {
         FreePacket(&dpacket);
-        close(client_socket);
         return ESP_FAIL;
     }
     FreePacket(&dpacket);
 
-    if(packet_size != sendto(client_socket, sendBuffer, packet_size, 0,
+    server->ack_frame_size = packet_size;
+    server->ack_frame_state = current_lamp_state;
+    server->ack_frame_managed = is_managed;
+
+    return ESP_OK;
+}
+
+// Sends the ack frame cached in send_buffer
+static esp_err_t send_ack_frame(discovery_server_t *server, u32_t networkAddr){
+
+    struct sockaddr_in destAddr;
+    memset(&destAddr, 0, sizeof(destAddr));
+
+    destAddr.sin_family = AF_INET;
+    destAddr.sin_addr.s_addr = networkAddr;
+    destAddr.sin_port = htons(BROKER_DISCOVERY_SERVER_PORT);
+
+    // Reply from the bound discovery socket
+    if(server->ack_frame_size != sendto(server->server_socket, server->send_buffer, server->ack_frame_size, 0,
         (const struct sockaddr*)&destAddr, (socklen_t) sizeof(destAddr)))
     {
-        close(client_socket);
         return ESP_FAIL;
     }
-    close(client_socket);
 
     return ESP_OK;
 }
 
+static esp_err_t send_discovery_response(discovery_server_t *server, u32_t networkAddr, uint8_t current_lamp_state, uint8_t is_managed){
 
-esp_err_t discovery_listen(uint8_t current_lamp_state, uint8_t is_managed, uint32_t pinCode){
+    if(ESP_OK != encode_discovery_ack(server, current_lamp_state, is_managed)){
+        return ESP_FAIL;
+    }
 
-    static struct sockaddr_in clientAddr;
-    static socklen_t clientAddrLen;
-    clientAddrLen = sizeof(clientAddr);
+    return send_ack_frame(server, networkAddr);
+}
+
+
+esp_err_t discovery_listen(discovery_server_t *server, uint8_t current_lamp_state, uint8_t is_managed, uint32_t pinCode){
+
+    struct sockaddr_in clientAddr;
+    socklen_t clientAddrLen = sizeof(clientAddr);
 
-    static struct timeval time_out_v;
+    struct timeval time_out_v;
     time_out_v.tv_sec = 0;
     time_out_v.tv_usec = DISCOVERY_SERVER_SELECT_TIMEOUT; // 500ms
 
     fd_set set;
 
     FD_ZERO(&set);
-    FD_SET(server_socket, &set);
+    FD_SET(server->server_socket, &set);
 
     // select
-    int ret = select(server_socket + 1, &set, NULL, NULL, &time_out_v);
+    int ret = select(server->server_socket + 1, &set, NULL, NULL, &time_out_v);
     if (ret == -1){
         // Select Error
         return ESP_FAIL;
@@ -136,8 +165,8 @@ esp_err_t discovery_listen(uint8_t current_lamp_state, uint8_t is_managed, uint3
 
     // Socket selected
 
-    memset(recvBuffer, 0, sizeof(unsigned char) * DISCOVERY_SERVER_BUFFER_SIZE);
-    int len = recvfrom(server_socket, recvBuffer, DISCOVERY_SERVER_BUFFER_SIZE - 1, 0, (struct sockaddr *)&clientAddr, &clientAddrLen);
+    memset(server->recv_buffer, 0, sizeof(unsigned char) * DISCOVERY_SERVER_BUFFER_SIZE);
+    int len = recvfrom(server->server_socket, server->recv_buffer, DISCOVERY_SERVER_BUFFER_SIZE - 1, 0, (struct sockaddr *)&clientAddr, &clientAddrLen);
     if (len < 0){
         // Error occured during receiving
         return ESP_FAIL;
@@ -149,9 +178,9 @@ esp_err_t discovery_listen(uint8_t current_lamp_state, uint8_t is_managed, uint3
     else
     {
         // Data received
-        recvBuffer[len] = 0; // NULL terminate buffer
+        server->recv_buffer[len] = 0; // NULL terminate buffer
         dpacket_struct_t dpacket;
-        if (DeserializeBuffer(recvBuffer, len, &dpacket))
+        if (DeserializeBuffer(server->recv_buffer, len, &dpacket))
         {
             serializable_list_node_t * node = dpacket.data_list.first_node;
             if (dpacket.packet_id == BROKER_DISCOVERY_REQUEST_PACKET_ID &&
@@ -170,8 +199,14 @@ esp_err_t discovery_listen(uint8_t current_lamp_state, uint8_t is_managed, uint3
 
                 // Free packet reference
                 FreePacket(&dpacket);
-                // Send discovery response
-                return send_discovery_response(networkAddr, current_lamp_state, is_managed);
+
+                // Only requests carrying the pin spend tokens, junk cannot starve the brokers
+                if(!take_rate_token(server)){
+                    return ESP_ERR_TIMEOUT;
+                }
+
+                // Send discovery response, the cached frame unless state changed
+                return send_discovery_response(server, networkAddr, current_lamp_state, is_managed);
             }
             // Free packet reference
             FreePacket(&dpacket);
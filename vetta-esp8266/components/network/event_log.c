@@ -0,0 +1,511 @@
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_err.h"
+#include "esp_partition.h"
+#include "esp_timer.h"
+#include "dbits.h"
+#include "packets.h"
+#include "event_log.h"
+
+#define EVENT_LOG_SECTOR_MAGIC (0x4C455456UL) // "VTEL"
+
+// Flash page, queued records are programmed in batches of up to one page
+#define EVENT_LOG_BATCH_SIZE (256)
+
+// Records are padded to whole words so every program starts aligned
+#define RECORD_SPACE(payload_len) (sizeof(event_log_record_t) + (((payload_len) + 3UL) & ~3UL))
+
+// Written once right after the sector is erased
+typedef struct event_log_sector_t
+{
+    uint32_t magic;
+    uint32_t sequence;    // Bumped on every rotation, the highest one is the sector being written
+    uint32_t first_entry; // Sequence of the first entry stored in this sector
+    uint32_t reserved;
+
+} event_log_sector_t;
+
+// Precedes each serialized entry, an erased header (0xFFFF, 0xFFFF) ends the sector
+typedef struct event_log_record_t
+{
+    uint16_t length;
+    uint16_t check; // Fletcher-16 over length and payload, never 0xFFFF
+
+} event_log_record_t;
+
+typedef struct event_log_entry_t
+{
+    uint32_t uptime_millis;
+    uint32_t arg;
+    uint8_t type;
+
+} event_log_entry_t;
+
+// Entries copied out per pass under flash_lock, the reader gets them once it is released
+#define EVENT_LOG_READ_BATCH (8)
+
+// Entry copied out of flash for the reader
+typedef struct event_log_copy_t
+{
+    uint32_t sequence;
+    uint16_t length;
+    uint8_t payload[EVENT_LOG_MAX_RECORD_SIZE - sizeof(event_log_record_t)];
+
+} event_log_copy_t;
+
+// Reader state while walking sectors
+typedef struct event_log_cursor_t
+{
+    uint32_t after;
+    size_t remaining;
+    event_log_copy_t *copies;
+    size_t copied;
+
+} event_log_cursor_t;
+
+static const esp_partition_t *log_partition = NULL;
+static size_t sector_count = 0;
+
+// Created last by init_event_log, appends are refused until it exists
+static QueueHandle_t log_queue = NULL;
+// Serialises flushes and flash reads, appends never take it
+static SemaphoreHandle_t flash_lock = NULL;
+// Serialises readers, owns read_copies while the reader runs without flash_lock
+static SemaphoreHandle_t read_lock = NULL;
+static event_log_copy_t read_copies[EVENT_LOG_READ_BATCH];
+
+// Only incremented by appenders and only read by the writer, a lost increment undercounts
+static volatile uint32_t dropped_count = 0;
+static uint32_t dropped_reported = 0;
+
+// Sector being written, owned by whoever holds flash_lock
+static size_t current_sector = 0;
+static uint32_t current_sector_sequence = 0;
+static size_t write_offset = EVENT_LOG_SECTOR_SIZE;
+static uint32_t next_entry = 1;
+
+// Records placed in the current sector, programmed at write_offset
+static uint8_t batch[EVENT_LOG_BATCH_SIZE] __attribute__((aligned(4)));
+static size_t batch_len = 0;
+
+static uint16_t record_check(const uint8_t *payload, uint16_t len)
+{
+    uint16_t a = (len & 0xFF) % 255;
+    uint16_t b = (len >> 8) % 255;
+
+    for (uint16_t i = 0; i < len; i++)
+    {
+        a = (a + payload[i]) % 255;
+        b = (b + a) % 255;
+    }
+    return (b << 8) | a;
+}
+
+static esp_err_t read_sector_header(size_t ix, event_log_sector_t *header)
+{
+    static esp_err_t _err;
+
+    if (ESP_OK != (_err = esp_partition_read(log_partition, ix * EVENT_LOG_SECTOR_SIZE, header, sizeof(event_log_sector_t))))
+    {
+        return _err;
+    }
+
+    // Erased sectors read as 0xFF
+    return (header->magic == EVENT_LOG_SECTOR_MAGIC) ? ESP_OK : ESP_ERR_NOT_FOUND;
+}
+
+// Erases sector ix and makes it the one being written
+static esp_err_t start_sector(size_t ix, uint32_t sequence, uint32_t first_entry)
+{
+    static esp_err_t _err;
+    static event_log_sector_t header;
+
+    header.magic = EVENT_LOG_SECTOR_MAGIC;
+    header.sequence = sequence;
+    header.first_entry = first_entry;
+    header.reserved = 0xFFFFFFFFUL;
+
+    if (ESP_OK != (_err = esp_partition_erase_range(log_partition, ix * EVENT_LOG_SECTOR_SIZE, EVENT_LOG_SECTOR_SIZE)) ||
+        ESP_OK != (_err = esp_partition_write(log_partition, ix * EVENT_LOG_SECTOR_SIZE, &header, sizeof(header))))
+    {
+        return _err;
+    }
+
+    current_sector = ix;
+    current_sector_sequence = sequence;
+    write_offset = sizeof(event_log_sector_t);
+    return ESP_OK;
+}
+
+// Walks the records of sector ix, copying entries past cursor->after out for the reader.
+// Returns the offset of the first erased record, or the sector size if a torn record ends it
+static size_t walk_sector(size_t ix, uint32_t first_entry, event_log_cursor_t *cursor, uint32_t *count)
+{
+    static event_log_record_t record;
+    static uint8_t payload[EVENT_LOG_MAX_RECORD_SIZE];
+    size_t base = ix * EVENT_LOG_SECTOR_SIZE;
+    size_t offset = sizeof(event_log_sector_t);
+
+    *count = 0;
+    while (offset + sizeof(event_log_record_t) <= EVENT_LOG_SECTOR_SIZE)
+    {
+        if (ESP_OK != esp_partition_read(log_partition, base + offset, &record, sizeof(record)))
+        {
+            return EVENT_LOG_SECTOR_SIZE;
+        }
+
+        if (record.length == 0xFFFF && record.check == 0xFFFF)
+        {
+            return offset;
+        }
+
+        if (record.length == 0 ||
+            record.length > EVENT_LOG_MAX_RECORD_SIZE - sizeof(event_log_record_t) ||
+            offset + RECORD_SPACE(record.length) > EVENT_LOG_SECTOR_SIZE ||
+            ESP_OK != esp_partition_read(log_partition, base + offset + sizeof(record), payload, record.length) ||
+            record.check != record_check(payload, record.length))
+        {
+            // Power cut mid program, nothing can be appended behind it
+            return EVENT_LOG_SECTOR_SIZE;
+        }
+
+        uint32_t entry = first_entry + *count;
+        (*count)++;
+        offset += RECORD_SPACE(record.length);
+
+        if (cursor != NULL && cursor->remaining > 0 && (int32_t)(entry - cursor->after) > 0)
+        {
+            event_log_copy_t *copy = &cursor->copies[cursor->copied++];
+            copy->sequence = entry;
+            copy->length = record.length;
+            memcpy(copy->payload, payload, record.length);
+            cursor->remaining--;
+        }
+    }
+    return offset;
+}
+
+static esp_err_t write_batch(void)
+{
+    static esp_err_t _err;
+
+    if (batch_len == 0)
+    {
+        return ESP_OK;
+    }
+
+    _err = esp_partition_write(log_partition, current_sector * EVENT_LOG_SECTOR_SIZE + write_offset, batch, batch_len);
+    // A failed program leaves the sector in an unknown state, the next record rotates away from it
+    write_offset = (ESP_OK == _err) ? write_offset + batch_len : EVENT_LOG_SECTOR_SIZE;
+    batch_len = 0;
+    return _err;
+}
+
+static esp_err_t encode_entry(uint32_t sequence, const event_log_entry_t *entry, uint8_t *buffer, size_t buffer_size, size_t *out_size)
+{
+    dpacket_struct_t dpacket;
+    if (!NewPacket(&dpacket, EVENT_LOG_ENTRY_PACKET_ID))
+    {
+        return ESP_FAIL;
+    }
+
+    if (!AddSerializable(&dpacket, UINT32_STYPE, (data_union_t){.decimal_v.u32_v = sequence}) ||
+        !AddSerializable(&dpacket, UINT32_STYPE, (data_union_t){.decimal_v.u32_v = entry->uptime_millis}) ||
+        !AddSerializable(&dpacket, UINT8_STYPE, (data_union_t){.decimal_v.u8_v = entry->type}) ||
+        !AddSerializable(&dpacket, UINT32_STYPE, (data_union_t){.decimal_v.u32_v = entry->arg}))
+    {
+        FreePacket(&dpacket);
+        return ESP_FAIL;
+    }
+
+    memset(buffer, 0, buffer_size);
+    if (!SerializePacket(buffer, buffer_size, &dpacket, out_size) || *out_size == 0 || *out_size > buffer_size)
+    {
+        FreePacket(&dpacket);
+        return ESP_FAIL;
+    }
+
+    FreePacket(&dpacket);
+    return ESP_OK;
+}
+
+// Encodes entry as the next sequence and adds it to the batch, rotating sectors when it does not fit
+static esp_err_t place_entry(const event_log_entry_t *entry)
+{
+    static esp_err_t _err;
+    static uint8_t payload[EVENT_LOG_MAX_RECORD_SIZE - sizeof(event_log_record_t)];
+    size_t payload_len = 0;
+
+    if (ESP_OK != (_err = encode_entry(next_entry, entry, payload, sizeof(payload), &payload_len)))
+    {
+        return _err;
+    }
+
+    size_t space = RECORD_SPACE(payload_len);
+    if (write_offset + batch_len + space > EVENT_LOG_SECTOR_SIZE)
+    {
+        write_batch();
+
+        // Round robin over every sector, the oldest one gets erased so wear is spread evenly
+        if (ESP_OK != (_err = start_sector((current_sector + 1) % sector_count, current_sector_sequence + 1, next_entry)))
+        {
+            return _err;
+        }
+    }
+
+    if (batch_len + space > sizeof(batch) && ESP_OK != (_err = write_batch()))
+    {
+        return _err;
+    }
+
+    event_log_record_t record = {
+        .length = (uint16_t)payload_len,
+        .check = record_check(payload, (uint16_t)payload_len)};
+
+    memset(batch + batch_len, 0xFF, space);
+    memcpy(batch + batch_len, &record, sizeof(record));
+    memcpy(batch + batch_len + sizeof(record), payload, payload_len);
+    batch_len += space;
+    next_entry++;
+    return ESP_OK;
+}
+
+esp_err_t init_event_log(void)
+{
+    static esp_err_t _err;
+    static event_log_sector_t header;
+
+    if (log_queue != NULL)
+    {
+        return ESP_OK;
+    }
+
+    if (log_partition == NULL)
+    {
+        log_partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+                                                 (esp_partition_subtype_t)EVENT_LOG_PARTITION_SUBTYPE,
+                                                 EVENT_LOG_PARTITION_LABEL);
+    }
+
+    // Rotating needs a sector to erase besides the one holding the newest entries
+    if (log_partition == NULL || log_partition->size < 2 * EVENT_LOG_SECTOR_SIZE)
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+    sector_count = log_partition->size / EVENT_LOG_SECTOR_SIZE;
+
+    if ((flash_lock == NULL && NULL == (flash_lock = xSemaphoreCreateMutex())) ||
+        (read_lock == NULL && NULL == (read_lock = xSemaphoreCreateMutex())))
+    {
+        return ESP_ERR_NO_MEM;
+    }
+
+    int newest = -1;
+    uint32_t newest_first_entry = 0;
+    for (size_t i = 0; i < sector_count; i++)
+    {
+        if (ESP_OK == read_sector_header(i, &header) &&
+            (newest < 0 || (int32_t)(header.sequence - current_sector_sequence) > 0))
+        {
+            newest = (int)i;
+            current_sector_sequence = header.sequence;
+            newest_first_entry = header.first_entry;
+        }
+    }
+
+    if (newest < 0)
+    {
+        // Blank partition
+        next_entry = 1;
+        if (ESP_OK != (_err = start_sector(0, 1, next_entry)))
+        {
+            return _err;
+        }
+    }
+    else
+    {
+        uint32_t count = 0;
+        current_sector = (size_t)newest;
+        write_offset = walk_sector(current_sector, newest_first_entry, NULL, &count);
+        next_entry = newest_first_entry + count;
+    }
+
+    if (NULL == (log_queue = xQueueCreate(EVENT_LOG_QUEUE_LENGTH, sizeof(event_log_entry_t))))
+    {
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+esp_err_t event_log_append(event_log_type_t type, uint32_t arg)
+{
+    if (log_queue == NULL)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    event_log_entry_t entry = {
+        .uptime_millis = (uint32_t)(esp_timer_get_time() / 1000LL),
+        .arg = arg,
+        .type = (uint8_t)type};
+
+    if (pdTRUE != xQueueSend(log_queue, &entry, 0))
+    {
+        dropped_count++;
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+esp_err_t event_log_flush(void)
+{
+    static event_log_entry_t entry;
+    esp_err_t err = ESP_OK;
+    esp_err_t place_err;
+
+    if (log_queue == NULL)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    xSemaphoreTake(flash_lock, portMAX_DELAY);
+
+    while (pdTRUE == xQueueReceive(log_queue, &entry, 0))
+    {
+        if (ESP_OK != (place_err = place_entry(&entry)))
+        {
+            err = place_err;
+        }
+    }
+
+    uint32_t dropped = dropped_count - dropped_reported;
+    if (dropped > 0)
+    {
+        entry.uptime_millis = (uint32_t)(esp_timer_get_time() / 1000LL);
+        entry.arg = dropped;
+        entry.type = EVENT_LOG_DROPPED;
+        if (ESP_OK == (place_err = place_entry(&entry)))
+        {
+            dropped_reported += dropped;
+        }
+        else
+        {
+            err = place_err;
+        }
+    }
+
+    if (ESP_OK != (place_err = write_batch()))
+    {
+        err = place_err;
+    }
+
+    xSemaphoreGive(flash_lock);
+    return err;
+}
+
+// Copies up to EVENT_LOG_READ_BATCH entries newer than after into read_copies, returns how many
+static size_t copy_entries(uint32_t after, size_t max_entries)
+{
+    static event_log_sector_t header;
+    static event_log_sector_t next_header;
+
+    event_log_cursor_t cursor = {
+        .after = after,
+        .remaining = (max_entries < EVENT_LOG_READ_BATCH) ? max_entries : EVENT_LOG_READ_BATCH,
+        .copies = read_copies,
+        .copied = 0};
+
+    xSemaphoreTake(flash_lock, portMAX_DELAY);
+
+    // Oldest sector is the one written after the current, the current one comes last
+    for (size_t i = 1; i <= sector_count && cursor.remaining > 0; i++)
+    {
+        size_t ix = (current_sector + i) % sector_count;
+        uint32_t count = 0;
+
+        if (ESP_OK != read_sector_header(ix, &header))
+        {
+            continue;
+        }
+
+        // Every entry is older than the next sector's first one, skip the walk
+        if (i < sector_count &&
+            ESP_OK == read_sector_header((ix + 1) % sector_count, &next_header) &&
+            (int32_t)(next_header.first_entry - 1 - after) <= 0)
+        {
+            continue;
+        }
+
+        walk_sector(ix, header.first_entry, &cursor, &count);
+    }
+
+    xSemaphoreGive(flash_lock);
+    return cursor.copied;
+}
+
+esp_err_t event_log_read(uint32_t after, size_t max_entries, event_log_reader_t reader, void *ctx, uint32_t *last)
+{
+    esp_err_t err = ESP_OK;
+
+    if (reader == NULL || last == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    *last = after;
+
+    if (log_queue == NULL)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    xSemaphoreTake(read_lock, portMAX_DELAY);
+
+    // Flash is only held while copying, the reader may block on the network meanwhile
+    while (ESP_OK == err && max_entries > 0)
+    {
+        size_t copied = copy_entries(*last, max_entries);
+
+        for (size_t i = 0; i < copied && ESP_OK == err; i++)
+        {
+            if (ESP_OK == (err = reader(read_copies[i].sequence, read_copies[i].payload, read_copies[i].length, ctx)))
+            {
+                *last = read_copies[i].sequence;
+                max_entries--;
+            }
+        }
+
+        if (copied < EVENT_LOG_READ_BATCH)
+        {
+            break;
+        }
+    }
+
+    xSemaphoreGive(read_lock);
+    return err;
+}
+
+void event_log_task(void *params)
+{
+    static event_log_entry_t entry;
+
+    for (;;)
+    {
+        // Sleeps until something is queued, then gives the batch time to fill
+        if (log_queue == NULL || pdTRUE != xQueuePeek(log_queue, &entry, portMAX_DELAY))
+        {
+            vTaskDelay(EVENT_LOG_FLUSH_MILLIS / portTICK_PERIOD_MS);
+            continue;
+        }
+
+        TickType_t batch_start = xTaskGetTickCount();
+        while ((xTaskGetTickCount() - batch_start) * portTICK_PERIOD_MS < EVENT_LOG_FLUSH_MILLIS &&
+               uxQueueMessagesWaiting(log_queue) < EVENT_LOG_QUEUE_LENGTH / 2)
+        {
+            vTaskDelay(100 / portTICK_PERIOD_MS);
+        }
+
+        event_log_flush();
+    }
+}
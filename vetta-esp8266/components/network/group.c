@@ -0,0 +1,228 @@
+#include <stdint.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/FreeRTOSConfig.h"
+#include "lwip/err.h"
+#include "lwip/sockets.h"
+#include "lwip/sys.h"
+#include <lwip/netdb.h>
+#include "mbedtls/md.h"
+#include "dbits.h"
+#include "packets.h"
+#include "group.h"
+
+static void put_uint32_le(uint8_t *out, uint32_t v){
+    out[0] = v & 0xff;
+    out[1] = (v >> 8) & 0xff;
+    out[2] = (v >> 16) & 0xff;
+    out[3] = (v >> 24) & 0xff;
+}
+
+static unsigned char is_authentic(const group_server_t *server, uint32_t group_id, uint32_t sequence, uint8_t state, uint64_t mac){
+
+    // MAC input: group ID, sequence number (little endian) and state
+    uint8_t input[2 * sizeof(uint32_t) + 1];
+    put_uint32_le(input, group_id);
+    put_uint32_le(input + sizeof(uint32_t), sequence);
+    input[2 * sizeof(uint32_t)] = state;
+
+    uint8_t digest[32];
+    if(0 != mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256),
+                            server->key, sizeof(server->key),
+                            input, sizeof(input),
+                            digest))
+    {
+        return 0;
+    }
+
+    // Truncated digest, big endian
+    uint64_t expected = 0;
+    for (size_t i = 0; i < GROUP_MAC_SIZE; i++)
+    {
+        expected = (expected << 8) | digest[i];
+    }
+
+    return expected == mac ? 1 : 0;
+}
+
+esp_err_t init_group_server(group_server_t *server, in_addr_t ip){
+
+    server->server_socket = socket(AF_INET, SOCK_DGRAM, 0);
+    if (server->server_socket < 0)
+    {
+        return ESP_FAIL;
+    }
+
+    struct sockaddr_in serverAddr;
+    memset(&serverAddr, 0, sizeof(serverAddr));
+
+    // Multicast datagrams only reach sockets bound to any address
+    serverAddr.sin_family = AF_INET;
+    serverAddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    serverAddr.sin_port = htons(GROUP_SERVER_PORT);
+
+    // Lamps simulated in one host process share the port, lwIP without SO_REUSE ignores it
+    int reuse = 1;
+    setsockopt(server->server_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    struct ip_mreq mreq;
+    memset(&mreq, 0, sizeof(mreq));
+    mreq.imr_multiaddr.s_addr = inet_addr(GROUP_MULTICAST_ADDRESS);
+    mreq.imr_interface.s_addr = ip;
+
+    if(0 > bind(server->server_socket, (struct sockaddr *)&serverAddr, sizeof(serverAddr)) ||
+        0 > setsockopt(server->server_socket, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)))
+    {
+        close(server->server_socket);
+        server->server_socket = -1;
+        return ESP_FAIL;
+    }
+
+    return ESP_OK;
+}
+
+void close_group_server(group_server_t *server){
+    if (server->server_socket != -1)
+    {
+        close(server->server_socket);
+        server->server_socket = -1;
+    }
+}
+
+void group_restore(group_server_t *server, uint32_t group_id, const uint8_t *key, uint32_t last_sequence){
+    server->group_id = group_id;
+    server->has_key = key ? 1 : 0;
+    if(key){
+        memcpy(server->key, key, GROUP_KEY_SIZE);
+    }else{
+        memset(server->key, 0, GROUP_KEY_SIZE);
+    }
+    server->last_sequence = key ? last_sequence : 0;
+    server->reserved_sequence = server->last_sequence;
+}
+
+unsigned char group_assign(group_server_t *server, uint32_t group_id, const uint8_t *key, size_t key_len){
+    if(key == NULL || key_len != GROUP_KEY_SIZE){
+        return 0;
+    }
+
+    // Frames captured under the old key fail their MAC, only the same key has to keep its window
+    if(!server->has_key || 0 != memcmp(server->key, key, GROUP_KEY_SIZE)){
+        memcpy(server->key, key, GROUP_KEY_SIZE);
+        server->has_key = 1;
+        server->last_sequence = 0;
+        server->reserved_sequence = 0;
+    }
+    server->group_id = group_id;
+    return 1;
+}
+
+unsigned char group_reserve_sequence(group_server_t *server, uint32_t *mark){
+    if(!server->has_key || mark == NULL ||
+       (int32_t)(server->reserved_sequence - server->last_sequence) >= GROUP_SEQUENCE_RESERVE / 2){
+        return 0;
+    }
+
+    // Saturates, sequences never wrap under one key
+    server->reserved_sequence = (server->last_sequence > UINT32_MAX - GROUP_SEQUENCE_RESERVE)
+                                    ? UINT32_MAX
+                                    : server->last_sequence + GROUP_SEQUENCE_RESERVE;
+    *mark = server->reserved_sequence;
+    return 1;
+}
+
+listener_event_t group_listen(group_server_t *server){
+
+    if (server->server_socket == -1)
+    {
+        return RESULT_NO_ACTION;
+    }
+
+    struct timeval time_out_v;
+    time_out_v.tv_sec = 0;
+    time_out_v.tv_usec = GROUP_SERVER_SELECT_TIMEOUT;
+
+    fd_set set;
+
+    FD_ZERO(&set);
+    FD_SET(server->server_socket, &set);
+
+    // select
+    int ret = select(server->server_socket + 1, &set, NULL, NULL, &time_out_v);
+    if (ret == -1){
+        // Select Error
+        return RESULT_FAIL;
+    }
+    else if (ret == 0){
+        // Select timeout
+        return RESULT_NO_ACTION;
+    }
+
+    memset(server->recv_buffer, 0, sizeof(unsigned char) * GROUP_SERVER_BUFFER_SIZE);
+    int len = recv(server->server_socket, server->recv_buffer, GROUP_SERVER_BUFFER_SIZE - 1, 0);
+    if (len < 0){
+        // Error occured during receiving
+        return RESULT_FAIL;
+    }
+    else if (len == 0){
+        return RESULT_NO_ACTION;
+    }
+
+    server->recv_buffer[len] = 0; // NULL terminate buffer
+
+    dpacket_struct_t dpacket;
+    if (!DeserializeBuffer(server->recv_buffer, len, &dpacket))
+    {
+        return RESULT_NO_ACTION;
+    }
+
+    serializable_list_node_t *node = dpacket.data_list.first_node;
+    if (dpacket.packet_id != GROUP_STATE_CHANGE_PACKET_ID ||
+        dpacket.data_list.size != GROUP_STATE_CHANGE_PACKET_SIZE ||
+        node == NULL || node->stype != UINT32_STYPE ||
+        node->next_node == NULL || node->next_node->stype != UINT32_STYPE ||
+        node->next_node->next_node == NULL || node->next_node->next_node->stype != UINT8_STYPE ||
+        node->next_node->next_node->next_node == NULL || node->next_node->next_node->next_node->stype != UINT64_STYPE)
+    {
+        FreePacket(&dpacket);
+        return RESULT_NO_ACTION;
+    }
+
+    uint32_t group_id = node->data.decimal_v.u32_v;
+    node = node->next_node;
+    uint32_t sequence = node->data.decimal_v.u32_v;
+    node = node->next_node;
+    uint8_t state = node->data.decimal_v.u8_v;
+    node = node->next_node;
+    uint64_t mac = node->data.decimal_v.u64_v;
+
+    // Free packet reference
+    FreePacket(&dpacket);
+
+    if (!server->has_key ||
+        (group_id != GROUP_ID_ALL && group_id != server->group_id) ||
+        sequence <= server->last_sequence ||
+        !is_authentic(server, group_id, sequence, state, mac))
+    {
+        return RESULT_NO_ACTION;
+    }
+    server->last_sequence = sequence;
+
+    switch (state)
+    {
+    case 0:
+        return RESULT_LED_OFF;
+    case 1:
+        return RESULT_LED_LOW;
+    case 2:
+        return RESULT_LED_MEDIUM;
+    case 3:
+        return RESULT_LED_HIGH;
+    case 4:
+        return RESULT_LED_NEXT;
+    default:
+        break;
+    }
+
+    return RESULT_NO_ACTION;
+}
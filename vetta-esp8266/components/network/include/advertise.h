@@ -0,0 +1,28 @@
+#ifndef __ADVERTISE_H
+
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define ADVERTISE_SERVICE_TYPE "_vetta"
+#define ADVERTISE_SERVICE_PROTO "_tcp"
+
+#define ADVERTISE_HOSTNAME_PREFIX "vetta-"
+#define ADVERTISE_INSTANCE_PREFIX "Vetta Lamp "
+
+#define ADVERTISE_NAME_BUFFER_SIZE (32UL)
+
+    esp_err_t init_service_advertise(uint32_t lamp_seed);
+
+    void close_service_advertise(void);
+
+    esp_err_t service_advertise_update(uint8_t current_lamp_state, uint8_t is_managed);
+
+#ifdef __cplusplus
+}
+#endif
+#define __ADVERTISE_H
+#endif // __ADVERTISE_H
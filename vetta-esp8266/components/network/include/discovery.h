@@ -3,6 +3,7 @@
 #include "esp_err.h"
 #include "esp_event.h"
 #include "sys/socket.h"
+#include "freertos/FreeRTOS.h"
 
 #ifdef __cplusplus
 extern "C"
@@ -15,11 +16,36 @@ extern "C"
 #define BROKER_DISCOVERY_SERVER_PORT 50000
 #define DISCOVERY_SERVER_BUFFER_SIZE (128UL)
 
-    esp_err_t init_discovery_server(in_addr_t ip, uint32_t lamp_seed);
+// Token bucket limiting the discovery acks sent, charged only by requests carrying the pin code
+#define DISCOVERY_RATE_BURST (4)
+#define DISCOVERY_RATE_REFILL_MILLIS (250)
 
-    void close_discovery_server(void);
+    // One discovery responder, the caller owns the storage
+    typedef struct discovery_server_t
+    {
+        in_addr_t ip;
+        uint32_t lamp_seed;
+        int server_socket;
 
-    esp_err_t discovery_listen(uint8_t current_lamp_state, uint8_t is_managed, uint32_t pinCode);
+        unsigned char recv_buffer[DISCOVERY_SERVER_BUFFER_SIZE];
+        unsigned char send_buffer[DISCOVERY_SERVER_BUFFER_SIZE];
+
+        // Discovery ack frame cached in send_buffer, re-encoded on state changes
+        size_t ack_frame_size;
+        uint8_t ack_frame_state;
+        uint8_t ack_frame_managed;
+
+        // Rate limiter
+        unsigned char rate_tokens;
+        TickType_t rate_refill_ticks;
+
+    } discovery_server_t;
+
+    esp_err_t init_discovery_server(discovery_server_t *server, in_addr_t ip, uint32_t lamp_seed);
+
+    void close_discovery_server(discovery_server_t *server);
+
+    esp_err_t discovery_listen(discovery_server_t *server, uint8_t current_lamp_state, uint8_t is_managed, uint32_t pinCode);
 
 #ifdef __cplusplus
 }
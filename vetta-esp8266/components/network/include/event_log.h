@@ -0,0 +1,90 @@
+#ifndef __EVENT_LOG_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// Raw data partition holding the log, written round robin one flash sector at a time
+#define EVENT_LOG_PARTITION_LABEL "eventlog"
+#define EVENT_LOG_PARTITION_SUBTYPE (0x41)
+#define EVENT_LOG_SECTOR_SIZE (4096UL)
+
+// Entries waiting in RAM for the writer, appends on a full queue are dropped and counted
+#ifndef EVENT_LOG_QUEUE_LENGTH
+#define EVENT_LOG_QUEUE_LENGTH (32)
+#endif
+
+// Entries are written this long after the first one queued, or once the queue is half full
+#ifndef EVENT_LOG_FLUSH_MILLIS
+#define EVENT_LOG_FLUSH_MILLIS (5000UL)
+#endif
+
+// Largest encoded entry, record header included
+#define EVENT_LOG_MAX_RECORD_SIZE (32)
+
+// Entries sent per log request, the client asks again from the last sequence it got
+#define EVENT_LOG_READ_MAX_ENTRIES (32)
+
+    // Stored and sent over the wire, values must not change
+    typedef enum
+    {
+        EVENT_LOG_BOOT = 1,            // arg: reset reason
+        EVENT_LOG_WIFI_DISCONNECT = 2, // arg: station disconnect reason
+        EVENT_LOG_WIFI_ONLINE = 3,     // arg: station IP
+        EVENT_LOG_TLS_FAIL = 4,        // arg: SSL error
+        EVENT_LOG_SERVER_FAIL = 5,     // arg: network state
+        EVENT_LOG_BUTTON_RESET = 6,
+        EVENT_LOG_TOUCH = 7,           // arg: lamp state when touched
+        EVENT_LOG_PROVISIONED = 8,     // arg: 1 when reprovisioned next to the station
+        EVENT_LOG_DROPPED = 9,         // arg: entries lost to a full queue
+        EVENT_LOG_OTA_UPDATE = 10,     // arg: image size, logged before restarting into it
+        EVENT_LOG_OTA_ROLLBACK = 11,   // arg: boots the updated image was given
+    } event_log_type_t;
+
+    /**
+     * Called by event_log_read for every entry, payload is the serialized EVENT_LOG_ENTRY packet.
+     * Anything but ESP_OK stops the read.
+     */
+    typedef esp_err_t (*event_log_reader_t)(uint32_t sequence, const uint8_t *payload, size_t payload_len, void *ctx);
+
+    /**
+     * Finds the newest log sector and the next entry sequence, creates the RAM queue.
+     * Network packets must be registered before entries are written.
+     */
+    esp_err_t init_event_log(void);
+
+    /**
+     * Queues an entry stamped with the uptime, never blocks.
+     * ESP_ERR_NO_MEM if the queue is full, the entry is counted as dropped.
+     */
+    esp_err_t event_log_append(event_log_type_t type, uint32_t arg);
+
+    /**
+     * Encodes and writes every queued entry, rotating to the oldest sector when the current one is full.
+     */
+    esp_err_t event_log_flush(void);
+
+    /**
+     * Hands written entries newer than after to reader, oldest first, at most max_entries.
+     * Entries still queued are left to event_log_task, flash is never programmed from here.
+     * The reader runs outside the flash lock, so it may block without holding up the writer.
+     * last is set to the sequence of the last entry read, or after if none was.
+     */
+    esp_err_t event_log_read(uint32_t after, size_t max_entries, event_log_reader_t reader, void *ctx, uint32_t *last);
+
+    /**
+     * Writer task, batches queued entries into one flash write every EVENT_LOG_FLUSH_MILLIS.
+     */
+    void event_log_task(void *params);
+
+#ifdef __cplusplus
+}
+#endif
+
+#define __EVENT_LOG_H
+#endif // __EVENT_LOG_H
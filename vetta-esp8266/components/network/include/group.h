@@ -0,0 +1,83 @@
+#ifndef __GROUP_H
+
+#include "esp_err.h"
+#include "sys/socket.h"
+#include "listener.h"
+#include "storage.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define GROUP_MULTICAST_ADDRESS "239.255.50.5"
+#define GROUP_SERVER_PORT 50006
+#define GROUP_SERVER_SELECT_TIMEOUT (500)
+#define GROUP_SERVER_BUFFER_SIZE (128UL)
+
+// Group commands addressed to this ID are applied by every lamp
+#define GROUP_ID_ALL (0)
+
+// Bytes of the HMAC-SHA256 digest carried by group commands
+#define GROUP_MAC_SIZE (8)
+
+// HMAC key of the group commands, sent by the broker in GROUP_ASSIGN over the TLS session
+#define GROUP_KEY_SIZE GROUP_KEY_LENGTH
+
+// Sequences reserved past the accepted ones by the stored high-water mark, a new mark is stored once per
+// GROUP_SEQUENCE_RESERVE / 2 commands. After a reboot the lamp resumes from the stored mark, so a broker
+// continues at least GROUP_SEQUENCE_RESERVE past the last sequence it sent once a lamp reconnects
+#define GROUP_SEQUENCE_RESERVE (64)
+
+    // Multicast group membership and command window of one lamp, the caller owns the storage
+    typedef struct group_server_t
+    {
+        int server_socket;
+        uint32_t group_id;
+        uint8_t key[GROUP_KEY_SIZE];
+        unsigned char has_key; // Commands are all dropped until a key is assigned
+        uint32_t last_sequence; // Sequence high-water mark, commands at or below it are replays
+        uint32_t reserved_sequence; // Stored mark, commands up to it are accepted without storing a new one
+        unsigned char recv_buffer[GROUP_SERVER_BUFFER_SIZE];
+
+    } group_server_t;
+
+    /**
+     * Joins the command multicast group on ip. Group, key and sequence window are kept across
+     * close_group_server() and init_group_server(), a reconnect does not reopen the replay window.
+     */
+    esp_err_t init_group_server(group_server_t *server, in_addr_t ip);
+
+    void close_group_server(group_server_t *server);
+
+    /**
+     * Sets the group, key and sequence mark stored by an earlier run, sequences up to the mark are replays.
+     * A NULL key drops the assignment.
+     */
+    void group_restore(group_server_t *server, uint32_t group_id, const uint8_t *key, uint32_t last_sequence);
+
+    /**
+     * Applies a GROUP_ASSIGN from the broker. A new key restarts the sequence window, the same key keeps it.
+     * Returns 0 if key_len is not GROUP_KEY_SIZE.
+     */
+    unsigned char group_assign(group_server_t *server, uint32_t group_id, const uint8_t *key, size_t key_len);
+
+    /*
+    @return RESULT_LED_* for an authenticated group command, its sequence is then in last_sequence
+    and the command is applied right away, followed by group_reserve_sequence(),
+    RESULT_NO_ACTION when nothing was applied, RESULT_FAIL on socket errors
+    */
+    listener_event_t group_listen(group_server_t *server);
+
+    /**
+     * Called after each applied command. Returns 1 with the mark to store once fewer than
+     * GROUP_SEQUENCE_RESERVE / 2 reserved sequences are left, the reservation then runs
+     * GROUP_SEQUENCE_RESERVE past last_sequence. Returns 0 while the stored mark is far enough ahead.
+     */
+    unsigned char group_reserve_sequence(group_server_t *server, uint32_t *mark);
+
+#ifdef __cplusplus
+}
+#endif
+#define __GROUP_H
+#endif // __GROUP_H
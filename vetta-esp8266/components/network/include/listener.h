@@ -3,20 +3,47 @@
 #include "esp_err.h"
 #include "esp_event.h"
 #include "tcpip_adapter.h"
+#include "freertos/FreeRTOS.h"
+#include "openssl/ssl.h"
 
 #ifdef __cplusplus
 extern "C"
 {
 #endif
 
-#define LISTENER_PING_DELAY (5000)
 #define LISTENER_SERVER_SELECT_TIMEOUT (500)
 
-#define LISTENER_PING_STEPS (10)
+// Keepalive ping interval, doubled after each successful ping up to LISTENER_PING_MAX_DELAY
+#define LISTENER_PING_DELAY (5000)
+#define LISTENER_PING_MAX_DELAY (60000)
+
+// TCP keepalive probing of the client socket (seconds, probes)
+#define LISTENER_TCP_KEEPALIVE_IDLE (30)
+#define LISTENER_TCP_KEEPALIVE_INTERVAL (5)
+#define LISTENER_TCP_KEEPALIVE_COUNT (3)
 #define LISTENER_SERVER_BUFFER_SIZE (128)
+// Received frames, sized for OTA_CHUNK frames. Every frame must be sent as exactly one TLS record,
+// each SSL_read() takes one record and is decoded as one frame
+#define LISTENER_SERVER_RECV_BUFFER_SIZE (256)
+
+// While an update runs, one listener_listen() call takes up to this many frames, each waited for up to
+// LISTENER_OTA_DRAIN_TIMEOUT microseconds. Group and discovery requests wait meanwhile
+#define LISTENER_OTA_DRAIN_FRAMES (64)
+#define LISTENER_OTA_DRAIN_TIMEOUT (50000)
 
 #define LISTENER_SERVER_PORT (50032)
 
+// Links the assets folder certificate and key into the image, as the last identity fallback.
+// The firmware reads them from the asset partition, the host build has no asset partition
+#ifndef LISTENER_EMBEDDED_IDENTITY
+#define LISTENER_EMBEDDED_IDENTITY (0)
+#endif
+
+// Firmware updates over the listener session, the host build has no app partitions
+#ifndef LISTENER_OTA_UPDATE
+#define LISTENER_OTA_UPDATE (1)
+#endif
+
     typedef enum listener_event_t{
         RESULT_FAIL = ESP_FAIL,
         RESULT_NO_ACTION = ESP_OK,
@@ -26,15 +53,48 @@ extern "C"
         RESULT_LED_MEDIUM,
         RESULT_LED_HIGH,
         RESULT_LED_NEXT,
+        RESULT_GROUP_ASSIGNED, // The group server has a new group or key, to be stored
     }listener_event_t;
 
-    esp_err_t init_listener_server(u32_t ip_info);
+    struct group_server_t;
+
+    // One TLS listener and its broker session, the caller owns the storage
+    typedef struct listener_server_t
+    {
+        u32_t ip;
+        int server_socket;
+        int client_socket;
+        SSL_CTX *ssl_ctx;
+        SSL *ssl_session;
+        struct group_server_t *group; // GROUP_ASSIGN frames go here, may be NULL
+
+        // Per connection heap report
+        uint32_t session_heap_start;
+        uint32_t session_heap_min;
+        uint32_t session_low_water;
+
+        // Keepalive scheduling
+        TickType_t last_send_ticks;
+        unsigned long int ping_delay_millis;
+
+        unsigned char recv_buffer[LISTENER_SERVER_RECV_BUFFER_SIZE];
+        unsigned char send_buffer[LISTENER_SERVER_BUFFER_SIZE];
+
+    } listener_server_t;
+
+    /**
+     * Loads the TLS identity and binds server to ip. Group assignments received over the session
+     * are applied to group, which may be NULL.
+     */
+    esp_err_t init_listener_server(listener_server_t *server, u32_t ip, struct group_server_t *group);
+
+    void close_listener_server(listener_server_t *server);
 
-    void close_listener_server(void);
+    listener_event_t listener_listen(listener_server_t *server);
 
-    listener_event_t listener_listen(void);
+    esp_err_t send_state_ping(listener_server_t *server);
 
-    esp_err_t send_state_ping(void);
+    unsigned char listener_has_client(const listener_server_t *server);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,87 @@
+#ifndef __NETSTATE_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    typedef enum
+    {
+        NET_STATE_OFF = 0,            // Radio down
+        NET_STATE_AP,                 // Lamp softAP up, waiting for a phone
+        NET_STATE_AP_PROVISIONING,    // Phone joined the softAP, provisioning socket open
+        NET_STATE_STA_CONNECTING,     // Station started, no IP yet
+        NET_STATE_STA_ONLINE,         // Station has an IP, servers bound to it
+        NET_STATE_STA_REPROVISIONING, // Station online next to the provisioning softAP
+        NET_STATE_COUNT
+    } net_state_t;
+
+    typedef enum
+    {
+        NET_EVENT_START_STA = 0,
+        NET_EVENT_START_AP,
+        NET_EVENT_SHUTDOWN,
+        NET_EVENT_AP_STA_CONNECTED,
+        NET_EVENT_AP_STA_DISCONNECTED,
+        NET_EVENT_PROVISION_DONE, // Provisioning exchange ended, timed out or was abandoned
+        NET_EVENT_STA_START,
+        NET_EVENT_STA_CONNECTED,
+        NET_EVENT_STA_DISCONNECTED,
+        NET_EVENT_STA_GOT_IP,
+        NET_EVENT_SERVER_FAIL,
+        NET_EVENT_COUNT
+    } net_event_t;
+
+    typedef enum
+    {
+        NET_ACTION_NONE = 0,
+        NET_ACTION_SHUTDOWN,
+        NET_ACTION_START_AP,
+        NET_ACTION_START_STA,
+        NET_ACTION_OPEN_PROVISION,
+        NET_ACTION_CLOSE_PROVISION,
+        NET_ACTION_STA_CONNECT,
+        NET_ACTION_RECORD_LINK,
+        NET_ACTION_RECONNECT,
+        NET_ACTION_BIND_SERVERS,
+        NET_ACTION_START_REPROVISION,
+        NET_ACTION_END_REPROVISION,
+        NET_ACTION_ABORT_REPROVISION
+    } net_action_t;
+
+    typedef struct
+    {
+        net_action_t action;
+        net_state_t next; // State once the action succeeded
+        net_state_t fail; // State if the action failed
+    } net_transition_t;
+
+// Event group bits published by the owner task for every state
+#define NET_STATE_BIT_RUNNING (1UL << 0UL)
+#define NET_STATE_BIT_SOFTAP (1UL << 1UL)
+#define NET_STATE_BIT_ONLINE (1UL << 2UL)
+#define NET_STATE_BITS_ALL (NET_STATE_BIT_RUNNING | NET_STATE_BIT_SOFTAP | NET_STATE_BIT_ONLINE)
+
+    /**
+     * Transition table lookup. Events without a row in state are ignored,
+     * returned as NET_ACTION_NONE with state as both next and fail.
+     * Pure function, no driver or RTOS calls, so event traces can be replayed on the host.
+     */
+    net_transition_t net_state_transition(net_state_t state, net_event_t event);
+
+    /**
+     * NET_STATE_BIT_* bits holding in state.
+     */
+    uint32_t net_state_bits(net_state_t state);
+
+    const char *net_state_name(net_state_t state);
+    const char *net_event_name(net_event_t event);
+
+#ifdef __cplusplus
+}
+#endif
+
+#define __NETSTATE_H
+#endif // __NETSTATE_H
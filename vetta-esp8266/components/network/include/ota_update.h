@@ -0,0 +1,122 @@
+#ifndef __OTA_UPDATE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// Firmware received in OTA_CHUNK frames is staged in sector buffers, one filled by the listener
+// while the writer task erases and programs the other
+#define OTA_SECTOR_SIZE (4096UL)
+#define OTA_BUFFER_COUNT (2)
+
+// Largest OTA_CHUNK payload, the frame fits LISTENER_SERVER_RECV_BUFFER_SIZE
+#define OTA_CHUNK_MAX_SIZE (224)
+
+// DER encoded ECDSA P-256 signature of the SHA-256 over the image version (4 bytes, little endian)
+// followed by the image, sent with OTA_BEGIN
+#define OTA_SIGNATURE_MAX_SIZE (80)
+
+// Version of this image, raise it with every release. Updates signed for a lower version are refused,
+// so an old signed image cannot be installed again to bring its bugs back
+#ifndef OTA_FIRMWARE_VERSION
+#define OTA_FIRMWARE_VERSION (1)
+#endif
+
+// DER public key in the asset partition, updates are refused without it
+#define OTA_KEY_ASSET "ota.pub"
+
+// A free sector buffer not coming back within this long fails the update
+#define OTA_WRITE_TIMEOUT_MILLIS (5000)
+
+// Updated image rolls back after this many boots without a broker session
+#ifndef OTA_TRIAL_MAX_BOOTS
+#define OTA_TRIAL_MAX_BOOTS (3)
+#endif
+
+// Updated image reboots, counting a trial boot, when no broker session confirms it within this long
+#ifndef OTA_TRIAL_MILLIS
+#define OTA_TRIAL_MILLIS (600000UL)
+#endif
+
+#ifndef OTA_WRITER_TASK_STACK_DEPTH
+#define OTA_WRITER_TASK_STACK_DEPTH (2048)
+#endif
+
+// Below the network task, sectors are written whenever it waits on the socket
+#ifndef OTA_WRITER_TASK_PRIORITY
+#define OTA_WRITER_TASK_PRIORITY (4)
+#endif
+
+    // Sent in OTA_STATUS frames, values must not change
+    typedef enum
+    {
+        OTA_STATUS_PENDING = 0, // Chunk taken, no status frame due
+        OTA_STATUS_ACK = 1,     // Update started, or one more sector handed to flash
+        OTA_STATUS_DONE = 2,    // Image verified and set to boot, the lamp restarts
+        OTA_STATUS_ERR_STATE = 16,
+        OTA_STATUS_ERR_SIZE = 17,
+        OTA_STATUS_ERR_OFFSET = 18,
+        OTA_STATUS_ERR_NO_KEY = 19,
+        OTA_STATUS_ERR_MEMORY = 20,
+        OTA_STATUS_ERR_FLASH = 21,
+        OTA_STATUS_ERR_SIGNATURE = 22,
+        OTA_STATUS_ERR_IMAGE = 23,
+        OTA_STATUS_ERR_VERSION = 24,
+    } ota_status_t;
+
+    /**
+     * Boot time trial of an updated image, after init_storage() and init_event_log().
+     * Counts the boot and arms the trial timer, or boots the previous image once OTA_TRIAL_MAX_BOOTS are used up.
+     */
+    esp_err_t init_ota_update(void);
+
+    /**
+     * Confirms the running image, called once a broker session is up. No-op when it is not on trial.
+     */
+    void ota_update_confirm(void);
+
+    /**
+     * Starts receiving an image of image_size bytes into the app partition not running, dropping an update in progress.
+     * Ends with OTA_STATUS_ACK, or an error status. OTA_STATUS_ERR_VERSION if version is below OTA_FIRMWARE_VERSION,
+     * the signature covers the version so it cannot be raised afterwards.
+     */
+    ota_status_t ota_update_begin(uint32_t image_size, uint32_t version, const uint8_t *signature, size_t signature_len);
+
+    /**
+     * Appends the chunk at offset, chunks must come in order.
+     * OTA_STATUS_ACK once a sector is handed to flash, OTA_STATUS_DONE after the last chunk verified.
+     * Any error drops the update.
+     */
+    ota_status_t ota_update_write(uint32_t offset, const uint8_t *data, size_t len);
+
+    /**
+     * Non zero between ota_update_begin() and the end of the update.
+     */
+    unsigned char ota_update_in_progress(void);
+
+    /**
+     * Image bytes taken by the current or the last update, the offset expected in the next chunk.
+     */
+    uint32_t ota_update_received(void);
+
+    /**
+     * Drops an update in progress, the running image stays the boot image.
+     */
+    void ota_update_abort(void);
+
+    /**
+     * Flushes the event log and restarts into the image set to boot by OTA_STATUS_DONE.
+     */
+    void ota_update_restart(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#define __OTA_UPDATE_H
+#endif // __OTA_UPDATE_H
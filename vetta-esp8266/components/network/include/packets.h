@@ -17,11 +17,38 @@ extern "C"
 #define BROKER_DISCOVERY_ACK_PACKET_SIZE 5
 
 #define PROVISION_PACKET_ID 3
-#define PROVISION_PACKET_SIZE 3
+#define PROVISION_PACKET_SIZE 4
 
 #define LAMP_STATE_CHANGE_PACKET_ID 4
 #define LAMP_STATE_CHANGE_PACKET_SIZE 1
 
+#define GROUP_STATE_CHANGE_PACKET_ID 5
+#define GROUP_STATE_CHANGE_PACKET_SIZE 4
+
+#define GROUP_ASSIGN_PACKET_ID 6
+#define GROUP_ASSIGN_PACKET_SIZE 2
+
+#define PROVISION_ACK_PACKET_ID 7
+#define PROVISION_ACK_PACKET_SIZE 2
+
+#define EVENT_LOG_ENTRY_PACKET_ID 8
+#define EVENT_LOG_ENTRY_PACKET_SIZE 4
+
+#define EVENT_LOG_REQUEST_PACKET_ID 9
+#define EVENT_LOG_REQUEST_PACKET_SIZE 1
+
+#define EVENT_LOG_END_PACKET_ID 10
+#define EVENT_LOG_END_PACKET_SIZE 2
+
+#define OTA_BEGIN_PACKET_ID 11
+#define OTA_BEGIN_PACKET_SIZE 3
+
+#define OTA_CHUNK_PACKET_ID 12
+#define OTA_CHUNK_PACKET_SIZE 2
+
+#define OTA_STATUS_PACKET_ID 13
+#define OTA_STATUS_PACKET_SIZE 2
+
     unsigned char RegisterNetworkPackets();
 
 #ifdef __cplusplus
@@ -0,0 +1,43 @@
+#ifndef __RECONNECT_H
+
+#include <stdint.h>
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define RECONNECT_BASE_DELAY_MILLIS (500UL)
+#define RECONNECT_MAX_DELAY_MILLIS (30000UL)
+
+// Reconnect attempts before the station is restarted from scratch
+#define RECONNECT_MAX_ATTEMPTS (10)
+
+    /**
+     * Backoff before reconnect attempt number attempt, exponential from RECONNECT_BASE_DELAY_MILLIS
+     * up to RECONNECT_MAX_DELAY_MILLIS, with half of it drawn from random.
+     * Pure function, callers supply the random value.
+     */
+    uint32_t reconnect_backoff_millis(uint8_t attempt, uint32_t random);
+
+    esp_err_t init_reconnect_scheduler(void);
+    void deinit_reconnect_scheduler(void);
+
+    /**
+     * Schedules the next esp_wifi_connect() on a one-shot timer, without blocking the caller.
+     * Returns ESP_ERR_TIMEOUT once RECONNECT_MAX_ATTEMPTS attempts were scheduled since the last reset.
+     */
+    esp_err_t reconnect_schedule(void);
+
+    /**
+     * Restores the full retry budget and cancels a pending attempt, called once the station got an IP.
+     */
+    void reconnect_reset(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#define __RECONNECT_H
+#endif // __RECONNECT_H
@@ -2,6 +2,7 @@
 
 #include "esp_err.h"
 #include "esp_event.h"
+#include "storage.h"
 
 #ifdef __cplusplus
 extern "C"
@@ -31,8 +32,78 @@ extern "C"
 
 #define LAMP_AP_SSID_STRLEN (7UL)
 
+    // Station power save profiles
+
+    typedef enum
+    {
+        WIFI_POWER_PROFILE_ACTIVE = 0, // Broker session open, radio always on (WIFI_PS_NONE)
+        WIFI_POWER_PROFILE_STANDBY,    // No broker session, wakes every DTIM period (WIFI_PS_MIN_MODEM)
+        WIFI_POWER_PROFILE_IDLE        // No broker for a while, wakes every listen interval (WIFI_PS_MAX_MODEM)
+    } wifi_power_profile_t;
+
+// Beacon intervals slept between wakes in WIFI_POWER_PROFILE_IDLE
+#define WIFI_POWER_IDLE_LISTEN_INTERVAL (3)
+
+// Beacon timing of the AP, the SDK reports neither the beacon interval nor the DTIM period of the associated AP.
+// Defaults are the common 100 TU (102.4 ms) beacons with DTIM 1, override them for APs configured otherwise
+#ifndef WIFI_POWER_BEACON_INTERVAL_TU
+#define WIFI_POWER_BEACON_INTERVAL_TU (100UL)
+#endif
+
+#ifndef WIFI_POWER_DTIM_PERIOD
+#define WIFI_POWER_DTIM_PERIOD (1UL)
+#endif
+
+// Milliseconds of n beacon intervals, rounded up, 1 TU is 1024 us
+#define WIFI_POWER_BEACONS_MILLIS(n) (((n) * WIFI_POWER_BEACON_INTERVAL_TU * 1024UL + 999UL) / 1000UL)
+
+// Theoretical worst case latency each profile adds to a command, one sleep period of the beacon timing above.
+// Standby sleeps for the DTIM period, idle for the listen interval. Derived, not measured on a lamp
+#define WIFI_POWER_ACTIVE_THEORETICAL_LATENCY_MILLIS (0UL)
+#define WIFI_POWER_STANDBY_THEORETICAL_LATENCY_MILLIS WIFI_POWER_BEACONS_MILLIS(WIFI_POWER_DTIM_PERIOD)
+#define WIFI_POWER_IDLE_THEORETICAL_LATENCY_MILLIS WIFI_POWER_BEACONS_MILLIS(WIFI_POWER_IDLE_LISTEN_INTERVAL)
+
     esp_err_t init_wifi_ap(esp_event_handler_t event_handler);
-    esp_err_t init_wifi_sta(esp_event_handler_t event_handler, const uint8_t *sta_ssid_str, size_t sta_ssid_size, const uint8_t *sta_pwd_str, size_t sta_pwd_size);
+    /**
+     * Starts the station. With a cached link, connects straight to the cached BSSID and channel
+     * and uses the cached lease as static IP, skipping the scan and DHCP until wifi_sta_link_confirmed().
+     */
+    esp_err_t init_wifi_sta(esp_event_handler_t event_handler, const uint8_t *sta_ssid_str, size_t sta_ssid_size, const uint8_t *sta_pwd_str, size_t sta_pwd_size, const wifi_link_cache_t *link);
+
+    /**
+     * Drops the cached link of the running station, next connect attempts scan all channels and use DHCP.
+     * Returns ESP_ERR_INVALID_STATE when the station was not started with a cached link.
+     */
+    esp_err_t wifi_sta_full_scan(void);
+
+    /**
+     * Hands the cached lease applied as static IP back to DHCP once the station got its IP, so the lease is renewed.
+     * Returns ESP_ERR_INVALID_STATE when the station was not started with a cached link.
+     */
+    esp_err_t wifi_sta_link_confirmed(void);
+
+    /**
+     * Brings up the provisioning softAP next to the running station (WIFI_MODE_APSTA),
+     * the station and its IP stay up.
+     */
+    esp_err_t wifi_start_provisioning_ap(void);
+    esp_err_t wifi_stop_provisioning_ap(void);
+
+    /**
+     * Replaces the credentials of the running station and drops the current association,
+     * the station reconnects to the new AP from its WIFI_EVENT_STA_DISCONNECTED handling.
+     */
+    esp_err_t wifi_sta_switch_credentials(const uint8_t *sta_ssid_str, size_t sta_ssid_size,
+                                          const uint8_t *sta_pwd_str, size_t sta_pwd_size);
+
+    /**
+     * Applies a station power save profile, a no-op when it is already active.
+     */
+    esp_err_t wifi_set_power_profile(wifi_power_profile_t profile);
+    /**
+     * Theoretical worst case latency the profile adds to a command in ms, see WIFI_POWER_*_THEORETICAL_LATENCY_MILLIS.
+     */
+    uint32_t wifi_power_profile_theoretical_latency(wifi_power_profile_t profile);
 
     esp_err_t deinit_wifi(esp_event_handler_t event_handler);
 
@@ -11,10 +11,26 @@ extern "C"
 #define PROVISION_SERVER_IP "192.168.4.1"
 #define PROVISION_SERVER_PORT 50030
 #define PROVISION_SERVER_BUFFER_SIZE (128UL)
+#define PROVISION_ACK_BUFFER_SIZE (16UL)
+
+// Provision ack status
+#define PROVISION_ACK_OK (0)
+#define PROVISION_ACK_STORAGE_FAIL (1)
 
     esp_err_t init_wifi_provision(void);
     void deinit_wifi_provision(void);
-    esp_err_t provision_listen(spiffs_string_t *ussid, spiffs_string_t *upwd, uint32_t * pinCode);
+
+    /**
+     * Listens for a provision packet, retransmissions of the last acknowledged packet are answered
+     * with the cached ack and reported as ESP_ERR_TIMEOUT, without being parsed again.
+     * Waits up to timeout_millis, 0 polls.
+     */
+    esp_err_t provision_listen(spiffs_string_t *ussid, spiffs_string_t *upwd, uint32_t * pinCode, uint32_t timeout_millis);
+
+    /**
+     * Acknowledges the last provision packet to its sender, echoing its nonce.
+     */
+    esp_err_t provision_ack(uint8_t status);
 
 #ifdef __cplusplus
 }
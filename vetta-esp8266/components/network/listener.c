@@ -1,4 +1,5 @@
 #include <string.h>
+#include <stdlib.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/FreeRTOSConfig.h"
 #include "lwip/err.h"
@@ -7,72 +8,216 @@
 #include <lwip/netdb.h>
 #include "lwip/ip_addr.h"
 #include "openssl/ssl.h"
+#include "esp_system.h"
 #include "dbits.h"
 #include "packets.h"
 #include "listener.h"
-
-#define OPENSSL_SERVER_FRAGMENT_SIZE 2048
-
-extern const uint8_t ca_pem_start[] asm("_binary_ca_pem_start");
-extern const uint8_t ca_pem_end[]   asm("_binary_ca_pem_end");
+#include "group.h"
+#include "event_log.h"
+#include "blob_store.h"
+#include "asset_store.h"
+#if LISTENER_OTA_UPDATE
+#include "ota_update.h"
+#endif
+
+// TLS record buffer length, negotiated as max fragment length.
+// Application frames never exceed LISTENER_SERVER_RECV_BUFFER_SIZE.
+// Only applies to brokers negotiating max_fragment_length, other brokers may send records up to
+// CONFIG_MBEDTLS_SSL_IN_CONTENT_LEN (4096), longer records end the session
+#define OPENSSL_SERVER_FRAGMENT_SIZE 512
+
+// Names in the asset partition, see the assets folder
+#define LISTENER_CERT_ASSET "lamp.pem"
+#define LISTENER_KEY_ASSET "lamp.key"
+
+#if LISTENER_EMBEDDED_IDENTITY
 extern const uint8_t lamp_pem_start[] asm("_binary_lamp_pem_start");
 extern const uint8_t lamp_pem_end[]   asm("_binary_lamp_pem_end");
 extern const uint8_t lamp_key_start[] asm("_binary_lamp_key_start");
 extern const uint8_t lamp_key_end[]   asm("_binary_lamp_key_end");
+#endif
+
+static unsigned long int millis_since(TickType_t ticks){
+    return (xTaskGetTickCount() - ticks) * portTICK_PERIOD_MS;
+}
+
+static void sample_session_heap(listener_server_t *server){
+    uint32_t free_heap = esp_get_free_heap_size();
+    if(free_heap < server->session_heap_min){
+        server->session_heap_min = free_heap;
+    }
+
+    // Catches the handshake peak, when the global low water mark dropped during this session
+    free_heap = esp_get_minimum_free_heap_size();
+    if(free_heap < server->session_low_water && free_heap < server->session_heap_min){
+        server->session_heap_min = free_heap;
+    }
+}
+
+static void set_client_keepalive(int sock){
+    int keep_alive = 1;
+    setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &keep_alive, sizeof(keep_alive));
+
+#ifdef TCP_KEEPIDLE
+    int keep_idle = LISTENER_TCP_KEEPALIVE_IDLE;
+    int keep_interval = LISTENER_TCP_KEEPALIVE_INTERVAL;
+    int keep_count = LISTENER_TCP_KEEPALIVE_COUNT;
+    setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE, &keep_idle, sizeof(keep_idle));
+    setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL, &keep_interval, sizeof(keep_interval));
+    setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT, &keep_count, sizeof(keep_count));
+#endif
+}
+
+// Whole blob in a heap buffer, NULL if it is not stored
+static unsigned char * load_blob(blob_id_t id, size_t *len){
+    blob_reader_t reader;
+    if(ESP_OK != blob_open(id, &reader) || reader.length == 0){
+        return NULL;
+    }
+
+    unsigned char *buf = malloc(reader.length);
+    if(!buf){
+        return NULL;
+    }
+
+    size_t chunk = 0;
+    *len = 0;
+    do{
+        if(ESP_OK != blob_read(&reader, buf + *len, reader.length - *len, &chunk)){
+            free(buf);
+            return NULL;
+        }
+        *len += chunk;
+    }while(chunk > 0);
+
+    return buf;
+}
+
+// Whole asset in a heap buffer, NULL if the asset partition does not hold it intact
+static unsigned char * load_asset(const char *name, size_t *len){
+    asset_t asset;
+    if(ESP_OK != asset_find(name, &asset) || asset.length == 0){
+        return NULL;
+    }
+
+    unsigned char *buf = malloc(asset.length);
+    if(!buf){
+        return NULL;
+    }
+
+    if(ESP_OK != asset_read(&asset, 0, buf, asset.length)){
+        free(buf);
+        return NULL;
+    }
 
-static u32_t ipAddress;
+    *len = asset.length;
+    return buf;
+}
+
+// Parses the certificate into ctx and frees its buffer, the parsed copy lives in the context
+static int use_certificate(SSL_CTX *ctx, unsigned char *cert, size_t cert_len){
+    int ret = cert && SSL_CTX_use_certificate_ASN1(ctx, cert_len, cert);
+
+    free(cert);
+    return ret;
+}
 
-static int server_socket = -1;
+// Parses the key into ctx and wipes and frees its buffer, the parsed copy lives in the context
+static int use_private_key(SSL_CTX *ctx, unsigned char *key, size_t key_len){
+    int ret = key && SSL_CTX_use_PrivateKey_ASN1(0, ctx, key, key_len);
 
-static int client_socket = -1;
-static struct sockaddr_in clientAddr;
-static unsigned int clientAddrLen = sizeof(clientAddr);
+    if(key){
+        memset(key, 0, key_len);
+        free(key);
+    }
+    return ret;
+}
 
-static unsigned char recvBuffer[LISTENER_SERVER_BUFFER_SIZE];
-static unsigned char sendBuffer[LISTENER_SERVER_BUFFER_SIZE];
+// The parsers want their whole input contiguous, so the certificate and the key are copied to the heap,
+// one at a time: each is parsed and freed before the other is read. The transient heap cost is the
+// longer of the two, reported in *heap_copy
+static int use_blob_identity(SSL_CTX *ctx, size_t *heap_copy){
+    size_t cert_len = 0, key_len = 0;
 
-static SSL * ssl_session;
-static SSL_CTX * ssl_ctx;
+    unsigned char *cert = load_blob(BLOB_DEVICE_CERT, &cert_len);
+    if(!use_certificate(ctx, cert, cert_len)){
+        return 0;
+    }
+    unsigned char *key = load_blob(BLOB_DEVICE_KEY, &key_len);
+    *heap_copy = cert_len > key_len ? cert_len : key_len;
+    return use_private_key(ctx, key, key_len);
+}
+
+static int use_asset_identity(SSL_CTX *ctx, size_t *heap_copy){
+    size_t cert_len = 0, key_len = 0;
+
+    unsigned char *cert = load_asset(LISTENER_CERT_ASSET, &cert_len);
+    if(!use_certificate(ctx, cert, cert_len)){
+        return 0;
+    }
+    unsigned char *key = load_asset(LISTENER_KEY_ASSET, &key_len);
+    *heap_copy = cert_len > key_len ? cert_len : key_len;
+    return use_private_key(ctx, key, key_len);
+}
+
+static int use_embedded_identity(SSL_CTX *ctx){
+#if LISTENER_EMBEDDED_IDENTITY
+    return SSL_CTX_use_certificate_ASN1(ctx, lamp_pem_end - lamp_pem_start, lamp_pem_start) &&
+        SSL_CTX_use_PrivateKey_ASN1(0, ctx, lamp_key_start, lamp_key_end - lamp_key_start);
+#else
+    (void)ctx;
+    return 0;
+#endif
+}
 
 static SSL_CTX * init_ssl_context(){
     SSL_CTX* ctx;
+    size_t heap_copy = 0;
 
     ctx = SSL_CTX_new(TLSv1_2_server_method());
     if (!ctx) {
         return NULL;
     }
 
-    int ret = SSL_CTX_use_certificate_ASN1(ctx, lamp_pem_end - lamp_pem_start, lamp_pem_start);
-    if (!ret) {
-        SSL_CTX_free(ctx);
-        return NULL;
-    }
-
-    ret = SSL_CTX_use_PrivateKey_ASN1(0, ctx, lamp_key_start, lamp_key_end - lamp_key_start);
-    if (!ret) {
+    // Provisioned pair first, then the one flashed with the assets.
+    // Every loader replaces whatever a half loaded pair left
+    if(use_blob_identity(ctx, &heap_copy)){
+        printf("\nTLS IDENTITY PROVISIONED, %u BYTES COPIED TO HEAP\n", (unsigned int)heap_copy);
+    }else if(use_asset_identity(ctx, &heap_copy)){
+        printf("\nTLS IDENTITY FROM ASSETS, %u BYTES COPIED TO HEAP\n", (unsigned int)heap_copy);
+    }else if(!use_embedded_identity(ctx)){
+        printf("\nNO TLS IDENTITY\n");
         SSL_CTX_free(ctx);
         return NULL;
     }
 
     SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
 
+    // Small record buffers, reused by every session created from this context
+    SSL_CTX_set_default_read_buffer_len(ctx, OPENSSL_SERVER_FRAGMENT_SIZE);
+
     return ctx;
 }
 
 
-esp_err_t init_listener_server(u32_t ip){
+esp_err_t init_listener_server(listener_server_t *server, u32_t ip, group_server_t *group){
 
-    ipAddress = ip;
+    server->ip = ip;
+    server->group = group;
+    server->server_socket = -1;
+    server->client_socket = -1;
+    server->ssl_session = NULL;
+    server->ping_delay_millis = LISTENER_PING_DELAY;
 
-    ssl_ctx = init_ssl_context();
-    if(!ssl_ctx){
+    server->ssl_ctx = init_ssl_context();
+    if(!server->ssl_ctx){
         return ESP_FAIL;
     }
 
-    server_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_socket < 0) {
-        SSL_CTX_free(ssl_ctx);
-        ssl_ctx = NULL;
+    server->server_socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (server->server_socket < 0) {
+        SSL_CTX_free(server->ssl_ctx);
+        server->ssl_ctx = NULL;
         return ESP_FAIL;
     }
 
@@ -83,52 +228,60 @@ esp_err_t init_listener_server(u32_t ip){
     serverAddr.sin_addr.s_addr = ip;
     serverAddr.sin_port = htons(LISTENER_SERVER_PORT);
 
-    int ret = bind(server_socket, (struct sockaddr*)&serverAddr, sizeof(serverAddr));
-    if (ret < 0 || listen(server_socket, 1) < 0) {
-        close(server_socket);
-        server_socket = -1;
-        SSL_CTX_free(ssl_ctx);
-        ssl_ctx = NULL;
+    int ret = bind(server->server_socket, (struct sockaddr*)&serverAddr, sizeof(serverAddr));
+    if (ret < 0 || listen(server->server_socket, 1) < 0) {
+        close(server->server_socket);
+        server->server_socket = -1;
+        SSL_CTX_free(server->ssl_ctx);
+        server->ssl_ctx = NULL;
         return ESP_FAIL;
     }
 
     return ESP_OK;
 }
 
-void close_client_socket(void){
+static void close_client_socket(listener_server_t *server){
     printf("\nCLOSING CLIENT SOCKET\n");
-    if(ssl_session != NULL){
-        SSL_shutdown(ssl_session);
-        SSL_free(ssl_session);
-        ssl_session = NULL;
+#if LISTENER_OTA_UPDATE
+    // An update only lives as long as the session sending it
+    ota_update_abort();
+#endif
+    if(server->ssl_session != NULL){
+        sample_session_heap(server);
+        printf("\nSSL SESSION HEAP start: %u | min: %u | peak usage: %u\n",
+            server->session_heap_start, server->session_heap_min, server->session_heap_start - server->session_heap_min);
+
+        SSL_shutdown(server->ssl_session);
+        SSL_free(server->ssl_session);
+        server->ssl_session = NULL;
     }
 
-    if(client_socket != -1){
-        close(client_socket);
-        client_socket = -1;
+    if(server->client_socket != -1){
+        close(server->client_socket);
+        server->client_socket = -1;
     }
 }
 
 
-void close_listener_server(void)
+void close_listener_server(listener_server_t *server)
 {
     printf("\nCLOSING SERVER SOCKET\n");
-    close_client_socket();
+    close_client_socket(server);
 
-    if(server_socket != -1){
-        close(server_socket);
-        server_socket = -1;
+    if(server->server_socket != -1){
+        close(server->server_socket);
+        server->server_socket = -1;
     }
 
-    if(ssl_ctx != NULL){
-        SSL_CTX_free(ssl_ctx);
-        ssl_ctx = NULL;
+    if(server->ssl_ctx != NULL){
+        SSL_CTX_free(server->ssl_ctx);
+        server->ssl_ctx = NULL;
     }
 }
 
-esp_err_t send_ping(uint8_t isStatePing){
+static esp_err_t send_ping(listener_server_t *server, uint8_t isStatePing){
 
-    if(client_socket == -1 || ssl_session == NULL){
+    if(server->client_socket == -1 || server->ssl_session == NULL){
         return ESP_FAIL;
     }
 
@@ -144,8 +297,8 @@ esp_err_t send_ping(uint8_t isStatePing){
     }
 
     size_t packet_size = 0;
-    memset(sendBuffer, 0, sizeof(unsigned char)*LISTENER_SERVER_BUFFER_SIZE);
-    if(!SerializePacket(sendBuffer, LISTENER_SERVER_BUFFER_SIZE-1, &dpacket, &packet_size) ||
+    memset(server->send_buffer, 0, sizeof(unsigned char)*LISTENER_SERVER_BUFFER_SIZE);
+    if(!SerializePacket(server->send_buffer, LISTENER_SERVER_BUFFER_SIZE-1, &dpacket, &packet_size) ||
         packet_size == 0 || packet_size >= LISTENER_SERVER_BUFFER_SIZE)
     {
         FreePacket(&dpacket);
@@ -153,129 +306,223 @@ esp_err_t send_ping(uint8_t isStatePing){
     }
     FreePacket(&dpacket);
 
-    if(packet_size != SSL_write(ssl_session, sendBuffer, packet_size)){
+    if(packet_size != SSL_write(server->ssl_session, server->send_buffer, packet_size)){
         return ESP_FAIL;
     }
 
+    // Any frame sent postpones the next keepalive ping
+    server->last_send_ticks = xTaskGetTickCount();
+
     return ESP_OK;
 }
 
-esp_err_t send_state_ping(void){
+esp_err_t send_state_ping(listener_server_t *server){
     printf("\nSENDING STATE PING\n");
-    return send_ping(1);
+    return send_ping(server, 1);
 }
 
-listener_event_t listener_listen(void){
+// Event log read context, the session entries go to and their count
+typedef struct listener_log_send_t
+{
+    listener_server_t *server;
+    size_t sent;
+} listener_log_send_t;
 
-    static uint8_t timeout_count = 0;
-    static struct timeval time_out_v;
-    time_out_v.tv_sec = 0;
-    time_out_v.tv_usec = LISTENER_SERVER_SELECT_TIMEOUT; // 500ms
+static esp_err_t send_log_entry(uint32_t sequence, const uint8_t *payload, size_t payload_len, void *ctx){
+    listener_log_send_t *log_send = (listener_log_send_t *)ctx;
 
-    fd_set server_set, client_set;
+    // Stored entries are already serialized EVENT_LOG_ENTRY packets
+    if(payload_len != SSL_write(log_send->server->ssl_session, payload, payload_len)){
+        return ESP_FAIL;
+    }
 
-    FD_ZERO(&server_set);
+    log_send->sent++;
+    return ESP_OK;
+}
 
-    FD_SET(server_socket, &server_set);
+static esp_err_t send_event_log(listener_server_t *server, uint32_t after){
 
-    int ret = 0;
-    if(client_socket == -1){
-        // select
-        ret = select(server_socket + 1, &server_set, NULL, NULL, &time_out_v);
-        if (ret == -1){
-            // Select Error
-            return RESULT_FAIL;
-        }
-        else if (ret == 0){
-            // Select timeout
-            return RESULT_NO_ACTION;
-        }
+    listener_log_send_t log_send = {.server = server, .sent = 0};
+    uint32_t last = after;
 
-        // accept
-        client_socket = accept(server_socket, (struct sockaddr*)&clientAddr, &clientAddrLen);
-        if (client_socket < 0) {
-            return RESULT_NO_ACTION;
-        }
+    // No log partition reads as an empty log
+    esp_err_t err = event_log_read(after, EVENT_LOG_READ_MAX_ENTRIES, &send_log_entry, &log_send, &last);
+    if(ESP_OK != err && ESP_ERR_INVALID_STATE != err){
+        return ESP_FAIL;
+    }
 
-        setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&time_out_v, sizeof(time_out_v));
+    dpacket_struct_t dpacket;
+    if(!NewPacket(&dpacket, EVENT_LOG_END_PACKET_ID)){
+        return ESP_FAIL;
+    }
 
-        // TODO Speed up handshake
-        printf("\nSocket Accepted\n");
+    if(!AddSerializable(&dpacket, UINT32_STYPE, (data_union_t){.decimal_v.u32_v = last}) ||
+        !AddSerializable(&dpacket, BOOLEAN_STYPE, (data_union_t){.boolean_v = (log_send.sent == EVENT_LOG_READ_MAX_ENTRIES)}))
+    {
+        FreePacket(&dpacket);
+        return ESP_FAIL;
+    }
 
-        ssl_session = SSL_new(ssl_ctx);
-        if (!ssl_session) {
-            close(client_socket);
-            client_socket = -1;
-            printf("\nERROR SSL_new()\n");
-            return RESULT_NO_ACTION;
-        }
+    size_t packet_size = 0;
+    memset(server->send_buffer, 0, sizeof(unsigned char)*LISTENER_SERVER_BUFFER_SIZE);
+    if(!SerializePacket(server->send_buffer, LISTENER_SERVER_BUFFER_SIZE-1, &dpacket, &packet_size) ||
+        packet_size == 0 || packet_size >= LISTENER_SERVER_BUFFER_SIZE)
+    {
+        FreePacket(&dpacket);
+        return ESP_FAIL;
+    }
+    FreePacket(&dpacket);
 
-        SSL_set_fd(ssl_session, client_socket);
+    if(packet_size != SSL_write(server->ssl_session, server->send_buffer, packet_size)){
+        return ESP_FAIL;
+    }
 
-        ret = SSL_accept(ssl_session);
-        if (!ret) {
+    server->last_send_ticks = xTaskGetTickCount();
 
-            close(client_socket);
-            client_socket = -1;
+    return ESP_OK;
+}
 
-            SSL_free(ssl_session);
-            ssl_session = NULL;
-            printf("\nERROR SSL_accept()\n");
-            return RESULT_NO_ACTION;
-        }
-        printf("\nSSL SESSION CREATED\n");
-    }
+#if LISTENER_OTA_UPDATE
+static esp_err_t send_ota_status(listener_server_t *server, ota_status_t status){
 
-    FD_ZERO(&client_set);
-    FD_SET(client_socket, &client_set);
+    dpacket_struct_t dpacket;
+    if(!NewPacket(&dpacket, OTA_STATUS_PACKET_ID)){
+        return ESP_FAIL;
+    }
 
-    // select
-    ret = select(client_socket + 1, &client_set, NULL, NULL, &time_out_v);
-    if (ret == -1){
-        // Select Error
-        close_client_socket();
-        return RESULT_FAIL;
+    if(!AddSerializable(&dpacket, UINT32_STYPE, (data_union_t){.decimal_v.u32_v = ota_update_received()}) ||
+        !AddSerializable(&dpacket, UINT8_STYPE, (data_union_t){.decimal_v.u8_v = status}))
+    {
+        FreePacket(&dpacket);
+        return ESP_FAIL;
     }
-    else if (ret == 0){
-        // Select timeout
 
-        // Send Ping
-        if(timeout_count >= LISTENER_PING_STEPS){
-            printf("\nSending ping\n");
-            if(ESP_OK != send_ping(0)){
-                close_client_socket();
-            }
-            timeout_count = 0;
-        }else{
-            timeout_count++;
-        }
+    size_t packet_size = 0;
+    memset(server->send_buffer, 0, sizeof(unsigned char)*LISTENER_SERVER_BUFFER_SIZE);
+    if(!SerializePacket(server->send_buffer, LISTENER_SERVER_BUFFER_SIZE-1, &dpacket, &packet_size) ||
+        packet_size == 0 || packet_size >= LISTENER_SERVER_BUFFER_SIZE)
+    {
+        FreePacket(&dpacket);
+        return ESP_FAIL;
+    }
+    FreePacket(&dpacket);
 
-        return RESULT_CLIENT_STALE;
+    if(packet_size != SSL_write(server->ssl_session, server->send_buffer, packet_size)){
+        return ESP_FAIL;
     }
 
-    printf("\nCLIENT SELECTED\n");
+    server->last_send_ticks = xTaskGetTickCount();
+
+    return ESP_OK;
+}
+#endif
+
+unsigned char listener_has_client(const listener_server_t *server){
+    return (server->client_socket != -1 && server->ssl_session != NULL) ? 1 : 0;
+}
+
+// Reads and handles one frame, which is one TLS record
+static listener_event_t read_frame(listener_server_t *server){
 
-    memset(recvBuffer, 0, LISTENER_SERVER_BUFFER_SIZE*sizeof(unsigned char));
-    ret = SSL_read(ssl_session, recvBuffer, LISTENER_SERVER_BUFFER_SIZE - 1);
+    int ret;
+
+    memset(server->recv_buffer, 0, LISTENER_SERVER_RECV_BUFFER_SIZE*sizeof(unsigned char));
+    ret = SSL_read(server->ssl_session, server->recv_buffer, LISTENER_SERVER_RECV_BUFFER_SIZE - 1);
     if (ret > 0) {
 
-        recvBuffer[ret] = 0; // NULL Terminate buffer
+        server->recv_buffer[ret] = 0; // NULL Terminate buffer
 
         printf("\nREAD %d BYTES\n", ret);
 
         dpacket_struct_t dpacket;
-        if(!DeserializeBuffer(recvBuffer, ret, &dpacket)){
-            close_client_socket();
+        if(!DeserializeBuffer(server->recv_buffer, ret, &dpacket)){
+            close_client_socket(server);
             return RESULT_NO_ACTION;
         }
 
+        if(dpacket.packet_id == GROUP_ASSIGN_PACKET_ID &&
+            dpacket.data_list.size == GROUP_ASSIGN_PACKET_SIZE &&
+            dpacket.data_list.first_node != NULL &&
+            dpacket.data_list.first_node->stype == UINT32_STYPE &&
+            dpacket.data_list.first_node->next_node != NULL &&
+            dpacket.data_list.first_node->next_node->stype == UTF8_STRING_STYPE)
+        {
+            // Multicast group membership and the key of its commands, which only ever travels over TLS
+            const utf8_string_t *key = &dpacket.data_list.first_node->next_node->data.utf8_str_v;
+            if(server->group == NULL){
+                FreePacket(&dpacket);
+                return RESULT_CLIENT_STALE;
+            }
+            if(!group_assign(server->group, dpacket.data_list.first_node->data.decimal_v.u32_v,
+                             (const uint8_t *)key->utf8_string, key->length)){
+                FreePacket(&dpacket);
+                close_client_socket(server);
+                return RESULT_NO_ACTION;
+            }
+            FreePacket(&dpacket);
+            return RESULT_GROUP_ASSIGNED;
+        }
+
+        if(dpacket.packet_id == EVENT_LOG_REQUEST_PACKET_ID &&
+            dpacket.data_list.size == EVENT_LOG_REQUEST_PACKET_SIZE &&
+            dpacket.data_list.first_node != NULL &&
+            dpacket.data_list.first_node->stype == UINT32_STYPE)
+        {
+            // Field log, streamed back oldest first and closed by an EVENT_LOG_END packet
+            uint32_t after = dpacket.data_list.first_node->data.decimal_v.u32_v;
+            FreePacket(&dpacket);
+            if(ESP_OK != send_event_log(server, after)){
+                close_client_socket(server);
+                return RESULT_NO_ACTION;
+            }
+            return RESULT_CLIENT_STALE;
+        }
+
+#if LISTENER_OTA_UPDATE
+        serializable_list_node_t *node = dpacket.data_list.first_node;
+        if((dpacket.packet_id == OTA_BEGIN_PACKET_ID &&
+            dpacket.data_list.size == OTA_BEGIN_PACKET_SIZE &&
+            node != NULL && node->stype == UINT32_STYPE &&
+            node->next_node != NULL && node->next_node->stype == UINT32_STYPE &&
+            node->next_node->next_node != NULL && node->next_node->next_node->stype == UTF8_STRING_STYPE) ||
+           (dpacket.packet_id == OTA_CHUNK_PACKET_ID &&
+            dpacket.data_list.size == OTA_CHUNK_PACKET_SIZE &&
+            node != NULL && node->stype == UINT32_STYPE &&
+            node->next_node != NULL && node->next_node->stype == UTF8_STRING_STYPE))
+        {
+            // Firmware update: image size, version and signature, then image bytes at their offset.
+            // Acked once started and every sector, the session ends with the restart into the new image
+            uint32_t value = node->data.decimal_v.u32_v;
+            ota_status_t status;
+            if(dpacket.packet_id == OTA_BEGIN_PACKET_ID){
+                const utf8_string_t *sig = &node->next_node->next_node->data.utf8_str_v;
+                status = ota_update_begin(value, node->next_node->data.decimal_v.u32_v, sig->utf8_string, sig->length);
+            }else{
+                const utf8_string_t *bytes = &node->next_node->data.utf8_str_v;
+                status = ota_update_write(value, bytes->utf8_string, bytes->length);
+            }
+            FreePacket(&dpacket);
+
+            if(status != OTA_STATUS_PENDING && ESP_OK != send_ota_status(server, status)){
+                close_client_socket(server);
+                return RESULT_NO_ACTION;
+            }
+
+            if(status == OTA_STATUS_DONE){
+                close_client_socket(server);
+                ota_update_restart();
+            }
+            return RESULT_CLIENT_STALE;
+        }
+#endif
+
         if(dpacket.packet_id != LAMP_STATE_CHANGE_PACKET_ID ||
             dpacket.data_list.size != LAMP_STATE_CHANGE_PACKET_SIZE ||
             dpacket.data_list.first_node == NULL ||
             dpacket.data_list.first_node->stype != UINT8_STYPE)
         {
             FreePacket(&dpacket);
-            close_client_socket();
+            close_client_socket(server);
             return RESULT_NO_ACTION;
         }
 
@@ -295,14 +542,164 @@ listener_event_t listener_listen(void){
         case 4:
             return RESULT_LED_NEXT;
         default:
-            close_client_socket();
+            close_client_socket(server);
             return RESULT_NO_ACTION;
         }
 
     }else if(ret < 0){
-        close_client_socket();
+        close_client_socket(server);
         return RESULT_NO_ACTION;
     }
 
     return RESULT_CLIENT_STALE;
 }
+
+#if LISTENER_OTA_UPDATE
+// Next OTA frame already decrypted, or arriving within LISTENER_OTA_DRAIN_TIMEOUT
+static unsigned char frame_pending(listener_server_t *server){
+
+    if(SSL_pending(server->ssl_session) > 0){
+        return 1;
+    }
+
+    struct timeval time_out_v;
+    time_out_v.tv_sec = 0;
+    time_out_v.tv_usec = LISTENER_OTA_DRAIN_TIMEOUT;
+
+    fd_set client_set;
+    FD_ZERO(&client_set);
+    FD_SET(server->client_socket, &client_set);
+
+    return (select(server->client_socket + 1, &client_set, NULL, NULL, &time_out_v) > 0) ? 1 : 0;
+}
+#endif
+
+listener_event_t listener_listen(listener_server_t *server){
+
+    struct sockaddr_in clientAddr;
+    socklen_t clientAddrLen = sizeof(clientAddr);
+
+    struct timeval time_out_v;
+    time_out_v.tv_sec = 0;
+    time_out_v.tv_usec = LISTENER_SERVER_SELECT_TIMEOUT; // 500ms
+
+    fd_set server_set, client_set;
+
+    FD_ZERO(&server_set);
+
+    FD_SET(server->server_socket, &server_set);
+
+    int ret = 0;
+    if(server->client_socket == -1){
+        // select
+        ret = select(server->server_socket + 1, &server_set, NULL, NULL, &time_out_v);
+        if (ret == -1){
+            // Select Error
+            return RESULT_FAIL;
+        }
+        else if (ret == 0){
+            // Select timeout
+            return RESULT_NO_ACTION;
+        }
+
+        // accept
+        server->client_socket = accept(server->server_socket, (struct sockaddr*)&clientAddr, &clientAddrLen);
+        if (server->client_socket < 0) {
+            return RESULT_NO_ACTION;
+        }
+
+        setsockopt(server->client_socket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&time_out_v, sizeof(time_out_v));
+        set_client_keepalive(server->client_socket);
+
+        // TODO Speed up handshake
+        printf("\nSocket Accepted\n");
+
+        server->session_heap_start = esp_get_free_heap_size();
+        server->session_heap_min = server->session_heap_start;
+        server->session_low_water = esp_get_minimum_free_heap_size();
+
+        server->ssl_session = SSL_new(server->ssl_ctx);
+        if (!server->ssl_session) {
+            close(server->client_socket);
+            server->client_socket = -1;
+            printf("\nERROR SSL_new()\n");
+            return RESULT_NO_ACTION;
+        }
+
+        SSL_set_fd(server->ssl_session, server->client_socket);
+
+        ret = SSL_accept(server->ssl_session);
+        if (!ret) {
+            event_log_append(EVENT_LOG_TLS_FAIL, SSL_get_error(server->ssl_session, ret));
+
+            close(server->client_socket);
+            server->client_socket = -1;
+
+            SSL_free(server->ssl_session);
+            server->ssl_session = NULL;
+            printf("\nERROR SSL_accept()\n");
+            return RESULT_NO_ACTION;
+        }
+        sample_session_heap(server);
+        printf("\nSSL SESSION CREATED, HEAP min: %u\n", server->session_heap_min);
+
+#if LISTENER_OTA_UPDATE
+        // A broker reaching the lamp confirms an updated image
+        ota_update_confirm();
+#endif
+
+        // Restart keepalive scheduling for the new session
+        server->last_send_ticks = xTaskGetTickCount();
+        server->ping_delay_millis = LISTENER_PING_DELAY;
+    }
+
+    sample_session_heap(server);
+
+    FD_ZERO(&client_set);
+    FD_SET(server->client_socket, &client_set);
+
+    // select
+    ret = select(server->client_socket + 1, &client_set, NULL, NULL, &time_out_v);
+    if (ret == -1){
+        // Select Error
+        close_client_socket(server);
+        return RESULT_FAIL;
+    }
+    else if (ret == 0){
+        // Select timeout
+
+        // Send Ping, unless a frame was sent within the current keepalive delay
+        if(millis_since(server->last_send_ticks) >= server->ping_delay_millis){
+            printf("\nSending ping\n");
+            if(ESP_OK != send_ping(server, 0)){
+                close_client_socket(server);
+                return RESULT_CLIENT_STALE;
+            }
+
+            // Link is healthy, back off
+            server->ping_delay_millis *= 2;
+            if(server->ping_delay_millis > LISTENER_PING_MAX_DELAY){
+                server->ping_delay_millis = LISTENER_PING_MAX_DELAY;
+            }
+        }
+
+        return RESULT_CLIENT_STALE;
+    }
+
+    printf("\nCLIENT SELECTED\n");
+
+    listener_event_t event = read_frame(server);
+
+#if LISTENER_OTA_UPDATE
+    // An image is a stream of OTA_CHUNK frames, taken here back to back rather than one per network task loop
+    for (int frames = 1;
+         event == RESULT_CLIENT_STALE && frames < LISTENER_OTA_DRAIN_FRAMES &&
+         server->ssl_session != NULL && ota_update_in_progress() && frame_pending(server);
+         frames++)
+    {
+        event = read_frame(server);
+    }
+#endif
+
+    return event;
+}
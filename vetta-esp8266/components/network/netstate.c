@@ -0,0 +1,103 @@
+#include <stddef.h>
+#include "netstate.h"
+
+typedef struct
+{
+    net_state_t state;
+    net_event_t event;
+    net_action_t action;
+    net_state_t next;
+    net_state_t fail;
+} net_state_row_t;
+
+// Actions failing into NET_STATE_OFF leave the radio down
+static const net_state_row_t transition_table[] = {
+    {NET_STATE_OFF, NET_EVENT_START_STA, NET_ACTION_START_STA, NET_STATE_STA_CONNECTING, NET_STATE_OFF},
+    {NET_STATE_OFF, NET_EVENT_START_AP, NET_ACTION_START_AP, NET_STATE_AP, NET_STATE_OFF},
+    {NET_STATE_OFF, NET_EVENT_SHUTDOWN, NET_ACTION_SHUTDOWN, NET_STATE_OFF, NET_STATE_OFF},
+
+    {NET_STATE_AP, NET_EVENT_AP_STA_CONNECTED, NET_ACTION_OPEN_PROVISION, NET_STATE_AP_PROVISIONING, NET_STATE_AP},
+    {NET_STATE_AP, NET_EVENT_PROVISION_DONE, NET_ACTION_SHUTDOWN, NET_STATE_OFF, NET_STATE_OFF},
+    {NET_STATE_AP, NET_EVENT_SHUTDOWN, NET_ACTION_SHUTDOWN, NET_STATE_OFF, NET_STATE_OFF},
+
+    {NET_STATE_AP_PROVISIONING, NET_EVENT_AP_STA_DISCONNECTED, NET_ACTION_CLOSE_PROVISION, NET_STATE_AP, NET_STATE_AP},
+    {NET_STATE_AP_PROVISIONING, NET_EVENT_PROVISION_DONE, NET_ACTION_SHUTDOWN, NET_STATE_OFF, NET_STATE_OFF},
+    {NET_STATE_AP_PROVISIONING, NET_EVENT_SHUTDOWN, NET_ACTION_SHUTDOWN, NET_STATE_OFF, NET_STATE_OFF},
+
+    {NET_STATE_STA_CONNECTING, NET_EVENT_STA_START, NET_ACTION_STA_CONNECT, NET_STATE_STA_CONNECTING, NET_STATE_STA_CONNECTING},
+    {NET_STATE_STA_CONNECTING, NET_EVENT_STA_CONNECTED, NET_ACTION_RECORD_LINK, NET_STATE_STA_CONNECTING, NET_STATE_STA_CONNECTING},
+    {NET_STATE_STA_CONNECTING, NET_EVENT_STA_DISCONNECTED, NET_ACTION_RECONNECT, NET_STATE_STA_CONNECTING, NET_STATE_OFF},
+    {NET_STATE_STA_CONNECTING, NET_EVENT_STA_GOT_IP, NET_ACTION_BIND_SERVERS, NET_STATE_STA_ONLINE, NET_STATE_OFF},
+    // Lamp that cannot reach its AP can still be provisioned again
+    {NET_STATE_STA_CONNECTING, NET_EVENT_START_AP, NET_ACTION_START_AP, NET_STATE_AP, NET_STATE_OFF},
+    {NET_STATE_STA_CONNECTING, NET_EVENT_SHUTDOWN, NET_ACTION_SHUTDOWN, NET_STATE_OFF, NET_STATE_OFF},
+
+    {NET_STATE_STA_ONLINE, NET_EVENT_STA_CONNECTED, NET_ACTION_RECORD_LINK, NET_STATE_STA_ONLINE, NET_STATE_STA_ONLINE},
+    {NET_STATE_STA_ONLINE, NET_EVENT_STA_DISCONNECTED, NET_ACTION_RECONNECT, NET_STATE_STA_CONNECTING, NET_STATE_OFF},
+    {NET_STATE_STA_ONLINE, NET_EVENT_STA_GOT_IP, NET_ACTION_BIND_SERVERS, NET_STATE_STA_ONLINE, NET_STATE_OFF},
+    {NET_STATE_STA_ONLINE, NET_EVENT_START_AP, NET_ACTION_START_REPROVISION, NET_STATE_STA_REPROVISIONING, NET_STATE_STA_ONLINE},
+    {NET_STATE_STA_ONLINE, NET_EVENT_SERVER_FAIL, NET_ACTION_SHUTDOWN, NET_STATE_OFF, NET_STATE_OFF},
+    {NET_STATE_STA_ONLINE, NET_EVENT_SHUTDOWN, NET_ACTION_SHUTDOWN, NET_STATE_OFF, NET_STATE_OFF},
+
+    {NET_STATE_STA_REPROVISIONING, NET_EVENT_AP_STA_CONNECTED, NET_ACTION_OPEN_PROVISION, NET_STATE_STA_REPROVISIONING, NET_STATE_STA_REPROVISIONING},
+    {NET_STATE_STA_REPROVISIONING, NET_EVENT_AP_STA_DISCONNECTED, NET_ACTION_CLOSE_PROVISION, NET_STATE_STA_REPROVISIONING, NET_STATE_STA_REPROVISIONING},
+    {NET_STATE_STA_REPROVISIONING, NET_EVENT_PROVISION_DONE, NET_ACTION_END_REPROVISION, NET_STATE_STA_ONLINE, NET_STATE_STA_ONLINE},
+    {NET_STATE_STA_REPROVISIONING, NET_EVENT_STA_CONNECTED, NET_ACTION_RECORD_LINK, NET_STATE_STA_REPROVISIONING, NET_STATE_STA_REPROVISIONING},
+    {NET_STATE_STA_REPROVISIONING, NET_EVENT_STA_DISCONNECTED, NET_ACTION_ABORT_REPROVISION, NET_STATE_STA_CONNECTING, NET_STATE_OFF},
+    {NET_STATE_STA_REPROVISIONING, NET_EVENT_STA_GOT_IP, NET_ACTION_BIND_SERVERS, NET_STATE_STA_REPROVISIONING, NET_STATE_OFF},
+    {NET_STATE_STA_REPROVISIONING, NET_EVENT_SERVER_FAIL, NET_ACTION_SHUTDOWN, NET_STATE_OFF, NET_STATE_OFF},
+    {NET_STATE_STA_REPROVISIONING, NET_EVENT_SHUTDOWN, NET_ACTION_SHUTDOWN, NET_STATE_OFF, NET_STATE_OFF},
+};
+
+net_transition_t net_state_transition(net_state_t state, net_event_t event)
+{
+    net_transition_t transition = {NET_ACTION_NONE, state, state};
+
+    for (size_t i = 0; i < sizeof(transition_table) / sizeof(transition_table[0]); i++)
+    {
+        if (transition_table[i].state == state && transition_table[i].event == event)
+        {
+            transition.action = transition_table[i].action;
+            transition.next = transition_table[i].next;
+            transition.fail = transition_table[i].fail;
+            break;
+        }
+    }
+
+    return transition;
+}
+
+uint32_t net_state_bits(net_state_t state)
+{
+    switch (state)
+    {
+    case NET_STATE_AP:
+    case NET_STATE_AP_PROVISIONING:
+        return NET_STATE_BIT_RUNNING | NET_STATE_BIT_SOFTAP;
+    case NET_STATE_STA_CONNECTING:
+        return NET_STATE_BIT_RUNNING;
+    case NET_STATE_STA_ONLINE:
+        return NET_STATE_BIT_RUNNING | NET_STATE_BIT_ONLINE;
+    case NET_STATE_STA_REPROVISIONING:
+        return NET_STATE_BIT_RUNNING | NET_STATE_BIT_SOFTAP | NET_STATE_BIT_ONLINE;
+    default:
+        return 0;
+    }
+}
+
+static const char *state_names[NET_STATE_COUNT] = {
+    "OFF", "AP", "AP_PROVISIONING", "STA_CONNECTING", "STA_ONLINE", "STA_REPROVISIONING"};
+
+static const char *event_names[NET_EVENT_COUNT] = {
+    "START_STA", "START_AP", "SHUTDOWN", "AP_STA_CONNECTED", "AP_STA_DISCONNECTED", "PROVISION_DONE",
+    "STA_START", "STA_CONNECTED", "STA_DISCONNECTED", "STA_GOT_IP", "SERVER_FAIL"};
+
+const char *net_state_name(net_state_t state)
+{
+    return (state < NET_STATE_COUNT) ? state_names[state] : "UNKNOWN";
+}
+
+const char *net_event_name(net_event_t event)
+{
+    return (event < NET_EVENT_COUNT) ? event_names[event] : "UNKNOWN";
+}
@@ -0,0 +1,469 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "esp_err.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "esp_partition.h"
+#include "esp_ota_ops.h"
+#include "mbedtls/md.h"
+#include "mbedtls/pk.h"
+#include "storage.h"
+#include "asset_store.h"
+#include "event_log.h"
+#include "ota_update.h"
+
+#define OTA_DIGEST_SIZE (32)
+
+// One flash sector of the image, padded with 0xFF to whole words
+typedef struct ota_sector_t
+{
+    uint32_t offset;
+    uint32_t length;
+    uint8_t data[OTA_SECTOR_SIZE];
+
+} ota_sector_t;
+
+// Update state, only touched by the network task. The writer task owns the sectors it took
+// from write_queue until it hands them back through free_queue
+static const esp_partition_t *target = NULL;
+static uint32_t image_size = 0;
+static uint32_t received = 0;
+
+static ota_sector_t *sectors = NULL;
+static ota_sector_t *filling = NULL;
+static QueueHandle_t write_queue = NULL;
+static QueueHandle_t free_queue = NULL;
+static TaskHandle_t writer_task = NULL;
+// Set by the writer only, read once it handed back the sector that failed
+static volatile esp_err_t write_err = ESP_OK;
+
+static mbedtls_md_context_t image_md;
+static mbedtls_pk_context ota_key;
+static uint8_t signature[OTA_SIGNATURE_MAX_SIZE];
+static size_t signature_len = 0;
+
+static esp_timer_handle_t trial_timer = NULL;
+
+// Erases each sector right before programming it, so no up-front erase of the whole image stalls the listener
+static void ota_writer_task(void *params)
+{
+    ota_sector_t *sector = NULL;
+
+    for (;;)
+    {
+        xQueueReceive(write_queue, &sector, portMAX_DELAY);
+        if (sector == NULL)
+        {
+            break;
+        }
+
+        if (ESP_OK == write_err)
+        {
+            esp_err_t err = esp_partition_erase_range(target, sector->offset, OTA_SECTOR_SIZE);
+            if (ESP_OK == err)
+            {
+                err = esp_partition_write(target, sector->offset, sector->data, (sector->length + 3UL) & ~3UL);
+            }
+            write_err = err;
+        }
+
+        xQueueSend(free_queue, &sector, portMAX_DELAY);
+    }
+
+    // Stop marker goes back last, every sector is free once it is received
+    xQueueSend(free_queue, &sector, portMAX_DELAY);
+    vTaskDelete(NULL);
+}
+
+static void release_update(void)
+{
+    ota_sector_t *sector = NULL;
+
+    if (writer_task != NULL)
+    {
+        xQueueSend(write_queue, &sector, portMAX_DELAY);
+        do
+        {
+            xQueueReceive(free_queue, &sector, portMAX_DELAY);
+        } while (sector != NULL);
+        writer_task = NULL;
+    }
+
+    if (write_queue != NULL)
+    {
+        vQueueDelete(write_queue);
+        write_queue = NULL;
+    }
+    if (free_queue != NULL)
+    {
+        vQueueDelete(free_queue);
+        free_queue = NULL;
+    }
+
+    free(sectors);
+    sectors = NULL;
+    filling = NULL;
+
+    mbedtls_md_free(&image_md);
+    mbedtls_pk_free(&ota_key);
+
+    // received is kept for the status frame ending the update
+    target = NULL;
+    image_size = 0;
+    signature_len = 0;
+}
+
+static esp_err_t load_ota_key(void)
+{
+    static esp_err_t _err;
+    asset_t asset;
+
+    if (ESP_OK != (_err = asset_find(OTA_KEY_ASSET, &asset)))
+    {
+        return _err;
+    }
+
+    unsigned char *der = malloc(asset.length);
+    if (!der)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+
+    _err = asset_read(&asset, 0, der, asset.length);
+    if (ESP_OK == _err && 0 != mbedtls_pk_parse_public_key(&ota_key, der, asset.length))
+    {
+        _err = ESP_ERR_INVALID_ARG;
+    }
+
+    free(der);
+    return _err;
+}
+
+static ota_status_t start_writer(void)
+{
+    sectors = malloc(OTA_BUFFER_COUNT * sizeof(ota_sector_t));
+    // Room for every sector plus the stop marker
+    write_queue = xQueueCreate(OTA_BUFFER_COUNT + 1, sizeof(ota_sector_t *));
+    free_queue = xQueueCreate(OTA_BUFFER_COUNT + 1, sizeof(ota_sector_t *));
+    if (!sectors || !write_queue || !free_queue)
+    {
+        return OTA_STATUS_ERR_MEMORY;
+    }
+
+    for (int i = 1; i < OTA_BUFFER_COUNT; i++)
+    {
+        ota_sector_t *sector = &sectors[i];
+        xQueueSend(free_queue, &sector, 0);
+    }
+    filling = &sectors[0];
+    filling->offset = 0;
+    filling->length = 0;
+
+    write_err = ESP_OK;
+    if (pdPASS != xTaskCreate(ota_writer_task,
+                              "ota_writer_task",
+                              OTA_WRITER_TASK_STACK_DEPTH,
+                              NULL,
+                              OTA_WRITER_TASK_PRIORITY,
+                              &writer_task))
+    {
+        writer_task = NULL;
+        return OTA_STATUS_ERR_MEMORY;
+    }
+    return OTA_STATUS_ACK;
+}
+
+ota_status_t ota_update_begin(uint32_t size, uint32_t version, const uint8_t *sig, size_t sig_len)
+{
+    static ota_status_t status;
+    uint8_t signed_version[sizeof(uint32_t)];
+
+    ota_update_abort();
+    received = 0;
+
+    mbedtls_md_init(&image_md);
+    mbedtls_pk_init(&ota_key);
+
+    target = esp_ota_get_next_update_partition(NULL);
+    if (target == NULL || size == 0 || size > target->size)
+    {
+        release_update();
+        return OTA_STATUS_ERR_SIZE;
+    }
+
+    if (!sig || sig_len == 0 || sig_len > sizeof(signature))
+    {
+        release_update();
+        return OTA_STATUS_ERR_SIGNATURE;
+    }
+
+    if (version < OTA_FIRMWARE_VERSION)
+    {
+        release_update();
+        return OTA_STATUS_ERR_VERSION;
+    }
+
+    if (ESP_OK != load_ota_key())
+    {
+        release_update();
+        return OTA_STATUS_ERR_NO_KEY;
+    }
+
+    // Version leads the signed digest
+    for (size_t i = 0; i < sizeof(signed_version); i++)
+    {
+        signed_version[i] = (version >> (8 * i)) & 0xff;
+    }
+
+    if (0 != mbedtls_md_setup(&image_md, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 0) ||
+        0 != mbedtls_md_starts(&image_md) ||
+        0 != mbedtls_md_update(&image_md, signed_version, sizeof(signed_version)))
+    {
+        release_update();
+        return OTA_STATUS_ERR_MEMORY;
+    }
+
+    if (OTA_STATUS_ACK != (status = start_writer()))
+    {
+        release_update();
+        return status;
+    }
+
+    memcpy(signature, sig, sig_len);
+    signature_len = sig_len;
+    image_size = size;
+
+    printf("\nOTA UPDATE STARTED -> %u BYTES, VERSION %u\n", size, version);
+    return OTA_STATUS_ACK;
+}
+
+// Hands the filled sector to the writer and takes the next free one
+static ota_status_t submit_sector(void)
+{
+    memset(filling->data + filling->length, 0xFF, OTA_SECTOR_SIZE - filling->length);
+    xQueueSend(write_queue, &filling, portMAX_DELAY);
+    filling = NULL;
+
+    if (received == image_size)
+    {
+        return OTA_STATUS_ACK;
+    }
+
+    if (pdTRUE != xQueueReceive(free_queue, &filling, OTA_WRITE_TIMEOUT_MILLIS / portTICK_PERIOD_MS))
+    {
+        return OTA_STATUS_ERR_FLASH;
+    }
+
+    filling->offset = received;
+    filling->length = 0;
+    return (ESP_OK == write_err) ? OTA_STATUS_ACK : OTA_STATUS_ERR_FLASH;
+}
+
+// Waits for the last sectors, then checks the signature before the image is set to boot
+static ota_status_t finish_update(void)
+{
+    static uint8_t digest[OTA_DIGEST_SIZE];
+    const esp_partition_t *running = esp_ota_get_running_partition();
+
+    // Every sector back means every sector written, release_update() stops the writer afterwards
+    for (int i = 0; i < OTA_BUFFER_COUNT; i++)
+    {
+        ota_sector_t *sector = NULL;
+        if (pdTRUE != xQueueReceive(free_queue, &sector, OTA_WRITE_TIMEOUT_MILLIS / portTICK_PERIOD_MS))
+        {
+            return OTA_STATUS_ERR_FLASH;
+        }
+    }
+
+    if (ESP_OK != write_err)
+    {
+        return OTA_STATUS_ERR_FLASH;
+    }
+
+    if (0 != mbedtls_md_finish(&image_md, digest) ||
+        0 != mbedtls_pk_verify(&ota_key, MBEDTLS_MD_SHA256, digest, sizeof(digest), signature, signature_len))
+    {
+        return OTA_STATUS_ERR_SIGNATURE;
+    }
+
+    // Also checks the image header and checksum
+    if (running == NULL || ESP_OK != esp_ota_set_boot_partition(target))
+    {
+        return OTA_STATUS_ERR_IMAGE;
+    }
+
+    // Trial is counted from the first boot of the new image
+    save_ota_trial(0, running->subtype);
+    storage_flush();
+    event_log_append(EVENT_LOG_OTA_UPDATE, image_size);
+
+    printf("\nOTA UPDATE DONE -> %s\n", target->label);
+    return OTA_STATUS_DONE;
+}
+
+ota_status_t ota_update_write(uint32_t offset, const uint8_t *data, size_t len)
+{
+    static ota_status_t status;
+
+    if (target == NULL || filling == NULL)
+    {
+        return OTA_STATUS_ERR_STATE;
+    }
+
+    if (offset != received || len == 0 || len > image_size - received)
+    {
+        ota_update_abort();
+        return OTA_STATUS_ERR_OFFSET;
+    }
+
+    if (0 != mbedtls_md_update(&image_md, data, len))
+    {
+        ota_update_abort();
+        return OTA_STATUS_ERR_MEMORY;
+    }
+
+    status = OTA_STATUS_PENDING;
+    while (len > 0)
+    {
+        size_t n = OTA_SECTOR_SIZE - filling->length;
+        if (n > len)
+        {
+            n = len;
+        }
+
+        memcpy(filling->data + filling->length, data, n);
+        filling->length += n;
+        received += n;
+        data += n;
+        len -= n;
+
+        if (filling->length == OTA_SECTOR_SIZE || received == image_size)
+        {
+            if (OTA_STATUS_ACK != (status = submit_sector()))
+            {
+                ota_update_abort();
+                return status;
+            }
+        }
+    }
+
+    if (received == image_size)
+    {
+        status = finish_update();
+        release_update();
+    }
+    return status;
+}
+
+unsigned char ota_update_in_progress(void)
+{
+    return (target != NULL) ? 1 : 0;
+}
+
+uint32_t ota_update_received(void)
+{
+    return received;
+}
+
+void ota_update_abort(void)
+{
+    if (target != NULL)
+    {
+        printf("\nOTA UPDATE ABORTED AT %u\n", received);
+        release_update();
+    }
+}
+
+void ota_update_restart(void)
+{
+    event_log_flush();
+    esp_restart();
+}
+
+static void trial_timer_callback(void *arg)
+{
+    printf("\nOTA IMAGE NOT CONFIRMED, RESTARTING\n");
+    ota_update_restart();
+}
+
+esp_err_t init_ota_update(void)
+{
+    static esp_err_t _err;
+    uint8_t boots = 0, rollback_slot = 0;
+
+    if (ESP_OK != get_ota_trial(&boots, &rollback_slot))
+    {
+        return ESP_OK;
+    }
+
+    const esp_partition_t *running = esp_ota_get_running_partition();
+    if (running == NULL)
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    // Back on the previous image, rolled back below or by the bootloader refusing the update
+    if (running->subtype == rollback_slot)
+    {
+        printf("\nOTA ROLLED BACK AFTER %u BOOTS\n", boots);
+        event_log_append(EVENT_LOG_OTA_ROLLBACK, boots);
+        clear_ota_trial();
+        return storage_flush();
+    }
+
+    if (boots >= OTA_TRIAL_MAX_BOOTS)
+    {
+        const esp_partition_t *previous = esp_partition_find_first(ESP_PARTITION_TYPE_APP,
+                                                                   (esp_partition_subtype_t)rollback_slot, NULL);
+        if (previous != NULL && ESP_OK == esp_ota_set_boot_partition(previous))
+        {
+            printf("\nOTA IMAGE ROLLING BACK -> %s\n", previous->label);
+            esp_restart();
+        }
+
+        // Nothing to go back to, the update stays
+        clear_ota_trial();
+        return storage_flush();
+    }
+
+    // Counted before anything else can crash
+    save_ota_trial(boots + 1, rollback_slot);
+    if (ESP_OK != (_err = storage_flush()))
+    {
+        return _err;
+    }
+
+    const esp_timer_create_args_t timer_args = {
+        .callback = &trial_timer_callback,
+        .arg = NULL,
+        .name = "ota_trial"};
+
+    if (ESP_OK != (_err = esp_timer_create(&timer_args, &trial_timer)) ||
+        ESP_OK != (_err = esp_timer_start_once(trial_timer, OTA_TRIAL_MILLIS * 1000ULL)))
+    {
+        return _err;
+    }
+
+    printf("\nOTA IMAGE ON TRIAL, BOOT %u OF %u\n", boots + 1, OTA_TRIAL_MAX_BOOTS);
+    return ESP_OK;
+}
+
+void ota_update_confirm(void)
+{
+    if (trial_timer == NULL)
+    {
+        return;
+    }
+
+    esp_timer_stop(trial_timer);
+    esp_timer_delete(trial_timer);
+    trial_timer = NULL;
+
+    clear_ota_trial();
+    storage_flush();
+    printf("\nOTA IMAGE CONFIRMED\n");
+}
@@ -21,18 +21,77 @@ static int brokerDiscoveryAckPacketFormat[BROKER_DISCOVERY_ACK_PACKET_SIZE] = {
 static int provisionPacketFormat[PROVISION_PACKET_SIZE] = {
     UTF8_STRING_STYPE,  // SSID
     UTF8_STRING_STYPE,  // AP Password
-    UINT32_STYPE        // Pin Code
+    UINT32_STYPE,       // Pin Code
+    UINT32_STYPE        // Nonce
 };
 
 static int lampStateChangePacketFormat[LAMP_STATE_CHANGE_PACKET_SIZE] = {
     UINT8_STYPE
 };
 
+static int groupStateChangePacketFormat[GROUP_STATE_CHANGE_PACKET_SIZE] = {
+    UINT32_STYPE,   // Group ID
+    UINT32_STYPE,   // Sequence number
+    UINT8_STYPE,    // Lamp state
+    UINT64_STYPE    // Truncated HMAC-SHA256
+};
+
+static int groupAssignPacketFormat[GROUP_ASSIGN_PACKET_SIZE] = {
+    UINT32_STYPE,       // Group ID
+    UTF8_STRING_STYPE   // Group key, GROUP_KEY_LENGTH raw bytes
+};
+
+static int provisionAckPacketFormat[PROVISION_ACK_PACKET_SIZE] = {
+    UINT32_STYPE,   // Nonce
+    UINT8_STYPE     // Status
+};
+
+static int eventLogEntryPacketFormat[EVENT_LOG_ENTRY_PACKET_SIZE] = {
+    UINT32_STYPE,   // Entry sequence
+    UINT32_STYPE,   // Uptime millis
+    UINT8_STYPE,    // Event type
+    UINT32_STYPE    // Event argument
+};
+
+static int eventLogRequestPacketFormat[EVENT_LOG_REQUEST_PACKET_SIZE] = {
+    UINT32_STYPE    // Send entries after this sequence
+};
+
+static int eventLogEndPacketFormat[EVENT_LOG_END_PACKET_SIZE] = {
+    UINT32_STYPE,   // Last entry sequence sent
+    BOOLEAN_STYPE   // More entries to read
+};
+
+static int otaBeginPacketFormat[OTA_BEGIN_PACKET_SIZE] = {
+    UINT32_STYPE,       // Image size
+    UINT32_STYPE,       // Image version, covered by the signature
+    UTF8_STRING_STYPE   // Image signature, raw bytes
+};
+
+static int otaChunkPacketFormat[OTA_CHUNK_PACKET_SIZE] = {
+    UINT32_STYPE,       // Image offset
+    UTF8_STRING_STYPE   // Image bytes
+};
+
+static int otaStatusPacketFormat[OTA_STATUS_PACKET_SIZE] = {
+    UINT32_STYPE,   // Image bytes received
+    UINT8_STYPE     // Status
+};
+
 unsigned char RegisterNetworkPackets()
 {
     return RegisterPacket(PING_PACKET_ID, pingPacketFormat, PING_PACKET_SIZE) &&
         RegisterPacket(BROKER_DISCOVERY_REQUEST_PACKET_ID, brokerDiscoveryRequestPacketFormat, BROKER_DISCOVERY_REQUEST_PACKET_SIZE) &&
         RegisterPacket(BROKER_DISCOVERY_ACK_PACKET_ID, brokerDiscoveryAckPacketFormat, BROKER_DISCOVERY_ACK_PACKET_SIZE) &&
         RegisterPacket(PROVISION_PACKET_ID, provisionPacketFormat, PROVISION_PACKET_SIZE) &&
-        RegisterPacket(LAMP_STATE_CHANGE_PACKET_ID, lampStateChangePacketFormat, LAMP_STATE_CHANGE_PACKET_SIZE);
+        RegisterPacket(LAMP_STATE_CHANGE_PACKET_ID, lampStateChangePacketFormat, LAMP_STATE_CHANGE_PACKET_SIZE) &&
+        RegisterPacket(GROUP_STATE_CHANGE_PACKET_ID, groupStateChangePacketFormat, GROUP_STATE_CHANGE_PACKET_SIZE) &&
+        RegisterPacket(GROUP_ASSIGN_PACKET_ID, groupAssignPacketFormat, GROUP_ASSIGN_PACKET_SIZE) &&
+        RegisterPacket(PROVISION_ACK_PACKET_ID, provisionAckPacketFormat, PROVISION_ACK_PACKET_SIZE) &&
+        RegisterPacket(EVENT_LOG_ENTRY_PACKET_ID, eventLogEntryPacketFormat, EVENT_LOG_ENTRY_PACKET_SIZE) &&
+        RegisterPacket(EVENT_LOG_REQUEST_PACKET_ID, eventLogRequestPacketFormat, EVENT_LOG_REQUEST_PACKET_SIZE) &&
+        RegisterPacket(EVENT_LOG_END_PACKET_ID, eventLogEndPacketFormat, EVENT_LOG_END_PACKET_SIZE) &&
+        RegisterPacket(OTA_BEGIN_PACKET_ID, otaBeginPacketFormat, OTA_BEGIN_PACKET_SIZE) &&
+        RegisterPacket(OTA_CHUNK_PACKET_ID, otaChunkPacketFormat, OTA_CHUNK_PACKET_SIZE) &&
+        RegisterPacket(OTA_STATUS_PACKET_ID, otaStatusPacketFormat, OTA_STATUS_PACKET_SIZE);
 }
@@ -0,0 +1,82 @@
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "esp_wifi.h"
+#include "reconnect.h"
+
+static esp_timer_handle_t reconnect_timer = NULL;
+static uint8_t reconnect_attempt = 0;
+
+uint32_t reconnect_backoff_millis(uint8_t attempt, uint32_t random)
+{
+    uint32_t delay = RECONNECT_MAX_DELAY_MILLIS;
+    if (attempt < 16 && (RECONNECT_BASE_DELAY_MILLIS << attempt) < RECONNECT_MAX_DELAY_MILLIS)
+    {
+        delay = RECONNECT_BASE_DELAY_MILLIS << attempt;
+    }
+
+    // Half fixed, half jitter, so lamps dropped by the same AP do not retry in lockstep
+    return delay / 2 + random % (delay / 2 + 1);
+}
+
+static void reconnect_timer_callback(void *arg)
+{
+    esp_wifi_connect();
+}
+
+esp_err_t init_reconnect_scheduler(void)
+{
+    reconnect_attempt = 0;
+
+    if (reconnect_timer != NULL)
+    {
+        esp_timer_stop(reconnect_timer);
+        return ESP_OK;
+    }
+
+    const esp_timer_create_args_t timer_args = {
+        .callback = &reconnect_timer_callback,
+        .arg = NULL,
+        .name = "reconnect"};
+
+    return esp_timer_create(&timer_args, &reconnect_timer);
+}
+
+void deinit_reconnect_scheduler(void)
+{
+    if (reconnect_timer != NULL)
+    {
+        esp_timer_stop(reconnect_timer);
+        esp_timer_delete(reconnect_timer);
+        reconnect_timer = NULL;
+    }
+    reconnect_attempt = 0;
+}
+
+esp_err_t reconnect_schedule(void)
+{
+    if (reconnect_timer == NULL)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    if (reconnect_attempt >= RECONNECT_MAX_ATTEMPTS)
+    {
+        return ESP_ERR_TIMEOUT;
+    }
+
+    uint32_t delay_millis = reconnect_backoff_millis(reconnect_attempt++, esp_random());
+
+    // Fails harmlessly when no attempt is pending
+    esp_timer_stop(reconnect_timer);
+
+    return esp_timer_start_once(reconnect_timer, (uint64_t)delay_millis * 1000ULL);
+}
+
+void reconnect_reset(void)
+{
+    reconnect_attempt = 0;
+    if (reconnect_timer != NULL)
+    {
+        esp_timer_stop(reconnect_timer);
+    }
+}
@@ -14,6 +14,9 @@
 
 static unsigned char is_initialized = 0;
 static wifi_mode_t current_mode;
+static unsigned char sta_link_cached = 0;
+static wifi_power_profile_t power_profile;
+static unsigned char power_profile_set = 0;
 
 static esp_err_t parse_sta_credentials(wifi_config_t *lamp_sta_config,
                                        const uint8_t *sta_ssid_str, size_t sta_ssid_size,
@@ -66,17 +69,15 @@ static esp_err_t init_wifi(wifi_mode_t wifi_mode, esp_event_handler_t event_hand
             return _err;
         }
         current_mode = wifi_mode;
-        // esp_wifi_set_ps(WIFI_PS_NONE);
+        power_profile_set = 0;
         return ESP_OK;
     }
 
     return ESP_FAIL;
 }
 
-esp_err_t init_wifi_ap(esp_event_handler_t event_handler)
+static esp_err_t set_lamp_ap_config(void)
 {
-    static esp_err_t _err;
-
     wifi_config_t lamp_ap_config = {
         .ap = {
             .ssid = LAMP_AP_SSID,
@@ -85,13 +86,11 @@ esp_err_t init_wifi_ap(esp_event_handler_t event_handler)
             .authmode = WIFI_AUTH_OPEN}};
 
     // lamp_ap_config.ap.authmode = WIFI_AUTH_MAX;
-    if (ESP_OK != (_err = init_wifi(WIFI_MODE_AP, event_handler)) ||
-        ESP_OK != (_err = esp_wifi_set_config(ESP_IF_WIFI_AP, &lamp_ap_config)) ||
-        ESP_OK != (_err = esp_wifi_start()))
-    {
-        return _err;
-    }
+    return esp_wifi_set_config(ESP_IF_WIFI_AP, &lamp_ap_config);
+}
 
+static void set_lamp_ap_ip(void)
+{
     tcpip_adapter_ip_info_t ip_info;
 
     IP4_ADDR(&ip_info.gw, 192, 168, 4, 1);
@@ -103,15 +102,81 @@ esp_err_t init_wifi_ap(esp_event_handler_t event_handler)
     tcpip_adapter_set_ip_info(TCPIP_ADAPTER_IF_AP, &ip_info);
 
     tcpip_adapter_dhcps_start(TCPIP_ADAPTER_IF_AP);
+}
+
+esp_err_t init_wifi_ap(esp_event_handler_t event_handler)
+{
+    static esp_err_t _err;
+
+    if (ESP_OK != (_err = init_wifi(WIFI_MODE_AP, event_handler)) ||
+        ESP_OK != (_err = set_lamp_ap_config()) ||
+        ESP_OK != (_err = esp_wifi_start()))
+    {
+        return _err;
+    }
+
+    set_lamp_ap_ip();
 
     is_initialized = 1;
 
     return ESP_OK;
 }
 
+esp_err_t wifi_start_provisioning_ap(void)
+{
+    static esp_err_t _err;
+
+    if (!is_initialized || current_mode != WIFI_MODE_STA)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    // The softAP follows the station channel, the station stays associated
+    if (ESP_OK != (_err = esp_wifi_set_mode(WIFI_MODE_APSTA)))
+    {
+        return _err;
+    }
+    current_mode = WIFI_MODE_APSTA;
+
+    if (ESP_OK != (_err = set_lamp_ap_config()))
+    {
+        wifi_stop_provisioning_ap();
+        return _err;
+    }
+
+    set_lamp_ap_ip();
+
+    return ESP_OK;
+}
+
+esp_err_t wifi_stop_provisioning_ap(void)
+{
+    static esp_err_t _err;
+
+    if (!is_initialized || current_mode != WIFI_MODE_APSTA)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    esp_wifi_deauth_sta(0);
+    tcpip_adapter_dhcps_stop(TCPIP_ADAPTER_IF_AP);
+
+    if (ESP_OK != (_err = esp_wifi_set_mode(WIFI_MODE_STA)))
+    {
+        return _err;
+    }
+    current_mode = WIFI_MODE_STA;
+
+    // Power save was unavailable next to the softAP, reapply it
+    power_profile_set = 0;
+
+    return ESP_OK;
+}
+
 esp_err_t init_wifi_sta(esp_event_handler_t event_handler,
                         const uint8_t *sta_ssid_str, size_t sta_ssid_size,
-                        const uint8_t *sta_pwd_str, size_t sta_pwd_size)
+                        const uint8_t *sta_pwd_str, size_t sta_pwd_size,
+                        const wifi_link_cache_t *link)
 {
     static esp_err_t _err;
 
@@ -119,6 +184,7 @@ esp_err_t init_wifi_sta(esp_event_handler_t event_handler,
         .sta = {
             .ssid = {0},
             .password = {0},
+            .listen_interval = WIFI_POWER_IDLE_LISTEN_INTERVAL,
             .threshold.authmode = WIFI_AUTH_WPA2_PSK}};
 
     if (ESP_OK != parse_sta_credentials(&lamp_sta_config, sta_ssid_str, sta_ssid_size, sta_pwd_str, sta_pwd_size))
@@ -126,9 +192,39 @@ esp_err_t init_wifi_sta(esp_event_handler_t event_handler,
         return ESP_ERR_INVALID_ARG;
     }
 
+    sta_link_cached = 0;
+    if (link)
+    {
+        // Directed connect, no channel scan
+        lamp_sta_config.sta.bssid_set = 1;
+        memcpy(lamp_sta_config.sta.bssid, link->bssid, sizeof(lamp_sta_config.sta.bssid));
+        lamp_sta_config.sta.channel = link->channel;
+    }
+
     if (ESP_OK != (_err = init_wifi(WIFI_MODE_STA, event_handler)) ||
-        ESP_OK != (_err = esp_wifi_set_config(ESP_IF_WIFI_STA, &lamp_sta_config)) ||
-        ESP_OK != (_err = esp_wifi_start()))
+        ESP_OK != (_err = esp_wifi_set_config(ESP_IF_WIFI_STA, &lamp_sta_config)))
+    {
+        return _err;
+    }
+
+    if (link)
+    {
+        // Static IP from the cached lease, IP_EVENT_STA_GOT_IP is posted as soon as the station connects
+        tcpip_adapter_ip_info_t ip_info;
+        ip_info.ip.addr = link->ip;
+        ip_info.netmask.addr = link->netmask;
+        ip_info.gw.addr = link->gw;
+
+        if (ESP_OK != tcpip_adapter_dhcpc_stop(TCPIP_ADAPTER_IF_STA) ||
+            ESP_OK != tcpip_adapter_set_ip_info(TCPIP_ADAPTER_IF_STA, &ip_info))
+        {
+            // Lease not applicable, directed connect with DHCP
+            tcpip_adapter_dhcpc_start(TCPIP_ADAPTER_IF_STA);
+        }
+        sta_link_cached = 1;
+    }
+
+    if (ESP_OK != (_err = esp_wifi_start()))
     {
         return _err;
     }
@@ -138,6 +234,142 @@ esp_err_t init_wifi_sta(esp_event_handler_t event_handler,
     return ESP_OK;
 }
 
+esp_err_t wifi_sta_link_confirmed(void)
+{
+    static esp_err_t _err;
+
+    if (!is_initialized || current_mode != WIFI_MODE_STA || !sta_link_cached)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    // With CONFIG_LWIP_DHCP_RESTORE_LAST_IP the client starts in INIT-REBOOT, requesting the address
+    // in use, servers and sessions bound to it stay up unless the DHCP server hands out another one
+    if (ESP_OK != (_err = tcpip_adapter_dhcpc_start(TCPIP_ADAPTER_IF_STA)) &&
+        ESP_ERR_TCPIP_ADAPTER_DHCP_ALREADY_STARTED != _err)
+    {
+        return _err;
+    }
+    return ESP_OK;
+}
+
+esp_err_t wifi_sta_full_scan(void)
+{
+    static esp_err_t _err;
+
+    if (!is_initialized || current_mode != WIFI_MODE_STA || !sta_link_cached)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    sta_link_cached = 0;
+
+    wifi_config_t lamp_sta_config;
+    if (ESP_OK != (_err = esp_wifi_get_config(ESP_IF_WIFI_STA, &lamp_sta_config)))
+    {
+        return _err;
+    }
+
+    lamp_sta_config.sta.bssid_set = 0;
+    lamp_sta_config.sta.channel = 0;
+
+    if (ESP_OK != (_err = esp_wifi_set_config(ESP_IF_WIFI_STA, &lamp_sta_config)))
+    {
+        return _err;
+    }
+
+    // Back to DHCP, a no-op when the cached lease was not applied
+    tcpip_adapter_dhcpc_start(TCPIP_ADAPTER_IF_STA);
+
+    return ESP_OK;
+}
+
+esp_err_t wifi_sta_switch_credentials(const uint8_t *sta_ssid_str, size_t sta_ssid_size,
+                                      const uint8_t *sta_pwd_str, size_t sta_pwd_size)
+{
+    static esp_err_t _err;
+
+    if (!is_initialized || (current_mode != WIFI_MODE_STA && current_mode != WIFI_MODE_APSTA))
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    wifi_config_t lamp_sta_config;
+    if (ESP_OK != (_err = esp_wifi_get_config(ESP_IF_WIFI_STA, &lamp_sta_config)))
+    {
+        return _err;
+    }
+
+    if (ESP_OK != parse_sta_credentials(&lamp_sta_config, sta_ssid_str, sta_ssid_size, sta_pwd_str, sta_pwd_size))
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    // New AP, scan all channels and use DHCP
+    lamp_sta_config.sta.bssid_set = 0;
+    lamp_sta_config.sta.channel = 0;
+    sta_link_cached = 0;
+    tcpip_adapter_dhcpc_start(TCPIP_ADAPTER_IF_STA);
+
+    // Reconnects through WIFI_EVENT_STA_DISCONNECTED with the new configuration
+    esp_wifi_disconnect();
+
+    return esp_wifi_set_config(ESP_IF_WIFI_STA, &lamp_sta_config);
+}
+
+esp_err_t wifi_set_power_profile(wifi_power_profile_t profile)
+{
+    static esp_err_t _err;
+
+    if (!is_initialized || current_mode != WIFI_MODE_STA)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    if (power_profile_set && power_profile == profile)
+    {
+        return ESP_OK;
+    }
+
+    wifi_ps_type_t ps_type;
+    switch (profile)
+    {
+    case WIFI_POWER_PROFILE_ACTIVE:
+        ps_type = WIFI_PS_NONE;
+        break;
+    case WIFI_POWER_PROFILE_STANDBY:
+        ps_type = WIFI_PS_MIN_MODEM;
+        break;
+    case WIFI_POWER_PROFILE_IDLE:
+        // Sleeps for the listen interval set in init_wifi_sta
+        ps_type = WIFI_PS_MAX_MODEM;
+        break;
+    default:
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (ESP_OK != (_err = esp_wifi_set_ps(ps_type)))
+    {
+        return _err;
+    }
+
+    power_profile = profile;
+    power_profile_set = 1;
+    return ESP_OK;
+}
+
+uint32_t wifi_power_profile_theoretical_latency(wifi_power_profile_t profile)
+{
+    switch (profile)
+    {
+    case WIFI_POWER_PROFILE_ACTIVE:
+        return WIFI_POWER_ACTIVE_THEORETICAL_LATENCY_MILLIS;
+    case WIFI_POWER_PROFILE_STANDBY:
+        return WIFI_POWER_STANDBY_THEORETICAL_LATENCY_MILLIS;
+    default:
+        return WIFI_POWER_IDLE_THEORETICAL_LATENCY_MILLIS;
+    }
+}
+
 esp_err_t deinit_wifi(esp_event_handler_t event_handler)
 {
 
@@ -146,7 +378,7 @@ esp_err_t deinit_wifi(esp_event_handler_t event_handler)
         return ESP_ERR_INVALID_ARG;
     }
 
-    if (current_mode == WIFI_MODE_AP)
+    if (current_mode == WIFI_MODE_AP || current_mode == WIFI_MODE_APSTA)
     {
         esp_wifi_deauth_sta(0);
         tcpip_adapter_dhcps_stop(WIFI_IF_AP);
@@ -162,5 +394,7 @@ esp_err_t deinit_wifi(esp_event_handler_t event_handler)
     }
 
     is_initialized = 0;
+    sta_link_cached = 0;
+    power_profile_set = 0;
     return ESP_OK;
 }
@@ -13,6 +13,31 @@ static int server_socket = -1;
 
 static unsigned char recvBuffer[PROVISION_SERVER_BUFFER_SIZE];
 
+static struct sockaddr_in clientAddr;
+static socklen_t clientAddrLen;
+
+// Last provision datagram and its nonce, retransmissions are matched against it
+static unsigned char lastDatagram[PROVISION_SERVER_BUFFER_SIZE];
+static int lastDatagramLen = 0;
+static uint32_t lastNonce = 0;
+
+// Ack frame sent for the last provision datagram, 0 size until acknowledged
+static unsigned char ackFrame[PROVISION_ACK_BUFFER_SIZE];
+static size_t ackFrameSize = 0;
+
+static void reset_provision_exchange(void)
+{
+    lastDatagramLen = 0;
+    lastNonce = 0;
+    ackFrameSize = 0;
+}
+
+static esp_err_t send_provision_ack(void)
+{
+    int ret = sendto(server_socket, ackFrame, ackFrameSize, 0, (struct sockaddr *)&clientAddr, clientAddrLen);
+    return (ret < 0 || (size_t)ret != ackFrameSize) ? ESP_FAIL : ESP_OK;
+}
+
 esp_err_t init_wifi_provision(void)
 {
     server_socket = socket(AF_INET, SOCK_DGRAM, 0);
@@ -36,6 +61,8 @@ esp_err_t init_wifi_provision(void)
         return ESP_FAIL;
     }
 
+    reset_provision_exchange();
+
     return ESP_OK;
 }
 
@@ -46,17 +73,16 @@ void deinit_wifi_provision(void)
         close(server_socket);
         server_socket = -1;
     }
+    reset_provision_exchange();
 }
 
-esp_err_t provision_listen(spiffs_string_t *ussid, spiffs_string_t *upwd, uint32_t * pinCode)
+esp_err_t provision_listen(spiffs_string_t *ussid, spiffs_string_t *upwd, uint32_t * pinCode, uint32_t timeout_millis)
 {
-    static struct sockaddr_in clientAddr;
-    static socklen_t clientAddrLen;
     clientAddrLen = sizeof(clientAddr);
 
     static struct timeval time_out_v;
-    time_out_v.tv_sec = 0;
-    time_out_v.tv_usec = 500000; // 500ms
+    time_out_v.tv_sec = timeout_millis / 1000UL;
+    time_out_v.tv_usec = (timeout_millis % 1000UL) * 1000UL;
 
     fd_set set;
 
@@ -94,6 +120,13 @@ esp_err_t provision_listen(spiffs_string_t *ussid, spiffs_string_t *upwd, uint32
         // Data received
         recvBuffer[len] = 0; // NULL terminate buffer
 
+        if (ackFrameSize > 0 && len == lastDatagramLen && 0 == memcmp(recvBuffer, lastDatagram, len))
+        {
+            // Retransmission, the previous ack was lost
+            send_provision_ack();
+            return ESP_ERR_TIMEOUT;
+        }
+
         // Deserialize Packet
         dpacket_struct_t dpacket;
         if (DeserializeBuffer(recvBuffer, len, &dpacket))
@@ -132,8 +165,16 @@ esp_err_t provision_listen(spiffs_string_t *ussid, spiffs_string_t *upwd, uint32
 
                 // Get Pin Code ( 6 digits )
                 serializable_list_node_t *n = dpacket.data_list.first_node->next_node->next_node;
-                if(n != NULL && n->stype == UINT32_STYPE && n->data.decimal_v.u32_v > 99999){
+                if(n != NULL && n->stype == UINT32_STYPE && n->data.decimal_v.u32_v > 99999 &&
+                    n->next_node != NULL && n->next_node->stype == UINT32_STYPE){
                     *pinCode = n->data.decimal_v.u32_v;
+
+                    // Remember the datagram until it is acknowledged
+                    memcpy(lastDatagram, recvBuffer, len);
+                    lastDatagramLen = len;
+                    lastNonce = n->next_node->data.decimal_v.u32_v;
+                    ackFrameSize = 0;
+
                     // Free packet reference
                     FreePacket(&dpacket);
 
@@ -149,3 +190,36 @@ esp_err_t provision_listen(spiffs_string_t *ussid, spiffs_string_t *upwd, uint32
 
     return ESP_FAIL;
 }
+
+esp_err_t provision_ack(uint8_t status)
+{
+    if (server_socket == -1 || lastDatagramLen == 0)
+    {
+        return ESP_FAIL;
+    }
+
+    dpacket_struct_t dpacket;
+    if (!NewPacket(&dpacket, PROVISION_ACK_PACKET_ID))
+    {
+        return ESP_FAIL;
+    }
+
+    if (!AddSerializable(&dpacket, UINT32_STYPE, (data_union_t){.decimal_v.u32_v = lastNonce}) ||
+        !AddSerializable(&dpacket, UINT8_STYPE, (data_union_t){.decimal_v.u8_v = status}))
+    {
+        FreePacket(&dpacket);
+        return ESP_FAIL;
+    }
+
+    memset(ackFrame, 0, sizeof(unsigned char) * PROVISION_ACK_BUFFER_SIZE);
+    if (!SerializePacket(ackFrame, PROVISION_ACK_BUFFER_SIZE, &dpacket, &ackFrameSize) ||
+        ackFrameSize == 0)
+    {
+        ackFrameSize = 0;
+        FreePacket(&dpacket);
+        return ESP_FAIL;
+    }
+    FreePacket(&dpacket);
+
+    return send_provision_ack();
+}
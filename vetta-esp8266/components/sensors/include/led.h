@@ -82,6 +82,11 @@ extern "C"
 
     uint8_t led_get_state(void);
 
+    /*  Switch the led to a state returned by led_get_state() (non-thread safe)
+    @return ESP_OK on success, ESP_ERR_INVALID_ARG for an unknown state, esp_err_t value in case of errors
+    */
+    esp_err_t led_set_state(uint8_t state);
+
 #ifdef __cplusplus
 }
 #endif
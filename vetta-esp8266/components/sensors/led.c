@@ -208,3 +208,18 @@ uint8_t led_get_state(void){
     }
     return 0;
 }
+
+esp_err_t led_set_state(uint8_t state){
+    switch (state)
+    {
+    case 0:
+        return led_off();
+    case 1:
+        return led_low();
+    case 2:
+        return led_medium();
+    case 3:
+        return led_high();
+    }
+    return ESP_ERR_INVALID_ARG;
+}
@@ -0,0 +1,167 @@
+#include <stddef.h>
+#include <string.h>
+#include "esp_err.h"
+#include "esp_partition.h"
+#include "config_record.h"
+#include "asset_store.h"
+
+typedef struct asset_header_t
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t count;
+    uint32_t length; // Image length, header and table included
+    uint32_t crc;    // CRC-32 over the header up to here and the table
+
+} asset_header_t;
+
+typedef struct asset_entry_t
+{
+    char name[ASSET_NAME_LENGTH]; // NUL padded, not terminated at full length
+    uint32_t offset;              // From the partition start
+    uint32_t length;
+    uint32_t crc; // CRC-32 of the asset data
+    uint32_t reserved;
+
+} asset_entry_t;
+
+typedef char asset_header_size_check[(sizeof(asset_header_t) == ASSET_HEADER_SIZE) ? 1 : -1];
+typedef char asset_entry_size_check[(sizeof(asset_entry_t) == ASSET_ENTRY_SIZE) ? 1 : -1];
+
+// Chunk size of the CRC check, on the stack of the calling task
+#define ASSET_CHECK_CHUNK_SIZE (128)
+
+static const esp_partition_t *asset_partition = NULL;
+
+static esp_err_t open_asset_partition(void)
+{
+    if (asset_partition == NULL)
+    {
+        asset_partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+                                                   (esp_partition_subtype_t)ASSET_PARTITION_SUBTYPE,
+                                                   ASSET_PARTITION_LABEL);
+    }
+
+    return (asset_partition == NULL) ? ESP_ERR_NOT_FOUND : ESP_OK;
+}
+
+static esp_err_t read_header(asset_header_t *header)
+{
+    static esp_err_t _err;
+
+    if (ESP_OK != (_err = esp_partition_read(asset_partition, 0, header, sizeof(asset_header_t))))
+    {
+        return _err;
+    }
+
+    // An unflashed partition reads as 0xFF
+    if (header->magic != ASSET_MAGIC ||
+        header->version == 0 ||
+        header->version > ASSET_VERSION ||
+        header->count > ASSET_MAX_COUNT ||
+        header->length > asset_partition->size ||
+        header->length < ASSET_HEADER_SIZE + header->count * ASSET_ENTRY_SIZE)
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+    return ESP_OK;
+}
+
+static esp_err_t check_data(const asset_entry_t *entry)
+{
+    static esp_err_t _err;
+    uint8_t chunk[ASSET_CHECK_CHUNK_SIZE];
+    uint32_t crc = 0;
+
+    for (size_t offset = 0; offset < entry->length; offset += sizeof(chunk))
+    {
+        size_t len = entry->length - offset;
+        if (len > sizeof(chunk))
+        {
+            len = sizeof(chunk);
+        }
+
+        if (ESP_OK != (_err = esp_partition_read(asset_partition, entry->offset + offset, chunk, len)))
+        {
+            return _err;
+        }
+        crc = storage_crc32_update(crc, chunk, len);
+    }
+
+    return (crc == entry->crc) ? ESP_OK : ESP_ERR_INVALID_CRC;
+}
+
+esp_err_t asset_find(const char *name, asset_t *asset)
+{
+    static esp_err_t _err;
+    static asset_header_t header;
+    static asset_entry_t entry;
+    static asset_entry_t found;
+
+    if (!name || !asset || strlen(name) > ASSET_NAME_LENGTH)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (ESP_OK != (_err = open_asset_partition()) || ESP_OK != (_err = read_header(&header)))
+    {
+        return _err;
+    }
+
+    // One pass over the table, a match only counts once the table CRC checks
+    uint32_t crc = storage_crc32_update(0, (const uint8_t *)&header, offsetof(asset_header_t, crc));
+    int matched = 0;
+
+    for (uint16_t i = 0; i < header.count; i++)
+    {
+        if (ESP_OK != (_err = esp_partition_read(asset_partition, ASSET_HEADER_SIZE + i * ASSET_ENTRY_SIZE,
+                                                 &entry, sizeof(entry))))
+        {
+            return _err;
+        }
+        crc = storage_crc32_update(crc, (const uint8_t *)&entry, sizeof(entry));
+
+        if (!matched && 0 == strncmp(entry.name, name, ASSET_NAME_LENGTH))
+        {
+            found = entry;
+            matched = 1;
+        }
+    }
+
+    if (crc != header.crc)
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    if (!matched ||
+        found.offset < ASSET_HEADER_SIZE + header.count * ASSET_ENTRY_SIZE ||
+        found.length > header.length ||
+        found.offset > header.length - found.length)
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    if (ESP_OK != (_err = check_data(&found)))
+    {
+        return _err;
+    }
+
+    asset->offset = found.offset;
+    asset->length = found.length;
+    return ESP_OK;
+}
+
+esp_err_t asset_read(const asset_t *asset, size_t offset, void *buf, size_t len)
+{
+    if (!asset || (!buf && len) || offset > asset->length || len > asset->length - offset)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (asset_partition == NULL)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    return esp_partition_read(asset_partition, asset->offset + offset, buf, len);
+}
@@ -0,0 +1,345 @@
+#include <stddef.h>
+#include <string.h>
+#include "esp_err.h"
+#include "esp_partition.h"
+#include "config_record.h"
+#include "blob_store.h"
+
+// Programmed last, a slot without it holds no blob
+typedef struct blob_header_t
+{
+    uint32_t magic;
+    uint16_t id;
+    uint16_t version;
+    uint32_t length;
+    uint32_t sequence;
+    uint32_t crc; // CRC-32 over the header up to here and the blob data
+    uint8_t reserved[BLOB_HEADER_SIZE - 20];
+
+} blob_header_t;
+
+typedef char blob_header_size_check[(sizeof(blob_header_t) == BLOB_HEADER_SIZE) ? 1 : -1];
+
+// Chunk size of the CRC check, on the stack of the calling task
+#define BLOB_CHECK_CHUNK_SIZE (128)
+
+static const esp_partition_t *blob_partition = NULL;
+
+static esp_err_t open_blob_partition(void)
+{
+    if (blob_partition == NULL)
+    {
+        blob_partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+                                                  (esp_partition_subtype_t)BLOB_PARTITION_SUBTYPE,
+                                                  BLOB_PARTITION_LABEL);
+    }
+
+    if (blob_partition == NULL || blob_partition->size < BLOB_COUNT * BLOB_SLOT_COUNT * BLOB_SLOT_SIZE)
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+    return ESP_OK;
+}
+
+static size_t slot_offset(blob_id_t id, int slot_ix)
+{
+    return ((size_t)id * BLOB_SLOT_COUNT + slot_ix) * BLOB_SLOT_SIZE;
+}
+
+static uint32_t header_crc(const blob_header_t *header)
+{
+    return storage_crc32_update(0, (const uint8_t *)header, offsetof(blob_header_t, crc));
+}
+
+// Header of slot_ix if it is complete, the data is not checked
+static esp_err_t read_header(blob_id_t id, int slot_ix, blob_header_t *header)
+{
+    static esp_err_t _err;
+
+    if (ESP_OK != (_err = esp_partition_read(blob_partition, slot_offset(id, slot_ix), header, sizeof(blob_header_t))))
+    {
+        return _err;
+    }
+
+    // Erased slots read as 0xFF
+    if (header->magic != BLOB_MAGIC ||
+        header->id != id ||
+        header->version == 0 ||
+        header->version > BLOB_VERSION ||
+        header->length > BLOB_MAX_LENGTH)
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+    return ESP_OK;
+}
+
+static esp_err_t check_data(blob_id_t id, int slot_ix, const blob_header_t *header)
+{
+    static esp_err_t _err;
+    uint8_t chunk[BLOB_CHECK_CHUNK_SIZE];
+    uint32_t crc = header_crc(header);
+    size_t base = slot_offset(id, slot_ix) + BLOB_HEADER_SIZE;
+
+    for (size_t offset = 0; offset < header->length; offset += sizeof(chunk))
+    {
+        size_t len = header->length - offset;
+        if (len > sizeof(chunk))
+        {
+            len = sizeof(chunk);
+        }
+
+        if (ESP_OK != (_err = esp_partition_read(blob_partition, base + offset, chunk, len)))
+        {
+            return _err;
+        }
+        crc = storage_crc32_update(crc, chunk, len);
+    }
+
+    return (crc == header->crc) ? ESP_OK : ESP_ERR_INVALID_CRC;
+}
+
+// Index of the slot holding the newest intact copy of blob id, -1 if none
+static int current_slot(blob_id_t id, blob_header_t *header)
+{
+    static blob_header_t headers[BLOB_SLOT_COUNT];
+    unsigned char valid[BLOB_SLOT_COUNT];
+
+    for (int i = 0; i < BLOB_SLOT_COUNT; i++)
+    {
+        valid[i] = (ESP_OK == read_header(id, i, &headers[i])) ? 1 : 0;
+    }
+
+    // Newest first, an older copy only counts when the newer one fails its CRC
+    for (int n = 0; n < BLOB_SLOT_COUNT; n++)
+    {
+        int newest = -1;
+        for (int i = 0; i < BLOB_SLOT_COUNT; i++)
+        {
+            if (valid[i] && (newest < 0 || (int32_t)(headers[i].sequence - headers[newest].sequence) > 0))
+            {
+                newest = i;
+            }
+        }
+
+        if (newest < 0)
+        {
+            return -1;
+        }
+
+        if (ESP_OK == check_data(id, newest, &headers[newest]))
+        {
+            *header = headers[newest];
+            return newest;
+        }
+        valid[newest] = 0;
+    }
+    return -1;
+}
+
+esp_err_t blob_open(blob_id_t id, blob_reader_t *reader)
+{
+    static blob_header_t header;
+
+    if (!reader || id >= BLOB_COUNT)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (ESP_OK != open_blob_partition())
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    int slot_ix = current_slot(id, &header);
+    if (slot_ix < 0)
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    reader->id = id;
+    reader->data_offset = slot_offset(id, slot_ix) + BLOB_HEADER_SIZE;
+    reader->length = header.length;
+    reader->offset = 0;
+    return ESP_OK;
+}
+
+esp_err_t blob_read(blob_reader_t *reader, uint8_t *buf, size_t buf_size, size_t *out_len)
+{
+    static esp_err_t _err;
+
+    if (!reader || !buf || !out_len || reader->offset > reader->length)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    size_t len = reader->length - reader->offset;
+    if (len > buf_size)
+    {
+        len = buf_size;
+    }
+
+    *out_len = 0;
+    if (len == 0)
+    {
+        return ESP_OK;
+    }
+
+    if (ESP_OK != (_err = esp_partition_read(blob_partition, reader->data_offset + reader->offset, buf, len)))
+    {
+        return _err;
+    }
+
+    reader->offset += len;
+    *out_len = len;
+    return ESP_OK;
+}
+
+esp_err_t blob_write_begin(blob_id_t id, size_t length, blob_writer_t *writer)
+{
+    static esp_err_t _err;
+    static blob_header_t header;
+
+    if (!writer || id >= BLOB_COUNT || length > BLOB_MAX_LENGTH)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (ESP_OK != (_err = open_blob_partition()))
+    {
+        return _err;
+    }
+
+    int current = current_slot(id, &header);
+    uint32_t sequence = (current < 0) ? 1 : header.sequence + 1;
+    // The current copy stays readable until the new header is programmed
+    int target = (current < 0) ? 0 : (current + 1) % BLOB_SLOT_COUNT;
+
+    memset(writer, 0, sizeof(blob_writer_t));
+    writer->id = id;
+    writer->slot_offset = slot_offset(id, target);
+    writer->length = length;
+    writer->sequence = sequence;
+
+    memset(&header, 0xFF, sizeof(header));
+    header.magic = BLOB_MAGIC;
+    header.id = id;
+    header.version = BLOB_VERSION;
+    header.length = length;
+    header.sequence = sequence;
+    writer->crc = header_crc(&header);
+
+    return esp_partition_erase_range(blob_partition, writer->slot_offset, BLOB_SLOT_SIZE);
+}
+
+esp_err_t blob_write(blob_writer_t *writer, const uint8_t *data, size_t len)
+{
+    static esp_err_t _err;
+
+    if (!writer || (!data && len) || len > writer->length - writer->written)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    size_t data_base = writer->slot_offset + BLOB_HEADER_SIZE;
+    writer->crc = storage_crc32_update(writer->crc, data, len);
+
+    // Completes the word left over by the previous chunk
+    if (writer->pending_len > 0)
+    {
+        size_t n = sizeof(writer->pending) - writer->pending_len;
+        if (n > len)
+        {
+            n = len;
+        }
+        memcpy(writer->pending + writer->pending_len, data, n);
+        writer->pending_len += n;
+        writer->written += n;
+        data += n;
+        len -= n;
+
+        if (writer->pending_len < sizeof(writer->pending))
+        {
+            return ESP_OK;
+        }
+
+        if (ESP_OK != (_err = esp_partition_write(blob_partition, data_base + writer->written - sizeof(writer->pending),
+                                                  writer->pending, sizeof(writer->pending))))
+        {
+            return _err;
+        }
+        writer->pending_len = 0;
+    }
+
+    size_t aligned = len & ~(sizeof(writer->pending) - 1);
+    if (aligned > 0)
+    {
+        if (ESP_OK != (_err = esp_partition_write(blob_partition, data_base + writer->written, data, aligned)))
+        {
+            return _err;
+        }
+        writer->written += aligned;
+        data += aligned;
+        len -= aligned;
+    }
+
+    memcpy(writer->pending, data, len);
+    writer->pending_len = len;
+    writer->written += len;
+    return ESP_OK;
+}
+
+esp_err_t blob_write_end(blob_writer_t *writer)
+{
+    static esp_err_t _err;
+    static blob_header_t header;
+
+    if (!writer)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (writer->written != writer->length)
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    if (writer->pending_len > 0)
+    {
+        // Padding stays erased
+        memset(writer->pending + writer->pending_len, 0xFF, sizeof(writer->pending) - writer->pending_len);
+        if (ESP_OK != (_err = esp_partition_write(blob_partition,
+                                                  writer->slot_offset + BLOB_HEADER_SIZE + writer->written - writer->pending_len,
+                                                  writer->pending, sizeof(writer->pending))))
+        {
+            return _err;
+        }
+        writer->pending_len = 0;
+    }
+
+    memset(&header, 0xFF, sizeof(header));
+    header.magic = BLOB_MAGIC;
+    header.id = writer->id;
+    header.version = BLOB_VERSION;
+    header.length = writer->length;
+    header.sequence = writer->sequence;
+    header.crc = writer->crc;
+
+    return esp_partition_write(blob_partition, writer->slot_offset, &header, sizeof(header));
+}
+
+esp_err_t blob_delete(blob_id_t id)
+{
+    static esp_err_t _err;
+
+    if (id >= BLOB_COUNT)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (ESP_OK != (_err = open_blob_partition()))
+    {
+        return _err;
+    }
+
+    return esp_partition_erase_range(blob_partition, slot_offset(id, 0), BLOB_SLOT_COUNT * BLOB_SLOT_SIZE);
+}
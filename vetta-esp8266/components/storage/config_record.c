@@ -0,0 +1,426 @@
+#include <stddef.h>
+#include <string.h>
+#include "esp_err.h"
+#include "esp_partition.h"
+#include "config_record.h"
+#include "storage_backend.h"
+
+// Entry header, followed by length payload bytes. Entries are appended back to back, 4 byte aligned
+typedef struct config_entry_header_t
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t length; // Stored payload bytes
+    uint32_t sequence;
+    uint32_t crc; // CRC-32 over the header up to here and the stored payload bytes
+
+} config_entry_header_t;
+
+// Whole config record. A slot written before the log held one of these at offset 0, still read as is
+typedef struct config_record_entry_t
+{
+    config_entry_header_t header;
+    config_record_t record;
+
+} config_record_entry_t;
+
+// Lamp state changed since the record before it, the rest of the record did not
+typedef struct config_state_entry_t
+{
+    config_entry_header_t header;
+    uint8_t lamp_state;
+    uint8_t reserved[3];
+
+} config_state_entry_t;
+
+// Flash page, a record entry is programmed within one
+#define CONFIG_PAGE_SIZE (256UL)
+
+typedef char config_record_entry_fits_page[(sizeof(config_record_entry_t) <= CONFIG_PAGE_SIZE && sizeof(config_record_entry_t) % 4 == 0) ? 1 : -1];
+
+// Records written by later versions may be longer, up to the rest of the page
+#define CONFIG_RECORD_MAX_LENGTH (CONFIG_PAGE_SIZE - sizeof(config_entry_header_t))
+
+#define CONFIG_ENTRY_SIZE(length) ((sizeof(config_entry_header_t) + (length) + 3UL) & ~3UL)
+
+static const esp_partition_t *config_partition = NULL;
+
+// Log position, found by the first read or write of the boot
+static unsigned char log_scanned = 0;
+static int log_slot = -1;         // Slot appended to, -1 while nothing is stored
+static size_t log_offset = 0;     // First free byte of log_slot
+static uint32_t log_sequence = 0; // Sequence of the newest entry
+static unsigned char log_has_record = 0;
+static config_record_t log_record; // Record the log reads back as
+
+uint32_t storage_crc32_update(uint32_t crc, const uint8_t *data, size_t len)
+{
+    crc = ~crc;
+    while (len--)
+    {
+        crc ^= *data++;
+        for (uint8_t bit = 0; bit < 8; bit++)
+        {
+            crc = (crc >> 1) ^ (0xEDB88320UL & (0UL - (crc & 1UL)));
+        }
+    }
+    return ~crc;
+}
+
+static uint32_t entry_crc(const config_entry_header_t *header, const void *payload)
+{
+    uint32_t crc = storage_crc32_update(0, (const uint8_t *)header, offsetof(config_entry_header_t, crc));
+    return storage_crc32_update(crc, (const uint8_t *)payload, header->length);
+}
+
+// CRC of a record entry longer than config_record_t, the unknown tail is read back from flash
+static esp_err_t long_entry_crc(size_t address, const config_record_entry_t *entry, uint32_t *out)
+{
+    static esp_err_t _err;
+    uint8_t tail[32];
+
+    uint32_t crc = storage_crc32_update(0, (const uint8_t *)&entry->header, offsetof(config_entry_header_t, crc));
+    crc = storage_crc32_update(crc, (const uint8_t *)&entry->record, sizeof(config_record_t));
+
+    size_t offset = sizeof(config_record_entry_t);
+    size_t end = sizeof(config_entry_header_t) + entry->header.length;
+    while (offset < end)
+    {
+        size_t n = (end - offset < sizeof(tail)) ? end - offset : sizeof(tail);
+        if (ESP_OK != (_err = esp_partition_read(config_partition, address + offset, tail, n)))
+        {
+            return _err;
+        }
+        crc = storage_crc32_update(crc, tail, n);
+        offset += n;
+    }
+
+    *out = crc;
+    return ESP_OK;
+}
+
+static esp_err_t open_config_partition(void)
+{
+    if (config_partition == NULL)
+    {
+        config_partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+                                                    (esp_partition_subtype_t)CONFIG_PARTITION_SUBTYPE,
+                                                    CONFIG_PARTITION_LABEL);
+    }
+
+    if (config_partition == NULL || config_partition->size < CONFIG_SLOT_COUNT * CONFIG_SLOT_SIZE)
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+    return ESP_OK;
+}
+
+// Reads and checks the record entry at address, its header already read
+static esp_err_t read_record_entry(size_t address, config_record_entry_t *entry)
+{
+    static esp_err_t _err;
+
+    // Newer versions only append fields, after a rollback to an older image their records
+    // still load, the fields it knows about included
+    if (entry->header.version == 0 ||
+        entry->header.length > CONFIG_RECORD_MAX_LENGTH)
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    size_t length = (entry->header.length < sizeof(config_record_t)) ? entry->header.length : sizeof(config_record_t);
+    memset(&entry->record, 0, sizeof(config_record_t));
+    if (ESP_OK != (_err = esp_partition_read(config_partition, address + sizeof(config_entry_header_t), &entry->record, length)))
+    {
+        return _err;
+    }
+
+    if (entry->header.length > sizeof(config_record_t))
+    {
+        uint32_t crc = 0;
+        if (ESP_OK != (_err = long_entry_crc(address, entry, &crc)))
+        {
+            return _err;
+        }
+        return (entry->header.crc == crc) ? ESP_OK : ESP_ERR_INVALID_CRC;
+    }
+
+    // Older, shorter records leave the new fields zeroed
+    return (entry->header.crc == entry_crc(&entry->header, &entry->record)) ? ESP_OK : ESP_ERR_INVALID_CRC;
+}
+
+static esp_err_t read_state_entry(size_t address, config_state_entry_t *entry)
+{
+    static esp_err_t _err;
+
+    if (entry->header.length != sizeof(config_state_entry_t) - sizeof(config_entry_header_t))
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    if (ESP_OK != (_err = esp_partition_read(config_partition, address + sizeof(config_entry_header_t),
+                                             &entry->lamp_state, entry->header.length)))
+    {
+        return _err;
+    }
+
+    return (entry->header.crc == entry_crc(&entry->header, &entry->lamp_state)) ? ESP_OK : ESP_ERR_INVALID_CRC;
+}
+
+// Header never programmed. A write cut before its magic leaves other bytes set and ends the slot instead
+static unsigned char erased(const config_entry_header_t *header)
+{
+    const uint8_t *bytes = (const uint8_t *)header;
+    for (size_t i = 0; i < sizeof(*header); i++)
+    {
+        if (bytes[i] != 0xFF)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Walks every entry of both slots. The newest record wins, lamp states logged after it apply on top.
+// The slot holding the newest entry is appended to, from its first erased byte. An entry that does
+// not check out ends its slot, a cut write is never programmed over
+static esp_err_t scan_log(void)
+{
+    static config_record_entry_t record_entry;
+    static config_state_entry_t state_entry;
+    static esp_err_t _err;
+
+    unsigned char has_record = 0;
+    uint32_t record_sequence = 0;
+    unsigned char has_state = 0;
+    uint32_t state_sequence = 0;
+    uint8_t lamp_state = 0;
+
+    log_slot = -1;
+    log_offset = 0;
+    log_sequence = 0;
+    log_has_record = 0;
+    memset(&log_record, 0, sizeof(log_record));
+
+    for (int slot = 0; slot < CONFIG_SLOT_COUNT; slot++)
+    {
+        size_t offset = 0;
+        size_t slot_end = CONFIG_SLOT_SIZE;
+
+        while (offset + sizeof(config_entry_header_t) <= CONFIG_SLOT_SIZE)
+        {
+            size_t address = slot * CONFIG_SLOT_SIZE + offset;
+            config_entry_header_t header;
+
+            if (ESP_OK != (_err = esp_partition_read(config_partition, address, &header, sizeof(header))))
+            {
+                return _err;
+            }
+
+            if (erased(&header))
+            {
+                // The log of this slot ends here
+                slot_end = offset;
+                break;
+            }
+
+            if (offset + CONFIG_ENTRY_SIZE(header.length) > CONFIG_SLOT_SIZE)
+            {
+                break;
+            }
+
+            if (header.magic == CONFIG_RECORD_MAGIC)
+            {
+                record_entry.header = header;
+                if (ESP_OK != read_record_entry(address, &record_entry))
+                {
+                    break;
+                }
+                if (!has_record || (int32_t)(header.sequence - record_sequence) > 0)
+                {
+                    has_record = 1;
+                    record_sequence = header.sequence;
+                    log_record = record_entry.record;
+                }
+            }
+            else if (header.magic == CONFIG_STATE_MAGIC)
+            {
+                state_entry.header = header;
+                if (ESP_OK != read_state_entry(address, &state_entry))
+                {
+                    break;
+                }
+                if (!has_state || (int32_t)(header.sequence - state_sequence) > 0)
+                {
+                    has_state = 1;
+                    state_sequence = header.sequence;
+                    lamp_state = state_entry.lamp_state;
+                }
+            }
+            else
+            {
+                break;
+            }
+
+            if (log_slot < 0 || (int32_t)(header.sequence - log_sequence) > 0)
+            {
+                log_slot = slot;
+                log_sequence = header.sequence;
+            }
+            offset += CONFIG_ENTRY_SIZE(header.length);
+        }
+
+        if (slot == log_slot)
+        {
+            log_offset = slot_end;
+        }
+    }
+
+    // Lamp states only ride on a record written before them
+    if (has_record && has_state && (int32_t)(state_sequence - record_sequence) > 0)
+    {
+        log_record.lamp_state = lamp_state;
+        log_record.flags |= CONFIG_RECORD_HAS_LAMP_STATE;
+    }
+    log_has_record = has_record;
+    log_scanned = 1;
+    return ESP_OK;
+}
+
+esp_err_t config_record_read(config_record_t *out)
+{
+    static esp_err_t _err;
+
+    if (!out)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (ESP_OK != open_config_partition())
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    if (ESP_OK != (_err = scan_log()))
+    {
+        log_scanned = 0;
+        return _err;
+    }
+
+    if (!log_has_record)
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    *out = log_record;
+    return ESP_OK;
+}
+
+// record differs from the logged one in its lamp state only
+static unsigned char lamp_state_only(const config_record_t *record)
+{
+    static config_record_t a;
+    static config_record_t b;
+
+    if (!log_has_record || !(record->flags & CONFIG_RECORD_HAS_LAMP_STATE))
+    {
+        return 0;
+    }
+
+    a = *record;
+    b = log_record;
+    a.lamp_state = b.lamp_state = 0;
+    a.flags |= CONFIG_RECORD_HAS_LAMP_STATE;
+    b.flags |= CONFIG_RECORD_HAS_LAMP_STATE;
+    return (0 == memcmp(&a, &b, sizeof(a))) ? 1 : 0;
+}
+
+esp_err_t config_record_write(const config_record_t *record)
+{
+    static config_record_entry_t record_entry;
+    static config_state_entry_t state_entry;
+    static esp_err_t _err;
+    const void *entry;
+    size_t size;
+
+    if (!record)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (ESP_OK != (_err = open_config_partition()))
+    {
+        return _err;
+    }
+
+    if (!log_scanned && ESP_OK != (_err = scan_log()))
+    {
+        return _err;
+    }
+
+    uint32_t sequence = (log_slot < 0) ? 1 : log_sequence + 1;
+    size_t state_size = CONFIG_ENTRY_SIZE(sizeof(config_state_entry_t) - sizeof(config_entry_header_t));
+    size_t record_size = CONFIG_ENTRY_SIZE(sizeof(config_record_t));
+
+    int slot = log_slot;
+    size_t offset = log_offset;
+    unsigned char state_only = lamp_state_only(record);
+
+    if (slot < 0 || offset + (state_only ? state_size : record_size) > CONFIG_SLOT_SIZE)
+    {
+        // Slot full, the other one is erased and starts with the whole record. The newest record
+        // stays readable in the full slot until then
+        slot = (slot < 0) ? 0 : (slot + 1) % CONFIG_SLOT_COUNT;
+        offset = 0;
+        state_only = 0;
+        if (ESP_OK != (_err = esp_partition_erase_range(config_partition, slot * CONFIG_SLOT_SIZE, CONFIG_SLOT_SIZE)))
+        {
+            log_scanned = 0;
+            return _err;
+        }
+    }
+
+    if (state_only)
+    {
+        memset(&state_entry, 0, sizeof(state_entry));
+        state_entry.header.magic = CONFIG_STATE_MAGIC;
+        state_entry.header.version = CONFIG_RECORD_VERSION;
+        state_entry.header.length = sizeof(config_state_entry_t) - sizeof(config_entry_header_t);
+        state_entry.header.sequence = sequence;
+        state_entry.lamp_state = record->lamp_state;
+        state_entry.header.crc = entry_crc(&state_entry.header, &state_entry.lamp_state);
+        entry = &state_entry;
+        size = state_size;
+    }
+    else
+    {
+        memset(&record_entry, 0, sizeof(record_entry));
+        record_entry.header.magic = CONFIG_RECORD_MAGIC;
+        record_entry.header.version = CONFIG_RECORD_VERSION;
+        record_entry.header.length = sizeof(config_record_t);
+        record_entry.header.sequence = sequence;
+        record_entry.record = *record;
+        record_entry.header.crc = entry_crc(&record_entry.header, &record_entry.record);
+        entry = &record_entry;
+        size = record_size;
+    }
+
+    if (ESP_OK != (_err = esp_partition_write(config_partition, slot * CONFIG_SLOT_SIZE + offset, entry, size)))
+    {
+        // Whatever got programmed ends the slot, found again by the next scan
+        log_scanned = 0;
+        return _err;
+    }
+
+    log_slot = slot;
+    log_offset = offset + size;
+    log_sequence = sequence;
+    log_has_record = 1;
+    log_record = *record;
+    return ESP_OK;
+}
+
+const storage_backend_t config_slot_backend = {
+    .name = "config slots",
+    .read = &config_record_read,
+    .write = &config_record_write};
@@ -0,0 +1,50 @@
+#ifndef __ASSET_STORE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// Read-only data partition holding the image built by mkassets.py, flashed apart from the firmware
+#define ASSET_PARTITION_LABEL "assets"
+#define ASSET_PARTITION_SUBTYPE (0x43)
+
+#define ASSET_MAGIC (0x53415456UL) // "VTAS"
+#define ASSET_VERSION (1)
+
+// Image header, the table of asset entries follows it
+#define ASSET_HEADER_SIZE (16UL)
+#define ASSET_ENTRY_SIZE (32UL)
+#define ASSET_NAME_LENGTH (16)
+#define ASSET_MAX_COUNT (64)
+
+    // Location of one asset in the partition
+    typedef struct asset_t
+    {
+        size_t offset;
+        size_t length;
+
+    } asset_t;
+
+    /**
+     * Looks name up in the asset table and checks the asset data CRC, streaming it through a small buffer.
+     * ESP_ERR_NOT_FOUND if the partition holds no valid image or no asset of that name.
+     * ESP_ERR_INVALID_CRC if the asset data is corrupt.
+     */
+    esp_err_t asset_find(const char *name, asset_t *asset);
+
+    /**
+     * Copies len bytes from offset into the asset into buf.
+     */
+    esp_err_t asset_read(const asset_t *asset, size_t offset, void *buf, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#define __ASSET_STORE_H
+#endif // __ASSET_STORE_H
@@ -0,0 +1,95 @@
+#ifndef __BLOB_STORE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// Raw data partition holding A/B slots for every blob id, one flash sector per slot
+#define BLOB_PARTITION_LABEL "blobs"
+#define BLOB_PARTITION_SUBTYPE (0x42)
+#define BLOB_SLOT_SIZE (4096UL)
+#define BLOB_SLOT_COUNT (2)
+
+#define BLOB_MAGIC (0x4C425456UL) // "VTBL"
+#define BLOB_VERSION (1)
+
+// Slot header, the blob data follows it
+#define BLOB_HEADER_SIZE (32UL)
+#define BLOB_MAX_LENGTH (BLOB_SLOT_SIZE - BLOB_HEADER_SIZE)
+
+    // Fixed slots in the blob partition, values must not change.
+    // mkblobs.py packs the same layout into an image flashed at provisioning
+    typedef enum
+    {
+        BLOB_DEVICE_CERT = 0, // Same encoding as the compiled-in lamp.pem
+        BLOB_DEVICE_KEY,      // Same encoding as the compiled-in lamp.key
+        BLOB_COUNT
+    } blob_id_t;
+
+    typedef struct blob_reader_t
+    {
+        blob_id_t id;
+        size_t data_offset; // Partition offset of the blob data
+        size_t length;
+        size_t offset; // Bytes already read
+
+    } blob_reader_t;
+
+    typedef struct blob_writer_t
+    {
+        blob_id_t id;
+        size_t slot_offset;
+        size_t length;
+        size_t written;
+        uint32_t sequence;
+        uint32_t crc; // Running CRC of the data
+        uint8_t pending[4]; // Tail not yet programmed, flash is programmed in words
+        size_t pending_len;
+
+    } blob_writer_t;
+
+    /**
+     * Opens the newest copy of blob id whose CRC checks, the check streams the data through a small buffer.
+     * ESP_ERR_NOT_FOUND if no slot holds one.
+     */
+    esp_err_t blob_open(blob_id_t id, blob_reader_t *reader);
+
+    /**
+     * Copies the next chunk of up to buf_size bytes into buf. out_len is 0 once the blob is read.
+     * A reader stays valid across one later write of the same blob, the write goes to the other slot.
+     */
+    esp_err_t blob_read(blob_reader_t *reader, uint8_t *buf, size_t buf_size, size_t *out_len);
+
+    /**
+     * Erases the slot not holding the current copy and starts writing length bytes into it.
+     * The blob is replaced by blob_write_end, a write never ended leaves the current copy in place.
+     */
+    esp_err_t blob_write_begin(blob_id_t id, size_t length, blob_writer_t *writer);
+
+    /**
+     * Appends len bytes, chunks may be of any size.
+     */
+    esp_err_t blob_write(blob_writer_t *writer, const uint8_t *data, size_t len);
+
+    /**
+     * Programs the slot header, which makes the new copy current.
+     * ESP_ERR_INVALID_SIZE if fewer bytes than announced were written.
+     */
+    esp_err_t blob_write_end(blob_writer_t *writer);
+
+    /**
+     * Erases both slots of blob id.
+     */
+    esp_err_t blob_delete(blob_id_t id);
+
+#ifdef __cplusplus
+}
+#endif
+
+#define __BLOB_STORE_H
+#endif // __BLOB_STORE_H
@@ -0,0 +1,82 @@
+#ifndef __CONFIG_RECORD_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "storage.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// Raw data partition holding the A/B config slots, one flash sector each. Records are appended to the
+// current slot, the other one is only erased once it is full
+#define CONFIG_PARTITION_LABEL "config"
+#define CONFIG_PARTITION_SUBTYPE (0x40)
+#define CONFIG_SLOT_SIZE (4096UL)
+#define CONFIG_SLOT_COUNT (2)
+
+#define CONFIG_RECORD_MAGIC (0x46435456UL) // "VTCF"
+#define CONFIG_STATE_MAGIC (0x54535456UL)  // "VTST", lamp state logged on top of the record before it
+// Bump when config_record_t grows, fields are only ever appended. Fields past the stored length read
+// as zero, fields past config_record_t in a record of a later version are dropped by the next write
+#define CONFIG_RECORD_VERSION (4)
+
+#define CONFIG_RECORD_HAS_SEED (0x01)
+#define CONFIG_RECORD_HAS_CREDENTIALS (0x02)
+#define CONFIG_RECORD_HAS_LINK (0x04)
+#define CONFIG_RECORD_HAS_LAMP_STATE (0x08)
+#define CONFIG_RECORD_HAS_OTA_TRIAL (0x10)
+#define CONFIG_RECORD_HAS_GROUP (0x20)
+
+    // Lamp identity, station config and last lamp state, stored as a whole
+    typedef struct config_record_t
+    {
+        uint32_t lamp_seed;
+        uint32_t pin_code;
+        uint8_t flags;
+        uint8_t ssid_len;
+        uint8_t pwd_len;
+        uint8_t reserved;
+        uint8_t ssid[MAX_SSID_LENGTH + 1];
+        uint8_t pwd[MAX_PASSWORD_LENGTH + 1];
+        wifi_link_cache_t link;
+        // Version 2
+        uint8_t lamp_state;
+        uint8_t lamp_state_reserved[3]; // Room for a scene
+        // Version 3
+        uint8_t ota_trial_boots;    // Boots of the updated image not yet confirmed
+        uint8_t ota_rollback_slot;  // App subtype of the image it replaced
+        uint8_t ota_reserved[2];
+        // Version 4
+        uint32_t group_id;
+        uint32_t group_sequence; // Highest group command sequence accepted under group_key
+        uint8_t group_key[GROUP_KEY_LENGTH];
+
+    } config_record_t;
+
+    /**
+     * CRC-32 (IEEE 802.3) of len more bytes, chained through crc. Shared by the records kept in raw partitions.
+     */
+    uint32_t storage_crc32_update(uint32_t crc, const uint8_t *data, size_t len);
+
+    /**
+     * Scans both slots and returns the newest record with a valid CRC, with the lamp state of any newer
+     * lamp state entry applied. ESP_ERR_NOT_FOUND if neither slot holds one.
+     */
+    esp_err_t config_record_read(config_record_t *out);
+
+    /**
+     * Appends record to the current slot, as a 20 byte lamp state entry when nothing else changed.
+     * A full slot is compacted: the other slot is erased and starts over with the whole record.
+     * A write cut short fails its CRC, ends its slot and the previous record stays current.
+     */
+    esp_err_t config_record_write(const config_record_t *record);
+
+#ifdef __cplusplus
+}
+#endif
+
+#define __CONFIG_RECORD_H
+#endif // __CONFIG_RECORD_H
@@ -1,6 +1,7 @@
 #ifndef _STORAGE_H
 
 #include "esp_err.h"
+#include "freertos/FreeRTOS.h"
 
 #ifdef __cplusplus
 extern "C"
@@ -12,6 +13,9 @@ extern "C"
 #define MAX_PASSWORD_LENGTH (64UL)
 #define MAX_SSID_LENGTH (32UL)
 
+// HMAC-SHA256 key of the group commands, assigned by the broker
+#define GROUP_KEY_LENGTH (32UL)
+
     typedef struct spiffs_string_t
     {
         const char *filename;
@@ -20,17 +24,121 @@ extern "C"
 
     } spiffs_string_t;
 
+    // Home AP and DHCP lease of the last successful station connection
+    typedef struct wifi_link_cache_t
+    {
+        uint8_t bssid[6];
+        uint8_t channel;
+        uint32_t ip;
+        uint32_t netmask;
+        uint32_t gw;
+
+    } wifi_link_cache_t;
+
+// Config updates are written to flash this long after the first one, later updates share the write
+#ifndef STORAGE_WRITE_BEHIND_MILLIS
+#define STORAGE_WRITE_BEHIND_MILLIS (1000UL)
+#endif
+
+// Group sequence marks are written by storage_task right away, commands run ahead of them meanwhile
+#ifndef STORAGE_GROUP_SEQUENCE_WRITE_BEHIND_MILLIS
+#define STORAGE_GROUP_SEQUENCE_WRITE_BEHIND_MILLIS (0UL)
+#endif
+
+// Lamp state changes in bursts of touches, its flash write waits until the state stayed put this long
+#ifndef STORAGE_LAMP_STATE_QUIET_MILLIS
+#define STORAGE_LAMP_STATE_QUIET_MILLIS (5000UL)
+#endif
+
+// Lamp state touched without a pause is still written this long after its first unwritten change
+#ifndef STORAGE_LAMP_STATE_MAX_DELAY_MILLIS
+#define STORAGE_LAMP_STATE_MAX_DELAY_MILLIS (60000UL)
+#endif
+
+    /**
+     * Loads the config record into RAM, getters and setters are served from it afterwards.
+     * Setters return once RAM is updated, the flash write runs in storage_task once a timer expires.
+     */
+    esp_err_t init_storage(void);
+
+    /**
+     * Writes pending config updates to flash before returning. On failure they stay pending and are retried behind the caller.
+     */
+    esp_err_t storage_flush(void);
+
+    /**
+     * Waits up to ticks_to_wait for the write-behind timer, then writes pending config updates.
+     * ESP_ERR_TIMEOUT if the timer did not expire. Host simulations without tasks call it after advancing the timer.
+     */
+    esp_err_t storage_flush_due(TickType_t ticks_to_wait);
+
+    /**
+     * Writer task, runs the write-behind flushes out of the esp_timer task.
+     */
+    void storage_task(void *params);
+
+    /**
+     * Opens a storage session, SPIFFS is mounted by the first one and later opens only take a reference.
+     * Config lives in the config record, SPIFFS only holds files, such as the legacy config files migrated on first boot.
+     */
+    esp_err_t storage_open(void);
+
+    /**
+     * Closes a storage session, SPIFFS is unmounted with the last one.
+     */
+    void storage_close(void);
+
     esp_err_t get_lamp_seed(uint32_t * out);
 
     esp_err_t get_user_ap_password_string(spiffs_string_t *out_string);
     esp_err_t get_user_ap_ssid_string(spiffs_string_t *out_string);
     esp_err_t get_pin_code(uint32_t * pinCode);
+    esp_err_t get_wifi_link_cache(wifi_link_cache_t *out);
+
+    /**
+     * Stores home AP credentials and pin code in a single config record write, dropping the cached link.
+     */
+    esp_err_t save_user_ap_credentials(const uint8_t *ap_ssid, size_t ssid_length,
+                                       const uint8_t *ap_pwd, size_t pwd_length,
+                                       uint32_t pinCode);
+    esp_err_t save_wifi_link_cache(const wifi_link_cache_t *link);
+
+    /**
+     * Last lamp state stored with save_lamp_state(), as returned by led_get_state().
+     * Saves reach flash once the state stayed put STORAGE_LAMP_STATE_QUIET_MILLIS, as a small log entry.
+     */
+    esp_err_t get_lamp_state(uint8_t *state);
+    esp_err_t save_lamp_state(uint8_t state);
+
+    /**
+     * Updated firmware image on trial: boots counted so far and the app partition subtype to roll back to.
+     * ESP_ERR_NOT_FOUND if the running image is confirmed. Callers needing the trial on flash follow with storage_flush().
+     */
+    esp_err_t get_ota_trial(uint8_t *boots, uint8_t *rollback_slot);
+    esp_err_t save_ota_trial(uint8_t boots, uint8_t rollback_slot);
+    esp_err_t clear_ota_trial(void);
+
+    /**
+     * Group assigned by the broker, its command key and the highest command sequence accepted under it.
+     * ESP_ERR_NOT_FOUND if no group is assigned.
+     */
+    esp_err_t get_group_config(uint32_t *group_id, uint8_t *key, uint32_t *sequence);
+
+    /**
+     * Stores a group assignment. The stored sequence restarts at 0 only if key differs from the stored one.
+     */
+    esp_err_t save_group_assignment(uint32_t group_id, const uint8_t *key);
 
-    esp_err_t save_user_ap_password(const uint8_t *ap_pwd, size_t pwd_length);
-    esp_err_t save_user_ap_ssid(const uint8_t *ap_ssid, size_t ssid_length);
-    esp_err_t save_pin_code(uint32_t pinCode);
+    /**
+     * Stores the group sequence mark reserved by group_reserve_sequence(), commands up to it are replays after a reboot.
+     * Written by storage_task without delay, see STORAGE_GROUP_SEQUENCE_WRITE_BEHIND_MILLIS.
+     */
+    esp_err_t save_group_sequence(uint32_t sequence);
 
-    void spiffs_data_reset(void);
+    /**
+     * Clears credentials, cached link and group, the lamp seed and lamp state are kept.
+     */
+    void storage_data_reset(void);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,51 @@
+#ifndef __STORAGE_BACKEND_H
+
+#include "esp_err.h"
+#include "config_record.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define STORAGE_BACKEND_CONFIG_SLOTS (0)
+#define STORAGE_BACKEND_NVS (1)
+
+// Backend holding the config record, build with -DSTORAGE_BACKEND=STORAGE_BACKEND_NVS to keep it in the nvs partition
+#ifndef STORAGE_BACKEND
+#define STORAGE_BACKEND STORAGE_BACKEND_CONFIG_SLOTS
+#endif
+
+    typedef struct storage_backend_t
+    {
+        const char *name;
+
+        /**
+         * Reads the whole config record, ESP_ERR_NOT_FOUND if nothing is stored.
+         */
+        esp_err_t (*read)(config_record_t *out);
+
+        /**
+         * Replaces the stored config record.
+         */
+        esp_err_t (*write)(const config_record_t *record);
+
+    } storage_backend_t;
+
+    // A/B slots in the raw config partition, see config_record.h
+    extern const storage_backend_t config_slot_backend;
+
+    // Typed keys in the nvs partition
+    extern const storage_backend_t nvs_storage_backend;
+
+    /**
+     * Backend selected by STORAGE_BACKEND, used by every storage.h call.
+     */
+    const storage_backend_t *storage_get_backend(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#define __STORAGE_BACKEND_H
+#endif // __STORAGE_BACKEND_H
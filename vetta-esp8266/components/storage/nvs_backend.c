@@ -0,0 +1,271 @@
+#include <string.h>
+#include "esp_err.h"
+#include "nvs.h"
+#include "storage_backend.h"
+
+#define NVS_STORAGE_NAMESPACE "vetta"
+
+static const char *seed_key = "seed";
+static const char *pin_key = "pin";
+static const char *ssid_key = "ssid";
+static const char *pwd_key = "pwd";
+static const char *link_key = "link";
+static const char *lamp_state_key = "state";
+static const char *ota_trial_key = "ota_trial";
+static const char *group_id_key = "group";
+static const char *group_key_key = "group_key";
+static const char *group_sequence_key = "group_seq";
+// Set once ssid, password and pin are all written
+static const char *credentials_key = "cred";
+
+static esp_err_t erase_key(nvs_handle handle, const char *key)
+{
+    static esp_err_t _err;
+
+    if (ESP_OK != (_err = nvs_erase_key(handle, key)) && ESP_ERR_NVS_NOT_FOUND != _err)
+    {
+        return _err;
+    }
+    return ESP_OK;
+}
+
+static esp_err_t read_nvs_string(nvs_handle handle, const char *key, uint8_t *str, size_t str_size, uint8_t *str_len)
+{
+    static esp_err_t _err;
+    size_t len = str_size;
+
+    // Stored with its NULL terminator
+    if (ESP_OK != (_err = nvs_get_str(handle, key, (char *)str, &len)))
+    {
+        return _err;
+    }
+
+    if (len < 2 || len > str_size)
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    *str_len = len - 1;
+    return ESP_OK;
+}
+
+// Stored credentials are the record's, or neither has any
+static unsigned char credentials_unchanged(nvs_handle handle, const config_record_t *record)
+{
+    static uint8_t ssid[MAX_SSID_LENGTH + 1];
+    static uint8_t pwd[MAX_PASSWORD_LENGTH + 1];
+    uint8_t ssid_len = 0;
+    uint8_t pwd_len = 0;
+    uint32_t pin_code = 0;
+    uint8_t credentials = 0;
+
+    if (ESP_OK != nvs_get_u8(handle, credentials_key, &credentials) || !credentials)
+    {
+        return (record->flags & CONFIG_RECORD_HAS_CREDENTIALS) ? 0 : 1;
+    }
+
+    return ((record->flags & CONFIG_RECORD_HAS_CREDENTIALS) &&
+            ESP_OK == read_nvs_string(handle, ssid_key, ssid, sizeof(ssid), &ssid_len) &&
+            ESP_OK == read_nvs_string(handle, pwd_key, pwd, sizeof(pwd), &pwd_len) &&
+            ESP_OK == nvs_get_u32(handle, pin_key, &pin_code) &&
+            ssid_len == record->ssid_len &&
+            pwd_len == record->pwd_len &&
+            pin_code == record->pin_code &&
+            0 == memcmp(ssid, record->ssid, ssid_len) &&
+            0 == memcmp(pwd, record->pwd, pwd_len))
+               ? 1
+               : 0;
+}
+
+static esp_err_t nvs_config_read(config_record_t *out)
+{
+    static esp_err_t _err;
+    nvs_handle handle;
+
+    if (!out)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    memset(out, 0, sizeof(config_record_t));
+
+    if (ESP_OK != (_err = nvs_open(NVS_STORAGE_NAMESPACE, NVS_READONLY, &handle)))
+    {
+        return (ESP_ERR_NVS_NOT_FOUND == _err) ? ESP_ERR_NOT_FOUND : _err;
+    }
+
+    if (ESP_OK == nvs_get_u32(handle, seed_key, &out->lamp_seed))
+    {
+        out->flags |= CONFIG_RECORD_HAS_SEED;
+    }
+
+    uint8_t credentials = 0;
+    if (ESP_OK == nvs_get_u8(handle, credentials_key, &credentials) &&
+        credentials &&
+        ESP_OK == read_nvs_string(handle, ssid_key, out->ssid, sizeof(out->ssid), &out->ssid_len) &&
+        ESP_OK == read_nvs_string(handle, pwd_key, out->pwd, sizeof(out->pwd), &out->pwd_len) &&
+        ESP_OK == nvs_get_u32(handle, pin_key, &out->pin_code))
+    {
+        out->flags |= CONFIG_RECORD_HAS_CREDENTIALS;
+    }
+    else
+    {
+        memset(out->ssid, 0, sizeof(out->ssid));
+        memset(out->pwd, 0, sizeof(out->pwd));
+        out->ssid_len = 0;
+        out->pwd_len = 0;
+        out->pin_code = 0;
+    }
+
+    size_t link_len = sizeof(out->link);
+    if (ESP_OK == nvs_get_blob(handle, link_key, &out->link, &link_len) &&
+        link_len == sizeof(out->link))
+    {
+        out->flags |= CONFIG_RECORD_HAS_LINK;
+    }
+    else
+    {
+        memset(&out->link, 0, sizeof(out->link));
+    }
+
+    if (ESP_OK == nvs_get_u8(handle, lamp_state_key, &out->lamp_state))
+    {
+        out->flags |= CONFIG_RECORD_HAS_LAMP_STATE;
+    }
+
+    // Boots in the low byte, rollback slot in the high byte
+    uint16_t ota_trial = 0;
+    if (ESP_OK == nvs_get_u16(handle, ota_trial_key, &ota_trial))
+    {
+        out->ota_trial_boots = ota_trial & 0xFF;
+        out->ota_rollback_slot = ota_trial >> 8;
+        out->flags |= CONFIG_RECORD_HAS_OTA_TRIAL;
+    }
+
+    size_t group_key_len = sizeof(out->group_key);
+    if (ESP_OK == nvs_get_u32(handle, group_id_key, &out->group_id) &&
+        ESP_OK == nvs_get_blob(handle, group_key_key, out->group_key, &group_key_len) &&
+        group_key_len == sizeof(out->group_key) &&
+        ESP_OK == nvs_get_u32(handle, group_sequence_key, &out->group_sequence))
+    {
+        out->flags |= CONFIG_RECORD_HAS_GROUP;
+    }
+    else
+    {
+        out->group_id = 0;
+        out->group_sequence = 0;
+        memset(out->group_key, 0, sizeof(out->group_key));
+    }
+
+    nvs_close(handle);
+    return out->flags ? ESP_OK : ESP_ERR_NOT_FOUND;
+}
+
+static esp_err_t nvs_config_write(const config_record_t *record)
+{
+    static esp_err_t _err;
+    static uint8_t ssid[MAX_SSID_LENGTH + 1];
+    static uint8_t pwd[MAX_PASSWORD_LENGTH + 1];
+    nvs_handle handle;
+
+    if (!record ||
+        record->ssid_len > MAX_SSID_LENGTH ||
+        record->pwd_len > MAX_PASSWORD_LENGTH)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (ESP_OK != (_err = nvs_open(NVS_STORAGE_NAMESPACE, NVS_READWRITE, &handle)))
+    {
+        return _err;
+    }
+
+    if (ESP_OK != (_err = (record->flags & CONFIG_RECORD_HAS_SEED) ? nvs_set_u32(handle, seed_key, record->lamp_seed)
+                                                                   : erase_key(handle, seed_key)))
+    {
+        nvs_close(handle);
+        return _err;
+    }
+
+    // Credentials are left alone unless they changed, so a power cut during a lamp state
+    // or group flush cannot unprovision the lamp
+    if (!credentials_unchanged(handle, record))
+    {
+        // NVS is atomic per key only, the credentials marker goes first and comes back last
+        // so a write cut short leaves no credentials rather than a mix of old and new
+        if (ESP_OK != (_err = erase_key(handle, credentials_key)))
+        {
+            nvs_close(handle);
+            return _err;
+        }
+
+        if (record->flags & CONFIG_RECORD_HAS_CREDENTIALS)
+        {
+            memset(ssid, 0, sizeof(ssid));
+            memcpy(ssid, record->ssid, record->ssid_len);
+            memset(pwd, 0, sizeof(pwd));
+            memcpy(pwd, record->pwd, record->pwd_len);
+
+            if (ESP_OK != (_err = nvs_set_str(handle, ssid_key, (const char *)ssid)) ||
+                ESP_OK != (_err = nvs_set_str(handle, pwd_key, (const char *)pwd)) ||
+                ESP_OK != (_err = nvs_set_u32(handle, pin_key, record->pin_code)) ||
+                ESP_OK != (_err = nvs_set_u8(handle, credentials_key, 1)))
+            {
+                nvs_close(handle);
+                return _err;
+            }
+        }
+        else if (ESP_OK != (_err = erase_key(handle, ssid_key)) ||
+                 ESP_OK != (_err = erase_key(handle, pwd_key)) ||
+                 ESP_OK != (_err = erase_key(handle, pin_key)))
+        {
+            nvs_close(handle);
+            return _err;
+        }
+    }
+
+    if (ESP_OK != (_err = (record->flags & CONFIG_RECORD_HAS_LINK) ? nvs_set_blob(handle, link_key, &record->link, sizeof(record->link))
+                                                                   : erase_key(handle, link_key)) ||
+        ESP_OK != (_err = (record->flags & CONFIG_RECORD_HAS_LAMP_STATE) ? nvs_set_u8(handle, lamp_state_key, record->lamp_state)
+                                                                         : erase_key(handle, lamp_state_key)) ||
+        ESP_OK != (_err = (record->flags & CONFIG_RECORD_HAS_OTA_TRIAL) ? nvs_set_u16(handle, ota_trial_key, record->ota_trial_boots | (record->ota_rollback_slot << 8))
+                                                                        : erase_key(handle, ota_trial_key)))
+    {
+        nvs_close(handle);
+        return _err;
+    }
+
+    // Key before sequence, a write cut in between leaves the new key under the old and higher sequence,
+    // which drops commands for a while rather than reopening the old key's window to replays
+    if (record->flags & CONFIG_RECORD_HAS_GROUP)
+    {
+        if (ESP_OK != (_err = nvs_set_blob(handle, group_key_key, record->group_key, sizeof(record->group_key))) ||
+            ESP_OK != (_err = nvs_set_u32(handle, group_sequence_key, record->group_sequence)) ||
+            ESP_OK != (_err = nvs_set_u32(handle, group_id_key, record->group_id)))
+        {
+            nvs_close(handle);
+            return _err;
+        }
+    }
+    else if (ESP_OK != (_err = erase_key(handle, group_id_key)) ||
+             ESP_OK != (_err = erase_key(handle, group_key_key)) ||
+             ESP_OK != (_err = erase_key(handle, group_sequence_key)))
+    {
+        nvs_close(handle);
+        return _err;
+    }
+
+    if (ESP_OK != (_err = nvs_commit(handle)))
+    {
+        nvs_close(handle);
+        return _err;
+    }
+
+    nvs_close(handle);
+    return ESP_OK;
+}
+
+const storage_backend_t nvs_storage_backend = {
+    .name = "nvs",
+    .read = &nvs_config_read,
+    .write = &nvs_config_write};
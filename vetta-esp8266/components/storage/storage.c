@@ -1,12 +1,18 @@
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
 #include <sys/unistd.h>
 #include <sys/stat.h>
 #include "errno.h"
 #include <sys/random.h>
 #include "esp_err.h"
 #include "esp_spiffs.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_timer.h"
 #include "storage.h"
+#include "config_record.h"
+#include "storage_backend.h"
 
 static esp_vfs_spiffs_conf_t conf = {
     .base_path = "/spiffs",
@@ -18,10 +24,16 @@ static esp_vfs_spiffs_conf_t conf = {
 static size_t totalSize = 0;
 static size_t usedSize = 0;
 
+// Legacy per-file config, migrated into the config record on the first boot after the upgrade
 static const char *user_ap_pwd_filename = "/spiffs/uap.txt";
 static const char *user_ap_ssid_filename = "/spiffs/ssid.txt";
 static const char *lamp_seed_filename = "/spiffs/seed.txt";
 static const char *pin_code_filename = "/spiffs/pin.txt";
+static const char *wifi_link_filename = "/spiffs/link.txt";
+
+// Open storage sessions, SPIFFS stays mounted while any is held
+static uint16_t storage_refs = 0;
+static SemaphoreHandle_t storage_lock = NULL;
 
 static esp_err_t init_spiffs(void)
 {
@@ -30,16 +42,98 @@ static esp_err_t init_spiffs(void)
     totalSize = 0;
     usedSize = 0;
 
-    if (ESP_OK != (_err = esp_vfs_spiffs_register(&conf)) ||
-        ESP_OK != (_err = esp_spiffs_info(NULL, &totalSize, &usedSize)) ||
-        !totalSize)
+    if (ESP_OK != (_err = esp_vfs_spiffs_register(&conf)))
     {
         return _err;
     }
 
+    if (ESP_OK != (_err = esp_spiffs_info(NULL, &totalSize, &usedSize)) ||
+        !totalSize)
+    {
+        esp_vfs_spiffs_unregister(NULL);
+        return (ESP_OK == _err) ? ESP_FAIL : _err;
+    }
+
     return ESP_OK;
 }
 
+esp_err_t storage_open(void)
+{
+    static esp_err_t _err;
+
+    // First open runs from app_main before any other task uses storage
+    if (storage_lock == NULL && (storage_lock = xSemaphoreCreateMutex()) == NULL)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+
+    xSemaphoreTake(storage_lock, portMAX_DELAY);
+
+    _err = ESP_OK;
+    if (storage_refs == 0)
+    {
+        // Mounting scans the whole partition, only done for the first session
+        _err = init_spiffs();
+    }
+
+    if (ESP_OK == _err)
+    {
+        storage_refs++;
+    }
+
+    xSemaphoreGive(storage_lock);
+    return _err;
+}
+
+void storage_close(void)
+{
+    if (storage_lock == NULL)
+    {
+        return;
+    }
+
+    xSemaphoreTake(storage_lock, portMAX_DELAY);
+
+    if (storage_refs > 0 && --storage_refs == 0)
+    {
+        esp_vfs_spiffs_unregister(NULL);
+    }
+
+    xSemaphoreGive(storage_lock);
+}
+
+#if STORAGE_BACKEND == STORAGE_BACKEND_NVS
+static const storage_backend_t *backend = &nvs_storage_backend;
+#else
+static const storage_backend_t *backend = &config_slot_backend;
+#endif
+
+const storage_backend_t *storage_get_backend(void)
+{
+    return backend;
+}
+
+// Authoritative copy of the config record after init_storage(), written to the backend behind the callers
+static config_record_t config_cache;
+static unsigned char config_dirty = 0;
+static SemaphoreHandle_t config_lock = NULL;
+// Serializes backend writes between the flush timer and storage_flush()
+static SemaphoreHandle_t flush_lock = NULL;
+static esp_timer_handle_t flush_timer = NULL;
+// Given by the flush timer, the flash write itself runs in storage_task
+static SemaphoreHandle_t flush_request = NULL;
+static unsigned char flush_armed = 0;
+static int64_t flush_deadline_us = 0;
+// Latest the pending updates may wait for their write, INT64_MAX while none is pending
+static int64_t flush_latest_us = INT64_MAX;
+// Lamp state left alone from then on, the flush waits for it. 0 while no lamp state change is pending
+static int64_t lamp_state_quiet_us = 0;
+// Record last read from or written to the backend, a cache changed back to it is not rewritten
+static config_record_t config_flushed;
+
+// Legacy files are only looked for once per boot
+static unsigned char legacy_checked = 0;
+
 static esp_err_t read_spiffs_string(const char *filename, spiffs_string_t *out_string)
 {
 
@@ -67,37 +161,29 @@ static esp_err_t read_spiffs_string(const char *filename, spiffs_string_t *out_s
     return ESP_OK;
 }
 
-static esp_err_t write_spiffs_string(const char *filename, const uint8_t *str, size_t str_len)
-{
-
-    if (NULL == filename ||
-        NULL == str ||
-        0 == str_len ||
-        str_len > MAX_SPIFFS_STRING_LENGTH)
-    {
-        return ESP_ERR_INVALID_ARG;
-    }
+static esp_err_t read_lamp_seed(uint32_t * out){
 
-    FILE *fp = fopen(filename, "w");
-    if (!fp)
-    {
+    FILE *fp = fopen(lamp_seed_filename, "r");
+    if (!fp){
         return ESP_FAIL;
     }
 
-    if (str_len != fwrite(str, sizeof(uint8_t), str_len, fp))
+    uint32_t tmp = 0;
+    if(1 != fread(&tmp, sizeof(uint32_t), 1, fp))
     {
         fclose(fp);
-        unlink(filename);
+        unlink(lamp_seed_filename);
         return ESP_FAIL;
     }
 
+    *out = tmp;
     fclose(fp);
     return ESP_OK;
 }
 
-static esp_err_t read_lamp_seed(uint32_t * out){
+static esp_err_t read_pin_code(uint32_t * out){
 
-    FILE *fp = fopen(lamp_seed_filename, "r");
+    FILE *fp = fopen(pin_code_filename, "r");
     if (!fp){
         return ESP_FAIL;
     }
@@ -106,7 +192,10 @@ static esp_err_t read_lamp_seed(uint32_t * out){
     if(1 != fread(&tmp, sizeof(uint32_t), 1, fp))
     {
         fclose(fp);
-        unlink(lamp_seed_filename);
+        unlink(pin_code_filename);
+
+        // Unlink cached home AP and lease
+        unlink(wifi_link_filename);
         return ESP_FAIL;
     }
 
@@ -115,18 +204,20 @@ static esp_err_t read_lamp_seed(uint32_t * out){
     return ESP_OK;
 }
 
-static esp_err_t read_pin_code(uint32_t * out){
+static esp_err_t read_wifi_link_cache(wifi_link_cache_t *out){
 
-    FILE *fp = fopen(pin_code_filename, "r");
+    FILE *fp = fopen(wifi_link_filename, "r");
     if (!fp){
         return ESP_FAIL;
     }
 
-    uint32_t tmp = 0;
-    if(1 != fread(&tmp, sizeof(uint32_t), 1, fp))
+    wifi_link_cache_t tmp;
+    if(1 != fread(&tmp, sizeof(wifi_link_cache_t), 1, fp) ||
+        tmp.channel == 0 ||
+        tmp.ip == 0)
     {
         fclose(fp);
-        unlink(pin_code_filename);
+        unlink(wifi_link_filename);
         return ESP_FAIL;
     }
 
@@ -139,177 +230,683 @@ static esp_err_t gen_lamp_seed(uint32_t * out){
 
     uint32_t tmp = 0;
     if(sizeof(uint32_t) == getrandom(&tmp, sizeof(uint32_t), 0)){
+        *out = tmp;
+        return ESP_OK;
+    }
+    return ESP_FAIL;
+}
 
-        FILE *fp = fopen(lamp_seed_filename, "w");
-        if (!fp){
-            return ESP_FAIL;
-        }
+static void unlink_legacy_files(void)
+{
+    unlink(user_ap_ssid_filename);
+    unlink(user_ap_pwd_filename);
+    unlink(lamp_seed_filename);
+    unlink(pin_code_filename);
+    unlink(wifi_link_filename);
+}
+
+// Builds a config record out of the legacy files, stored once it holds anything
+static esp_err_t migrate_legacy_files(config_record_t *cfg)
+{
+    static spiffs_string_t ssid;
+    static spiffs_string_t pwd;
 
-        if(1 != fwrite(&tmp, sizeof(uint32_t), 1, fp))
+    memset(cfg, 0, sizeof(config_record_t));
+
+    if (legacy_checked)
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+    legacy_checked = 1;
+
+    if (ESP_OK != storage_open())
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    if (ESP_OK == read_lamp_seed(&cfg->lamp_seed))
+    {
+        cfg->flags |= CONFIG_RECORD_HAS_SEED;
+    }
+
+    if (ESP_OK == read_spiffs_string(user_ap_ssid_filename, &ssid) &&
+        ESP_OK == read_spiffs_string(user_ap_pwd_filename, &pwd) &&
+        ESP_OK == read_pin_code(&cfg->pin_code) &&
+        ssid.string_len <= MAX_SSID_LENGTH &&
+        pwd.string_len <= MAX_PASSWORD_LENGTH)
+    {
+        memcpy(cfg->ssid, ssid.string_array, ssid.string_len);
+        cfg->ssid_len = ssid.string_len;
+        memcpy(cfg->pwd, pwd.string_array, pwd.string_len);
+        cfg->pwd_len = pwd.string_len;
+        cfg->flags |= CONFIG_RECORD_HAS_CREDENTIALS;
+
+        if (ESP_OK == read_wifi_link_cache(&cfg->link))
         {
-            fclose(fp);
-            unlink(lamp_seed_filename);
-            return ESP_FAIL;
+            cfg->flags |= CONFIG_RECORD_HAS_LINK;
         }
-        fclose(fp);
+    }
 
-        *out = tmp;
-        return ESP_OK;
+    // Files go once the record holding them is written
+    if (cfg->flags && ESP_OK == backend->write(cfg))
+    {
+        unlink_legacy_files();
     }
-    return ESP_FAIL;
+
+    storage_close();
+    return cfg->flags ? ESP_OK : ESP_ERR_NOT_FOUND;
 }
 
-static esp_err_t write_pin_code(uint32_t pinCode){
+// Current config record, zeroed when there is none yet
+static esp_err_t load_config(config_record_t *cfg)
+{
+    static esp_err_t _err;
 
+    if (ESP_ERR_NOT_FOUND != (_err = backend->read(cfg)))
+    {
+        return _err;
+    }
+    return migrate_legacy_files(cfg);
+}
 
-    FILE *fp = fopen(pin_code_filename, "w");
-    if (!fp){
+static esp_err_t read_config_string(const uint8_t *str, size_t str_len, spiffs_string_t *out_string)
+{
+    out_string->string_len = 0;
+    memset(out_string->string_array, 0, MAX_SPIFFS_STRING_LENGTH * sizeof(uint8_t));
+
+    if (str_len == 0 || str_len >= MAX_SPIFFS_STRING_LENGTH)
+    {
         return ESP_FAIL;
     }
 
-    uint32_t tmp = pinCode;
-    if(1 != fwrite(&tmp, sizeof(uint32_t), 1, fp))
+    // NULL terminated by the memset above
+    memcpy(out_string->string_array, str, str_len);
+    out_string->string_len = str_len;
+    return ESP_OK;
+}
+
+// Writes the cache out if it changed, the backend write runs without holding the cache
+static esp_err_t flush_config(void)
+{
+    static config_record_t snapshot;
+    static esp_err_t _err;
+
+    xSemaphoreTake(flush_lock, portMAX_DELAY);
+
+    xSemaphoreTake(config_lock, portMAX_DELAY);
+    if (!config_dirty)
     {
-        fclose(fp);
-        unlink(pin_code_filename);
-        return ESP_FAIL;
+        xSemaphoreGive(config_lock);
+        xSemaphoreGive(flush_lock);
+        return ESP_OK;
     }
-    fclose(fp);
+    snapshot = config_cache;
+    config_dirty = 0;
+    xSemaphoreGive(config_lock);
+
+    if (0 == memcmp(&snapshot, &config_flushed, sizeof(snapshot)))
+    {
+        // Spares an erase cycle, e.g. the lamp switched a few times and ended where it was
+        xSemaphoreGive(flush_lock);
+        return ESP_OK;
+    }
+
+    if (ESP_OK == (_err = backend->write(&snapshot)))
+    {
+        config_flushed = snapshot;
+    }
+    else
+    {
+        // Kept for the next flush
+        xSemaphoreTake(config_lock, portMAX_DELAY);
+        config_dirty = 1;
+        xSemaphoreGive(config_lock);
+    }
+
+    xSemaphoreGive(flush_lock);
+    return _err;
+}
+
+// Called with config_lock held. Arms the flush timer for when the first pending update is due, or for the
+// lamp state going quiet when that comes sooner.
+static void arm_flush_timer(void)
+{
+    int64_t deadline_us = flush_latest_us;
+
+    if (lamp_state_quiet_us != 0 && lamp_state_quiet_us < deadline_us)
+    {
+        deadline_us = lamp_state_quiet_us;
+    }
+
+    if (flush_armed && flush_deadline_us == deadline_us)
+    {
+        return;
+    }
+
+    int64_t delay_us = deadline_us - esp_timer_get_time();
+    esp_timer_stop(flush_timer);
+    if (delay_us <= 0)
+    {
+        // Due already, storage_task is woken without the timer
+        xSemaphoreGive(flush_request);
+        flush_armed = 1;
+        flush_deadline_us = deadline_us;
+    }
+    else if (ESP_OK == esp_timer_start_once(flush_timer, (uint64_t)delay_us))
+    {
+        flush_armed = 1;
+        flush_deadline_us = deadline_us;
+    }
+}
+
+// Called with config_lock held. The update is written delay_millis out at the latest, updates landing
+// before the flush share its write.
+static void mark_config_dirty(uint32_t delay_millis)
+{
+    int64_t deadline_us = esp_timer_get_time() + (int64_t)delay_millis * 1000LL;
+
+    config_dirty = 1;
+
+    if (deadline_us < flush_latest_us)
+    {
+        flush_latest_us = deadline_us;
+    }
+    arm_flush_timer();
+}
 
+// Called with config_lock held. Every change pushes the write out to STORAGE_LAMP_STATE_QUIET_MILLIS,
+// up to STORAGE_LAMP_STATE_MAX_DELAY_MILLIS after the first change not yet written.
+static void mark_lamp_state_dirty(void)
+{
+    lamp_state_quiet_us = esp_timer_get_time() + (int64_t)STORAGE_LAMP_STATE_QUIET_MILLIS * 1000LL;
+    mark_config_dirty(STORAGE_LAMP_STATE_MAX_DELAY_MILLIS);
+}
+
+// Called with config_lock held, the pending updates are about to be written
+static void clear_flush_deadlines(void)
+{
+    flush_armed = 0;
+    flush_latest_us = INT64_MAX;
+    lamp_state_quiet_us = 0;
+}
+
+// Runs in the esp_timer task, which must not block on flash erases or locks
+static void flush_timer_callback(void *arg)
+{
+    xSemaphoreGive(flush_request);
+}
+
+esp_err_t storage_flush_due(TickType_t ticks_to_wait)
+{
+    static esp_err_t _err;
+
+    if (config_lock == NULL || pdTRUE != xSemaphoreTake(flush_request, ticks_to_wait))
+    {
+        return ESP_ERR_TIMEOUT;
+    }
+
+    xSemaphoreTake(config_lock, portMAX_DELAY);
+    clear_flush_deadlines();
+    xSemaphoreGive(config_lock);
+
+    if (ESP_OK != (_err = flush_config()))
+    {
+        printf("\nSTORAGE FLUSH FAILED, RETRYING\n");
+        xSemaphoreTake(config_lock, portMAX_DELAY);
+        mark_config_dirty(STORAGE_WRITE_BEHIND_MILLIS);
+        xSemaphoreGive(config_lock);
+    }
+    return _err;
+}
+
+void storage_task(void *params)
+{
+    for (;;)
+    {
+        storage_flush_due(portMAX_DELAY);
+    }
+}
+
+static esp_err_t lock_config(void)
+{
+    if (config_lock == NULL)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    xSemaphoreTake(config_lock, portMAX_DELAY);
     return ESP_OK;
 }
 
+esp_err_t init_storage(void)
+{
+    static esp_err_t _err;
+
+    if (config_lock != NULL)
+    {
+        return ESP_OK;
+    }
+
+    const esp_timer_create_args_t timer_args = {
+        .callback = &flush_timer_callback,
+        .arg = NULL,
+        .name = "storage_flush"};
+
+    if (NULL == (flush_lock = xSemaphoreCreateMutex()) ||
+        NULL == (flush_request = xSemaphoreCreateBinary()) ||
+        ESP_OK != (_err = esp_timer_create(&timer_args, &flush_timer)))
+    {
+        return ESP_ERR_NO_MEM;
+    }
+
+    memset(&config_cache, 0, sizeof(config_cache));
+    if (ESP_OK != (_err = load_config(&config_cache)) && ESP_ERR_NOT_FOUND != _err)
+    {
+        memset(&config_cache, 0, sizeof(config_cache));
+        printf("\nCONFIG READ FAILED {%d}\n", _err);
+    }
+    config_flushed = config_cache;
+
+    if (NULL == (config_lock = xSemaphoreCreateMutex()))
+    {
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+esp_err_t storage_flush(void)
+{
+    static esp_err_t _err;
+
+    if (config_lock == NULL)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    esp_timer_stop(flush_timer);
+
+    xSemaphoreTake(config_lock, portMAX_DELAY);
+    clear_flush_deadlines();
+    xSemaphoreGive(config_lock);
+
+    if (ESP_OK != (_err = flush_config()))
+    {
+        // Left to the write-behind retries
+        xSemaphoreTake(config_lock, portMAX_DELAY);
+        mark_config_dirty(STORAGE_WRITE_BEHIND_MILLIS);
+        xSemaphoreGive(config_lock);
+    }
+    return _err;
+}
+
 esp_err_t get_lamp_seed(uint32_t * out){
 
-    if (ESP_OK == init_spiffs())
+    static esp_err_t _err;
+
+    if (!out)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (ESP_OK != (_err = lock_config()))
     {
-        if(ESP_OK == read_lamp_seed(out) ||
-            ESP_OK == gen_lamp_seed(out))
+        return _err;
+    }
+
+    _err = ESP_OK;
+    if (!(config_cache.flags & CONFIG_RECORD_HAS_SEED))
+    {
+        if (ESP_OK == (_err = gen_lamp_seed(&config_cache.lamp_seed)))
         {
-            esp_vfs_spiffs_unregister(NULL);
-            return ESP_OK;
+            config_cache.flags |= CONFIG_RECORD_HAS_SEED;
+            mark_config_dirty(STORAGE_WRITE_BEHIND_MILLIS);
         }
-        esp_vfs_spiffs_unregister(NULL);
     }
-    return ESP_FAIL;
+
+    *out = config_cache.lamp_seed;
+    xSemaphoreGive(config_lock);
+    return _err;
 }
 
 esp_err_t get_pin_code(uint32_t * pinCode){
-    if (ESP_OK == init_spiffs())
+
+    static esp_err_t _err;
+
+    if (!pinCode || ESP_OK != lock_config())
     {
-        uint32_t i = 0;
-        if(ESP_OK == read_pin_code(&i))
-        {
-            *pinCode = i;
-            esp_vfs_spiffs_unregister(NULL);
-            return ESP_OK;
-        }
-        esp_vfs_spiffs_unregister(NULL);
+        return ESP_FAIL;
     }
-    return ESP_FAIL;
+
+    _err = ESP_FAIL;
+    if (config_cache.flags & CONFIG_RECORD_HAS_CREDENTIALS)
+    {
+        *pinCode = config_cache.pin_code;
+        _err = ESP_OK;
+    }
+
+    xSemaphoreGive(config_lock);
+    return _err;
+}
+
+esp_err_t get_wifi_link_cache(wifi_link_cache_t *out){
+
+    static esp_err_t _err;
+
+    if (!out || ESP_OK != lock_config())
+    {
+        return ESP_FAIL;
+    }
+
+    _err = ESP_FAIL;
+    if (config_cache.flags & CONFIG_RECORD_HAS_LINK)
+    {
+        *out = config_cache.link;
+        _err = ESP_OK;
+    }
+
+    xSemaphoreGive(config_lock);
+    return _err;
 }
 
 esp_err_t get_user_ap_password_string(spiffs_string_t *out_string)
 {
-    if (!out_string)
+    static esp_err_t _err;
+
+    if (!out_string || ESP_OK != lock_config())
     {
         return ESP_FAIL;
     }
-    static esp_err_t _err;
 
-    if (ESP_OK == (_err = init_spiffs()))
+    _err = ESP_FAIL;
+    if (config_cache.flags & CONFIG_RECORD_HAS_CREDENTIALS)
     {
-        if (ESP_OK == (_err = read_spiffs_string(user_ap_pwd_filename, out_string)))
-        {
-            esp_vfs_spiffs_unregister(NULL);
-            return ESP_OK;
-        }
-        esp_vfs_spiffs_unregister(NULL);
+        _err = read_config_string(config_cache.pwd, config_cache.pwd_len, out_string);
     }
-    return ESP_FAIL;
+
+    xSemaphoreGive(config_lock);
+    return _err;
 }
 
 esp_err_t get_user_ap_ssid_string(spiffs_string_t *out_string)
 {
-    if (!out_string)
+    static esp_err_t _err;
+
+    if (!out_string || ESP_OK != lock_config())
     {
         return ESP_FAIL;
     }
 
+    _err = ESP_FAIL;
+    if (config_cache.flags & CONFIG_RECORD_HAS_CREDENTIALS)
+    {
+        _err = read_config_string(config_cache.ssid, config_cache.ssid_len, out_string);
+    }
+
+    xSemaphoreGive(config_lock);
+    return _err;
+}
+
+esp_err_t save_user_ap_credentials(const uint8_t *ap_ssid, size_t ssid_length,
+                                   const uint8_t *ap_pwd, size_t pwd_length,
+                                   uint32_t pinCode)
+{
     static esp_err_t _err;
 
-    if (ESP_OK == (_err = init_spiffs()))
+    if (NULL == ap_ssid ||
+        NULL == ap_pwd ||
+        0 == ssid_length ||
+        ssid_length > MAX_SSID_LENGTH ||
+        0 == pwd_length ||
+        pwd_length > MAX_PASSWORD_LENGTH)
     {
-        if (ESP_OK == (_err = read_spiffs_string(user_ap_ssid_filename, out_string)))
-        {
-            esp_vfs_spiffs_unregister(NULL);
-            return ESP_OK;
-        }
-        esp_vfs_spiffs_unregister(NULL);
+        return ESP_ERR_INVALID_ARG;
     }
-    return ESP_FAIL;
+
+    if (ESP_OK != (_err = lock_config()))
+    {
+        return _err;
+    }
+
+    memset(config_cache.ssid, 0, sizeof(config_cache.ssid));
+    memcpy(config_cache.ssid, ap_ssid, ssid_length);
+    config_cache.ssid_len = ssid_length;
+
+    memset(config_cache.pwd, 0, sizeof(config_cache.pwd));
+    memcpy(config_cache.pwd, ap_pwd, pwd_length);
+    config_cache.pwd_len = pwd_length;
+
+    config_cache.pin_code = pinCode;
+    config_cache.flags |= CONFIG_RECORD_HAS_CREDENTIALS;
+
+    // Cached home AP and lease belong to the previous credentials
+    memset(&config_cache.link, 0, sizeof(config_cache.link));
+    config_cache.flags &= ~CONFIG_RECORD_HAS_LINK;
+
+    mark_config_dirty(STORAGE_WRITE_BEHIND_MILLIS);
+    xSemaphoreGive(config_lock);
+    return ESP_OK;
 }
 
-esp_err_t save_user_ap_password(const uint8_t *ap_pwd, size_t pwd_length)
+esp_err_t save_wifi_link_cache(const wifi_link_cache_t *link)
 {
     static esp_err_t _err;
 
-    if (ESP_OK == (_err = init_spiffs()))
+    if (!link)
     {
-        if (ESP_OK == (_err = write_spiffs_string(user_ap_pwd_filename, ap_pwd, pwd_length)))
-        {
-            esp_vfs_spiffs_unregister(NULL);
-            return ESP_OK;
-        }
-        esp_vfs_spiffs_unregister(NULL);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (ESP_OK != (_err = lock_config()))
+    {
+        return _err;
+    }
+
+    config_cache.link = *link;
+    config_cache.flags |= CONFIG_RECORD_HAS_LINK;
+
+    mark_config_dirty(STORAGE_WRITE_BEHIND_MILLIS);
+    xSemaphoreGive(config_lock);
+    return ESP_OK;
+}
+
+void storage_data_reset(void)
+{
+    if (ESP_OK != lock_config())
+    {
+        return;
     }
+
+    // Lamp seed, lamp state and OTA trial are kept, credentials, cached link and group go
+    memset(config_cache.ssid, 0, sizeof(config_cache.ssid));
+    memset(config_cache.pwd, 0, sizeof(config_cache.pwd));
+    memset(&config_cache.link, 0, sizeof(config_cache.link));
+    config_cache.ssid_len = 0;
+    config_cache.pwd_len = 0;
+    config_cache.pin_code = 0;
+    config_cache.group_id = 0;
+    config_cache.group_sequence = 0;
+    memset(config_cache.group_key, 0, sizeof(config_cache.group_key));
+    config_cache.flags &= (CONFIG_RECORD_HAS_SEED | CONFIG_RECORD_HAS_LAMP_STATE | CONFIG_RECORD_HAS_OTA_TRIAL);
+
+    mark_config_dirty(STORAGE_WRITE_BEHIND_MILLIS);
+    xSemaphoreGive(config_lock);
+}
+
+esp_err_t get_lamp_state(uint8_t *state)
+{
+    static esp_err_t _err;
+
+    if (!state || ESP_OK != lock_config())
+    {
+        return ESP_FAIL;
+    }
+
+    _err = ESP_FAIL;
+    if (config_cache.flags & CONFIG_RECORD_HAS_LAMP_STATE)
+    {
+        *state = config_cache.lamp_state;
+        _err = ESP_OK;
+    }
+
+    xSemaphoreGive(config_lock);
     return _err;
 }
 
-esp_err_t save_user_ap_ssid(const uint8_t *ap_ssid, size_t ssid_length)
+esp_err_t save_lamp_state(uint8_t state)
 {
     static esp_err_t _err;
 
-    if (ESP_OK == (_err = init_spiffs()))
+    if (ESP_OK != (_err = lock_config()))
     {
+        return _err;
+    }
 
-        if (ESP_OK == (_err = write_spiffs_string(user_ap_ssid_filename, ap_ssid, ssid_length)))
-        {
-            esp_vfs_spiffs_unregister(NULL);
-            return ESP_OK;
-        }
-        esp_vfs_spiffs_unregister(NULL);
+    if (!(config_cache.flags & CONFIG_RECORD_HAS_LAMP_STATE) ||
+        config_cache.lamp_state != state)
+    {
+        config_cache.lamp_state = state;
+        config_cache.flags |= CONFIG_RECORD_HAS_LAMP_STATE;
+        mark_lamp_state_dirty();
+    }
+
+    xSemaphoreGive(config_lock);
+    return ESP_OK;
+}
+
+esp_err_t get_ota_trial(uint8_t *boots, uint8_t *rollback_slot)
+{
+    static esp_err_t _err;
+
+    if (!boots || !rollback_slot || ESP_OK != lock_config())
+    {
+        return ESP_FAIL;
+    }
+
+    _err = ESP_ERR_NOT_FOUND;
+    if (config_cache.flags & CONFIG_RECORD_HAS_OTA_TRIAL)
+    {
+        *boots = config_cache.ota_trial_boots;
+        *rollback_slot = config_cache.ota_rollback_slot;
+        _err = ESP_OK;
     }
+
+    xSemaphoreGive(config_lock);
     return _err;
 }
 
-esp_err_t save_pin_code(uint32_t pinCode)
+esp_err_t save_ota_trial(uint8_t boots, uint8_t rollback_slot)
 {
     static esp_err_t _err;
 
-    if (ESP_OK == (_err = init_spiffs()))
+    if (ESP_OK != (_err = lock_config()))
     {
-        if(ESP_OK == write_pin_code(pinCode)){
-            esp_vfs_spiffs_unregister(NULL);
-            return ESP_OK;
-        }
-        esp_vfs_spiffs_unregister(NULL);
+        return _err;
+    }
+
+    config_cache.ota_trial_boots = boots;
+    config_cache.ota_rollback_slot = rollback_slot;
+    config_cache.flags |= CONFIG_RECORD_HAS_OTA_TRIAL;
+    mark_config_dirty(STORAGE_WRITE_BEHIND_MILLIS);
+
+    xSemaphoreGive(config_lock);
+    return ESP_OK;
+}
+
+esp_err_t clear_ota_trial(void)
+{
+    static esp_err_t _err;
+
+    if (ESP_OK != (_err = lock_config()))
+    {
+        return _err;
     }
+
+    if (config_cache.flags & CONFIG_RECORD_HAS_OTA_TRIAL)
+    {
+        config_cache.ota_trial_boots = 0;
+        config_cache.ota_rollback_slot = 0;
+        config_cache.flags &= ~CONFIG_RECORD_HAS_OTA_TRIAL;
+        mark_config_dirty(STORAGE_WRITE_BEHIND_MILLIS);
+    }
+
+    xSemaphoreGive(config_lock);
+    return ESP_OK;
+}
+
+esp_err_t get_group_config(uint32_t *group_id, uint8_t *key, uint32_t *sequence)
+{
+    static esp_err_t _err;
+
+    if (!group_id || !key || !sequence || ESP_OK != lock_config())
+    {
+        return ESP_FAIL;
+    }
+
+    _err = ESP_ERR_NOT_FOUND;
+    if (config_cache.flags & CONFIG_RECORD_HAS_GROUP)
+    {
+        *group_id = config_cache.group_id;
+        memcpy(key, config_cache.group_key, GROUP_KEY_LENGTH);
+        *sequence = config_cache.group_sequence;
+        _err = ESP_OK;
+    }
+
+    xSemaphoreGive(config_lock);
     return _err;
 }
 
-void spiffs_data_reset(void)
+esp_err_t save_group_assignment(uint32_t group_id, const uint8_t *key)
 {
     static esp_err_t _err;
-    if (ESP_OK == (_err = init_spiffs()))
+
+    if (!key)
     {
-        // Unlink Wifi STA credentials
-        unlink(user_ap_ssid_filename);
+        return ESP_ERR_INVALID_ARG;
+    }
 
-        unlink(user_ap_pwd_filename);
+    if (ESP_OK != (_err = lock_config()))
+    {
+        return _err;
+    }
 
-        unlink(pin_code_filename);
+    if (!(config_cache.flags & CONFIG_RECORD_HAS_GROUP) ||
+        0 != memcmp(config_cache.group_key, key, GROUP_KEY_LENGTH))
+    {
+        memcpy(config_cache.group_key, key, GROUP_KEY_LENGTH);
+        config_cache.group_sequence = 0;
+        config_cache.flags |= CONFIG_RECORD_HAS_GROUP;
+        mark_config_dirty(STORAGE_WRITE_BEHIND_MILLIS);
+    }
+    if (config_cache.group_id != group_id)
+    {
+        config_cache.group_id = group_id;
+        mark_config_dirty(STORAGE_WRITE_BEHIND_MILLIS);
+    }
 
-        esp_vfs_spiffs_unregister(NULL);
+    xSemaphoreGive(config_lock);
+    return ESP_OK;
+}
+
+esp_err_t save_group_sequence(uint32_t sequence)
+{
+    static esp_err_t _err;
+
+    if (ESP_OK != (_err = lock_config()))
+    {
+        return _err;
+    }
+
+    _err = ESP_ERR_INVALID_STATE;
+    if (config_cache.flags & CONFIG_RECORD_HAS_GROUP)
+    {
+        if (config_cache.group_sequence != sequence)
+        {
+            config_cache.group_sequence = sequence;
+            mark_config_dirty(STORAGE_GROUP_SEQUENCE_WRITE_BEHIND_MILLIS);
+        }
+        _err = ESP_OK;
     }
+
+    xSemaphoreGive(config_lock);
+    return _err;
 }
@@ -3,6 +3,8 @@
 import subprocess
 import os, sys
 from multiprocessing import cpu_count
+from mkassets import ASSET_PARTITION_LABEL, partition_geometry
+from mkblobs import BLOB_PARTITION_LABEL
 
 __IDF_PATH = os.getenv("IDF_PATH")
 __ESPTOOL_PATH = os.path.join(
@@ -19,6 +21,26 @@ __PARTITION_TABLE_BIN = os.path.join(__BUILD_PATH, "partition-table.bin")
 
 __BINARY_BIN_PATH = os.path.join(__BUILD_PATH, "vetta-esp8266.bin")
 
+__ASSETS_BIN_PATH = os.path.join(__BUILD_PATH, "assets.bin")
+
+__PARTITION_CSV = os.path.join(os.path.dirname(os.path.abspath(__file__)), "partition-table.csv")
+
+__ASSETS_OFFSET, _ = partition_geometry(__PARTITION_CSV, ASSET_PARTITION_LABEL)
+
+# Device identity packed by mkblobs.py, flashed along only when it was built
+__BLOBS_BIN_PATH = os.path.join(__BUILD_PATH, "blobs.bin")
+
+__BLOBS_OFFSET, _ = partition_geometry(__PARTITION_CSV, BLOB_PARTITION_LABEL)
+
+__BLOBS_ARGS = f"{hex(__BLOBS_OFFSET)} {__BLOBS_BIN_PATH}" if os.path.exists(__BLOBS_BIN_PATH) else ""
+
+# The USB flashed firmware goes to ota_0, an erased otadata boots it whichever slot an OTA update left set
+__APP_OFFSET, _ = partition_geometry(__PARTITION_CSV, "ota_0")
+
+__OTA_DATA_BIN_PATH = os.path.join(__BUILD_PATH, "ota_data_initial.bin")
+
+__OTA_DATA_OFFSET, __OTA_DATA_SIZE = partition_geometry(__PARTITION_CSV, "otadata")
+
 __FLASH_PORT = sys.argv[1] if len(sys.argv) > 1 else "/dev/ttyUSB0"
 __BAUD_RATE = "74880"
 __FLASH_MODE = "dio"
@@ -39,11 +61,14 @@ write_flash -z \
 --flash_size {__FLASH_SIZE} \
 0x0 {__BOOTLOADER_BIN_PATH} \
 0x8000 {__PARTITION_TABLE_BIN} \
-0x10000 {__BINARY_BIN_PATH} \
+{hex(__OTA_DATA_OFFSET)} {__OTA_DATA_BIN_PATH} \
+{hex(__APP_OFFSET)} {__BINARY_BIN_PATH} \
+{hex(__ASSETS_OFFSET)} {__ASSETS_BIN_PATH} \
+{__BLOBS_ARGS} \
 \
 """
 
-__BUILD_ARGS = f"make bootloader app -j {cpu_count()}"
+__BUILD_ARGS = f"make bootloader app -j {cpu_count()} && python {os.path.join(os.path.dirname(os.path.abspath(__file__)), 'mkassets.py')} {__ASSETS_BIN_PATH}"
 
 
 def _run() -> int:
@@ -53,6 +78,9 @@ def _run() -> int:
         except KeyboardInterrupt:
             return -1
 
+    with open(__OTA_DATA_BIN_PATH, "wb") as ota_data:
+        ota_data.write(b"\xff" * __OTA_DATA_SIZE)
+
     os.environ[
         "CPPFLAGS"
     ] = "-DSPIFFS_OBJ_META_LEN=4 -DSPIFFS_ALIGNED_OBJECT_INDEX_TABLES=4"
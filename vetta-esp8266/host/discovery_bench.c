@@ -0,0 +1,532 @@
+/*
+ * Discovery flood benchmark.
+ *
+ * Runs one simulated lamp thread looping the network task's discovery_listen()/listener_listen() calls on
+ * 127.0.0.2. A flood thread sends BROKER_DISCOVERY_REQUEST datagrams with a wrong pin at a fixed rate from a
+ * few requester addresses, next to a broker requester sending the right pin at a low rate, and counts the
+ * acks coming back, which only the broker can earn. The main thread acts as the broker, drives
+ * LAMP_STATE_CHANGE commands over TLS and times each one until its state ping ack, which is the control
+ * path the flood must not starve.
+ *
+ * Usage: discovery_bench [-f requests/s[,requests/s...]] [-u requesters] [-b broker requests/s] [-r commands/s] [-d seconds]
+ * Prints one CSV row per flood rate: flood_rate,requests,broker_requests,broker_acks,commands,acked,p50_us,p99_us,p999_us
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <openssl/ssl.h>
+#include "lwip/sockets.h"
+#include "dbits.h"
+#include "packets.h"
+#include "discovery.h"
+#include "listener.h"
+
+#define BENCH_MAX_SWEEP (16)
+#define BENCH_MAX_REQUESTERS (64)
+#define BENCH_LAMP_ADDR (0x7f000002UL)      // 127.0.0.2
+#define BENCH_REQUESTER_BASE (0x7f010001UL) // 127.1.0.1 upwards
+#define BENCH_BROKER_ADDR (0x7f020001UL)    // 127.2.0.1
+#define BENCH_PIN_CODE (123456UL)
+#define BENCH_JUNK_PIN_CODE (654321UL)
+#define BENCH_LAMP_SEED (0x5eedUL)
+#define BENCH_CONNECT_RETRIES (50)
+
+static discovery_server_t discovery;
+static listener_server_t listener;
+
+// Cleared to stop the lamp and flood threads
+static atomic_int running;
+
+static atomic_size_t requests_sent;
+static atomic_size_t broker_requests_sent;
+static atomic_size_t acks_received;
+
+static double flood_rate = 0;
+static size_t requesters = 4;
+static double broker_rate = 2.0;
+static double command_rate = 20.0;
+
+// Results, stdout carries the firmware logs and goes to /dev/null
+static FILE *csv = NULL;
+
+static uint64_t *latencies = NULL;
+static size_t latency_count = 0;
+static size_t latency_capacity = 0;
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + (uint64_t)ts.tv_nsec / 1000ULL;
+}
+
+// Simulated lamp: the network task's discovery and listener calls, with the led reduced to a state byte
+static void *run_lamp(void *arg)
+{
+    uint8_t state = 0;
+    (void)arg;
+
+    while (atomic_load(&running))
+    {
+        if (ESP_FAIL == discovery_listen(&discovery, state, 1, BENCH_PIN_CODE))
+        {
+            fprintf(stderr, "lamp: discovery server failed\n");
+            return NULL;
+        }
+
+        listener_event_t event = listener_listen(&listener);
+        switch (event)
+        {
+        case RESULT_FAIL:
+            fprintf(stderr, "lamp: listener failed\n");
+            return NULL;
+        case RESULT_LED_OFF:
+        case RESULT_LED_LOW:
+        case RESULT_LED_MEDIUM:
+        case RESULT_LED_HIGH:
+            state = (uint8_t)(event - RESULT_LED_OFF);
+            send_state_ping(&listener);
+            break;
+        case RESULT_LED_NEXT:
+            state = (state + 1) % 4;
+            send_state_ping(&listener);
+            break;
+        default:
+            break;
+        }
+    }
+    return NULL;
+}
+
+static size_t encode_request(unsigned char *buffer, size_t size, uint32_t networkAddr, uint32_t pinCode)
+{
+    size_t packet_size = 0;
+
+    // Serialization ORs bits into the buffer, so it must start zeroed
+    memset(buffer, 0, size);
+
+    dpacket_struct_t dpacket;
+    if (!NewPacket(&dpacket, BROKER_DISCOVERY_REQUEST_PACKET_ID) ||
+        !AddSerializable(&dpacket, UINT32_STYPE, (data_union_t){.decimal_v.u32_v = networkAddr}) ||
+        !AddSerializable(&dpacket, UINT32_STYPE, (data_union_t){.decimal_v.u32_v = pinCode}) ||
+        !SerializePacket(buffer, size - 1, &dpacket, &packet_size))
+    {
+        packet_size = 0;
+    }
+    FreePacket(&dpacket);
+    return packet_size;
+}
+
+// Flood and broker sender, paced per millisecond, and receiver of the acks sent to every requester address
+static void *run_flood(void *arg)
+{
+    int *socks = (int *)arg;
+    unsigned char requests[BENCH_MAX_REQUESTERS][DISCOVERY_SERVER_BUFFER_SIZE];
+    size_t request_size[BENCH_MAX_REQUESTERS];
+    unsigned char broker_request[DISCOVERY_SERVER_BUFFER_SIZE];
+    unsigned char buffer[DISCOVERY_SERVER_BUFFER_SIZE];
+
+    for (size_t i = 0; i < requesters; i++)
+    {
+        request_size[i] = encode_request(requests[i], sizeof(requests[i]), htonl(BENCH_REQUESTER_BASE + i), BENCH_JUNK_PIN_CODE);
+    }
+    size_t broker_request_size = encode_request(broker_request, sizeof(broker_request), htonl(BENCH_BROKER_ADDR), BENCH_PIN_CODE);
+
+    struct sockaddr_in lamp;
+    memset(&lamp, 0, sizeof(lamp));
+    lamp.sin_family = AF_INET;
+    lamp.sin_addr.s_addr = htonl(BENCH_LAMP_ADDR);
+    lamp.sin_port = htons(DISCOVERY_SERVER_PORT);
+
+    uint64_t start = now_us();
+    size_t sent = 0, broker_sent = 0;
+    while (atomic_load(&running))
+    {
+        uint64_t elapsed = now_us() - start;
+        size_t due = (size_t)(elapsed * flood_rate / 1000000.0);
+        for (; sent < due; sent++)
+        {
+            size_t i = sent % requesters;
+            if (request_size[i] > 0)
+            {
+                sendto(socks[0], requests[i], request_size[i], MSG_DONTWAIT, (struct sockaddr *)&lamp, sizeof(lamp));
+            }
+        }
+        atomic_store(&requests_sent, sent);
+
+        // Broker requests go out the same socket, queued behind the flood like on the air
+        size_t broker_due = 1 + (size_t)(elapsed * broker_rate / 1000000.0);
+        for (; broker_sent < broker_due && broker_request_size > 0; broker_sent++)
+        {
+            sendto(socks[0], broker_request, broker_request_size, MSG_DONTWAIT, (struct sockaddr *)&lamp, sizeof(lamp));
+        }
+        atomic_store(&broker_requests_sent, broker_sent);
+
+        struct pollfd fd = {.fd = socks[1], .events = POLLIN};
+        if (poll(&fd, 1, 1) > 0)
+        {
+            while (recv(socks[1], buffer, sizeof(buffer), MSG_DONTWAIT) > 0)
+            {
+                atomic_fetch_add(&acks_received, 1);
+            }
+        }
+    }
+    return NULL;
+}
+
+static SSL *connect_lamp(SSL_CTX *ctx, int *out_sock)
+{
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(BENCH_LAMP_ADDR);
+    addr.sin_port = htons(LISTENER_SERVER_PORT);
+
+    for (int retry = 0; retry < BENCH_CONNECT_RETRIES; retry++)
+    {
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (sock < 0)
+        {
+            return NULL;
+        }
+
+        if (0 == connect(sock, (struct sockaddr *)&addr, sizeof(addr)))
+        {
+            int nodelay = 1;
+            setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+            SSL *ssl = SSL_new(ctx);
+            SSL_set_fd(ssl, sock);
+            if (1 == SSL_connect(ssl))
+            {
+                *out_sock = sock;
+                return ssl;
+            }
+            SSL_free(ssl);
+        }
+        close(sock);
+        usleep(100000);
+    }
+    return NULL;
+}
+
+static int send_state_change(SSL *ssl, uint8_t state)
+{
+    // Serialization ORs bits into the buffer, so it must start zeroed
+    unsigned char buffer[LISTENER_SERVER_BUFFER_SIZE] = {0};
+    size_t packet_size = 0;
+
+    dpacket_struct_t dpacket;
+    if (!NewPacket(&dpacket, LAMP_STATE_CHANGE_PACKET_ID) ||
+        !AddSerializable(&dpacket, UINT8_STYPE, (data_union_t){.decimal_v.u8_v = state}) ||
+        !SerializePacket(buffer, sizeof(buffer) - 1, &dpacket, &packet_size))
+    {
+        FreePacket(&dpacket);
+        return -1;
+    }
+    FreePacket(&dpacket);
+
+    return (int)packet_size == SSL_write(ssl, buffer, (int)packet_size) ? 0 : -1;
+}
+
+// Returns 1 for a state ping, 0 for keepalive pings or partial reads, -1 on errors
+static int read_ack(SSL *ssl)
+{
+    unsigned char buffer[LISTENER_SERVER_BUFFER_SIZE];
+
+    int ret = SSL_read(ssl, buffer, sizeof(buffer) - 1);
+    if (ret <= 0)
+    {
+        return SSL_get_error(ssl, ret) == SSL_ERROR_WANT_READ ? 0 : -1;
+    }
+
+    dpacket_struct_t dpacket;
+    if (!DeserializeBuffer(buffer, ret, &dpacket))
+    {
+        return 0;
+    }
+
+    int is_state_ping = dpacket.packet_id == PING_PACKET_ID &&
+                        dpacket.data_list.first_node != NULL &&
+                        dpacket.data_list.first_node->data.decimal_v.u8_v == 1;
+    FreePacket(&dpacket);
+
+    return is_state_ping ? 1 : 0;
+}
+
+static void record_latency(uint64_t us)
+{
+    if (latency_count == latency_capacity)
+    {
+        latency_capacity = latency_capacity ? latency_capacity * 2 : 4096;
+        latencies = realloc(latencies, latency_capacity * sizeof(uint64_t));
+    }
+    latencies[latency_count++] = us;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static uint64_t percentile(double p)
+{
+    if (latency_count == 0)
+    {
+        return 0;
+    }
+    size_t ix = (size_t)(p * (latency_count - 1));
+    return latencies[ix];
+}
+
+static int open_flood_sockets(int *socks)
+{
+    socks[0] = socket(AF_INET, SOCK_DGRAM, 0);
+    socks[1] = socket(AF_INET, SOCK_DGRAM, 0);
+    if (socks[0] < 0 || socks[1] < 0)
+    {
+        return -1;
+    }
+
+    // Acks go to every requester address, on the broker discovery port
+    int reuse = 1;
+    setsockopt(socks[1], SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(BROKER_DISCOVERY_SERVER_PORT);
+    return bind(socks[1], (struct sockaddr *)&addr, sizeof(addr));
+}
+
+static int run_flood_rate(SSL_CTX *ctx, double rate, double duration)
+{
+    int socks[2] = {-1, -1};
+    int sock = -1;
+    SSL *ssl = NULL;
+    pthread_t lamp_thread, flood_thread;
+    int result = -1;
+
+    latency_count = 0;
+    flood_rate = rate;
+    atomic_store(&requests_sent, 0);
+    atomic_store(&broker_requests_sent, 0);
+    atomic_store(&acks_received, 0);
+
+    // Servers are set up from this thread, the lamp thread only runs the listen loop
+    if (ESP_OK != init_discovery_server(&discovery, htonl(BENCH_LAMP_ADDR), BENCH_LAMP_SEED))
+    {
+        fprintf(stderr, "lamp: discovery init failed\n");
+        return -1;
+    }
+    if (ESP_OK != init_listener_server(&listener, htonl(BENCH_LAMP_ADDR), NULL))
+    {
+        fprintf(stderr, "lamp: listener init failed\n");
+        close_discovery_server(&discovery);
+        return -1;
+    }
+    if (0 != open_flood_sockets(socks))
+    {
+        fprintf(stderr, "flood: sockets failed\n");
+        goto close_servers;
+    }
+
+    atomic_store(&running, 1);
+    if (0 != pthread_create(&lamp_thread, NULL, run_lamp, NULL))
+    {
+        goto close_servers;
+    }
+
+    if (NULL == (ssl = connect_lamp(ctx, &sock)))
+    {
+        fprintf(stderr, "lamp: TLS connect failed\n");
+        atomic_store(&running, 0);
+        pthread_join(lamp_thread, NULL);
+        goto close_servers;
+    }
+
+    // Flood starts once the session is up, the handshake is not measured
+    if (0 != pthread_create(&flood_thread, NULL, run_flood, socks))
+    {
+        atomic_store(&running, 0);
+        goto close_session;
+    }
+
+    uint64_t interval_us = (uint64_t)(1000000.0 / command_rate);
+    uint64_t start = now_us();
+    uint64_t end = start + (uint64_t)(duration * 1000000.0);
+    uint64_t next_send = start;
+    uint64_t outstanding = 0;
+    size_t commands = 0;
+    uint8_t state = 0;
+    uint64_t now;
+
+    result = 0;
+    while (result == 0 && (now = now_us()) < end)
+    {
+        // Closed loop, one outstanding command
+        if (outstanding == 0 && now >= next_send)
+        {
+            state = (state + 1) % 4;
+            outstanding = now_us();
+            if (0 != send_state_change(ssl, state))
+            {
+                fprintf(stderr, "lamp: send failed\n");
+                result = -1;
+                break;
+            }
+            next_send += interval_us;
+            commands++;
+        }
+
+        struct pollfd fd = {.fd = sock, .events = POLLIN};
+        if (poll(&fd, 1, 1) <= 0)
+        {
+            continue;
+        }
+        do
+        {
+            int ret = read_ack(ssl);
+            if (ret < 0)
+            {
+                fprintf(stderr, "lamp: session closed\n");
+                result = -1;
+                break;
+            }
+            if (ret == 1 && outstanding != 0)
+            {
+                record_latency(now_us() - outstanding);
+                outstanding = 0;
+            }
+        } while (SSL_pending(ssl) > 0);
+    }
+
+    if (result == 0)
+    {
+        qsort(latencies, latency_count, sizeof(uint64_t), compare_u64);
+        fprintf(csv, "%.0f,%zu,%zu,%zu,%zu,%zu,%llu,%llu,%llu\n",
+                rate, atomic_load(&requests_sent), atomic_load(&broker_requests_sent), atomic_load(&acks_received),
+                commands, latency_count,
+                (unsigned long long)percentile(0.50),
+                (unsigned long long)percentile(0.99),
+                (unsigned long long)percentile(0.999));
+        fflush(csv);
+    }
+
+    atomic_store(&running, 0);
+    pthread_join(flood_thread, NULL);
+
+close_session:
+    // Broker side first, the lamp thread sees its session close
+    SSL_shutdown(ssl);
+    SSL_free(ssl);
+    close(sock);
+    pthread_join(lamp_thread, NULL);
+
+close_servers:
+    atomic_store(&running, 0);
+    close_listener_server(&listener);
+    close_discovery_server(&discovery);
+    for (int i = 0; i < 2; i++)
+    {
+        if (socks[i] >= 0)
+        {
+            close(socks[i]);
+        }
+    }
+    return result;
+}
+
+int main(int argc, char **argv)
+{
+    double sweep[BENCH_MAX_SWEEP] = {0, 1000, 10000};
+    size_t sweep_count = 3;
+    double duration = 5.0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "f:u:b:r:d:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'f':
+            sweep_count = 0;
+            for (char *tok = strtok(optarg, ","); tok != NULL && sweep_count < BENCH_MAX_SWEEP; tok = strtok(NULL, ","))
+            {
+                sweep[sweep_count++] = atof(tok);
+            }
+            break;
+        case 'u':
+            requesters = strtoul(optarg, NULL, 10);
+            break;
+        case 'b':
+            broker_rate = atof(optarg);
+            break;
+        case 'r':
+            command_rate = atof(optarg);
+            break;
+        case 'd':
+            duration = atof(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-f requests/s[,requests/s...]] [-u requesters] [-b broker requests/s] [-r commands/s] [-d seconds]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (command_rate <= 0 || broker_rate <= 0 || duration <= 0 || requesters == 0 || requesters > BENCH_MAX_REQUESTERS)
+    {
+        fprintf(stderr, "rates and duration must be positive, requesters 1 to %d\n", BENCH_MAX_REQUESTERS);
+        return 1;
+    }
+
+    if (!RegisterNetworkPackets())
+    {
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    // Keep the firmware logs out of the CSV output
+    csv = fdopen(dup(STDOUT_FILENO), "w");
+    int devnull = open("/dev/null", O_WRONLY);
+    if (!csv || devnull < 0)
+    {
+        return 1;
+    }
+    dup2(devnull, STDOUT_FILENO);
+    close(devnull);
+
+    // Starts the shimmed tick count before the lamp thread reads it
+    xTaskGetTickCount();
+
+    SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+    if (!ctx)
+    {
+        return 1;
+    }
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, NULL);
+
+    fprintf(csv, "flood_rate,requests,broker_requests,broker_acks,commands,acked,p50_us,p99_us,p999_us\n");
+    for (size_t s = 0; s < sweep_count; s++)
+    {
+        if (sweep[s] < 0 || 0 != run_flood_rate(ctx, sweep[s], duration))
+        {
+            SSL_CTX_free(ctx);
+            return 1;
+        }
+    }
+
+    SSL_CTX_free(ctx);
+    free(latencies);
+    fclose(csv);
+    return 0;
+}
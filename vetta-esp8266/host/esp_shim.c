@@ -0,0 +1,387 @@
+#include <stdlib.h>
+#include <time.h>
+#include <malloc.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/pem.h>
+#include <openssl/rand.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "esp_wifi.h"
+#include "mbedtls/md.h"
+#include "openssl/ssl.h"
+#include "lwip/sockets.h"
+#undef setsockopt
+
+// Heap budget reported to the firmware, matching the lamp's usable DRAM
+#define HOST_HEAP_SIZE (80UL * 1024UL)
+
+static uint32_t minimum_free_heap = HOST_HEAP_SIZE;
+
+struct host_queue
+{
+    UBaseType_t length;
+    UBaseType_t item_size;
+    UBaseType_t head;
+    UBaseType_t count;
+    uint8_t items[];
+};
+
+struct host_semaphore
+{
+    int taken;
+};
+
+struct esp_timer
+{
+    esp_timer_cb_t callback;
+    void *arg;
+    int64_t deadline_us; // -1 when stopped
+};
+
+static esp_timer_handle_t active_timers[8];
+static int64_t simulated_time_us = 0;
+
+static uint32_t wifi_connect_count = 0;
+
+static uint64_t monotonic_millis(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000ULL + (uint64_t)ts.tv_nsec / 1000000ULL;
+}
+
+int host_setsockopt(int fd, int level, int optname, const void *optval, socklen_t optlen)
+{
+    if (level == SOL_SOCKET && (optname == SO_RCVTIMEO || optname == SO_SNDTIMEO) &&
+        optlen == sizeof(struct timeval))
+    {
+        struct timeval tv = *(const struct timeval *)optval;
+        tv.tv_usec -= tv.tv_usec % 1000;
+        return setsockopt(fd, level, optname, &tv, optlen);
+    }
+    return setsockopt(fd, level, optname, optval, optlen);
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+    static uint64_t start = 0;
+    if (start == 0)
+    {
+        start = monotonic_millis();
+    }
+    return (TickType_t)((monotonic_millis() - start) / portTICK_PERIOD_MS);
+}
+
+void vTaskDelay(const TickType_t xTicksToDelay)
+{
+    uint64_t millis = (uint64_t)xTicksToDelay * portTICK_PERIOD_MS;
+    struct timespec ts = {
+        .tv_sec = millis / 1000ULL,
+        .tv_nsec = (millis % 1000ULL) * 1000000ULL};
+    nanosleep(&ts, NULL);
+}
+
+uint32_t esp_get_free_heap_size(void)
+{
+    struct mallinfo2 info = mallinfo2();
+    uint32_t free_heap = info.uordblks >= HOST_HEAP_SIZE ? 0 : HOST_HEAP_SIZE - (uint32_t)info.uordblks;
+    if (free_heap < minimum_free_heap)
+    {
+        minimum_free_heap = free_heap;
+    }
+    return free_heap;
+}
+
+uint32_t esp_get_minimum_free_heap_size(void)
+{
+    esp_get_free_heap_size();
+    return minimum_free_heap;
+}
+
+uint32_t esp_random(void)
+{
+    uint32_t r = 0;
+    RAND_bytes((unsigned char *)&r, sizeof(r));
+    return r;
+}
+
+const mbedtls_md_info_t *mbedtls_md_info_from_type(mbedtls_md_type_t md_type)
+{
+    if (md_type != MBEDTLS_MD_SHA256)
+    {
+        return NULL;
+    }
+    return (const mbedtls_md_info_t *)EVP_sha256();
+}
+
+int mbedtls_md_hmac(const mbedtls_md_info_t *md_info,
+                    const unsigned char *key, size_t keylen,
+                    const unsigned char *input, size_t ilen,
+                    unsigned char *output)
+{
+    if (md_info == NULL ||
+        NULL == HMAC((const EVP_MD *)md_info, key, (int)keylen, input, ilen, output, NULL))
+    {
+        return -1;
+    }
+    return 0;
+}
+
+int host_use_certificate_pem(SSL_CTX *ctx, int len, const unsigned char *d)
+{
+    BIO *bio = BIO_new_mem_buf(d, len);
+    if (!bio)
+    {
+        return 0;
+    }
+
+    X509 *cert = PEM_read_bio_X509(bio, NULL, NULL, NULL);
+    BIO_free(bio);
+    if (!cert)
+    {
+        return 0;
+    }
+
+    int ret = SSL_CTX_use_certificate(ctx, cert);
+    X509_free(cert);
+    return ret;
+}
+
+int host_use_private_key_pem(int pk, SSL_CTX *ctx, const unsigned char *d, long len)
+{
+    (void)pk;
+
+    BIO *bio = BIO_new_mem_buf(d, (int)len);
+    if (!bio)
+    {
+        return 0;
+    }
+
+    EVP_PKEY *key = PEM_read_bio_PrivateKey(bio, NULL, NULL, NULL);
+    BIO_free(bio);
+    if (!key)
+    {
+        return 0;
+    }
+
+    int ret = SSL_CTX_use_PrivateKey(ctx, key);
+    EVP_PKEY_free(key);
+    return ret;
+}
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *create_args, esp_timer_handle_t *out_handle)
+{
+    if (!create_args || !create_args->callback || !out_handle)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    esp_timer_handle_t timer = calloc(1, sizeof(struct esp_timer));
+    if (!timer)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+
+    timer->callback = create_args->callback;
+    timer->arg = create_args->arg;
+    timer->deadline_us = -1;
+
+    *out_handle = timer;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us)
+{
+    if (!timer || timer->deadline_us >= 0)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    for (size_t i = 0; i < sizeof(active_timers) / sizeof(active_timers[0]); i++)
+    {
+        if (active_timers[i] == NULL)
+        {
+            timer->deadline_us = simulated_time_us + (int64_t)timeout_us;
+            active_timers[i] = timer;
+            return ESP_OK;
+        }
+    }
+    return ESP_ERR_NO_MEM;
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer)
+{
+    if (!timer || timer->deadline_us < 0)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    for (size_t i = 0; i < sizeof(active_timers) / sizeof(active_timers[0]); i++)
+    {
+        if (active_timers[i] == timer)
+        {
+            active_timers[i] = NULL;
+        }
+    }
+    timer->deadline_us = -1;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_delete(esp_timer_handle_t timer)
+{
+    if (!timer)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (timer->deadline_us >= 0)
+    {
+        esp_timer_stop(timer);
+    }
+    free(timer);
+    return ESP_OK;
+}
+
+int64_t esp_timer_get_time(void)
+{
+    return simulated_time_us;
+}
+
+void host_esp_timer_advance(uint64_t us)
+{
+    int64_t target = simulated_time_us + (int64_t)us;
+
+    for (;;)
+    {
+        // Fire the earliest due timer, callbacks may rearm
+        esp_timer_handle_t next = NULL;
+        for (size_t i = 0; i < sizeof(active_timers) / sizeof(active_timers[0]); i++)
+        {
+            if (active_timers[i] != NULL && active_timers[i]->deadline_us <= target &&
+                (next == NULL || active_timers[i]->deadline_us < next->deadline_us))
+            {
+                next = active_timers[i];
+            }
+        }
+
+        if (next == NULL)
+        {
+            break;
+        }
+
+        simulated_time_us = next->deadline_us;
+        esp_timer_stop(next);
+        next->callback(next->arg);
+    }
+
+    simulated_time_us = target;
+}
+
+esp_err_t esp_wifi_connect(void)
+{
+    wifi_connect_count++;
+    return ESP_OK;
+}
+
+uint32_t host_wifi_connect_count(void)
+{
+    return wifi_connect_count;
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t uxQueueLength, UBaseType_t uxItemSize)
+{
+    QueueHandle_t queue = calloc(1, sizeof(struct host_queue) + uxQueueLength * uxItemSize);
+    if (queue)
+    {
+        queue->length = uxQueueLength;
+        queue->item_size = uxItemSize;
+    }
+    return queue;
+}
+
+BaseType_t xQueueSend(QueueHandle_t xQueue, const void *pvItemToQueue, TickType_t xTicksToWait)
+{
+    (void)xTicksToWait;
+
+    if (!xQueue || xQueue->count == xQueue->length)
+    {
+        return pdFALSE;
+    }
+
+    UBaseType_t tail = (xQueue->head + xQueue->count) % xQueue->length;
+    memcpy(xQueue->items + tail * xQueue->item_size, pvItemToQueue, xQueue->item_size);
+    xQueue->count++;
+    return pdTRUE;
+}
+
+BaseType_t xQueuePeek(QueueHandle_t xQueue, void *pvBuffer, TickType_t xTicksToWait)
+{
+    (void)xTicksToWait;
+
+    if (!xQueue || xQueue->count == 0)
+    {
+        return pdFALSE;
+    }
+
+    memcpy(pvBuffer, xQueue->items + xQueue->head * xQueue->item_size, xQueue->item_size);
+    return pdTRUE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t xQueue, void *pvBuffer, TickType_t xTicksToWait)
+{
+    if (pdTRUE != xQueuePeek(xQueue, pvBuffer, xTicksToWait))
+    {
+        return pdFALSE;
+    }
+
+    xQueue->head = (xQueue->head + 1) % xQueue->length;
+    xQueue->count--;
+    return pdTRUE;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t xQueue)
+{
+    return xQueue ? xQueue->count : 0;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+    return calloc(1, sizeof(struct host_semaphore));
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void)
+{
+    SemaphoreHandle_t semaphore = calloc(1, sizeof(struct host_semaphore));
+    if (semaphore)
+    {
+        semaphore->taken = 1;
+    }
+    return semaphore;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t xSemaphore, TickType_t xBlockTime)
+{
+    (void)xBlockTime;
+
+    if (!xSemaphore || xSemaphore->taken)
+    {
+        return pdFALSE;
+    }
+    xSemaphore->taken = 1;
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t xSemaphore)
+{
+    if (!xSemaphore || !xSemaphore->taken)
+    {
+        return pdFALSE;
+    }
+    xSemaphore->taken = 0;
+    return pdTRUE;
+}
@@ -0,0 +1,551 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "esp_partition.h"
+#include "esp_spiffs.h"
+#include "flash_emu.h"
+
+// Partition table sits at 0x8000, the first partition follows it
+#define FLASH_EMU_TABLE_END (0x9000UL)
+#define FLASH_EMU_APP_ALIGN (0x10000UL)
+#define FLASH_EMU_MAX_PARTITIONS (16)
+
+// Written into the lookup page of every block by the format model, SPIFFS_USE_MAGIC style
+#define FLASH_EMU_SPIFFS_MAGIC (0x53504653UL) // "SPFS"
+
+// Image file layout: the flash contents, then one erase counter per sector
+#define FLASH_EMU_IMAGE_SIZE (FLASH_EMU_SIZE + FLASH_EMU_SECTOR_COUNT * sizeof(uint32_t))
+
+static uint8_t *image = NULL;
+static uint32_t *erase_counts = NULL;
+
+static esp_partition_t partitions[FLASH_EMU_MAX_PARTITIONS];
+static size_t partition_count = 0;
+
+static flash_emu_stats_t stats;
+
+// Bytes left before the power cut, negative when none is scheduled
+static int64_t power_budget = -1;
+static int powered_off = 0;
+
+static const esp_partition_t *spiffs_mounted = NULL;
+
+static void trim(char *s)
+{
+    char *end = s + strlen(s);
+    while (end > s && isspace((unsigned char)end[-1]))
+    {
+        *--end = 0;
+    }
+
+    char *start = s;
+    while (isspace((unsigned char)*start))
+    {
+        start++;
+    }
+    memmove(s, start, strlen(start) + 1);
+}
+
+static int parse_size(const char *s, uint32_t *out)
+{
+    char *end = NULL;
+    unsigned long v = strtoul(s, &end, 0);
+    if (end == s)
+    {
+        return -1;
+    }
+
+    if (*end == 'K' || *end == 'k')
+    {
+        v *= 1024UL;
+    }
+    else if (*end == 'M' || *end == 'm')
+    {
+        v *= 1024UL * 1024UL;
+    }
+    *out = (uint32_t)v;
+    return 0;
+}
+
+static int parse_type(const char *s, esp_partition_type_t *out)
+{
+    uint32_t v = 0;
+    if (0 == strcmp(s, "app"))
+    {
+        *out = ESP_PARTITION_TYPE_APP;
+    }
+    else if (0 == strcmp(s, "data"))
+    {
+        *out = ESP_PARTITION_TYPE_DATA;
+    }
+    else if (0 == parse_size(s, &v))
+    {
+        *out = (esp_partition_type_t)v;
+    }
+    else
+    {
+        return -1;
+    }
+    return 0;
+}
+
+static int parse_subtype(const char *s, esp_partition_subtype_t *out)
+{
+    static const struct
+    {
+        const char *name;
+        uint32_t subtype;
+    } names[] = {
+        {"factory", 0x00},
+        {"test", 0x20},
+        {"ota", 0x00},
+        {"phy", 0x01},
+        {"nvs", 0x02},
+        {"coredump", 0x03},
+        {"nvs_keys", 0x04},
+        {"fat", 0x81},
+        {"spiffs", 0x82},
+    };
+
+    uint32_t v = 0;
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+    {
+        if (0 == strcmp(s, names[i].name))
+        {
+            *out = (esp_partition_subtype_t)names[i].subtype;
+            return 0;
+        }
+    }
+
+    if (0 == strncmp(s, "ota_", 4))
+    {
+        *out = (esp_partition_subtype_t)(0x10 + strtoul(s + 4, NULL, 10));
+        return 0;
+    }
+
+    if (0 == parse_size(s, &v))
+    {
+        *out = (esp_partition_subtype_t)v;
+        return 0;
+    }
+    return -1;
+}
+
+// Name, Type, SubType, Offset, Size, Flags. Blank offsets follow the previous partition, apps 64K aligned
+static esp_err_t load_partition_table(const char *path)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    char line[256];
+    uint32_t next_offset = FLASH_EMU_TABLE_END;
+    partition_count = 0;
+
+    while (fgets(line, sizeof(line), fp))
+    {
+        char *fields[6] = {0};
+        size_t n = 0;
+
+        trim(line);
+        if (line[0] == 0 || line[0] == '#')
+        {
+            continue;
+        }
+
+        for (char *tok = line; tok != NULL && n < 6; n++)
+        {
+            fields[n] = tok;
+            if (NULL != (tok = strchr(tok, ',')))
+            {
+                *tok++ = 0;
+            }
+        }
+
+        if (n < 5 || partition_count == FLASH_EMU_MAX_PARTITIONS)
+        {
+            fclose(fp);
+            return ESP_ERR_INVALID_ARG;
+        }
+
+        for (size_t i = 0; i < n; i++)
+        {
+            trim(fields[i]);
+        }
+
+        esp_partition_t *p = &partitions[partition_count];
+        memset(p, 0, sizeof(*p));
+        strncpy(p->label, fields[0], sizeof(p->label) - 1);
+
+        if (0 != parse_type(fields[1], &p->type) ||
+            0 != parse_subtype(fields[2], &p->subtype) ||
+            0 != parse_size(fields[4], &p->size))
+        {
+            fclose(fp);
+            return ESP_ERR_INVALID_ARG;
+        }
+
+        if (fields[3][0] != 0)
+        {
+            if (0 != parse_size(fields[3], &p->address))
+            {
+                fclose(fp);
+                return ESP_ERR_INVALID_ARG;
+            }
+        }
+        else
+        {
+            uint32_t align = (p->type == ESP_PARTITION_TYPE_APP) ? FLASH_EMU_APP_ALIGN : FLASH_EMU_SECTOR_SIZE;
+            p->address = (next_offset + align - 1) & ~(align - 1);
+        }
+
+        if (p->address % FLASH_EMU_SECTOR_SIZE || p->size % FLASH_EMU_SECTOR_SIZE ||
+            (uint64_t)p->address + p->size > FLASH_EMU_SIZE)
+        {
+            fclose(fp);
+            return ESP_ERR_INVALID_SIZE;
+        }
+
+        next_offset = p->address + p->size;
+        partition_count++;
+    }
+
+    fclose(fp);
+    return ESP_OK;
+}
+
+esp_err_t flash_emu_open(const char *image_path, const char *partition_csv)
+{
+    esp_err_t err;
+
+    flash_emu_close();
+
+    if (ESP_OK != (err = load_partition_table(partition_csv)))
+    {
+        return err;
+    }
+
+    int fd = open(image_path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+    {
+        return ESP_FAIL;
+    }
+
+    struct stat st;
+    int blank = (0 == fstat(fd, &st) && st.st_size == 0);
+    if ((blank && 0 != ftruncate(fd, FLASH_EMU_IMAGE_SIZE)) ||
+        (!blank && st.st_size != (off_t)FLASH_EMU_IMAGE_SIZE))
+    {
+        close(fd);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    // Shared so the image outlives the simulated lamp process
+    void *map = mmap(NULL, FLASH_EMU_IMAGE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        return ESP_FAIL;
+    }
+
+    image = map;
+    erase_counts = (uint32_t *)(image + FLASH_EMU_SIZE);
+    if (blank)
+    {
+        // Factory fresh flash reads erased, counters start at zero
+        memset(image, 0xFF, FLASH_EMU_SIZE);
+    }
+
+    flash_emu_reset_stats();
+    power_budget = -1;
+    powered_off = 0;
+    spiffs_mounted = NULL;
+    return ESP_OK;
+}
+
+void flash_emu_close(void)
+{
+    if (image != NULL)
+    {
+        munmap(image, FLASH_EMU_IMAGE_SIZE);
+    }
+    image = NULL;
+    erase_counts = NULL;
+    partition_count = 0;
+    spiffs_mounted = NULL;
+}
+
+void flash_emu_power_cut_after(int64_t bytes)
+{
+    power_budget = bytes;
+}
+
+void flash_emu_get_stats(flash_emu_stats_t *out)
+{
+    *out = stats;
+}
+
+void flash_emu_reset_stats(void)
+{
+    memset(&stats, 0, sizeof(stats));
+}
+
+esp_err_t flash_emu_partition_wear(const char *label, uint32_t *min_erases, uint32_t *max_erases)
+{
+    const esp_partition_t *p = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, label);
+    if (p == NULL)
+    {
+        p = esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_ANY, label);
+    }
+    if (p == NULL)
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    *min_erases = UINT32_MAX;
+    *max_erases = 0;
+    for (uint32_t s = p->address / FLASH_EMU_SECTOR_SIZE; s < (p->address + p->size) / FLASH_EMU_SECTOR_SIZE; s++)
+    {
+        if (erase_counts[s] < *min_erases)
+        {
+            *min_erases = erase_counts[s];
+        }
+        if (erase_counts[s] > *max_erases)
+        {
+            *max_erases = erase_counts[s];
+        }
+    }
+    return ESP_OK;
+}
+
+// Bytes of a size byte operation that complete before the power cut
+static size_t powered_bytes(size_t size)
+{
+    if (power_budget < 0)
+    {
+        return size;
+    }
+
+    if ((int64_t)size >= power_budget)
+    {
+        size = (size_t)power_budget;
+        powered_off = 1;
+    }
+    power_budget -= (int64_t)size;
+    return size;
+}
+
+static esp_err_t check_access(const esp_partition_t *partition, size_t offset, size_t size)
+{
+    if (image == NULL || partition == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (powered_off)
+    {
+        return ESP_FAIL;
+    }
+    if (offset > partition->size || size > partition->size - offset)
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    return ESP_OK;
+}
+
+const esp_partition_t *esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype, const char *label)
+{
+    for (size_t i = 0; i < partition_count; i++)
+    {
+        if (partitions[i].type == type &&
+            (subtype == ESP_PARTITION_SUBTYPE_ANY || partitions[i].subtype == subtype) &&
+            (label == NULL || 0 == strcmp(label, partitions[i].label)))
+        {
+            return &partitions[i];
+        }
+    }
+    return NULL;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t *partition, size_t src_offset, void *dst, size_t size)
+{
+    esp_err_t err;
+    if (ESP_OK != (err = check_access(partition, src_offset, size)))
+    {
+        return err;
+    }
+
+    memcpy(dst, image + partition->address + src_offset, size);
+
+    stats.reads++;
+    stats.read_bytes += size;
+    stats.busy_ns += FLASH_EMU_READ_SETUP_NS + FLASH_EMU_READ_NS_PER_BYTE * size;
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_write(const esp_partition_t *partition, size_t dst_offset, const void *src, size_t size)
+{
+    esp_err_t err;
+    if (ESP_OK != (err = check_access(partition, dst_offset, size)))
+    {
+        return err;
+    }
+
+    if (size == 0)
+    {
+        return ESP_OK;
+    }
+
+    // Programming only clears bits, set bits need an erase first
+    uint8_t *dst = image + partition->address + dst_offset;
+    const uint8_t *bytes = src;
+    size_t done = powered_bytes(size);
+    for (size_t i = 0; i < done; i++)
+    {
+        dst[i] &= bytes[i];
+    }
+
+    uint32_t address = partition->address + dst_offset;
+    uint32_t pages = (address + size - 1) / FLASH_EMU_PAGE_SIZE - address / FLASH_EMU_PAGE_SIZE + 1;
+    stats.page_programs += pages;
+    stats.program_bytes += done;
+    stats.busy_ns += FLASH_EMU_PAGE_PROGRAM_NS * pages;
+
+    return (done == size) ? ESP_OK : ESP_FAIL;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t *partition, size_t start_addr, size_t size)
+{
+    esp_err_t err;
+    if (ESP_OK != (err = check_access(partition, start_addr, size)))
+    {
+        return err;
+    }
+
+    if (start_addr % FLASH_EMU_SECTOR_SIZE || size % FLASH_EMU_SECTOR_SIZE)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    for (size_t offset = start_addr; offset < start_addr + size; offset += FLASH_EMU_SECTOR_SIZE)
+    {
+        uint32_t address = partition->address + offset;
+        size_t done = powered_bytes(FLASH_EMU_SECTOR_SIZE);
+
+        // A cut erase leaves the sector part erased, part old data
+        memset(image + address, 0xFF, done);
+        erase_counts[address / FLASH_EMU_SECTOR_SIZE]++;
+        stats.sector_erases++;
+        stats.busy_ns += FLASH_EMU_SECTOR_ERASE_NS;
+
+        if (done != FLASH_EMU_SECTOR_SIZE)
+        {
+            return ESP_FAIL;
+        }
+    }
+    return ESP_OK;
+}
+
+static const esp_partition_t *find_spiffs(const char *partition_label)
+{
+    return esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_SPIFFS, partition_label);
+}
+
+// Formats by erasing every block and tagging its lookup page
+static esp_err_t format_spiffs(const esp_partition_t *p)
+{
+    esp_err_t err;
+    uint32_t magic = FLASH_EMU_SPIFFS_MAGIC;
+
+    stats.spiffs_formats++;
+    for (size_t block = 0; block < p->size; block += FLASH_EMU_SECTOR_SIZE)
+    {
+        if (ESP_OK != (err = esp_partition_erase_range(p, block, FLASH_EMU_SECTOR_SIZE)) ||
+            ESP_OK != (err = esp_partition_write(p, block + FLASH_EMU_PAGE_SIZE - sizeof(magic), &magic, sizeof(magic))))
+        {
+            return err;
+        }
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_vfs_spiffs_register(const esp_vfs_spiffs_conf_t *conf)
+{
+    esp_err_t err;
+    uint8_t lookup[FLASH_EMU_PAGE_SIZE];
+
+    if (conf == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    const esp_partition_t *p = find_spiffs(conf->partition_label);
+    if (p == NULL)
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+    if (spiffs_mounted != NULL)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    // Mounting scans the object lookup page of every block
+    int formatted = 1;
+    for (size_t block = 0; block < p->size; block += FLASH_EMU_SECTOR_SIZE)
+    {
+        uint32_t magic;
+        if (ESP_OK != (err = esp_partition_read(p, block, lookup, sizeof(lookup))))
+        {
+            return err;
+        }
+        memcpy(&magic, lookup + sizeof(lookup) - sizeof(magic), sizeof(magic));
+        formatted = formatted && (magic == FLASH_EMU_SPIFFS_MAGIC);
+    }
+
+    if (!formatted)
+    {
+        if (!conf->format_if_mount_failed)
+        {
+            return ESP_FAIL;
+        }
+        if (ESP_OK != (err = format_spiffs(p)))
+        {
+            return err;
+        }
+    }
+
+    stats.spiffs_mounts++;
+    spiffs_mounted = p;
+    return ESP_OK;
+}
+
+esp_err_t esp_vfs_spiffs_unregister(const char *partition_label)
+{
+    if (spiffs_mounted == NULL ||
+        (partition_label != NULL && 0 != strcmp(partition_label, spiffs_mounted->label)))
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    spiffs_mounted = NULL;
+    return ESP_OK;
+}
+
+esp_err_t esp_spiffs_info(const char *partition_label, size_t *total_bytes, size_t *used_bytes)
+{
+    if (spiffs_mounted == NULL ||
+        (partition_label != NULL && 0 != strcmp(partition_label, spiffs_mounted->label)))
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    // Lookup pages and the spare blocks SPIFFS keeps for garbage collection are not usable
+    *total_bytes = spiffs_mounted->size - 2 * FLASH_EMU_SECTOR_SIZE;
+    *used_bytes = 0;
+    return ESP_OK;
+}
@@ -0,0 +1,431 @@
+/*
+ * Fleet load generator for broker -> lamp commands.
+ *
+ * Runs every simulated lamp in this process, one thread per lamp, each looping the firmware
+ * listener_listen()/send_state_ping() over its own listener_server_t on its own loopback address.
+ * The main thread acts as the broker: opens a TLS session to every lamp, drives LAMP_STATE_CHANGE
+ * commands at a fixed rate and times each command until its state ping ack.
+ *
+ * Usage: fleet_bench [-n lamps[,lamps...]] [-r commands/s per lamp] [-d seconds]
+ * Prints one CSV row per fleet size: lamps,sent,acked,throughput,p50_us,p99_us,p999_us
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <openssl/ssl.h>
+#include "lwip/sockets.h"
+#include "dbits.h"
+#include "packets.h"
+#include "listener.h"
+
+#define BENCH_MAX_LAMPS (250)
+#define BENCH_MAX_SWEEP (16)
+#define BENCH_LAMP_BASE_ADDR (0x7f000002UL) // 127.0.0.2
+#define BENCH_CONNECT_RETRIES (50)
+
+typedef struct bench_lamp_t
+{
+    listener_server_t server;
+    pthread_t thread;
+    int running;
+    int sock;
+    SSL *ssl;
+    uint64_t next_send_us;
+    uint64_t outstanding_us;
+    uint8_t state;
+} bench_lamp_t;
+
+static bench_lamp_t lamps[BENCH_MAX_LAMPS];
+
+// Cleared to stop the lamp threads
+static atomic_int lamps_running;
+
+// Results, stdout carries the firmware logs of every lamp and goes to /dev/null
+static FILE *csv = NULL;
+
+static uint64_t *latencies = NULL;
+static size_t latency_count = 0;
+static size_t latency_capacity = 0;
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + (uint64_t)ts.tv_nsec / 1000ULL;
+}
+
+static in_addr_t lamp_address(size_t i)
+{
+    return htonl(BENCH_LAMP_BASE_ADDR + i);
+}
+
+// Simulated lamp: the network task's listener loop, with the led reduced to a state byte
+static void *run_lamp(void *arg)
+{
+    bench_lamp_t *lamp = (bench_lamp_t *)arg;
+    uint8_t state = 0;
+
+    while (atomic_load(&lamps_running))
+    {
+        listener_event_t event = listener_listen(&lamp->server);
+        switch (event)
+        {
+        case RESULT_FAIL:
+            fprintf(stderr, "lamp %zu: listener failed\n", (size_t)(lamp - lamps));
+            return NULL;
+        case RESULT_LED_OFF:
+        case RESULT_LED_LOW:
+        case RESULT_LED_MEDIUM:
+        case RESULT_LED_HIGH:
+            state = (uint8_t)(event - RESULT_LED_OFF);
+            send_state_ping(&lamp->server);
+            break;
+        case RESULT_LED_NEXT:
+            state = (state + 1) % 4;
+            send_state_ping(&lamp->server);
+            break;
+        default:
+            break;
+        }
+    }
+    (void)state;
+    return NULL;
+}
+
+static int connect_lamp(SSL_CTX *ctx, size_t i)
+{
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = lamp_address(i);
+    addr.sin_port = htons(LISTENER_SERVER_PORT);
+
+    for (int retry = 0; retry < BENCH_CONNECT_RETRIES; retry++)
+    {
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (sock < 0)
+        {
+            return -1;
+        }
+
+        if (0 == connect(sock, (struct sockaddr *)&addr, sizeof(addr)))
+        {
+            int nodelay = 1;
+            setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+            SSL *ssl = SSL_new(ctx);
+            SSL_set_fd(ssl, sock);
+            if (1 == SSL_connect(ssl))
+            {
+                lamps[i].sock = sock;
+                lamps[i].ssl = ssl;
+                return 0;
+            }
+            SSL_free(ssl);
+        }
+        close(sock);
+        usleep(100000);
+    }
+    return -1;
+}
+
+static int send_state_change(size_t i, uint8_t state)
+{
+    // Serialization ORs bits into the buffer, so it must start zeroed
+    unsigned char buffer[LISTENER_SERVER_BUFFER_SIZE] = {0};
+    size_t packet_size = 0;
+
+    dpacket_struct_t dpacket;
+    if (!NewPacket(&dpacket, LAMP_STATE_CHANGE_PACKET_ID) ||
+        !AddSerializable(&dpacket, UINT8_STYPE, (data_union_t){.decimal_v.u8_v = state}) ||
+        !SerializePacket(buffer, sizeof(buffer) - 1, &dpacket, &packet_size))
+    {
+        FreePacket(&dpacket);
+        return -1;
+    }
+    FreePacket(&dpacket);
+
+    return (int)packet_size == SSL_write(lamps[i].ssl, buffer, (int)packet_size) ? 0 : -1;
+}
+
+// Returns 1 for a state ping, 0 for keepalive pings or partial reads, -1 on errors
+static int read_ack(size_t i)
+{
+    unsigned char buffer[LISTENER_SERVER_BUFFER_SIZE];
+
+    int ret = SSL_read(lamps[i].ssl, buffer, sizeof(buffer) - 1);
+    if (ret <= 0)
+    {
+        return SSL_get_error(lamps[i].ssl, ret) == SSL_ERROR_WANT_READ ? 0 : -1;
+    }
+
+    dpacket_struct_t dpacket;
+    if (!DeserializeBuffer(buffer, ret, &dpacket))
+    {
+        return 0;
+    }
+
+    int is_state_ping = dpacket.packet_id == PING_PACKET_ID &&
+                        dpacket.data_list.first_node != NULL &&
+                        dpacket.data_list.first_node->data.decimal_v.u8_v == 1;
+    FreePacket(&dpacket);
+
+    return is_state_ping ? 1 : 0;
+}
+
+static void record_latency(uint64_t us)
+{
+    if (latency_count == latency_capacity)
+    {
+        latency_capacity = latency_capacity ? latency_capacity * 2 : 4096;
+        latencies = realloc(latencies, latency_capacity * sizeof(uint64_t));
+    }
+    latencies[latency_count++] = us;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static uint64_t percentile(double p)
+{
+    if (latency_count == 0)
+    {
+        return 0;
+    }
+    size_t ix = (size_t)(p * (latency_count - 1));
+    return latencies[ix];
+}
+
+static void stop_lamps(size_t count)
+{
+    // Broker side first, the lamp threads see their sessions close
+    for (size_t i = 0; i < count; i++)
+    {
+        if (lamps[i].ssl)
+        {
+            SSL_shutdown(lamps[i].ssl);
+            SSL_free(lamps[i].ssl);
+            lamps[i].ssl = NULL;
+        }
+        if (lamps[i].sock >= 0)
+        {
+            close(lamps[i].sock);
+            lamps[i].sock = -1;
+        }
+    }
+
+    atomic_store(&lamps_running, 0);
+    for (size_t i = 0; i < count; i++)
+    {
+        if (lamps[i].running)
+        {
+            pthread_join(lamps[i].thread, NULL);
+            close_listener_server(&lamps[i].server);
+            lamps[i].running = 0;
+        }
+    }
+}
+
+static int run_fleet(SSL_CTX *ctx, size_t count, double rate, double duration)
+{
+    memset(lamps, 0, sizeof(lamps));
+    latency_count = 0;
+
+    // Servers are set up from this thread, the lamp threads only run the listen loop
+    atomic_store(&lamps_running, 1);
+    for (size_t i = 0; i < count; i++)
+    {
+        lamps[i].sock = -1;
+        if (ESP_OK != init_listener_server(&lamps[i].server, lamp_address(i), NULL))
+        {
+            fprintf(stderr, "lamp %zu: init failed\n", i);
+            stop_lamps(i);
+            return -1;
+        }
+        if (0 != pthread_create(&lamps[i].thread, NULL, run_lamp, &lamps[i]))
+        {
+            close_listener_server(&lamps[i].server);
+            stop_lamps(i);
+            return -1;
+        }
+        lamps[i].running = 1;
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        if (0 != connect_lamp(ctx, i))
+        {
+            fprintf(stderr, "lamp %zu: TLS connect failed\n", i);
+            stop_lamps(count);
+            return -1;
+        }
+    }
+
+    uint64_t interval_us = (uint64_t)(1000000.0 / rate);
+    uint64_t start = now_us();
+    uint64_t end = start + (uint64_t)(duration * 1000000.0);
+    size_t sent = 0;
+
+    // Spread the first commands over one interval
+    for (size_t i = 0; i < count; i++)
+    {
+        lamps[i].next_send_us = start + interval_us * i / count;
+    }
+
+    struct pollfd fds[BENCH_MAX_LAMPS];
+    uint64_t now;
+    while ((now = now_us()) < end)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            // Closed loop, one outstanding command per lamp
+            if (lamps[i].outstanding_us == 0 && now >= lamps[i].next_send_us)
+            {
+                lamps[i].state = (lamps[i].state + 1) % 4;
+                lamps[i].outstanding_us = now_us();
+                if (0 != send_state_change(i, lamps[i].state))
+                {
+                    fprintf(stderr, "lamp %zu: send failed\n", i);
+                    stop_lamps(count);
+                    return -1;
+                }
+                lamps[i].next_send_us += interval_us;
+                sent++;
+            }
+            fds[i].fd = lamps[i].sock;
+            fds[i].events = POLLIN;
+            fds[i].revents = 0;
+        }
+
+        if (poll(fds, count, 1) <= 0)
+        {
+            continue;
+        }
+
+        for (size_t i = 0; i < count; i++)
+        {
+            if (!(fds[i].revents & POLLIN))
+            {
+                continue;
+            }
+            do
+            {
+                int ret = read_ack(i);
+                if (ret < 0)
+                {
+                    fprintf(stderr, "lamp %zu: session closed\n", i);
+                    stop_lamps(count);
+                    return -1;
+                }
+                if (ret == 1 && lamps[i].outstanding_us != 0)
+                {
+                    record_latency(now_us() - lamps[i].outstanding_us);
+                    lamps[i].outstanding_us = 0;
+                }
+            } while (SSL_pending(lamps[i].ssl) > 0);
+        }
+    }
+
+    double elapsed = (now_us() - start) / 1000000.0;
+    qsort(latencies, latency_count, sizeof(uint64_t), compare_u64);
+    fprintf(csv, "%zu,%zu,%zu,%.1f,%llu,%llu,%llu\n",
+           count, sent, latency_count, latency_count / elapsed,
+           (unsigned long long)percentile(0.50),
+           (unsigned long long)percentile(0.99),
+           (unsigned long long)percentile(0.999));
+    fflush(csv);
+
+    stop_lamps(count);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    size_t sweep[BENCH_MAX_SWEEP] = {1};
+    size_t sweep_count = 1;
+    double rate = 10.0;
+    double duration = 5.0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:r:d:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            sweep_count = 0;
+            for (char *tok = strtok(optarg, ","); tok != NULL && sweep_count < BENCH_MAX_SWEEP; tok = strtok(NULL, ","))
+            {
+                sweep[sweep_count++] = strtoul(tok, NULL, 10);
+            }
+            break;
+        case 'r':
+            rate = atof(optarg);
+            break;
+        case 'd':
+            duration = atof(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n lamps[,lamps...]] [-r commands/s per lamp] [-d seconds]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (rate <= 0 || duration <= 0)
+    {
+        fprintf(stderr, "rate and duration must be positive\n");
+        return 1;
+    }
+
+    if (!RegisterNetworkPackets())
+    {
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    // Keep the firmware logs out of the CSV output
+    csv = fdopen(dup(STDOUT_FILENO), "w");
+    int devnull = open("/dev/null", O_WRONLY);
+    if (!csv || devnull < 0)
+    {
+        return 1;
+    }
+    dup2(devnull, STDOUT_FILENO);
+    close(devnull);
+
+    // Starts the shimmed tick count before the lamp threads read it
+    xTaskGetTickCount();
+
+    SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+    if (!ctx)
+    {
+        return 1;
+    }
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, NULL);
+
+    fprintf(csv, "lamps,sent,acked,throughput,p50_us,p99_us,p999_us\n");
+    for (size_t s = 0; s < sweep_count; s++)
+    {
+        if (sweep[s] == 0 || sweep[s] > BENCH_MAX_LAMPS ||
+            0 != run_fleet(ctx, sweep[s], rate, duration))
+        {
+            SSL_CTX_free(ctx);
+            return 1;
+        }
+    }
+
+    SSL_CTX_free(ctx);
+    free(latencies);
+    fclose(csv);
+    return 0;
+}
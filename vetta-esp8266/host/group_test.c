@@ -0,0 +1,746 @@
+/*
+ * Group command test over a simulated fleet.
+ *
+ * Runs every simulated lamp in this process, one thread per lamp, each looping the firmware
+ * listener_listen()/group_listen() over its own listener_server_t and group_server_t on its own
+ * loopback address. The main thread acts as the broker: it assigns group IDs and keys over the
+ * TLS sessions, even lamps to group 1, odd lamps to group 2, then multicasts GROUP_STATE_CHANGE
+ * frames and checks which lamps applied them: group addressing, replays, forged MACs, reboots,
+ * reassignments and key changes.
+ * Stored sequence marks are kept per lamp the way the network task reserves them. The storage round trip
+ * of group ID, key and sequence is checked separately, one simulated boot per process over the
+ * flash emulator.
+ *
+ * Usage: group_test [-n lamps]
+ * Prints one line per check and the spread of the apply times over each group, exits non zero on failures.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/wait.h>
+#include <openssl/ssl.h>
+#include <openssl/hmac.h>
+#include <openssl/evp.h>
+#include "lwip/sockets.h"
+#include "dbits.h"
+#include "packets.h"
+#include "listener.h"
+#include "group.h"
+#include "storage.h"
+#include "flash_emu.h"
+
+#define TEST_MAX_LAMPS (250)
+#define TEST_DEFAULT_LAMPS (24)
+#define TEST_LAMP_BASE_ADDR (0x7f000002UL) // 127.0.0.2
+#define TEST_CONNECT_RETRIES (50)
+#define TEST_APPLY_TIMEOUT_MILLIS (2000)
+// Time given to lamps to show they ignored a frame
+#define TEST_IGNORE_MILLIS (200)
+#define TEST_STATE_UNSET (0xff)
+#define TEST_PIN_CODE (1234)
+
+typedef struct test_lamp_t
+{
+    listener_server_t server;
+    group_server_t group;
+    pthread_t thread;
+    int running;
+    int sock;
+    SSL *ssl;
+
+    // Written by the lamp thread
+    atomic_int state;
+    atomic_int applied;
+    atomic_int assigned;
+    atomic_uint_fast64_t applied_us;
+    // Sequence mark the network task would have stored after applying the command
+    atomic_uint stored_sequence;
+
+    // Set by the broker, the lamp thread loses its RAM group state and restores the stored one
+    atomic_int reboot;
+
+} test_lamp_t;
+
+static test_lamp_t lamps[TEST_MAX_LAMPS];
+static size_t lamp_count = TEST_DEFAULT_LAMPS;
+
+// Cleared to stop the lamp threads
+static atomic_int lamps_running;
+
+// Results, stdout carries the firmware logs of every lamp and goes to /dev/null
+static FILE *out = NULL;
+static int failures = 0;
+
+static int multicast_socket = -1;
+
+static const uint8_t key_a[GROUP_KEY_SIZE] = "group one key, 32 random bytes.";
+static const uint8_t key_b[GROUP_KEY_SIZE] = "group two key, 32 random bytes.";
+static const uint8_t key_c[GROUP_KEY_SIZE] = "group one key after a rotation.";
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + (uint64_t)ts.tv_nsec / 1000ULL;
+}
+
+static in_addr_t lamp_address(size_t i)
+{
+    return htonl(TEST_LAMP_BASE_ADDR + i);
+}
+
+static uint32_t lamp_group(size_t i)
+{
+    return (i % 2) ? 2 : 1;
+}
+
+static void check(int ok, const char *name)
+{
+    fprintf(out, "%s %s\n", ok ? "ok  " : "FAIL", name);
+    fflush(out);
+    if (!ok)
+    {
+        failures++;
+    }
+}
+
+// Simulated lamp: the network task's group and listener calls, with the led reduced to a state byte
+static void *run_lamp(void *arg)
+{
+    test_lamp_t *lamp = (test_lamp_t *)arg;
+
+    while (atomic_load(&lamps_running))
+    {
+        if (atomic_exchange(&lamp->reboot, 0))
+        {
+            // RAM is lost, the group comes back from storage as at boot
+            close_group_server(&lamp->group);
+            uint32_t group_id = lamp->group.group_id;
+            uint8_t key[GROUP_KEY_SIZE];
+            memcpy(key, lamp->group.key, sizeof(key));
+            memset(&lamp->group, 0, sizeof(lamp->group));
+            group_restore(&lamp->group, group_id, key, atomic_load(&lamp->stored_sequence));
+            if (ESP_OK != init_group_server(&lamp->group, lamp->server.ip))
+            {
+                fprintf(stderr, "lamp %zu: group server failed\n", (size_t)(lamp - lamps));
+                return NULL;
+            }
+        }
+
+        listener_event_t event = group_listen(&lamp->group);
+        if (event == RESULT_FAIL)
+        {
+            fprintf(stderr, "lamp %zu: group server failed\n", (size_t)(lamp - lamps));
+            return NULL;
+        }
+        if (event >= RESULT_LED_OFF && event <= RESULT_LED_HIGH)
+        {
+            uint32_t mark;
+            atomic_store(&lamp->applied_us, now_us());
+            atomic_store(&lamp->state, event - RESULT_LED_OFF);
+            atomic_fetch_add(&lamp->applied, 1);
+            if (group_reserve_sequence(&lamp->group, &mark))
+            {
+                atomic_store(&lamp->stored_sequence, mark);
+            }
+        }
+
+        event = listener_listen(&lamp->server);
+        if (event == RESULT_FAIL)
+        {
+            fprintf(stderr, "lamp %zu: listener failed\n", (size_t)(lamp - lamps));
+            return NULL;
+        }
+        if (event == RESULT_GROUP_ASSIGNED)
+        {
+            // A new key restarts the window, the same key keeps it
+            atomic_store(&lamp->stored_sequence, lamp->group.last_sequence);
+            atomic_fetch_add(&lamp->assigned, 1);
+        }
+    }
+    return NULL;
+}
+
+static int connect_lamp(SSL_CTX *ctx, size_t i)
+{
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = lamp_address(i);
+    addr.sin_port = htons(LISTENER_SERVER_PORT);
+
+    for (int retry = 0; retry < TEST_CONNECT_RETRIES; retry++)
+    {
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (sock < 0)
+        {
+            return -1;
+        }
+
+        if (0 == connect(sock, (struct sockaddr *)&addr, sizeof(addr)))
+        {
+            SSL *ssl = SSL_new(ctx);
+            SSL_set_fd(ssl, sock);
+            if (1 == SSL_connect(ssl))
+            {
+                lamps[i].sock = sock;
+                lamps[i].ssl = ssl;
+                return 0;
+            }
+            SSL_free(ssl);
+        }
+        close(sock);
+        usleep(100000);
+    }
+    return -1;
+}
+
+static int send_group_assign(size_t i, uint32_t group_id, const uint8_t *key)
+{
+    // Serialization ORs bits into the buffer, so it must start zeroed
+    unsigned char buffer[LISTENER_SERVER_BUFFER_SIZE] = {0};
+    size_t packet_size = 0;
+
+    data_union_t key_value;
+    memset(&key_value, 0, sizeof(key_value));
+    key_value.utf8_str_v.length = GROUP_KEY_SIZE;
+    memcpy(key_value.utf8_str_v.utf8_string, key, GROUP_KEY_SIZE);
+
+    dpacket_struct_t dpacket;
+    if (!NewPacket(&dpacket, GROUP_ASSIGN_PACKET_ID) ||
+        !AddSerializable(&dpacket, UINT32_STYPE, (data_union_t){.decimal_v.u32_v = group_id}) ||
+        !AddSerializable(&dpacket, UTF8_STRING_STYPE, key_value) ||
+        !SerializePacket(buffer, sizeof(buffer) - 1, &dpacket, &packet_size))
+    {
+        FreePacket(&dpacket);
+        return -1;
+    }
+    FreePacket(&dpacket);
+
+    return (int)packet_size == SSL_write(lamps[i].ssl, buffer, (int)packet_size) ? 0 : -1;
+}
+
+// GROUP_STATE_CHANGE frame, MAC computed with OpenSSL rather than the firmware code under test
+static size_t build_group_frame(unsigned char *buffer, size_t size, const uint8_t *key, size_t key_len,
+                                uint32_t group_id, uint32_t sequence, uint8_t state)
+{
+    uint8_t input[2 * sizeof(uint32_t) + 1];
+    for (size_t b = 0; b < sizeof(uint32_t); b++)
+    {
+        input[b] = (group_id >> (8 * b)) & 0xff;
+        input[sizeof(uint32_t) + b] = (sequence >> (8 * b)) & 0xff;
+    }
+    input[2 * sizeof(uint32_t)] = state;
+
+    uint8_t digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_len = 0;
+    HMAC(EVP_sha256(), key, (int)key_len, input, sizeof(input), digest, &digest_len);
+
+    uint64_t mac = 0;
+    for (size_t b = 0; b < GROUP_MAC_SIZE; b++)
+    {
+        mac = (mac << 8) | digest[b];
+    }
+
+    memset(buffer, 0, size);
+    size_t packet_size = 0;
+    dpacket_struct_t dpacket;
+    if (!NewPacket(&dpacket, GROUP_STATE_CHANGE_PACKET_ID) ||
+        !AddSerializable(&dpacket, UINT32_STYPE, (data_union_t){.decimal_v.u32_v = group_id}) ||
+        !AddSerializable(&dpacket, UINT32_STYPE, (data_union_t){.decimal_v.u32_v = sequence}) ||
+        !AddSerializable(&dpacket, UINT8_STYPE, (data_union_t){.decimal_v.u8_v = state}) ||
+        !AddSerializable(&dpacket, UINT64_STYPE, (data_union_t){.decimal_v.u64_v = mac}) ||
+        !SerializePacket(buffer, size - 1, &dpacket, &packet_size))
+    {
+        packet_size = 0;
+    }
+    FreePacket(&dpacket);
+    return packet_size;
+}
+
+static uint64_t send_frame(const unsigned char *frame, size_t size)
+{
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr(GROUP_MULTICAST_ADDRESS);
+    addr.sin_port = htons(GROUP_SERVER_PORT);
+
+    uint64_t sent_us = now_us();
+    if ((ssize_t)size != sendto(multicast_socket, frame, size, 0, (struct sockaddr *)&addr, sizeof(addr)))
+    {
+        fprintf(stderr, "multicast send failed\n");
+    }
+    return sent_us;
+}
+
+static uint64_t send_command(const uint8_t *key, uint32_t group_id, uint32_t sequence, uint8_t state)
+{
+    unsigned char frame[GROUP_SERVER_BUFFER_SIZE];
+    size_t size = build_group_frame(frame, sizeof(frame), key, GROUP_KEY_SIZE, group_id, sequence, state);
+    return size ? send_frame(frame, size) : 0;
+}
+
+// Snapshot of the applied counters, to check which lamps took the next frame
+static void snapshot_applied(int *applied)
+{
+    for (size_t i = 0; i < lamp_count; i++)
+    {
+        applied[i] = atomic_load(&lamps[i].applied);
+    }
+}
+
+// Waits for the lamps selected by mask to apply one more command with state, and checks the others did not
+static int expect_applied(const int *before, const unsigned char *mask, uint8_t state, uint64_t sent_us, const char *name)
+{
+    uint64_t deadline = now_us() + TEST_APPLY_TIMEOUT_MILLIS * 1000ULL;
+    size_t pending;
+    do
+    {
+        pending = 0;
+        for (size_t i = 0; i < lamp_count; i++)
+        {
+            if (mask[i] && atomic_load(&lamps[i].applied) == before[i])
+            {
+                pending++;
+            }
+        }
+        if (pending)
+        {
+            usleep(1000);
+        }
+    } while (pending && now_us() < deadline);
+
+    // Lamps left out get the same time to show they ignored the frame
+    usleep(TEST_IGNORE_MILLIS * 1000);
+
+    int ok = 1;
+    uint64_t first = UINT64_MAX, last = 0;
+    for (size_t i = 0; i < lamp_count; i++)
+    {
+        int applied = atomic_load(&lamps[i].applied) - before[i];
+        if (applied != (mask[i] ? 1 : 0) ||
+            (mask[i] && atomic_load(&lamps[i].state) != state))
+        {
+            ok = 0;
+        }
+        if (mask[i])
+        {
+            uint64_t at = atomic_load(&lamps[i].applied_us);
+            first = at < first ? at : first;
+            last = at > last ? at : last;
+        }
+    }
+
+    check(ok, name);
+    if (ok && last && sent_us)
+    {
+        fprintf(out, "     applied %llu..%llu us after the send\n",
+                (unsigned long long)(first - sent_us), (unsigned long long)(last - sent_us));
+    }
+    return ok;
+}
+
+static int wait_assigned(const int *before, const unsigned char *mask)
+{
+    uint64_t deadline = now_us() + TEST_APPLY_TIMEOUT_MILLIS * 1000ULL;
+    while (now_us() < deadline)
+    {
+        size_t pending = 0;
+        for (size_t i = 0; i < lamp_count; i++)
+        {
+            if (mask[i] && atomic_load(&lamps[i].assigned) == before[i])
+            {
+                pending++;
+            }
+        }
+        if (!pending)
+        {
+            return 0;
+        }
+        usleep(1000);
+    }
+    return -1;
+}
+
+static int assign(const unsigned char *mask, const uint8_t *key_even, const uint8_t *key_odd)
+{
+    int before[TEST_MAX_LAMPS];
+    for (size_t i = 0; i < lamp_count; i++)
+    {
+        before[i] = atomic_load(&lamps[i].assigned);
+        if (mask[i] && 0 != send_group_assign(i, lamp_group(i), (i % 2) ? key_odd : key_even))
+        {
+            return -1;
+        }
+    }
+    return wait_assigned(before, mask);
+}
+
+static void stop_lamps(size_t count)
+{
+    // Broker side first, the lamp threads see their sessions close
+    for (size_t i = 0; i < count; i++)
+    {
+        if (lamps[i].ssl)
+        {
+            SSL_shutdown(lamps[i].ssl);
+            SSL_free(lamps[i].ssl);
+            lamps[i].ssl = NULL;
+        }
+        if (lamps[i].sock >= 0)
+        {
+            close(lamps[i].sock);
+            lamps[i].sock = -1;
+        }
+    }
+
+    atomic_store(&lamps_running, 0);
+    for (size_t i = 0; i < count; i++)
+    {
+        if (lamps[i].running)
+        {
+            pthread_join(lamps[i].thread, NULL);
+            close_group_server(&lamps[i].group);
+            close_listener_server(&lamps[i].server);
+            lamps[i].running = 0;
+        }
+    }
+}
+
+static int start_lamps(SSL_CTX *ctx)
+{
+    memset(lamps, 0, sizeof(lamps));
+
+    // Servers are set up from this thread, the lamp threads only run the listen loops
+    atomic_store(&lamps_running, 1);
+    for (size_t i = 0; i < lamp_count; i++)
+    {
+        lamps[i].sock = -1;
+        atomic_store(&lamps[i].state, TEST_STATE_UNSET);
+        if (ESP_OK != init_listener_server(&lamps[i].server, lamp_address(i), &lamps[i].group) ||
+            ESP_OK != init_group_server(&lamps[i].group, lamp_address(i)))
+        {
+            fprintf(stderr, "lamp %zu: init failed\n", i);
+            close_listener_server(&lamps[i].server);
+            stop_lamps(i);
+            return -1;
+        }
+        if (0 != pthread_create(&lamps[i].thread, NULL, run_lamp, &lamps[i]))
+        {
+            close_group_server(&lamps[i].group);
+            close_listener_server(&lamps[i].server);
+            stop_lamps(i);
+            return -1;
+        }
+        lamps[i].running = 1;
+    }
+
+    for (size_t i = 0; i < lamp_count; i++)
+    {
+        if (0 != connect_lamp(ctx, i))
+        {
+            fprintf(stderr, "lamp %zu: TLS connect failed\n", i);
+            stop_lamps(lamp_count);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int open_multicast_socket(void)
+{
+    multicast_socket = socket(AF_INET, SOCK_DGRAM, 0);
+    if (multicast_socket < 0)
+    {
+        return -1;
+    }
+
+    struct in_addr interface;
+    interface.s_addr = htonl(INADDR_LOOPBACK);
+    unsigned char loop = 1;
+    if (0 != setsockopt(multicast_socket, IPPROTO_IP, IP_MULTICAST_IF, &interface, sizeof(interface)) ||
+        0 != setsockopt(multicast_socket, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)))
+    {
+        close(multicast_socket);
+        multicast_socket = -1;
+        return -1;
+    }
+    return 0;
+}
+
+static void run_fleet_checks(void)
+{
+    unsigned char none[TEST_MAX_LAMPS] = {0};
+    unsigned char all[TEST_MAX_LAMPS];
+    unsigned char even[TEST_MAX_LAMPS];
+    unsigned char odd[TEST_MAX_LAMPS];
+    for (size_t i = 0; i < lamp_count; i++)
+    {
+        all[i] = 1;
+        even[i] = (i % 2) ? 0 : 1;
+        odd[i] = (i % 2) ? 1 : 0;
+    }
+
+    int before[TEST_MAX_LAMPS];
+    unsigned char frame[GROUP_SERVER_BUFFER_SIZE];
+    unsigned char captured[GROUP_SERVER_BUFFER_SIZE];
+    size_t captured_size;
+    uint64_t sent;
+
+    snapshot_applied(before);
+    sent = send_command(key_a, 1, 1, 3);
+    expect_applied(before, none, 3, sent, "commands before any assignment are dropped");
+
+    check(0 == assign(all, key_a, key_b), "groups and keys assigned over TLS");
+
+    // Kept for the replays below
+    captured_size = build_group_frame(captured, sizeof(captured), key_a, GROUP_KEY_SIZE, 1, 1, 3);
+    snapshot_applied(before);
+    sent = send_frame(captured, captured_size);
+    expect_applied(before, even, 3, sent, "group 1 command reaches group 1 only");
+
+    snapshot_applied(before);
+    sent = send_command(key_b, 2, 1, 2);
+    expect_applied(before, odd, 2, sent, "group 2 command reaches group 2 only");
+
+    snapshot_applied(before);
+    sent = send_command(key_a, GROUP_ID_ALL, 2, 1);
+    expect_applied(before, even, 1, sent, "all lamps command only passes the MAC of its key");
+
+    snapshot_applied(before);
+    sent = send_frame(captured, captured_size);
+    expect_applied(before, none, 3, sent, "replayed command is dropped");
+
+    // The pin code is no longer the key, a frame keyed from it fails the MAC
+    uint8_t pin_key[sizeof(uint32_t)];
+    for (size_t b = 0; b < sizeof(pin_key); b++)
+    {
+        pin_key[b] = (TEST_PIN_CODE >> (8 * b)) & 0xff;
+    }
+    size_t forged_size = build_group_frame(frame, sizeof(frame), pin_key, sizeof(pin_key), 1, 100, 0);
+    snapshot_applied(before);
+    sent = send_frame(frame, forged_size);
+    expect_applied(before, none, 0, sent, "command keyed from the pin code is dropped");
+
+    // Stored sequence survives the reboot, the captured frames stay replays
+    for (size_t i = 0; i < lamp_count; i++)
+    {
+        atomic_store(&lamps[i].reboot, 1);
+    }
+    usleep(TEST_IGNORE_MILLIS * 1000);
+    snapshot_applied(before);
+    sent = send_frame(captured, captured_size);
+    expect_applied(before, none, 3, sent, "replay after a reboot is dropped");
+
+    // Sequences up to the reserved mark stay replays
+    snapshot_applied(before);
+    sent = send_command(key_a, 1, 3, 2);
+    expect_applied(before, none, 3, sent, "command below the reserved mark after a reboot is dropped");
+
+    // Broker skips ahead by the reservation once the lamps reconnect
+    size_t second_size = build_group_frame(captured, sizeof(captured), key_a, GROUP_KEY_SIZE, 1, 2 + GROUP_SEQUENCE_RESERVE + 1, 2);
+    snapshot_applied(before);
+    sent = send_frame(captured, second_size);
+    expect_applied(before, even, 2, sent, "command past the reserved mark after a reboot applies");
+
+    // Broker reconnects and assigns the same key again
+    check(0 == assign(even, key_a, key_b), "same key reassigned");
+    snapshot_applied(before);
+    sent = send_frame(captured, second_size);
+    expect_applied(before, none, 2, sent, "reassigning the same key keeps the sequence window");
+
+    check(0 == assign(even, key_c, key_b), "group 1 key rotated");
+    snapshot_applied(before);
+    sent = send_command(key_a, 1, 4, 0);
+    expect_applied(before, none, 0, sent, "command under the old key is dropped");
+
+    snapshot_applied(before);
+    sent = send_command(key_c, 1, 1, 0);
+    expect_applied(before, even, 0, sent, "command under the new key applies from sequence 1");
+}
+
+// Storage round trip, one simulated boot per process over the flash emulator
+typedef int (*boot_step_t)(void);
+
+static const char *image_path = NULL;
+static const char *partition_csv = NULL;
+
+static int run_boot(boot_step_t step)
+{
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        return -1;
+    }
+
+    if (pid == 0)
+    {
+        int ok = (ESP_OK == flash_emu_open(image_path, partition_csv)) && (0 == step());
+        flash_emu_close();
+        _exit(ok ? 0 : 1);
+    }
+
+    int status = 0;
+    waitpid(pid, &status, 0);
+    return (WIFEXITED(status) && WEXITSTATUS(status) == 0) ? 0 : -1;
+}
+
+static int boot_assign(void)
+{
+    return (ESP_OK == init_storage() &&
+            ESP_OK == save_group_assignment(1, key_a) &&
+            ESP_OK == save_group_sequence(7) &&
+            ESP_OK == storage_flush())
+               ? 0
+               : -1;
+}
+
+static int expect_stored(uint32_t group_id, const uint8_t *key, uint32_t sequence)
+{
+    uint32_t stored_id = 0, stored_sequence = 0;
+    uint8_t stored_key[GROUP_KEY_LENGTH];
+    return (ESP_OK == get_group_config(&stored_id, stored_key, &stored_sequence) &&
+            stored_id == group_id &&
+            0 == memcmp(stored_key, key, GROUP_KEY_LENGTH) &&
+            stored_sequence == sequence)
+               ? 0
+               : -1;
+}
+
+static int boot_same_key(void)
+{
+    return (ESP_OK == init_storage() &&
+            0 == expect_stored(1, key_a, 7) &&
+            ESP_OK == save_group_assignment(1, key_a) &&
+            ESP_OK == storage_flush() &&
+            0 == expect_stored(1, key_a, 7))
+               ? 0
+               : -1;
+}
+
+static int boot_new_key(void)
+{
+    return (ESP_OK == init_storage() &&
+            0 == expect_stored(1, key_a, 7) &&
+            ESP_OK == save_group_assignment(1, key_c) &&
+            ESP_OK == storage_flush())
+               ? 0
+               : -1;
+}
+
+static int boot_after_new_key(void)
+{
+    if (ESP_OK != init_storage() || 0 != expect_stored(1, key_c, 0))
+    {
+        return -1;
+    }
+    storage_data_reset();
+    return (ESP_OK == storage_flush()) ? 0 : -1;
+}
+
+static int boot_after_reset(void)
+{
+    uint32_t group_id, sequence;
+    uint8_t key[GROUP_KEY_LENGTH];
+    return (ESP_OK == init_storage() &&
+            ESP_ERR_NOT_FOUND == get_group_config(&group_id, key, &sequence))
+               ? 0
+               : -1;
+}
+
+static void run_storage_checks(void)
+{
+    char path[] = "/tmp/vetta_group_test_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0)
+    {
+        check(0, "flash image created");
+        return;
+    }
+    close(fd);
+    unlink(path);
+    image_path = path;
+    partition_csv = (0 == access("partition-table.csv", R_OK)) ? "partition-table.csv" : "../partition-table.csv";
+
+    check(0 == run_boot(boot_assign), "group, key and sequence stored");
+    check(0 == run_boot(boot_same_key), "stored after a reboot, same key keeps the sequence");
+    check(0 == run_boot(boot_new_key), "new key stored");
+    check(0 == run_boot(boot_after_new_key), "new key restarts the stored sequence");
+    check(0 == run_boot(boot_after_reset), "storage reset drops the group");
+
+    unlink(path);
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "n:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            lamp_count = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n lamps]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (lamp_count < 2 || lamp_count > TEST_MAX_LAMPS)
+    {
+        fprintf(stderr, "lamps must be 2 to %d\n", TEST_MAX_LAMPS);
+        return 1;
+    }
+
+    if (!RegisterNetworkPackets())
+    {
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    // Keep the firmware logs out of the results
+    out = fdopen(dup(STDOUT_FILENO), "w");
+    int devnull = open("/dev/null", O_WRONLY);
+    if (!out || devnull < 0)
+    {
+        return 1;
+    }
+    dup2(devnull, STDOUT_FILENO);
+    close(devnull);
+
+    run_storage_checks();
+
+    // Starts the shimmed tick count before the lamp threads read it
+    xTaskGetTickCount();
+
+    SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+    if (!ctx || 0 != open_multicast_socket())
+    {
+        return 1;
+    }
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, NULL);
+
+    fprintf(out, "%zu lamps\n", lamp_count);
+    if (0 != start_lamps(ctx))
+    {
+        SSL_CTX_free(ctx);
+        return 1;
+    }
+    run_fleet_checks();
+    stop_lamps(lamp_count);
+
+    close(multicast_socket);
+    SSL_CTX_free(ctx);
+    fprintf(out, "%d failures\n", failures);
+    fclose(out);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,10 @@
+#ifndef __HOST_ESP_EVENT_H
+
+#include "esp_err.h"
+#include "tcpip_adapter.h"
+
+typedef const char *esp_event_base_t;
+typedef void (*esp_event_handler_t)(void *event_handler_arg, esp_event_base_t event_base, int32_t event_id, void *event_data);
+
+#define __HOST_ESP_EVENT_H
+#endif // __HOST_ESP_EVENT_H
@@ -0,0 +1,47 @@
+#ifndef __HOST_ESP_PARTITION_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    typedef enum
+    {
+        ESP_PARTITION_TYPE_APP = 0x00,
+        ESP_PARTITION_TYPE_DATA = 0x01,
+    } esp_partition_type_t;
+
+    typedef enum
+    {
+        ESP_PARTITION_SUBTYPE_APP_FACTORY = 0x00,
+        ESP_PARTITION_SUBTYPE_DATA_PHY = 0x01,
+        ESP_PARTITION_SUBTYPE_DATA_NVS = 0x02,
+        ESP_PARTITION_SUBTYPE_DATA_SPIFFS = 0x82,
+        ESP_PARTITION_SUBTYPE_ANY = 0xff,
+    } esp_partition_subtype_t;
+
+    typedef struct
+    {
+        esp_partition_type_t type;
+        esp_partition_subtype_t subtype;
+        uint32_t address;
+        uint32_t size;
+        char label[17];
+    } esp_partition_t;
+
+    // Served by the flash emulator, see flash_emu.h, nothing is found before flash_emu_open()
+    const esp_partition_t *esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype, const char *label);
+    esp_err_t esp_partition_read(const esp_partition_t *partition, size_t src_offset, void *dst, size_t size);
+    esp_err_t esp_partition_write(const esp_partition_t *partition, size_t dst_offset, const void *src, size_t size);
+    esp_err_t esp_partition_erase_range(const esp_partition_t *partition, size_t start_addr, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#define __HOST_ESP_PARTITION_H
+#endif // __HOST_ESP_PARTITION_H
@@ -0,0 +1,30 @@
+#ifndef __HOST_ESP_SPIFFS_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    typedef struct
+    {
+        const char *base_path;
+        const char *partition_label;
+        size_t max_files;
+        bool format_if_mount_failed;
+    } esp_vfs_spiffs_conf_t;
+
+    // Mount and format cost over the flash emulator, files are not emulated and base_path is not registered
+    esp_err_t esp_vfs_spiffs_register(const esp_vfs_spiffs_conf_t *conf);
+    esp_err_t esp_vfs_spiffs_unregister(const char *partition_label);
+    esp_err_t esp_spiffs_info(const char *partition_label, size_t *total_bytes, size_t *used_bytes);
+
+#ifdef __cplusplus
+}
+#endif
+
+#define __HOST_ESP_SPIFFS_H
+#endif // __HOST_ESP_SPIFFS_H
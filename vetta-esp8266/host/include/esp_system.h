@@ -0,0 +1,19 @@
+#ifndef __HOST_ESP_SYSTEM_H
+
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    uint32_t esp_get_free_heap_size(void);
+    uint32_t esp_get_minimum_free_heap_size(void);
+    uint32_t esp_random(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#define __HOST_ESP_SYSTEM_H
+#endif // __HOST_ESP_SYSTEM_H
@@ -0,0 +1,35 @@
+#ifndef __HOST_ESP_TIMER_H
+
+#include <stdint.h>
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    typedef struct esp_timer *esp_timer_handle_t;
+    typedef void (*esp_timer_cb_t)(void *arg);
+
+    typedef struct
+    {
+        esp_timer_cb_t callback;
+        void *arg;
+        const char *name;
+    } esp_timer_create_args_t;
+
+    esp_err_t esp_timer_create(const esp_timer_create_args_t *create_args, esp_timer_handle_t *out_handle);
+    esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us);
+    esp_err_t esp_timer_stop(esp_timer_handle_t timer);
+    esp_err_t esp_timer_delete(esp_timer_handle_t timer);
+
+    // Simulated clock, timers only fire from host_esp_timer_advance()
+    int64_t esp_timer_get_time(void);
+    void host_esp_timer_advance(uint64_t us);
+
+#ifdef __cplusplus
+}
+#endif
+
+#define __HOST_ESP_TIMER_H
+#endif // __HOST_ESP_TIMER_H
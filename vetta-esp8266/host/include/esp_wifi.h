@@ -0,0 +1,20 @@
+#ifndef __HOST_ESP_WIFI_H
+
+#include <stdint.h>
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    // Counts connect requests, there is no radio on the host
+    esp_err_t esp_wifi_connect(void);
+    uint32_t host_wifi_connect_count(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#define __HOST_ESP_WIFI_H
+#endif // __HOST_ESP_WIFI_H
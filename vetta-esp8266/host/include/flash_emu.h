@@ -0,0 +1,72 @@
+#ifndef __HOST_FLASH_EMU_H
+
+#include <stdint.h>
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// SPI NOR flash of the lamp modules
+#define FLASH_EMU_SIZE (4UL * 1024UL * 1024UL)
+#define FLASH_EMU_SECTOR_SIZE (4096UL)
+#define FLASH_EMU_PAGE_SIZE (256UL)
+#define FLASH_EMU_SECTOR_COUNT (FLASH_EMU_SIZE / FLASH_EMU_SECTOR_SIZE)
+
+// Cost model, typical datasheet figures of 4MB SPI NOR parts read at 40MHz DIO
+#ifndef FLASH_EMU_READ_SETUP_NS
+#define FLASH_EMU_READ_SETUP_NS (2000ULL)
+#endif
+#ifndef FLASH_EMU_READ_NS_PER_BYTE
+#define FLASH_EMU_READ_NS_PER_BYTE (100ULL)
+#endif
+#ifndef FLASH_EMU_PAGE_PROGRAM_NS
+#define FLASH_EMU_PAGE_PROGRAM_NS (700000ULL)
+#endif
+#ifndef FLASH_EMU_SECTOR_ERASE_NS
+#define FLASH_EMU_SECTOR_ERASE_NS (45000000ULL)
+#endif
+
+    typedef struct flash_emu_stats_t
+    {
+        uint32_t reads;
+        uint64_t read_bytes;
+        uint32_t page_programs; // Pages touched by esp_partition_write
+        uint64_t program_bytes;
+        uint32_t sector_erases;
+        uint64_t busy_ns; // Time the flash would have kept the CPU waiting
+        uint32_t spiffs_mounts;
+        uint32_t spiffs_formats;
+
+    } flash_emu_stats_t;
+
+    /**
+     * Maps the flash image at image_path, created erased if missing, and lays the partitions of
+     * partition_csv over it the way the ESP-IDF partition tool does.
+     * The image keeps a program/erase counter per sector, so wear adds up over simulated reboots.
+     */
+    esp_err_t flash_emu_open(const char *image_path, const char *partition_csv);
+
+    void flash_emu_close(void);
+
+    /**
+     * Power is cut once bytes more bytes have been programmed or erased, the operation in flight
+     * is left half done and every flash call fails afterwards. Negative disables.
+     */
+    void flash_emu_power_cut_after(int64_t bytes);
+
+    void flash_emu_get_stats(flash_emu_stats_t *out);
+    void flash_emu_reset_stats(void);
+
+    /**
+     * Lowest and highest erase count over the sectors of the partition named label.
+     */
+    esp_err_t flash_emu_partition_wear(const char *label, uint32_t *min_erases, uint32_t *max_erases);
+
+#ifdef __cplusplus
+}
+#endif
+
+#define __HOST_FLASH_EMU_H
+#endif // __HOST_FLASH_EMU_H
@@ -0,0 +1,33 @@
+#ifndef __HOST_FREERTOS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "FreeRTOSConfig.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    typedef uint32_t TickType_t;
+    typedef long BaseType_t;
+    typedef unsigned long UBaseType_t;
+
+#define pdTRUE 1
+#define pdFALSE 0
+#define portMAX_DELAY ((TickType_t)0xffffffffUL)
+#define portTICK_PERIOD_MS ((TickType_t)1000 / CONFIG_FREERTOS_HZ)
+
+    // Milliseconds since process start, in ticks
+    TickType_t xTaskGetTickCount(void);
+
+    void vTaskDelay(const TickType_t xTicksToDelay);
+
+#ifdef __cplusplus
+}
+#endif
+
+#define __HOST_FREERTOS_H
+#endif // __HOST_FREERTOS_H
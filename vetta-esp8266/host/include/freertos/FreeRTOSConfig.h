@@ -0,0 +1,9 @@
+#ifndef __HOST_FREERTOS_CONFIG_H
+
+// From sdkconfig
+#ifndef CONFIG_FREERTOS_HZ
+#define CONFIG_FREERTOS_HZ 100
+#endif
+
+#define __HOST_FREERTOS_CONFIG_H
+#endif // __HOST_FREERTOS_CONFIG_H
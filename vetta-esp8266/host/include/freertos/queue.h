@@ -0,0 +1,24 @@
+#ifndef __HOST_FREERTOS_QUEUE_H
+
+#include "FreeRTOS.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    typedef struct host_queue *QueueHandle_t;
+
+    // Single threaded ring buffers, blocking calls return at once
+    QueueHandle_t xQueueCreate(UBaseType_t uxQueueLength, UBaseType_t uxItemSize);
+    BaseType_t xQueueSend(QueueHandle_t xQueue, const void *pvItemToQueue, TickType_t xTicksToWait);
+    BaseType_t xQueueReceive(QueueHandle_t xQueue, void *pvBuffer, TickType_t xTicksToWait);
+    BaseType_t xQueuePeek(QueueHandle_t xQueue, void *pvBuffer, TickType_t xTicksToWait);
+    UBaseType_t uxQueueMessagesWaiting(QueueHandle_t xQueue);
+
+#ifdef __cplusplus
+}
+#endif
+
+#define __HOST_FREERTOS_QUEUE_H
+#endif // __HOST_FREERTOS_QUEUE_H
@@ -0,0 +1,24 @@
+#ifndef __HOST_FREERTOS_SEMPHR_H
+
+#include "FreeRTOS.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    typedef struct host_semaphore *SemaphoreHandle_t;
+
+    // Single threaded, a mutex is always free
+    SemaphoreHandle_t xSemaphoreCreateMutex(void);
+    // Created empty, takes fail until it is given
+    SemaphoreHandle_t xSemaphoreCreateBinary(void);
+    BaseType_t xSemaphoreTake(SemaphoreHandle_t xSemaphore, TickType_t xBlockTime);
+    BaseType_t xSemaphoreGive(SemaphoreHandle_t xSemaphore);
+
+#ifdef __cplusplus
+}
+#endif
+
+#define __HOST_FREERTOS_SEMPHR_H
+#endif // __HOST_FREERTOS_SEMPHR_H
@@ -0,0 +1,18 @@
+#ifndef __HOST_LWIP_SOCKETS_H
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "tcpip_adapter.h"
+
+// lwIP converts SO_RCVTIMEO/SO_SNDTIMEO to whole milliseconds, so sub-millisecond
+// timeouts block like on the lamp
+int host_setsockopt(int fd, int level, int optname, const void *optval, socklen_t optlen);
+#define setsockopt host_setsockopt
+
+#define __HOST_LWIP_SOCKETS_H
+#endif // __HOST_LWIP_SOCKETS_H
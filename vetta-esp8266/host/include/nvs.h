@@ -0,0 +1,55 @@
+#ifndef __HOST_NVS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define ESP_ERR_NVS_BASE 0x1100
+#define ESP_ERR_NVS_NOT_INITIALIZED (ESP_ERR_NVS_BASE + 0x01)
+#define ESP_ERR_NVS_NOT_FOUND (ESP_ERR_NVS_BASE + 0x02)
+#define ESP_ERR_NVS_TYPE_MISMATCH (ESP_ERR_NVS_BASE + 0x03)
+#define ESP_ERR_NVS_READ_ONLY (ESP_ERR_NVS_BASE + 0x04)
+#define ESP_ERR_NVS_NOT_ENOUGH_SPACE (ESP_ERR_NVS_BASE + 0x05)
+#define ESP_ERR_NVS_INVALID_NAME (ESP_ERR_NVS_BASE + 0x06)
+#define ESP_ERR_NVS_INVALID_HANDLE (ESP_ERR_NVS_BASE + 0x07)
+#define ESP_ERR_NVS_KEY_TOO_LONG (ESP_ERR_NVS_BASE + 0x09)
+#define ESP_ERR_NVS_INVALID_LENGTH (ESP_ERR_NVS_BASE + 0x0c)
+#define ESP_ERR_NVS_VALUE_TOO_LONG (ESP_ERR_NVS_BASE + 0x0e)
+
+    typedef uint32_t nvs_handle;
+
+    typedef enum
+    {
+        NVS_READONLY,
+        NVS_READWRITE
+    } nvs_open_mode;
+
+    // Served by the NVS emulator over the nvs partition of the flash emulator, see nvs_emu.c
+    esp_err_t nvs_open(const char *name, nvs_open_mode open_mode, nvs_handle *out_handle);
+    void nvs_close(nvs_handle handle);
+    esp_err_t nvs_commit(nvs_handle handle);
+    esp_err_t nvs_erase_key(nvs_handle handle, const char *key);
+
+    esp_err_t nvs_get_u8(nvs_handle handle, const char *key, uint8_t *out_value);
+    esp_err_t nvs_get_u16(nvs_handle handle, const char *key, uint16_t *out_value);
+    esp_err_t nvs_get_u32(nvs_handle handle, const char *key, uint32_t *out_value);
+    esp_err_t nvs_get_str(nvs_handle handle, const char *key, char *out_value, size_t *length);
+    esp_err_t nvs_get_blob(nvs_handle handle, const char *key, void *out_value, size_t *length);
+
+    esp_err_t nvs_set_u8(nvs_handle handle, const char *key, uint8_t value);
+    esp_err_t nvs_set_u16(nvs_handle handle, const char *key, uint16_t value);
+    esp_err_t nvs_set_u32(nvs_handle handle, const char *key, uint32_t value);
+    esp_err_t nvs_set_str(nvs_handle handle, const char *key, const char *value);
+    esp_err_t nvs_set_blob(nvs_handle handle, const char *key, const void *value, size_t length);
+
+#ifdef __cplusplus
+}
+#endif
+
+#define __HOST_NVS_H
+#endif // __HOST_NVS_H
@@ -0,0 +1,21 @@
+#ifndef __HOST_NVS_FLASH_H
+
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /**
+     * Scans the pages of the nvs partition, drops items cut short by a power loss and finishes
+     * a page reclaim left half done. Call after flash_emu_open() on every simulated boot.
+     */
+    esp_err_t nvs_flash_init(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#define __HOST_NVS_FLASH_H
+#endif // __HOST_NVS_FLASH_H
@@ -0,0 +1,22 @@
+#ifndef __HOST_OPENSSL_SSL_H
+
+#include_next <openssl/ssl.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    // The ESP OpenSSL compat layer accepts PEM data in the ASN1 loaders, system OpenSSL does not
+    int host_use_certificate_pem(SSL_CTX *ctx, int len, const unsigned char *d);
+    int host_use_private_key_pem(int pk, SSL_CTX *ctx, const unsigned char *d, long len);
+
+#define SSL_CTX_use_certificate_ASN1(ctx, len, d) host_use_certificate_pem(ctx, len, d)
+#define SSL_CTX_use_PrivateKey_ASN1(pk, ctx, d, len) host_use_private_key_pem(pk, ctx, d, len)
+
+#ifdef __cplusplus
+}
+#endif
+
+#define __HOST_OPENSSL_SSL_H
+#endif // __HOST_OPENSSL_SSL_H
@@ -0,0 +1,10 @@
+#ifndef __HOST_SYS_SOCKET_H
+// Defined first, netinet/in.h includes sys/socket.h back
+#define __HOST_SYS_SOCKET_H
+
+// lwIP's sys/socket.h also provides the netinet address types
+#include_next <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#endif // __HOST_SYS_SOCKET_H
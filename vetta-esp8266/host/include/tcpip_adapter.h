@@ -0,0 +1,10 @@
+#ifndef __HOST_TCPIP_ADAPTER_H
+
+#include <stdint.h>
+
+typedef uint8_t u8_t;
+typedef uint16_t u16_t;
+typedef uint32_t u32_t;
+
+#define __HOST_TCPIP_ADAPTER_H
+#endif // __HOST_TCPIP_ADAPTER_H
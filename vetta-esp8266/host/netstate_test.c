@@ -0,0 +1,222 @@
+/*
+ * Network state machine trace replay.
+ *
+ * Replays recorded driver and button event traces against net_state_transition(), the way the network
+ * task dispatches them, and checks the action run for every event and the state reached. Actions can be
+ * marked as failing to follow the fail edges. Table wide properties are checked afterwards: every state
+ * shuts down to NET_STATE_OFF, unknown events are ignored, and the published bits follow the state.
+ *
+ * Usage: netstate_test
+ * Prints one line per trace and property, exits non zero on failures.
+ */
+#include <stdio.h>
+#include <string.h>
+#include "netstate.h"
+
+#define TRACE_MAX_STEPS (16)
+
+typedef struct trace_step_t
+{
+    net_event_t event;
+    int action_fails;
+    net_action_t action; // Expected action
+    net_state_t state;   // Expected state afterwards
+} trace_step_t;
+
+typedef struct trace_t
+{
+    const char *name;
+    net_state_t start;
+    size_t steps;
+    trace_step_t step[TRACE_MAX_STEPS];
+} trace_t;
+
+static const trace_t traces[] = {
+    {"first boot provisioning",
+     NET_STATE_OFF,
+     6,
+     {{NET_EVENT_START_AP, 0, NET_ACTION_START_AP, NET_STATE_AP},
+      {NET_EVENT_AP_STA_CONNECTED, 0, NET_ACTION_OPEN_PROVISION, NET_STATE_AP_PROVISIONING},
+      {NET_EVENT_AP_STA_DISCONNECTED, 0, NET_ACTION_CLOSE_PROVISION, NET_STATE_AP},
+      {NET_EVENT_AP_STA_CONNECTED, 0, NET_ACTION_OPEN_PROVISION, NET_STATE_AP_PROVISIONING},
+      {NET_EVENT_PROVISION_DONE, 0, NET_ACTION_SHUTDOWN, NET_STATE_OFF},
+      {NET_EVENT_START_STA, 0, NET_ACTION_START_STA, NET_STATE_STA_CONNECTING}}},
+
+    {"provisioning socket fails to open",
+     NET_STATE_AP,
+     2,
+     {{NET_EVENT_AP_STA_CONNECTED, 1, NET_ACTION_OPEN_PROVISION, NET_STATE_AP},
+      {NET_EVENT_AP_STA_CONNECTED, 0, NET_ACTION_OPEN_PROVISION, NET_STATE_AP_PROVISIONING}}},
+
+    {"station boot with reconnects",
+     NET_STATE_OFF,
+     9,
+     {{NET_EVENT_START_STA, 0, NET_ACTION_START_STA, NET_STATE_STA_CONNECTING},
+      {NET_EVENT_STA_START, 0, NET_ACTION_STA_CONNECT, NET_STATE_STA_CONNECTING},
+      {NET_EVENT_STA_DISCONNECTED, 0, NET_ACTION_RECONNECT, NET_STATE_STA_CONNECTING},
+      {NET_EVENT_STA_CONNECTED, 0, NET_ACTION_RECORD_LINK, NET_STATE_STA_CONNECTING},
+      {NET_EVENT_STA_GOT_IP, 0, NET_ACTION_BIND_SERVERS, NET_STATE_STA_ONLINE},
+      {NET_EVENT_STA_DISCONNECTED, 0, NET_ACTION_RECONNECT, NET_STATE_STA_CONNECTING},
+      {NET_EVENT_STA_CONNECTED, 0, NET_ACTION_RECORD_LINK, NET_STATE_STA_CONNECTING},
+      {NET_EVENT_STA_GOT_IP, 0, NET_ACTION_BIND_SERVERS, NET_STATE_STA_ONLINE},
+      // Lease renewed with a new address
+      {NET_EVENT_STA_GOT_IP, 0, NET_ACTION_BIND_SERVERS, NET_STATE_STA_ONLINE}}},
+
+    {"reconnect budget spent",
+     NET_STATE_STA_ONLINE,
+     2,
+     {{NET_EVENT_STA_DISCONNECTED, 0, NET_ACTION_RECONNECT, NET_STATE_STA_CONNECTING},
+      {NET_EVENT_STA_DISCONNECTED, 1, NET_ACTION_RECONNECT, NET_STATE_OFF}}},
+
+    {"servers fail to bind",
+     NET_STATE_STA_CONNECTING,
+     2,
+     {{NET_EVENT_STA_GOT_IP, 1, NET_ACTION_BIND_SERVERS, NET_STATE_OFF},
+      {NET_EVENT_STA_DISCONNECTED, 0, NET_ACTION_NONE, NET_STATE_OFF}}},
+
+    {"server failure while online",
+     NET_STATE_STA_ONLINE,
+     2,
+     {{NET_EVENT_SERVER_FAIL, 0, NET_ACTION_SHUTDOWN, NET_STATE_OFF},
+      {NET_EVENT_START_STA, 0, NET_ACTION_START_STA, NET_STATE_STA_CONNECTING}}},
+
+    {"reprovisioning next to the station",
+     NET_STATE_STA_ONLINE,
+     6,
+     {{NET_EVENT_START_AP, 0, NET_ACTION_START_REPROVISION, NET_STATE_STA_REPROVISIONING},
+      {NET_EVENT_AP_STA_CONNECTED, 0, NET_ACTION_OPEN_PROVISION, NET_STATE_STA_REPROVISIONING},
+      // Station keeps its lease meanwhile
+      {NET_EVENT_STA_GOT_IP, 0, NET_ACTION_BIND_SERVERS, NET_STATE_STA_REPROVISIONING},
+      {NET_EVENT_PROVISION_DONE, 0, NET_ACTION_END_REPROVISION, NET_STATE_STA_ONLINE},
+      {NET_EVENT_STA_DISCONNECTED, 0, NET_ACTION_RECONNECT, NET_STATE_STA_CONNECTING},
+      {NET_EVENT_STA_GOT_IP, 0, NET_ACTION_BIND_SERVERS, NET_STATE_STA_ONLINE}}},
+
+    {"station lost while reprovisioning",
+     NET_STATE_STA_REPROVISIONING,
+     2,
+     {{NET_EVENT_STA_DISCONNECTED, 0, NET_ACTION_ABORT_REPROVISION, NET_STATE_STA_CONNECTING},
+      {NET_EVENT_PROVISION_DONE, 0, NET_ACTION_NONE, NET_STATE_STA_CONNECTING}}},
+
+    {"softAP refused while online",
+     NET_STATE_STA_ONLINE,
+     1,
+     {{NET_EVENT_START_AP, 1, NET_ACTION_START_REPROVISION, NET_STATE_STA_ONLINE}}},
+
+    {"unreachable AP, provisioned again",
+     NET_STATE_STA_CONNECTING,
+     3,
+     {{NET_EVENT_START_AP, 0, NET_ACTION_START_AP, NET_STATE_AP},
+      // Late station events of the stopped station
+      {NET_EVENT_STA_DISCONNECTED, 0, NET_ACTION_NONE, NET_STATE_AP},
+      {NET_EVENT_STA_GOT_IP, 0, NET_ACTION_NONE, NET_STATE_AP}}},
+
+    {"button shutdown while provisioning",
+     NET_STATE_AP_PROVISIONING,
+     2,
+     {{NET_EVENT_SHUTDOWN, 0, NET_ACTION_SHUTDOWN, NET_STATE_OFF},
+      {NET_EVENT_AP_STA_DISCONNECTED, 0, NET_ACTION_NONE, NET_STATE_OFF}}},
+};
+
+static int failures = 0;
+
+static void check(int ok, const char *name)
+{
+    printf("%s %s\n", ok ? "ok  " : "FAIL", name);
+    if (!ok)
+    {
+        failures++;
+    }
+}
+
+static int replay(const trace_t *trace)
+{
+    net_state_t state = trace->start;
+
+    for (size_t i = 0; i < trace->steps; i++)
+    {
+        const trace_step_t *step = &trace->step[i];
+        net_transition_t transition = net_state_transition(state, step->event);
+        net_state_t next = step->action_fails ? transition.fail : transition.next;
+
+        if (transition.action != step->action || next != step->state)
+        {
+            printf("     step %zu: %s in %s ran action %d into %s, expected action %d into %s\n",
+                   i, net_event_name(step->event), net_state_name(state),
+                   transition.action, net_state_name(next), step->action, net_state_name(step->state));
+            return 0;
+        }
+        state = next;
+    }
+    return 1;
+}
+
+static int check_shutdown(void)
+{
+    for (int state = 0; state < NET_STATE_COUNT; state++)
+    {
+        net_transition_t transition = net_state_transition((net_state_t)state, NET_EVENT_SHUTDOWN);
+        if (transition.action != NET_ACTION_SHUTDOWN ||
+            transition.next != NET_STATE_OFF ||
+            transition.fail != NET_STATE_OFF)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int check_closed_table(void)
+{
+    for (int state = 0; state < NET_STATE_COUNT; state++)
+    {
+        for (int event = 0; event <= NET_EVENT_COUNT; event++)
+        {
+            net_transition_t transition = net_state_transition((net_state_t)state, (net_event_t)event);
+            if (transition.next >= NET_STATE_COUNT || transition.fail >= NET_STATE_COUNT)
+            {
+                return 0;
+            }
+            // Ignored events leave the state as it is
+            if (transition.action == NET_ACTION_NONE &&
+                (transition.next != state || transition.fail != state))
+            {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+static int check_bits(void)
+{
+    for (int state = 0; state < NET_STATE_COUNT; state++)
+    {
+        uint32_t bits = net_state_bits((net_state_t)state);
+        int online = (state == NET_STATE_STA_ONLINE || state == NET_STATE_STA_REPROVISIONING);
+        int softap = (state == NET_STATE_AP || state == NET_STATE_AP_PROVISIONING || state == NET_STATE_STA_REPROVISIONING);
+
+        if ((bits & ~NET_STATE_BITS_ALL) ||
+            !!(bits & NET_STATE_BIT_RUNNING) != (state != NET_STATE_OFF) ||
+            !!(bits & NET_STATE_BIT_ONLINE) != online ||
+            !!(bits & NET_STATE_BIT_SOFTAP) != softap)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int main(void)
+{
+    for (size_t i = 0; i < sizeof(traces) / sizeof(traces[0]); i++)
+    {
+        check(replay(&traces[i]), traces[i].name);
+    }
+
+    check(check_shutdown(), "every state shuts down to OFF");
+    check(check_closed_table(), "unknown and ignored events keep the state");
+    check(check_bits(), "published bits follow the state");
+
+    printf("%d failures\n", failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,1029 @@
+/*
+ * NVS emulation over the nvs partition of the flash emulator.
+ *
+ * Keeps the page and item layout of the SDK's nvs_flash, so its flash traffic and wear are charged by
+ * flash_emu: 4 KB pages of a 32 byte header, a 2 bit per entry state bitmap and 126 entries of 32 bytes.
+ * An item is programmed into the active page, marked written, and only then is its old copy marked
+ * erased. One page is held in reserve: once it is the only empty page left, the full page with the most
+ * erased entries is marked freeing, its live items are copied to the reserve and its sector is erased.
+ * Setting a key to the value it holds writes nothing. Strings and blobs are single items spanning their
+ * data entries, the blob layout of the older SDKs.
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "esp_partition.h"
+#include "nvs.h"
+#include "nvs_flash.h"
+
+#define NVS_PAGE_SIZE (4096UL)
+#define NVS_BITMAP_OFFSET (32UL)
+#define NVS_ENTRIES_OFFSET (64UL)
+#define NVS_ENTRY_SIZE (32UL)
+#define NVS_ENTRY_COUNT (126)
+#define NVS_MAX_PAGES (16)
+#define NVS_MAX_ITEMS (NVS_MAX_PAGES * NVS_ENTRY_COUNT)
+#define NVS_KEY_SIZE (16)
+#define NVS_MAX_HANDLES (8)
+// Empty pages are read back in chunks this long to check they are erased
+#define NVS_CHECK_CHUNK (256UL)
+
+#define NVS_PAGE_EMPTY (0xFFFFFFFFUL)
+#define NVS_PAGE_ACTIVE (0xFFFFFFFEUL)
+#define NVS_PAGE_FULL (0xFFFFFFFCUL)
+#define NVS_PAGE_FREEING (0xFFFFFFF8UL)
+#define NVS_PAGE_VERSION (0xFE)
+
+#define NVS_ENTRY_EMPTY (3)
+#define NVS_ENTRY_WRITTEN (2)
+#define NVS_ENTRY_ERASED (0)
+
+#define NVS_TYPE_U8 (0x01)
+#define NVS_TYPE_U16 (0x02)
+#define NVS_TYPE_U32 (0x04)
+#define NVS_TYPE_STR (0x21)
+#define NVS_TYPE_BLOB (0x41)
+
+// Namespace names are u8 items of namespace 0, valued with the index of their namespace
+#define NVS_NAMESPACE_INDEX (0)
+#define NVS_NAMESPACE_MAX (254)
+
+typedef struct nvs_page_header_t
+{
+    uint32_t state;
+    uint32_t sequence;
+    uint8_t version;
+    uint8_t unused[19];
+    uint32_t crc; // CRC-32 from sequence up to here
+
+} nvs_page_header_t;
+
+typedef struct nvs_item_t
+{
+    uint8_t ns;
+    uint8_t type;
+    uint8_t span; // Entries taken, the item and its data
+    uint8_t chunk;
+    uint32_t crc; // CRC-32 over the item without this field
+    char key[NVS_KEY_SIZE];
+    union
+    {
+        uint8_t value[8];
+        struct
+        {
+            uint16_t size;
+            uint16_t reserved;
+            uint32_t crc; // CRC-32 of the data entries, size bytes
+        } var;
+    } data;
+
+} nvs_item_t;
+
+typedef char nvs_item_fits_entry[(sizeof(nvs_item_t) == NVS_ENTRY_SIZE && sizeof(nvs_page_header_t) == NVS_BITMAP_OFFSET) ? 1 : -1];
+
+typedef struct nvs_page_t
+{
+    uint32_t state;
+    uint32_t sequence;
+    uint16_t next_free;
+    uint16_t erased;
+
+} nvs_page_t;
+
+// Live item, the way the SDK keeps its hash list in RAM
+typedef struct nvs_index_t
+{
+    uint8_t ns;
+    uint8_t type;
+    uint8_t span;
+    uint8_t page;
+    uint8_t entry;
+    char key[NVS_KEY_SIZE];
+
+} nvs_index_t;
+
+typedef struct nvs_open_t
+{
+    unsigned char used;
+    unsigned char readonly;
+    uint8_t ns;
+
+} nvs_open_t;
+
+static const esp_partition_t *nvs_partition = NULL;
+static unsigned char initialized = 0;
+static int page_count = 0;
+static nvs_page_t pages[NVS_MAX_PAGES];
+static int active = -1;
+static uint32_t next_sequence = 0;
+
+static nvs_index_t items[NVS_MAX_ITEMS];
+static int item_count = 0;
+
+static nvs_open_t handles[NVS_MAX_HANDLES];
+
+// Data entries of one item, read back or programmed
+static uint8_t entry_buffer[NVS_ENTRY_COUNT * NVS_ENTRY_SIZE];
+
+static uint32_t crc32_update(uint32_t crc, const uint8_t *data, size_t len)
+{
+    crc = ~crc;
+    while (len--)
+    {
+        crc ^= *data++;
+        for (uint8_t bit = 0; bit < 8; bit++)
+        {
+            crc = (crc >> 1) ^ (0xEDB88320UL & (0UL - (crc & 1UL)));
+        }
+    }
+    return ~crc;
+}
+
+static uint32_t item_crc(const nvs_item_t *item)
+{
+    uint32_t crc = crc32_update(0, (const uint8_t *)item, offsetof(nvs_item_t, crc));
+    return crc32_update(crc, (const uint8_t *)item->key, sizeof(item->key) + sizeof(item->data));
+}
+
+static uint32_t header_crc(const nvs_page_header_t *header)
+{
+    return crc32_update(0, (const uint8_t *)&header->sequence, offsetof(nvs_page_header_t, crc) - offsetof(nvs_page_header_t, sequence));
+}
+
+static size_t entry_address(int page, int entry)
+{
+    return page * NVS_PAGE_SIZE + NVS_ENTRIES_OFFSET + entry * NVS_ENTRY_SIZE;
+}
+
+static unsigned char all_erased(const uint8_t *data, size_t len)
+{
+    while (len--)
+    {
+        if (*data++ != 0xFF)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static uint8_t entry_state(const uint8_t *bitmap, int entry)
+{
+    return (bitmap[entry / 4] >> ((entry % 4) * 2)) & 3;
+}
+
+// Programs the bitmap words holding entries first to first + count - 1, the other entries' bits are left set
+static esp_err_t set_entry_state(int page, int first, int count, uint8_t state)
+{
+    uint8_t bitmap[NVS_BITMAP_OFFSET];
+    memset(bitmap, 0xFF, sizeof(bitmap));
+
+    for (int entry = first; entry < first + count; entry++)
+    {
+        int shift = (entry % 4) * 2;
+        bitmap[entry / 4] &= (uint8_t)(~(3 << shift) | (state << shift));
+    }
+
+    size_t start = (first / 4) & ~3;
+    size_t end = (((first + count - 1) / 4) | 3) + 1;
+    return esp_partition_write(nvs_partition, page * NVS_PAGE_SIZE + NVS_BITMAP_OFFSET + start, bitmap + start, end - start);
+}
+
+static esp_err_t set_page_state(int page, uint32_t state)
+{
+    static esp_err_t _err;
+
+    if (ESP_OK != (_err = esp_partition_write(nvs_partition, page * NVS_PAGE_SIZE, &state, sizeof(state))))
+    {
+        return _err;
+    }
+    pages[page].state = state;
+    return ESP_OK;
+}
+
+static esp_err_t erase_page(int page)
+{
+    static esp_err_t _err;
+
+    if (ESP_OK != (_err = esp_partition_erase_range(nvs_partition, page * NVS_PAGE_SIZE, NVS_PAGE_SIZE)))
+    {
+        return _err;
+    }
+    memset(&pages[page], 0, sizeof(pages[page]));
+    pages[page].state = NVS_PAGE_EMPTY;
+    return ESP_OK;
+}
+
+static esp_err_t activate_page(int page)
+{
+    static esp_err_t _err;
+    nvs_page_header_t header;
+
+    memset(&header, 0xFF, sizeof(header));
+    header.state = NVS_PAGE_ACTIVE;
+    header.sequence = next_sequence;
+    header.version = NVS_PAGE_VERSION;
+    header.crc = header_crc(&header);
+
+    if (ESP_OK != (_err = esp_partition_write(nvs_partition, page * NVS_PAGE_SIZE, &header, sizeof(header))))
+    {
+        return _err;
+    }
+
+    pages[page].state = NVS_PAGE_ACTIVE;
+    pages[page].sequence = next_sequence++;
+    pages[page].next_free = 0;
+    pages[page].erased = 0;
+    active = page;
+    return ESP_OK;
+}
+
+static int find_item(uint8_t ns, const char *key)
+{
+    for (int i = 0; i < item_count; i++)
+    {
+        if (items[i].ns == ns && 0 == strncmp(items[i].key, key, NVS_KEY_SIZE))
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void remove_item(int index)
+{
+    items[index] = items[--item_count];
+}
+
+// Copies the entries of a live item to the end of the active page
+static esp_err_t copy_item(int index)
+{
+    static esp_err_t _err;
+    nvs_index_t *item = &items[index];
+    size_t len = item->span * NVS_ENTRY_SIZE;
+    int entry = pages[active].next_free;
+
+    if (ESP_OK != (_err = esp_partition_read(nvs_partition, entry_address(item->page, item->entry), entry_buffer, len)) ||
+        ESP_OK != (_err = esp_partition_write(nvs_partition, entry_address(active, entry), entry_buffer, len)) ||
+        ESP_OK != (_err = set_entry_state(active, entry, item->span, NVS_ENTRY_WRITTEN)))
+    {
+        return _err;
+    }
+
+    pages[active].next_free += item->span;
+    item->page = active;
+    item->entry = entry;
+    return ESP_OK;
+}
+
+// Moves the live items of a freeing page to the active page and erases it
+static esp_err_t reclaim_page(int page)
+{
+    static esp_err_t _err;
+
+    for (int i = 0; i < item_count; i++)
+    {
+        if (items[i].page == page && ESP_OK != (_err = copy_item(i)))
+        {
+            return _err;
+        }
+    }
+    return erase_page(page);
+}
+
+static int empty_page(void)
+{
+    for (int page = 0; page < page_count; page++)
+    {
+        if (pages[page].state == NVS_PAGE_EMPTY)
+        {
+            return page;
+        }
+    }
+    return -1;
+}
+
+// Full page with the most erased entries, -1 if no full page has any
+static int reclaim_candidate(void)
+{
+    int candidate = -1;
+
+    for (int page = 0; page < page_count; page++)
+    {
+        if (pages[page].state == NVS_PAGE_FULL && pages[page].erased > 0 &&
+            (candidate < 0 || pages[page].erased > pages[candidate].erased))
+        {
+            candidate = page;
+        }
+    }
+    return candidate;
+}
+
+// Closes the active page and opens the next one, reclaiming a page when only the reserve is left
+static esp_err_t request_page(void)
+{
+    static esp_err_t _err;
+    int empty_count = 0;
+
+    for (int page = 0; page < page_count; page++)
+    {
+        empty_count += (pages[page].state == NVS_PAGE_EMPTY) ? 1 : 0;
+    }
+
+    if (active >= 0 && ESP_OK != (_err = set_page_state(active, NVS_PAGE_FULL)))
+    {
+        return _err;
+    }
+    if (active >= 0)
+    {
+        pages[active].next_free = NVS_ENTRY_COUNT;
+        active = -1;
+    }
+
+    if (empty_count > 1)
+    {
+        return activate_page(empty_page());
+    }
+
+    int reserve = empty_page();
+    int victim = reclaim_candidate();
+    if (reserve < 0 || victim < 0)
+    {
+        return ESP_ERR_NVS_NOT_ENOUGH_SPACE;
+    }
+
+    if (ESP_OK != (_err = set_page_state(victim, NVS_PAGE_FREEING)) ||
+        ESP_OK != (_err = activate_page(reserve)))
+    {
+        return _err;
+    }
+    return reclaim_page(victim);
+}
+
+// Room for span entries in the active page
+static esp_err_t reserve_entries(int span)
+{
+    static esp_err_t _err;
+
+    for (int attempt = 0; attempt <= page_count; attempt++)
+    {
+        if (active >= 0 && pages[active].next_free + span <= NVS_ENTRY_COUNT)
+        {
+            return ESP_OK;
+        }
+        if (ESP_OK != (_err = request_page()))
+        {
+            return _err;
+        }
+    }
+    return ESP_ERR_NVS_NOT_ENOUGH_SPACE;
+}
+
+// Marks the entries of an old copy erased, programmed after its replacement is written
+static esp_err_t erase_entries(int page, int entry, int span)
+{
+    static esp_err_t _err;
+
+    if (ESP_OK != (_err = set_entry_state(page, entry, span, NVS_ENTRY_ERASED)))
+    {
+        return _err;
+    }
+    pages[page].erased += span;
+    return ESP_OK;
+}
+
+static esp_err_t index_item(const nvs_item_t *item, int page, int entry)
+{
+    static esp_err_t _err;
+    int index = find_item(item->ns, item->key);
+
+    if (index >= 0)
+    {
+        // Older copy of the key: replaced by a set, or left behind by a power cut and found on load
+        if (ESP_OK != (_err = erase_entries(items[index].page, items[index].entry, items[index].span)))
+        {
+            return _err;
+        }
+    }
+    else if (item_count < NVS_MAX_ITEMS)
+    {
+        index = item_count++;
+    }
+    else
+    {
+        return ESP_ERR_NVS_NOT_ENOUGH_SPACE;
+    }
+
+    items[index].ns = item->ns;
+    items[index].type = item->type;
+    items[index].span = item->span;
+    items[index].page = page;
+    items[index].entry = entry;
+    memcpy(items[index].key, item->key, NVS_KEY_SIZE);
+    return ESP_OK;
+}
+
+static unsigned char valid_type(uint8_t type)
+{
+    return type == NVS_TYPE_U8 || type == NVS_TYPE_U16 || type == NVS_TYPE_U32 ||
+           type == NVS_TYPE_STR || type == NVS_TYPE_BLOB;
+}
+
+static unsigned char variable_length(uint8_t type)
+{
+    return type == NVS_TYPE_STR || type == NVS_TYPE_BLOB;
+}
+
+// Indexes the written items of a page. Entries programmed but never marked written, and items failing
+// their CRC, are marked erased
+static esp_err_t load_page(int page)
+{
+    static esp_err_t _err;
+    uint8_t bitmap[NVS_BITMAP_OFFSET];
+    nvs_item_t item;
+
+    if (ESP_OK != (_err = esp_partition_read(nvs_partition, page * NVS_PAGE_SIZE + NVS_BITMAP_OFFSET, bitmap, sizeof(bitmap))))
+    {
+        return _err;
+    }
+
+    pages[page].next_free = NVS_ENTRY_COUNT;
+    pages[page].erased = 0;
+
+    for (int entry = 0; entry < NVS_ENTRY_COUNT;)
+    {
+        uint8_t state = entry_state(bitmap, entry);
+
+        if (state == NVS_ENTRY_ERASED || (state != NVS_ENTRY_EMPTY && state != NVS_ENTRY_WRITTEN))
+        {
+            pages[page].erased++;
+            entry++;
+            continue;
+        }
+
+        if (ESP_OK != (_err = esp_partition_read(nvs_partition, entry_address(page, entry), &item, sizeof(item))))
+        {
+            return _err;
+        }
+
+        if (state == NVS_ENTRY_EMPTY)
+        {
+            if (all_erased((const uint8_t *)&item, sizeof(item)))
+            {
+                pages[page].next_free = entry;
+                break;
+            }
+            if (ESP_OK != (_err = erase_entries(page, entry, 1)))
+            {
+                return _err;
+            }
+            entry++;
+            continue;
+        }
+
+        unsigned char ok = valid_type(item.type) && item.span >= 1 && entry + item.span <= NVS_ENTRY_COUNT &&
+                           item.crc == item_crc(&item);
+        if (ok && variable_length(item.type))
+        {
+            ok = item.data.var.size <= (item.span - 1) * NVS_ENTRY_SIZE;
+            if (ok && ESP_OK != (_err = esp_partition_read(nvs_partition, entry_address(page, entry + 1), entry_buffer, item.data.var.size)))
+            {
+                return _err;
+            }
+            ok = ok && item.data.var.crc == crc32_update(0, entry_buffer, item.data.var.size);
+        }
+        if (ok && item.span > 1)
+        {
+            // Data entries marked written with their item, a cut while marking leaves the item erased
+            for (int data = entry + 1; data < entry + item.span; data++)
+            {
+                ok = ok && entry_state(bitmap, data) == NVS_ENTRY_WRITTEN;
+            }
+        }
+
+        int span = ok ? item.span : 1;
+        if (!ok)
+        {
+            if (ESP_OK != (_err = erase_entries(page, entry, span)))
+            {
+                return _err;
+            }
+        }
+        else if (ESP_OK != (_err = index_item(&item, page, entry)))
+        {
+            return _err;
+        }
+        entry += span;
+    }
+
+    // Only the active page takes more items
+    if (pages[page].state != NVS_PAGE_ACTIVE)
+    {
+        pages[page].next_free = NVS_ENTRY_COUNT;
+    }
+    return ESP_OK;
+}
+
+// Reads a page header, pages neither in use nor erased are erased again
+static esp_err_t check_page(int page)
+{
+    static esp_err_t _err;
+    nvs_page_header_t header;
+
+    if (ESP_OK != (_err = esp_partition_read(nvs_partition, page * NVS_PAGE_SIZE, &header, sizeof(header))))
+    {
+        return _err;
+    }
+
+    memset(&pages[page], 0, sizeof(pages[page]));
+
+    if (header.state == NVS_PAGE_EMPTY)
+    {
+        // A page activation cut short leaves bits programmed past the header
+        for (size_t offset = 0; offset < NVS_PAGE_SIZE; offset += NVS_CHECK_CHUNK)
+        {
+            if (ESP_OK != (_err = esp_partition_read(nvs_partition, page * NVS_PAGE_SIZE + offset, entry_buffer, NVS_CHECK_CHUNK)))
+            {
+                return _err;
+            }
+            if (!all_erased(entry_buffer, NVS_CHECK_CHUNK))
+            {
+                return erase_page(page);
+            }
+        }
+        pages[page].state = NVS_PAGE_EMPTY;
+        return ESP_OK;
+    }
+
+    if ((header.state != NVS_PAGE_ACTIVE && header.state != NVS_PAGE_FULL && header.state != NVS_PAGE_FREEING) ||
+        header.crc != header_crc(&header))
+    {
+        return erase_page(page);
+    }
+
+    pages[page].state = header.state;
+    pages[page].sequence = header.sequence;
+    return ESP_OK;
+}
+
+esp_err_t nvs_flash_init(void)
+{
+    static esp_err_t _err;
+    int order[NVS_MAX_PAGES];
+    int used = 0;
+
+    initialized = 0;
+    active = -1;
+    item_count = 0;
+    next_sequence = 0;
+    memset(handles, 0, sizeof(handles));
+
+    nvs_partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_NVS, NULL);
+    if (nvs_partition == NULL)
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    page_count = nvs_partition->size / NVS_PAGE_SIZE;
+    page_count = (page_count > NVS_MAX_PAGES) ? NVS_MAX_PAGES : page_count;
+    if (page_count < 2)
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    for (int page = 0; page < page_count; page++)
+    {
+        if (ESP_OK != (_err = check_page(page)))
+        {
+            return _err;
+        }
+        if (pages[page].state == NVS_PAGE_EMPTY)
+        {
+            continue;
+        }
+
+        // Oldest first, newer copies of a key replace older ones
+        int at = used++;
+        while (at > 0 && (int32_t)(pages[order[at - 1]].sequence - pages[page].sequence) > 0)
+        {
+            order[at] = order[at - 1];
+            at--;
+        }
+        order[at] = page;
+    }
+
+    int freeing = -1;
+    for (int i = 0; i < used; i++)
+    {
+        int page = order[i];
+        if (ESP_OK != (_err = load_page(page)))
+        {
+            return _err;
+        }
+        next_sequence = pages[page].sequence + 1;
+
+        if (pages[page].state == NVS_PAGE_ACTIVE)
+        {
+            active = page;
+        }
+        else if (pages[page].state == NVS_PAGE_FREEING)
+        {
+            freeing = page;
+        }
+    }
+
+    if (active >= 0 && freeing >= 0 && (int32_t)(pages[active].sequence - pages[freeing].sequence) < 0)
+    {
+        // Freeing page marked, reserve never activated
+        active = -1;
+    }
+    if (freeing >= 0)
+    {
+        // Reclaim cut short, the items not copied yet are moved to the reserve before the page is erased
+        int page = empty_page();
+        if (active < 0 && (page < 0 || ESP_OK != (_err = activate_page(page))))
+        {
+            return (page < 0) ? ESP_ERR_NVS_NOT_ENOUGH_SPACE : _err;
+        }
+        if (ESP_OK != (_err = reclaim_page(freeing)))
+        {
+            return _err;
+        }
+    }
+    else if (active < 0 && ESP_OK != (_err = request_page()))
+    {
+        // Fresh partition, or cut between closing a page and opening the next
+        return _err;
+    }
+
+    initialized = 1;
+    return ESP_OK;
+}
+
+static esp_err_t check_key(const char *key)
+{
+    if (key == NULL || key[0] == 0)
+    {
+        return ESP_ERR_NVS_INVALID_NAME;
+    }
+    return (strlen(key) < NVS_KEY_SIZE) ? ESP_OK : ESP_ERR_NVS_KEY_TOO_LONG;
+}
+
+static esp_err_t get_handle(nvs_handle handle, nvs_open_t **out)
+{
+    if (!initialized)
+    {
+        return ESP_ERR_NVS_NOT_INITIALIZED;
+    }
+    if (handle == 0 || handle > NVS_MAX_HANDLES || !handles[handle - 1].used)
+    {
+        return ESP_ERR_NVS_INVALID_HANDLE;
+    }
+    *out = &handles[handle - 1];
+    return ESP_OK;
+}
+
+// Reads back the item of index and, up to data_size, its data entries
+static esp_err_t read_item(int index, nvs_item_t *item, void *data, size_t data_size)
+{
+    static esp_err_t _err;
+
+    if (ESP_OK != (_err = esp_partition_read(nvs_partition, entry_address(items[index].page, items[index].entry), item, sizeof(*item))))
+    {
+        return _err;
+    }
+    if (data && data_size > 0)
+    {
+        return esp_partition_read(nvs_partition, entry_address(items[index].page, items[index].entry + 1), data, data_size);
+    }
+    return ESP_OK;
+}
+
+static esp_err_t write_item(uint8_t ns, uint8_t type, const char *key, const void *data, size_t len)
+{
+    static esp_err_t _err;
+    static nvs_item_t item;
+    static nvs_item_t stored;
+
+    memset(&item, 0xFF, sizeof(item));
+    item.ns = ns;
+    item.type = type;
+    memset(item.key, 0, sizeof(item.key));
+    strncpy(item.key, key, sizeof(item.key) - 1);
+
+    size_t data_len = 0;
+    if (variable_length(type))
+    {
+        data_len = (len + NVS_ENTRY_SIZE - 1) / NVS_ENTRY_SIZE * NVS_ENTRY_SIZE;
+        if (1 + data_len / NVS_ENTRY_SIZE > NVS_ENTRY_COUNT || len > 0xFFFF)
+        {
+            return ESP_ERR_NVS_VALUE_TOO_LONG;
+        }
+        item.span = 1 + data_len / NVS_ENTRY_SIZE;
+        item.data.var.size = len;
+        item.data.var.reserved = 0xFFFF;
+        item.data.var.crc = crc32_update(0, (const uint8_t *)data, len);
+    }
+    else
+    {
+        item.span = 1;
+        memcpy(item.data.value, data, len);
+    }
+    item.crc = item_crc(&item);
+
+    int index = find_item(ns, item.key);
+    if (index >= 0 && items[index].type == type && items[index].span == item.span)
+    {
+        // Same value, nothing written
+        if (ESP_OK != (_err = read_item(index, &stored, entry_buffer, variable_length(type) ? len : 0)))
+        {
+            return _err;
+        }
+        if (0 == memcmp(&stored, &item, sizeof(item)) &&
+            (!variable_length(type) || 0 == memcmp(entry_buffer, data, len)))
+        {
+            return ESP_OK;
+        }
+    }
+
+    // A page reclaim may move the old copy
+    if (ESP_OK != (_err = reserve_entries(item.span)))
+    {
+        return _err;
+    }
+
+    memset(entry_buffer, 0xFF, item.span * NVS_ENTRY_SIZE);
+    memcpy(entry_buffer, &item, sizeof(item));
+    if (variable_length(type))
+    {
+        memcpy(entry_buffer + NVS_ENTRY_SIZE, data, len);
+    }
+
+    int entry = pages[active].next_free;
+    if (ESP_OK != (_err = esp_partition_write(nvs_partition, entry_address(active, entry), entry_buffer, item.span * NVS_ENTRY_SIZE)) ||
+        ESP_OK != (_err = set_entry_state(active, entry, item.span, NVS_ENTRY_WRITTEN)))
+    {
+        return _err;
+    }
+    pages[active].next_free += item.span;
+
+    return index_item(&item, active, entry);
+}
+
+static esp_err_t set_value(nvs_handle handle, const char *key, uint8_t type, const void *data, size_t len)
+{
+    static esp_err_t _err;
+    nvs_open_t *open;
+
+    if (ESP_OK != (_err = get_handle(handle, &open)) ||
+        ESP_OK != (_err = check_key(key)))
+    {
+        return _err;
+    }
+    if (open->readonly)
+    {
+        return ESP_ERR_NVS_READ_ONLY;
+    }
+    return write_item(open->ns, type, key, data, len);
+}
+
+// Fixed size values
+static esp_err_t get_value(nvs_handle handle, const char *key, uint8_t type, void *out, size_t len)
+{
+    static esp_err_t _err;
+    nvs_open_t *open;
+    nvs_item_t item;
+
+    if (ESP_OK != (_err = get_handle(handle, &open)) ||
+        ESP_OK != (_err = check_key(key)))
+    {
+        return _err;
+    }
+
+    int index = find_item(open->ns, key);
+    if (index < 0 || items[index].type != type)
+    {
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+    if (ESP_OK != (_err = read_item(index, &item, NULL, 0)))
+    {
+        return _err;
+    }
+    memcpy(out, item.data.value, len);
+    return ESP_OK;
+}
+
+static esp_err_t get_variable(nvs_handle handle, const char *key, uint8_t type, void *out, size_t *length)
+{
+    static esp_err_t _err;
+    nvs_open_t *open;
+    nvs_item_t item;
+
+    if (!length)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (ESP_OK != (_err = get_handle(handle, &open)) ||
+        ESP_OK != (_err = check_key(key)))
+    {
+        return _err;
+    }
+
+    int index = find_item(open->ns, key);
+    if (index < 0 || items[index].type != type)
+    {
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+    if (ESP_OK != (_err = read_item(index, &item, NULL, 0)))
+    {
+        return _err;
+    }
+
+    // Length query
+    if (out == NULL)
+    {
+        *length = item.data.var.size;
+        return ESP_OK;
+    }
+    if (*length < item.data.var.size)
+    {
+        return ESP_ERR_NVS_INVALID_LENGTH;
+    }
+
+    if (ESP_OK != (_err = read_item(index, &item, out, item.data.var.size)))
+    {
+        return _err;
+    }
+    *length = item.data.var.size;
+    return ESP_OK;
+}
+
+esp_err_t nvs_open(const char *name, nvs_open_mode open_mode, nvs_handle *out_handle)
+{
+    static esp_err_t _err;
+    nvs_item_t item;
+    uint8_t ns = 0;
+
+    if (!initialized)
+    {
+        return ESP_ERR_NVS_NOT_INITIALIZED;
+    }
+    if (!out_handle)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (ESP_OK != (_err = check_key(name)))
+    {
+        return _err;
+    }
+
+    int index = find_item(NVS_NAMESPACE_INDEX, name);
+    if (index >= 0)
+    {
+        if (ESP_OK != (_err = read_item(index, &item, NULL, 0)))
+        {
+            return _err;
+        }
+        ns = item.data.value[0];
+    }
+    else if (open_mode == NVS_READONLY)
+    {
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+    else
+    {
+        // Next unused namespace index
+        for (int i = 0; i < item_count; i++)
+        {
+            if (items[i].ns == NVS_NAMESPACE_INDEX && ESP_OK == (_err = read_item(i, &item, NULL, 0)) &&
+                item.data.value[0] > ns)
+            {
+                ns = item.data.value[0];
+            }
+        }
+        if (ns >= NVS_NAMESPACE_MAX)
+        {
+            return ESP_ERR_NVS_NOT_ENOUGH_SPACE;
+        }
+        ns++;
+        if (ESP_OK != (_err = write_item(NVS_NAMESPACE_INDEX, NVS_TYPE_U8, name, &ns, sizeof(ns))))
+        {
+            return _err;
+        }
+    }
+
+    for (int i = 0; i < NVS_MAX_HANDLES; i++)
+    {
+        if (!handles[i].used)
+        {
+            handles[i].used = 1;
+            handles[i].readonly = (open_mode == NVS_READONLY) ? 1 : 0;
+            handles[i].ns = ns;
+            *out_handle = i + 1;
+            return ESP_OK;
+        }
+    }
+    return ESP_ERR_NO_MEM;
+}
+
+void nvs_close(nvs_handle handle)
+{
+    if (handle > 0 && handle <= NVS_MAX_HANDLES)
+    {
+        handles[handle - 1].used = 0;
+    }
+}
+
+// Items are on flash once set returns, as in the SDK
+esp_err_t nvs_commit(nvs_handle handle)
+{
+    nvs_open_t *open;
+    return get_handle(handle, &open);
+}
+
+esp_err_t nvs_erase_key(nvs_handle handle, const char *key)
+{
+    static esp_err_t _err;
+    nvs_open_t *open;
+
+    if (ESP_OK != (_err = get_handle(handle, &open)) ||
+        ESP_OK != (_err = check_key(key)))
+    {
+        return _err;
+    }
+    if (open->readonly)
+    {
+        return ESP_ERR_NVS_READ_ONLY;
+    }
+
+    int index = find_item(open->ns, key);
+    if (index < 0)
+    {
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+    if (ESP_OK != (_err = erase_entries(items[index].page, items[index].entry, items[index].span)))
+    {
+        return _err;
+    }
+    remove_item(index);
+    return ESP_OK;
+}
+
+esp_err_t nvs_get_u8(nvs_handle handle, const char *key, uint8_t *out_value)
+{
+    return get_value(handle, key, NVS_TYPE_U8, out_value, sizeof(*out_value));
+}
+
+esp_err_t nvs_get_u16(nvs_handle handle, const char *key, uint16_t *out_value)
+{
+    return get_value(handle, key, NVS_TYPE_U16, out_value, sizeof(*out_value));
+}
+
+esp_err_t nvs_get_u32(nvs_handle handle, const char *key, uint32_t *out_value)
+{
+    return get_value(handle, key, NVS_TYPE_U32, out_value, sizeof(*out_value));
+}
+
+esp_err_t nvs_get_str(nvs_handle handle, const char *key, char *out_value, size_t *length)
+{
+    return get_variable(handle, key, NVS_TYPE_STR, out_value, length);
+}
+
+esp_err_t nvs_get_blob(nvs_handle handle, const char *key, void *out_value, size_t *length)
+{
+    return get_variable(handle, key, NVS_TYPE_BLOB, out_value, length);
+}
+
+esp_err_t nvs_set_u8(nvs_handle handle, const char *key, uint8_t value)
+{
+    return set_value(handle, key, NVS_TYPE_U8, &value, sizeof(value));
+}
+
+esp_err_t nvs_set_u16(nvs_handle handle, const char *key, uint16_t value)
+{
+    return set_value(handle, key, NVS_TYPE_U16, &value, sizeof(value));
+}
+
+esp_err_t nvs_set_u32(nvs_handle handle, const char *key, uint32_t value)
+{
+    return set_value(handle, key, NVS_TYPE_U32, &value, sizeof(value));
+}
+
+// Stored with its NULL terminator
+esp_err_t nvs_set_str(nvs_handle handle, const char *key, const char *value)
+{
+    if (!value)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    return set_value(handle, key, NVS_TYPE_STR, value, strlen(value) + 1);
+}
+
+esp_err_t nvs_set_blob(nvs_handle handle, const char *key, const void *value, size_t length)
+{
+    if (!value && length)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    return set_value(handle, key, NVS_TYPE_BLOB, value, length);
+}
@@ -0,0 +1,237 @@
+/*
+ * Reconnect scheduler test.
+ *
+ * Checks reconnect_backoff_millis() bounds and jitter, then runs the scheduler on the simulated esp_timer
+ * clock: every attempt must reach esp_wifi_connect() within its backoff bounds, the attempt after
+ * RECONNECT_MAX_ATTEMPTS must be refused so the network task shuts the station down, and a reset must
+ * cancel the pending attempt and restore the budget.
+ *
+ * Usage: reconnect_test
+ * Prints one line per check, exits non zero on failures.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include "esp_timer.h"
+#include "esp_wifi.h"
+#include "esp_system.h"
+#include "reconnect.h"
+
+#define TEST_STEP_US (1000ULL)
+#define TEST_JITTER_DRAWS (1000)
+
+static int failures = 0;
+
+static void check(int ok, const char *name)
+{
+    printf("%s %s\n", ok ? "ok  " : "FAIL", name);
+    if (!ok)
+    {
+        failures++;
+    }
+}
+
+// Backoff ceiling of an attempt, before jitter
+static uint32_t backoff_ceiling(uint8_t attempt)
+{
+    uint64_t delay = (uint64_t)RECONNECT_BASE_DELAY_MILLIS << (attempt < 32 ? attempt : 32);
+    return delay < RECONNECT_MAX_DELAY_MILLIS ? (uint32_t)delay : RECONNECT_MAX_DELAY_MILLIS;
+}
+
+static int check_bounds(void)
+{
+    const uint32_t randoms[] = {0, 1, 12345, 0x7fffffffUL, 0xfffffffeUL, 0xffffffffUL};
+
+    for (int attempt = 0; attempt <= 255; attempt++)
+    {
+        uint32_t ceiling = backoff_ceiling((uint8_t)attempt);
+        for (size_t i = 0; i < sizeof(randoms) / sizeof(randoms[0]); i++)
+        {
+            uint32_t delay = reconnect_backoff_millis((uint8_t)attempt, randoms[i]);
+            if (delay < ceiling / 2 || delay > ceiling)
+            {
+                printf("     attempt %d random %u: %u ms outside [%u, %u]\n",
+                       attempt, randoms[i], delay, ceiling / 2, ceiling);
+                return 0;
+            }
+        }
+        if (reconnect_backoff_millis((uint8_t)attempt, 0) != ceiling / 2)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int check_growth(void)
+{
+    for (uint8_t attempt = 1; attempt < RECONNECT_MAX_ATTEMPTS; attempt++)
+    {
+        if (backoff_ceiling(attempt) < backoff_ceiling(attempt - 1))
+        {
+            return 0;
+        }
+    }
+    return backoff_ceiling(0) == RECONNECT_BASE_DELAY_MILLIS &&
+           backoff_ceiling(RECONNECT_MAX_ATTEMPTS - 1) == RECONNECT_MAX_DELAY_MILLIS;
+}
+
+// Draws spread over the jitter half, so lamps dropped together do not retry in lockstep
+static int check_jitter(void)
+{
+    for (uint8_t attempt = 0; attempt < RECONNECT_MAX_ATTEMPTS; attempt++)
+    {
+        uint32_t ceiling = backoff_ceiling(attempt);
+        uint32_t low = ceiling, high = 0;
+
+        for (int i = 0; i < TEST_JITTER_DRAWS; i++)
+        {
+            uint32_t delay = reconnect_backoff_millis(attempt, esp_random());
+            low = delay < low ? delay : low;
+            high = delay > high ? delay : high;
+        }
+
+        if (low > ceiling / 2 + ceiling / 16 || high < ceiling - ceiling / 16)
+        {
+            printf("     attempt %u: draws within [%u, %u] of [%u, %u]\n",
+                   attempt, low, high, ceiling / 2, ceiling);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Advances the simulated clock until the pending attempt connects, returns the elapsed millis or -1
+static int64_t time_to_connect(uint64_t limit_millis)
+{
+    uint32_t connects = host_wifi_connect_count();
+    int64_t start = esp_timer_get_time();
+
+    while ((uint64_t)(esp_timer_get_time() - start) < limit_millis * 1000ULL)
+    {
+        host_esp_timer_advance(TEST_STEP_US);
+        if (host_wifi_connect_count() != connects)
+        {
+            return host_wifi_connect_count() - connects == 1 ? (esp_timer_get_time() - start) / 1000 : -1;
+        }
+    }
+    return -1;
+}
+
+static int check_schedule(void)
+{
+    if (ESP_OK != init_reconnect_scheduler())
+    {
+        return 0;
+    }
+
+    for (uint8_t attempt = 0; attempt < RECONNECT_MAX_ATTEMPTS; attempt++)
+    {
+        uint32_t ceiling = backoff_ceiling(attempt);
+        if (ESP_OK != reconnect_schedule())
+        {
+            printf("     attempt %u refused\n", attempt);
+            return 0;
+        }
+
+        int64_t elapsed = time_to_connect(ceiling + 1);
+        if (elapsed < ceiling / 2 || elapsed > ceiling)
+        {
+            printf("     attempt %u: connected after %lld ms, expected [%u, %u]\n",
+                   attempt, (long long)elapsed, ceiling / 2, ceiling);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Budget spent: the next attempt is refused and nothing connects any more
+static int check_max_attempts(void)
+{
+    uint32_t connects = host_wifi_connect_count();
+
+    if (ESP_ERR_TIMEOUT != reconnect_schedule() || ESP_ERR_TIMEOUT != reconnect_schedule())
+    {
+        return 0;
+    }
+    host_esp_timer_advance(2 * RECONNECT_MAX_DELAY_MILLIS * 1000ULL);
+    return host_wifi_connect_count() == connects;
+}
+
+static int check_reset(void)
+{
+    uint32_t connects = host_wifi_connect_count();
+
+    reconnect_reset();
+    if (ESP_OK != reconnect_schedule())
+    {
+        return 0;
+    }
+
+    // Pending attempt cancelled
+    reconnect_reset();
+    host_esp_timer_advance(2 * RECONNECT_MAX_DELAY_MILLIS * 1000ULL);
+    if (host_wifi_connect_count() != connects)
+    {
+        return 0;
+    }
+
+    // Full budget, starting from the base delay again
+    for (uint8_t attempt = 0; attempt < RECONNECT_MAX_ATTEMPTS; attempt++)
+    {
+        if (ESP_OK != reconnect_schedule())
+        {
+            return 0;
+        }
+        int64_t elapsed = time_to_connect(backoff_ceiling(attempt) + 1);
+        if (elapsed < backoff_ceiling(attempt) / 2 || elapsed > backoff_ceiling(attempt))
+        {
+            return 0;
+        }
+    }
+    return ESP_ERR_TIMEOUT == reconnect_schedule();
+}
+
+// Scheduling again while an attempt is pending replaces it, one connect per schedule at most
+static int check_reschedule(void)
+{
+    uint32_t connects = host_wifi_connect_count();
+
+    reconnect_reset();
+    if (ESP_OK != reconnect_schedule() || ESP_OK != reconnect_schedule())
+    {
+        return 0;
+    }
+    host_esp_timer_advance(2 * RECONNECT_MAX_DELAY_MILLIS * 1000ULL);
+    return host_wifi_connect_count() == connects + 1;
+}
+
+static int check_deinit(void)
+{
+    uint32_t connects = host_wifi_connect_count();
+
+    reconnect_reset();
+    if (ESP_OK != reconnect_schedule())
+    {
+        return 0;
+    }
+    deinit_reconnect_scheduler();
+    host_esp_timer_advance(2 * RECONNECT_MAX_DELAY_MILLIS * 1000ULL);
+
+    return host_wifi_connect_count() == connects &&
+           ESP_ERR_INVALID_STATE == reconnect_schedule();
+}
+
+int main(void)
+{
+    check(check_bounds(), "backoff within [ceiling / 2, ceiling] for every attempt");
+    check(check_growth(), "ceiling grows from the base delay up to the max delay");
+    check(check_jitter(), "jitter spreads over the whole upper half");
+    check(check_schedule(), "attempts connect within their backoff on the simulated clock");
+    check(check_max_attempts(), "attempts past the budget are refused and never connect");
+    check(check_reset(), "reset cancels the pending attempt and restores the budget");
+    check(check_reschedule(), "rescheduling replaces the pending attempt");
+    check(check_deinit(), "deinit cancels the pending attempt");
+
+    printf("%d failures\n", failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,663 @@
+/*
+ * Storage latency and wear benchmark over the file-backed flash emulator.
+ *
+ * Storage keeps its state in file scope, so every simulated boot runs in a fresh process against
+ * the same flash image: records, torn writes and erase counters carry over from one boot to the next.
+ * Latency is the flash busy time of the emulator cost model, not host CPU time.
+ *
+ * Built once per config backend, storage_bench for the config slots and storage_bench_nvs for NVS over the
+ * NVS emulator, the backend column tells their rows apart.
+ *
+ * Usage: storage_bench [-p partition csv] [-f flash image] [-n runs]
+ * Prints one CSV row per scenario: backend,scenario,runs,failures,flash_ms_avg,flash_ms_max,read_kb,program_kb,erases,spiffs_mounts,wear_min,wear_max
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "esp_timer.h"
+#include "flash_emu.h"
+#include "storage.h"
+#include "config_record.h"
+#include "storage_backend.h"
+#if STORAGE_BACKEND == STORAGE_BACKEND_NVS
+#include "nvs_flash.h"
+#endif
+#include "event_log.h"
+#include "blob_store.h"
+#include "packets.h"
+
+#define BENCH_DEFAULT_IMAGE "/tmp/vetta_storage_bench.img"
+#define BENCH_LAMP_STATE_CHANGES (100)
+#define BENCH_LAMP_STATE_INTERVAL_MILLIS (2000ULL)
+#define BENCH_EVENT_LOG_ENTRIES (1000)
+#define BENCH_EVENT_LOG_BATCH (16)
+// Device certificate sized blob, streamed in listener sized chunks
+#define BENCH_BLOB_LENGTH (1740)
+#define BENCH_BLOB_CHUNK (128)
+// Power cut points swept over one append, and one erase and program of a config slot
+#define BENCH_POWER_CUT_STEP (64)
+// Config log entry of a whole record, as config_record.c lays it out
+#define BENCH_CONFIG_ENTRY_SIZE ((16 + sizeof(config_record_t) + 3) & ~3UL)
+
+// Bytes programmed by a provisioning save to NVS, four keys and their bitmap words
+#define BENCH_NVS_SAVE_SPAN (512)
+
+// Partition the config record lives in, its wear is reported for the config scenarios
+#if STORAGE_BACKEND == STORAGE_BACKEND_NVS
+#define BENCH_CONFIG_PARTITION "nvs"
+#else
+#define BENCH_CONFIG_PARTITION CONFIG_PARTITION_LABEL
+#endif
+
+typedef struct bench_run_t
+{
+    int ok;
+    uint32_t value;
+    flash_emu_stats_t stats;
+} bench_run_t;
+
+typedef struct bench_row_t
+{
+    const char *name;
+    const char *partition;
+    size_t runs;
+    size_t failures;
+    uint64_t busy_sum_ns;
+    uint64_t busy_max_ns;
+    uint64_t read_bytes;
+    uint64_t program_bytes;
+    uint64_t erases;
+    uint64_t mounts;
+} bench_row_t;
+
+typedef int (*bench_step_t)(int arg, bench_run_t *run);
+
+static const char *image_path = BENCH_DEFAULT_IMAGE;
+static const char *partition_csv = NULL;
+
+// Simulated boot: maps the image in a new process and runs step there
+static int run_boot(bench_step_t step, int arg, bench_run_t *out)
+{
+    int fds[2];
+    if (0 != pipe(fds))
+    {
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+
+    if (pid == 0)
+    {
+        bench_run_t run;
+        memset(&run, 0, sizeof(run));
+
+        // Keep the firmware logs out of the CSV output
+        int devnull = open("/dev/null", O_WRONLY);
+        if (devnull >= 0)
+        {
+            dup2(devnull, STDOUT_FILENO);
+            close(devnull);
+        }
+
+#if STORAGE_BACKEND == STORAGE_BACKEND_NVS
+        // Mounted by app_main before init_storage()
+        if (ESP_OK == flash_emu_open(image_path, partition_csv) && ESP_OK == nvs_flash_init())
+#else
+        if (ESP_OK == flash_emu_open(image_path, partition_csv))
+#endif
+        {
+            run.ok = (0 == step(arg, &run));
+            flash_emu_get_stats(&run.stats);
+            flash_emu_close();
+        }
+
+        ssize_t written = write(fds[1], &run, sizeof(run));
+        _exit(written == sizeof(run) ? 0 : 1);
+    }
+
+    close(fds[1]);
+    ssize_t got = read(fds[0], out, sizeof(*out));
+    close(fds[0]);
+
+    int status = 0;
+    waitpid(pid, &status, 0);
+    return (got == sizeof(*out) && WIFEXITED(status) && WEXITSTATUS(status) == 0) ? 0 : -1;
+}
+
+static void add_run(bench_row_t *row, const bench_run_t *run, int ok)
+{
+    row->runs++;
+    if (!ok)
+    {
+        row->failures++;
+    }
+    row->busy_sum_ns += run->stats.busy_ns;
+    if (run->stats.busy_ns > row->busy_max_ns)
+    {
+        row->busy_max_ns = run->stats.busy_ns;
+    }
+    row->read_bytes += run->stats.read_bytes;
+    row->program_bytes += run->stats.program_bytes;
+    row->erases += run->stats.sector_erases;
+    row->mounts += run->stats.spiffs_mounts;
+}
+
+static void print_row(const bench_row_t *row)
+{
+    uint32_t wear_min = 0, wear_max = 0;
+
+    // Wear is read from the image left behind by the last run
+    if (ESP_OK == flash_emu_open(image_path, partition_csv))
+    {
+        flash_emu_partition_wear(row->partition, &wear_min, &wear_max);
+        flash_emu_close();
+    }
+
+    printf("%s,%s,%zu,%zu,%.3f,%.3f,%.1f,%.1f,%llu,%llu,%u,%u\n",
+           storage_get_backend()->name, row->name, row->runs, row->failures,
+           row->runs ? row->busy_sum_ns / 1e6 / row->runs : 0.0,
+           row->busy_max_ns / 1e6,
+           row->read_bytes / 1024.0,
+           row->program_bytes / 1024.0,
+           (unsigned long long)row->erases,
+           (unsigned long long)row->mounts,
+           wear_min, wear_max);
+    fflush(stdout);
+}
+
+static void credentials_for(int n, char *ssid, size_t ssid_size, char *pwd, size_t pwd_size)
+{
+    snprintf(ssid, ssid_size, "bench-ap-%d", n);
+    snprintf(pwd, pwd_size, "bench-password-%08d", n);
+}
+
+// Pin code stored with credentials_for(n), tells a mixed record apart
+static uint32_t pin_for(int n)
+{
+    return 100000U + (uint32_t)n;
+}
+
+// Current credentials index, -1 if none, -2 if ssid and pin do not belong together
+static int stored_credentials(void)
+{
+    static spiffs_string_t ssid;
+    uint32_t pin = 0;
+    int n = -1;
+
+    if (ESP_OK != get_user_ap_ssid_string(&ssid) || ESP_OK != get_pin_code(&pin))
+    {
+        return -1;
+    }
+
+    if (1 != sscanf((const char *)ssid.string_array, "bench-ap-%d", &n) || pin != pin_for(n))
+    {
+        return -2;
+    }
+    return n;
+}
+
+static esp_err_t save_credentials(int n)
+{
+    char ssid[MAX_SSID_LENGTH + 1];
+    char pwd[MAX_PASSWORD_LENGTH + 1];
+
+    credentials_for(n, ssid, sizeof(ssid), pwd, sizeof(pwd));
+    return save_user_ap_credentials((const uint8_t *)ssid, strlen(ssid),
+                                    (const uint8_t *)pwd, strlen(pwd),
+                                    pin_for(n));
+}
+
+// Factory fresh lamp: config load, legacy file check, lamp seed generated and written
+static int step_first_boot(int arg, bench_run_t *run)
+{
+    (void)arg;
+    return (ESP_OK == init_storage() &&
+            ESP_OK == get_lamp_seed(&run->value) &&
+            ESP_OK == storage_flush())
+               ? 0
+               : -1;
+}
+
+// Config load of every later boot, served from RAM afterwards
+static int step_boot(int arg, bench_run_t *run)
+{
+    (void)arg;
+    uint8_t state;
+
+    if (ESP_OK != init_storage() || ESP_OK != get_lamp_seed(&run->value))
+    {
+        return -1;
+    }
+    get_lamp_state(&state);
+    return (stored_credentials() >= -1) ? 0 : -1;
+}
+
+// Provisioning save, from the credentials handed over to the record on flash
+static int step_provision(int arg, bench_run_t *run)
+{
+    (void)run;
+
+    if (ESP_OK != init_storage())
+    {
+        return -1;
+    }
+
+    flash_emu_reset_stats();
+    return (ESP_OK == save_credentials(arg) && ESP_OK == storage_flush()) ? 0 : -1;
+}
+
+// Continuous touching, one state change every BENCH_LAMP_STATE_INTERVAL_MILLIS, never quiet long enough to flush
+static int step_lamp_state(int arg, bench_run_t *run)
+{
+    (void)arg;
+    (void)run;
+
+    if (ESP_OK != init_storage())
+    {
+        return -1;
+    }
+
+    flash_emu_reset_stats();
+    for (int i = 0; i < BENCH_LAMP_STATE_CHANGES; i++)
+    {
+        if (ESP_OK != save_lamp_state((uint8_t)(i % 4)))
+        {
+            return -1;
+        }
+        host_esp_timer_advance(BENCH_LAMP_STATE_INTERVAL_MILLIS * 1000ULL);
+        // storage_task's part, no tasks run on the host
+        storage_flush_due(0);
+    }
+    return (ESP_OK == storage_flush()) ? 0 : -1;
+}
+
+// Provisioning save with the power cut arg bytes into the flash writes
+static int step_torn_provision(int arg, bench_run_t *run)
+{
+    (void)run;
+
+    if (ESP_OK != init_storage())
+    {
+        return -1;
+    }
+
+    flash_emu_power_cut_after(arg);
+    save_credentials(1);
+    storage_flush();
+    return 0;
+}
+
+#if STORAGE_BACKEND != STORAGE_BACKEND_NVS
+// Fills the current config slot up to its last record, credentials 0 stored last, the next save compacts
+static int step_fill_slot(int arg, bench_run_t *run)
+{
+    (void)arg;
+    (void)run;
+    flash_emu_stats_t stats;
+    int n = 2;
+
+    if (ESP_OK != init_storage())
+    {
+        return -1;
+    }
+
+    // Saves until a compaction leaves its record alone at the start of a slot
+    do
+    {
+        flash_emu_reset_stats();
+        if (ESP_OK != save_credentials(n++) || ESP_OK != storage_flush())
+        {
+            return -1;
+        }
+        flash_emu_get_stats(&stats);
+    } while (stats.sector_erases == 0 && n < 2 + 2 * (int)(CONFIG_SLOT_SIZE / BENCH_CONFIG_ENTRY_SIZE));
+
+    int left = (int)(CONFIG_SLOT_SIZE / BENCH_CONFIG_ENTRY_SIZE) - 1;
+    for (int i = 1; i <= left; i++)
+    {
+        if (ESP_OK != save_credentials(i == left ? 0 : n++) || ESP_OK != storage_flush())
+        {
+            return -1;
+        }
+    }
+    return (stats.sector_erases > 0) ? 0 : -1;
+}
+#endif
+
+// Boot after a power cut, the record must hold either the old or the new credentials
+static int step_recover(int arg, bench_run_t *run)
+{
+    (void)arg;
+
+    if (ESP_OK != init_storage())
+    {
+        return -1;
+    }
+
+    int n = stored_credentials();
+    run->value = (uint32_t)n;
+    return (n == 0 || n == 1) ? 0 : -1;
+}
+
+static int step_event_log(int arg, bench_run_t *run)
+{
+    (void)arg;
+    (void)run;
+
+    if (!RegisterNetworkPackets() || ESP_OK != init_event_log())
+    {
+        return -1;
+    }
+
+    flash_emu_reset_stats();
+    for (int i = 0; i < BENCH_EVENT_LOG_ENTRIES; i++)
+    {
+        event_log_append(EVENT_LOG_TOUCH, (uint32_t)(i % 4));
+        if ((i + 1) % BENCH_EVENT_LOG_BATCH == 0 && ESP_OK != event_log_flush())
+        {
+            return -1;
+        }
+        host_esp_timer_advance(1000000ULL);
+    }
+    return (ESP_OK == event_log_flush()) ? 0 : -1;
+}
+
+static uint8_t blob_byte(int run, size_t i)
+{
+    return (uint8_t)(run * 31 + i * 7);
+}
+
+// Certificate blob written and read back in chunks
+static int step_cert_blob(int arg, bench_run_t *run)
+{
+    (void)run;
+    blob_writer_t writer;
+    blob_reader_t reader;
+    uint8_t chunk[BENCH_BLOB_CHUNK];
+    size_t len = 0;
+
+    if (ESP_OK != blob_write_begin(BLOB_DEVICE_CERT, BENCH_BLOB_LENGTH, &writer))
+    {
+        return -1;
+    }
+
+    for (size_t offset = 0; offset < BENCH_BLOB_LENGTH; offset += len)
+    {
+        len = BENCH_BLOB_LENGTH - offset;
+        if (len > sizeof(chunk))
+        {
+            len = sizeof(chunk);
+        }
+        for (size_t i = 0; i < len; i++)
+        {
+            chunk[i] = blob_byte(arg, offset + i);
+        }
+        if (ESP_OK != blob_write(&writer, chunk, len))
+        {
+            return -1;
+        }
+    }
+
+    if (ESP_OK != blob_write_end(&writer) ||
+        ESP_OK != blob_open(BLOB_DEVICE_CERT, &reader) ||
+        reader.length != BENCH_BLOB_LENGTH)
+    {
+        return -1;
+    }
+
+    size_t offset = 0;
+    do
+    {
+        if (ESP_OK != blob_read(&reader, chunk, sizeof(chunk), &len))
+        {
+            return -1;
+        }
+        for (size_t i = 0; i < len; i++)
+        {
+            if (chunk[i] != blob_byte(arg, offset + i))
+            {
+                return -1;
+            }
+        }
+        offset += len;
+    } while (len > 0);
+
+    return (offset == BENCH_BLOB_LENGTH) ? 0 : -1;
+}
+
+static void *load_image(size_t *size)
+{
+    struct stat st;
+    FILE *fp = fopen(image_path, "rb");
+    if (!fp || 0 != fstat(fileno(fp), &st))
+    {
+        if (fp)
+        {
+            fclose(fp);
+        }
+        return NULL;
+    }
+
+    void *data = malloc(st.st_size);
+    if (data && 1 != fread(data, st.st_size, 1, fp))
+    {
+        free(data);
+        data = NULL;
+    }
+    fclose(fp);
+    *size = st.st_size;
+    return data;
+}
+
+static int store_image(const void *data, size_t size)
+{
+    FILE *fp = fopen(image_path, "wb");
+    if (!fp)
+    {
+        return -1;
+    }
+    int ret = (1 == fwrite(data, size, 1, fp)) ? 0 : -1;
+    fclose(fp);
+    return ret;
+}
+
+static int run_scenario(bench_row_t *row, bench_step_t step, int runs, int fresh_image)
+{
+    bench_run_t run;
+
+    for (int i = 0; i < runs; i++)
+    {
+        if (fresh_image)
+        {
+            unlink(image_path);
+        }
+        if (0 != run_boot(step, i, &run))
+        {
+            return -1;
+        }
+        add_run(row, &run, run.ok);
+    }
+    print_row(row);
+    return 0;
+}
+
+// Power cut at every step of the next provisioning save of the image, then a boot after each
+static int sweep_power_cut(bench_row_t *row, bench_row_t *boot_row, int64_t span)
+{
+    bench_run_t run;
+    size_t image_size = 0;
+
+    void *image = load_image(&image_size);
+    if (!image)
+    {
+        return -1;
+    }
+
+    // A little past the save for the cut that never lands
+    span += 2 * BENCH_POWER_CUT_STEP;
+    for (int64_t cut = 0; cut <= span; cut += BENCH_POWER_CUT_STEP)
+    {
+        if (0 != store_image(image, image_size) ||
+            0 != run_boot(step_torn_provision, (int)cut, &run))
+        {
+            free(image);
+            return -1;
+        }
+        add_run(row, &run, 1);
+
+        if (0 != run_boot(step_recover, 0, &run))
+        {
+            free(image);
+            return -1;
+        }
+        add_run(boot_row, &run, run.ok);
+    }
+
+    free(image);
+    return 0;
+}
+
+#if STORAGE_BACKEND == STORAGE_BACKEND_NVS
+// Sweeps the power cut over a provisioning save, its keys written and the old copies marked erased
+static int run_power_loss(bench_row_t *row, bench_row_t *boot_row)
+{
+    bench_run_t run;
+
+    // Known state: seed and credentials 0 stored
+    unlink(image_path);
+    if (0 != run_boot(step_first_boot, 0, &run) || !run.ok ||
+        0 != run_boot(step_provision, 0, &run) || !run.ok ||
+        0 != sweep_power_cut(row, boot_row, BENCH_NVS_SAVE_SPAN))
+    {
+        return -1;
+    }
+
+    print_row(row);
+    print_row(boot_row);
+    return 0;
+}
+#else
+// Sweeps the power cut over a provisioning save appended to the slot, then over one compacting a full slot
+static int run_power_loss(bench_row_t *row, bench_row_t *boot_row)
+{
+    bench_run_t run;
+
+    // Known state: seed and credentials 0 stored
+    unlink(image_path);
+    if (0 != run_boot(step_first_boot, 0, &run) || !run.ok ||
+        0 != run_boot(step_provision, 0, &run) || !run.ok ||
+        0 != sweep_power_cut(row, boot_row, BENCH_CONFIG_ENTRY_SIZE))
+    {
+        return -1;
+    }
+
+    if (0 != run_boot(step_fill_slot, 0, &run) || !run.ok ||
+        0 != sweep_power_cut(row, boot_row, CONFIG_SLOT_SIZE + BENCH_CONFIG_ENTRY_SIZE))
+    {
+        return -1;
+    }
+
+    print_row(row);
+    print_row(boot_row);
+    return 0;
+}
+#endif
+
+int main(int argc, char **argv)
+{
+    int runs = 20;
+    int keep_image = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "p:f:n:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'p':
+            partition_csv = optarg;
+            break;
+        case 'f':
+            image_path = optarg;
+            keep_image = 1;
+            break;
+        case 'n':
+            runs = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-p partition csv] [-f flash image] [-n runs]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (runs <= 0)
+    {
+        fprintf(stderr, "runs must be positive\n");
+        return 1;
+    }
+
+    // Run from the repository root or from host/
+    if (partition_csv == NULL)
+    {
+        partition_csv = (0 == access("partition-table.csv", R_OK)) ? "partition-table.csv" : "../partition-table.csv";
+    }
+
+    bench_row_t first_boot = {.name = "first_boot", .partition = BENCH_CONFIG_PARTITION};
+    bench_row_t boot = {.name = "boot", .partition = BENCH_CONFIG_PARTITION};
+    bench_row_t provision = {.name = "provision", .partition = BENCH_CONFIG_PARTITION};
+    bench_row_t lamp_state = {.name = "lamp_state", .partition = BENCH_CONFIG_PARTITION};
+    bench_row_t torn = {.name = "power_cut_provision", .partition = BENCH_CONFIG_PARTITION};
+    bench_row_t recover = {.name = "power_cut_boot", .partition = BENCH_CONFIG_PARTITION};
+    bench_row_t event_log = {.name = "event_log", .partition = EVENT_LOG_PARTITION_LABEL};
+    bench_row_t cert_blob = {.name = "cert_blob", .partition = BLOB_PARTITION_LABEL};
+
+    printf("backend,scenario,runs,failures,flash_ms_avg,flash_ms_max,read_kb,program_kb,erases,spiffs_mounts,wear_min,wear_max\n");
+
+    int ret = run_scenario(&first_boot, step_first_boot, runs, 1);
+    if (ret == 0)
+    {
+        // Later boots and saves share one image, wear adds up
+        ret = run_scenario(&boot, step_boot, runs, 0);
+    }
+    if (ret == 0)
+    {
+        ret = run_scenario(&provision, step_provision, runs, 0);
+    }
+    if (ret == 0)
+    {
+        ret = run_scenario(&lamp_state, step_lamp_state, runs, 0);
+    }
+    if (ret == 0)
+    {
+        ret = run_power_loss(&torn, &recover);
+    }
+    if (ret == 0)
+    {
+        ret = run_scenario(&event_log, step_event_log, runs, 0);
+    }
+    if (ret == 0)
+    {
+        ret = run_scenario(&cert_blob, step_cert_blob, runs, 0);
+    }
+
+    if (!keep_image)
+    {
+        unlink(image_path);
+    }
+
+    if (ret != 0)
+    {
+        fprintf(stderr, "benchmark aborted, flash emulator or simulated boot failed\n");
+        return 1;
+    }
+    return 0;
+}
@@ -21,6 +21,28 @@ extern "C"
 
 #define NETWORK_TASK_STACK_DEPTH 8192
 
+#define EVENT_LOG_TASK_STACK_DEPTH 2048
+
+#define STORAGE_TASK_STACK_DEPTH 2048
+
+// Network state machine events waiting for the network task, posted without blocking and dropped when full
+#define NETWORK_EVENT_QUEUE_LENGTH 16
+
+// Touch state changes falling within this window are pushed to the broker as a single state ping
+#define LAMP_STATE_PUSH_COALESCE_MILLIS 300
+
+// Provisioning stays open this long after a successful ack, answering retransmissions whose ack was lost
+#define PROVISION_LINGER_MILLIS 3000
+
+// Provisioning listen timeout while only the softAP is up
+#define PROVISION_LISTEN_MILLIS 500
+
+// Reprovisioning softAP closes after this long without a provisioning exchange
+#define REPROVISION_AP_TIMEOUT_MILLIS 300000
+
+// Without a broker session for this long the station drops from standby to idle power save
+#define WIFI_POWER_IDLE_AFTER_MILLIS 60000
+
 // Task notifications
 #ifndef configTASK_NOTIFICATION_ARRAY_ENTRIES
 #define configTASK_NOTIFICATION_ARRAY_ENTRIES 1
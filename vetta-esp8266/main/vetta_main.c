@@ -4,6 +4,7 @@
 #include "freertos/FreeRTOSConfig.h"
 #include "freertos/task.h"
 #include "freertos/event_groups.h"
+#include "freertos/queue.h"
 #include "nvs_flash.h"
 #include "esp_system.h"
 #include "esp_wifi.h"
@@ -21,6 +22,12 @@
 #include "wifi_provision.h"
 #include "discovery.h"
 #include "listener.h"
+#include "advertise.h"
+#include "group.h"
+#include "reconnect.h"
+#include "netstate.h"
+#include "event_log.h"
+#include "ota_update.h"
 
 // Sensors Events
 
@@ -51,33 +58,37 @@
 #define BUTTON_INTR_EVENT_WAIT (0x01)
 #define BUTTON_INTR_EVENT (1UL << 0UL)
 
-// Network Events
-#define WIFI_SHUTDOWN_EVENT_WAIT (0x01)
-#define WIFI_SHUTDOWN_EVENT (1UL << 0UL)
-
-#define WIFI_START_AP_EVENT_WAIT (0x02)
-#define WIFI_START_AP_EVENT (1UL << 1UL)
-
-#define WIFI_AP_STA_CONNECTED_EVENT_WAIT (0x04)
-#define WIFI_AP_STA_CONNECTED_EVENT (1UL << 2UL)
-
-#define WIFI_AP_STA_DISCONNECTED_EVENT_WAIT (0x08)
-#define WIFI_AP_STA_DISCONNECTED_EVENT (1UL << 3UL)
-
-#define WIFI_START_STA_EVENT_WAIT (0x10)
-#define WIFI_START_STA_EVENT (1UL << 4UL)
+// Network task notifications, state machine events go through networkEventQueue
+#define LAMP_STATE_PUSH_EVENT_WAIT (0x01)
+#define LAMP_STATE_PUSH_EVENT (1UL << 0UL)
 
 /* FreeRTOS event group to signal network events*/
+static EventGroupHandle_t networkStateGroup = NULL;
+// Bounded queue of network state machine events, drained by the network task only
+static QueueHandle_t networkEventQueue = NULL;
+
+// Critical network events that found networkEventQueue full, coalesced and replayed by the network task
+#define NET_PENDING_STA_DISCONNECTED (1UL << 0UL)
+#define NET_PENDING_STA_GOT_IP (1UL << 1UL)
+#define NET_PENDING_SHUTDOWN (1UL << 2UL)
+#define NET_PENDING_ALL (NET_PENDING_STA_DISCONNECTED | NET_PENDING_STA_GOT_IP | NET_PENDING_SHUTDOWN)
+static EventGroupHandle_t networkPendingGroup = NULL;
+// Last coalesced link event, NET_EVENT_STA_DISCONNECTED or NET_EVENT_STA_GOT_IP, replayed after the other
+static volatile net_event_t pending_link_event = NET_EVENT_STA_DISCONNECTED;
 
 static const UBaseType_t LED_SENSOR_TASK_PRIORITY = 7;
 static const UBaseType_t CAPACITIVE_SENSOR_TASK_PRIORITY = 7;
 static const UBaseType_t BUTTON_TASK_PRIORITY = 6;
 static const UBaseType_t NETWORK_TASK_PRIORITY = 5;
+static const UBaseType_t EVENT_LOG_TASK_PRIORITY = 2;
+static const UBaseType_t STORAGE_TASK_PRIORITY = 2;
 
 static TaskHandle_t ledUpdaterTask = NULL;
 static TaskHandle_t capSensorTask = NULL;
 static TaskHandle_t buttonTask = NULL;
 static TaskHandle_t networkTask = NULL;
+static TaskHandle_t eventLogTask = NULL;
+static TaskHandle_t storageTask = NULL;
 
 static SemaphoreHandle_t ledStopSem = NULL;
 static SemaphoreHandle_t ledAnimationSem = NULL;
@@ -105,7 +116,18 @@ static void led_updater_task(void *params)
             if (ledNotificationValue & LED_NEXT_EVENT_WAIT || ledNotificationValue & LED_NEXT_NETWORK_EVENT)
             {
                 // Led update from sensor
-                led_set_next();
+                if (ESP_OK == led_set_next())
+                {
+                    save_lamp_state(led_get_state());
+
+                    if (ledNotificationValue & LED_NEXT_EVENT_WAIT &&
+                        networkTask != NULL &&
+                        xEventGroupGetBits(networkStateGroup) & NET_STATE_BIT_ONLINE)
+                    {
+                        // Push touch state changes to the broker
+                        xTaskNotify(networkTask, LAMP_STATE_PUSH_EVENT, eSetBits);
+                    }
+                }
             }
             else if (ledNotificationValue & LED_BLINK_START_EVENT_WAIT)
             {
@@ -125,15 +147,19 @@ static void led_updater_task(void *params)
             }else if (ledNotificationValue & LED_OFF_EVENT_WAIT)
             {
                 led_off();
+                save_lamp_state(led_get_state());
             }else if (ledNotificationValue & LED_LOW_EVENT_WAIT)
             {
                 led_low();
+                save_lamp_state(led_get_state());
             }else if (ledNotificationValue & LED_MEDIUM_EVENT_WAIT)
             {
                 led_medium();
+                save_lamp_state(led_get_state());
             }else if (ledNotificationValue & LED_HIGH_EVENT_WAIT)
             {
                 led_high();
+                save_lamp_state(led_get_state());
             }
         }
     }
@@ -206,6 +232,7 @@ static void capacitive_sensor_task(void *params)
                 time_offset = 0;
 
                 printf("\nCAP SENSOR NOTIFY avg: %u | idle: %u\n", total / READING_SAMPLES_POOL_SIZE, idle_read);
+                event_log_append(EVENT_LOG_TOUCH, led_get_state());
                 // send led update event from sensor task
                 xTaskNotify(ledUpdaterTask, LED_NEXT_EVENT, eSetBits);
             }
@@ -234,17 +261,45 @@ static void button_isr_handler(void *args)
     portEND_SWITCHING_ISR(xHigherPriorityTaskWoken);
 }
 
-static unsigned char is_provisioning = 0;
-static unsigned char credentials_ok = 0;
+// Network state, owned by the network task and published to other tasks through networkStateGroup
+static net_state_t net_state = NET_STATE_OFF;
+// Discovery, listener and the optional servers are bound to the station IP
+static unsigned char sta_servers_up = 0;
+// Provisioning socket open for the phone on the softAP
+static unsigned char provision_open = 0;
+static unsigned char provision_lingering = 0;
+static TickType_t provision_linger_start = 0;
 static unsigned char ap_credentials_available = 0;
 static spiffs_string_t upwd;
 static spiffs_string_t ussid;
+
+// Credentials received by provisioning
+static spiffs_string_t new_upwd;
+static spiffs_string_t new_ussid;
+static uint32_t new_pin_code = 0;
+
+// Provisioning softAP running next to the connected station
+static TickType_t reprovision_start = 0;
+
+// Station switched to reprovisioned credentials, persisted once it gets an IP, reverted if it never does
+static unsigned char sta_switch_pending = 0;
+static spiffs_string_t prev_upwd;
+static spiffs_string_t prev_ussid;
+static uint32_t prev_pin_code = 0;
+
+// Home AP and lease of the last connection, used for a directed connect with static IP
+static wifi_link_cache_t link_cache;
+static unsigned char link_cache_available = 0;
+// Station was started from the cached link and has not got an IP yet
+static unsigned char link_fast_path = 0;
+static group_server_t group_server;
+
 static void reset_persistent_storage(void)
 {
     // Reset SPIFFS persistent storage
-    spiffs_data_reset();
+    storage_data_reset();
     ap_credentials_available = 0;
-    credentials_ok = 0;
+    group_restore(&group_server, GROUP_ID_ALL, NULL, 0);
 
     // Clear references
     if (ussid.string_array != NULL)
@@ -258,6 +313,82 @@ static void reset_persistent_storage(void)
         memset(upwd.string_array, 0, sizeof(uint8_t) * MAX_SPIFFS_STRING_LENGTH);
     }
     upwd.string_len = 0;
+
+    link_cache_available = 0;
+}
+
+// Network state machine event, with the driver event data it needs copied in
+typedef struct
+{
+    net_event_t event;
+    union
+    {
+        // NET_EVENT_STA_GOT_IP
+        tcpip_adapter_ip_info_t ip_info;
+        // NET_EVENT_STA_CONNECTED
+        struct
+        {
+            uint8_t bssid[6];
+            uint8_t channel;
+        } link;
+        // NET_EVENT_AP_STA_CONNECTED and NET_EVENT_AP_STA_DISCONNECTED
+        struct
+        {
+            uint8_t mac[6];
+            uint8_t aid;
+        } station;
+    };
+} net_event_msg_t;
+
+static EventBits_t network_pending_bit(net_event_t event)
+{
+    switch (event)
+    {
+    case NET_EVENT_STA_DISCONNECTED:
+        return NET_PENDING_STA_DISCONNECTED;
+    case NET_EVENT_STA_GOT_IP:
+        return NET_PENDING_STA_GOT_IP;
+    case NET_EVENT_SHUTDOWN:
+        return NET_PENDING_SHUTDOWN;
+    default:
+        return 0;
+    }
+}
+
+// Never blocks. Shutdown, disconnect and got IP events arriving on a full queue are coalesced into
+// networkPendingGroup, and so are the ones following them until the network task replayed them, other events
+// are dropped
+static void post_network_message(const net_event_msg_t *msg)
+{
+    EventBits_t pending_bit = network_pending_bit(msg->event);
+
+    if (networkEventQueue != NULL &&
+        !(pending_bit && (xEventGroupGetBits(networkPendingGroup) & NET_PENDING_ALL)) &&
+        pdTRUE == xQueueSend(networkEventQueue, msg, 0))
+    {
+        return;
+    }
+
+    if (networkEventQueue == NULL || !pending_bit)
+    {
+        printf("\nNETWORK EVENT %s DROPPED\n", net_event_name(msg->event));
+        return;
+    }
+
+    if (pending_bit != NET_PENDING_SHUTDOWN)
+    {
+        pending_link_event = msg->event;
+    }
+    xEventGroupSetBits(networkPendingGroup, pending_bit);
+    printf("\nNETWORK EVENT %s COALESCED\n", net_event_name(msg->event));
+}
+
+static void post_network_event(net_event_t event)
+{
+    net_event_msg_t msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.event = event;
+    post_network_message(&msg);
 }
 
 static void button_task(void *params)
@@ -277,6 +408,7 @@ static void button_task(void *params)
                 switch (get_press_event())
                 {
                 case PRESS_EVENT_RESET:
+                    event_log_append(EVENT_LOG_BUTTON_RESET, 0);
                     xTaskNotify(ledUpdaterTask, LED_BLINK_START_EVENT, eSetBits);
 
                     // TODO renable this
@@ -285,13 +417,14 @@ static void button_task(void *params)
                     // Delay one second before shutting down wifi and led animation
                     TIME_DELAY_MILLIS(1000);
 
-                    xTaskNotify(networkTask, WIFI_SHUTDOWN_EVENT, eSetBits);
+                    post_network_event(NET_EVENT_SHUTDOWN);
                     break;
                 case PRESS_EVENT_DISCOVERY:
-                    if(!is_provisioning && (!credentials_ok || !ap_credentials_available)){
+                    // The state machine picks provisioning or reprovisioning, a running softAP is left alone
+                    if(!(xEventGroupGetBits(networkStateGroup) & NET_STATE_BIT_SOFTAP)){
                         // TODO renable this
                         //reset_persistent_storage();
-                        xTaskNotify(networkTask, WIFI_START_AP_EVENT, eSetBits);
+                        post_network_event(NET_EVENT_START_AP);
                     }
                     break;
                 default:
@@ -302,128 +435,639 @@ static void button_task(void *params)
     }
 }
 
-#define TIME_DELAY_RECONNECTION_MILLIS 3000
-#define MAX_CONNECTION_RETRIES 2
-static unsigned char connection_retries = 0;
+// Capacitive sensor stays off for this long after the station state changes, letting the radio settle
+#define CAP_SENSOR_RESUME_DISCONNECT_MILLIS 1000
+#define CAP_SENSOR_RESUME_GOT_IP_MILLIS 500
+static unsigned char cap_sensor_resume_pending = 0;
+static TickType_t cap_sensor_resume_tick = 0;
+
+// Resumes the capacitive sensor from the network task loop instead of blocking on a delay
+static void schedule_cap_sensor_resume(uint32_t delay_millis)
+{
+    cap_sensor_resume_tick = xTaskGetTickCount() + delay_millis / portTICK_PERIOD_MS;
+    cap_sensor_resume_pending = 1;
+}
 
 static tcpip_adapter_ip_info_t ip_info;
-static unsigned char network_task_working = 0;
-static unsigned char sta_connected = 0;
-static wifi_event_ap_staconnected_t *event_ap_staconnected = NULL;
-static wifi_event_ap_stadisconnected_t *event_ap_stadisconnected = NULL;
+static wifi_link_cache_t link_pending;
+
+// Station servers, bound to ip_info while sta_servers_up
+static discovery_server_t discovery_server;
+static listener_server_t listener_server;
+
+// Last time a broker session was open, drives the station power save profile
+static TickType_t broker_seen_tick = 0;
+static int power_profile = -1;
+
+static void close_station_servers(void)
+{
+    if (sta_servers_up)
+    {
+        close_service_advertise();
+        close_group_server(&group_server);
+        close_discovery_server(&discovery_server);
+        close_listener_server(&listener_server);
+    }
+    sta_servers_up = 0;
+}
+
+static void close_provision(void)
+{
+    if (provision_open)
+    {
+        deinit_wifi_provision();
+    }
+    provision_open = 0;
+}
+
+static unsigned char link_cache_changed(const wifi_link_cache_t *link)
+{
+    return (!link_cache_available ||
+            0 != memcmp(link->bssid, link_cache.bssid, sizeof(link_cache.bssid)) ||
+            link->channel != link_cache.channel ||
+            link->ip != link_cache.ip ||
+            link->netmask != link_cache.netmask ||
+            link->gw != link_cache.gw) ? 1 : 0;
+}
+
+// Runs on the event loop task, only queues the event for the network task
 static void wifi_event_handler(void *arg, esp_event_base_t event_base,
                                int32_t event_id, void *event_data)
 {
-    if (event_id == WIFI_EVENT_AP_STACONNECTED)
-    {
+    net_event_msg_t msg;
+    memset(&msg, 0, sizeof(msg));
 
+    if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_AP_STACONNECTED)
+    {
         // Station connected to lamp AP
-        event_ap_staconnected = (wifi_event_ap_staconnected_t *)event_data;
-
-        xTaskNotify(networkTask, WIFI_AP_STA_CONNECTED_EVENT, eSetBits);
+        wifi_event_ap_staconnected_t *event = (wifi_event_ap_staconnected_t *)event_data;
+        msg.event = NET_EVENT_AP_STA_CONNECTED;
+        memcpy(msg.station.mac, event->mac, sizeof(msg.station.mac));
+        msg.station.aid = event->aid;
     }
-    else if (event_id == WIFI_EVENT_AP_STADISCONNECTED)
+    else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_AP_STADISCONNECTED)
     {
-
         // Station disconnected from lamp AP
-        event_ap_stadisconnected = (wifi_event_ap_stadisconnected_t *)event_data;
-
-        xTaskNotify(networkTask, WIFI_AP_STA_DISCONNECTED_EVENT, eSetBits);
+        wifi_event_ap_stadisconnected_t *event = (wifi_event_ap_stadisconnected_t *)event_data;
+        msg.event = NET_EVENT_AP_STA_DISCONNECTED;
+        memcpy(msg.station.mac, event->mac, sizeof(msg.station.mac));
+        msg.station.aid = event->aid;
     }
     else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START)
     {
-        printf("\nCONNECTING TO WIFI\n");
-        if(credentials_ok == 0){
-            credentials_ok = (ESP_OK == esp_wifi_connect()) ? 1: 0;
-            if(credentials_ok){
-                printf("\nCREDENTIALS OK!\n");
-            }
-        }else{
-            esp_wifi_connect();
-        }
+        msg.event = NET_EVENT_STA_START;
+    }
+    else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_CONNECTED)
+    {
+        // Lamp station associated, remember the AP for the next directed connect
+        wifi_event_sta_connected_t *event = (wifi_event_sta_connected_t *)event_data;
+        msg.event = NET_EVENT_STA_CONNECTED;
+        memcpy(msg.link.bssid, event->bssid, sizeof(msg.link.bssid));
+        msg.link.channel = event->channel;
     }
     else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED)
     {
         // Lamp station disconnected from home AP
+        wifi_event_sta_disconnected_t *event = (wifi_event_sta_disconnected_t *)event_data;
+        msg.event = NET_EVENT_STA_DISCONNECTED;
+        event_log_append(EVENT_LOG_WIFI_DISCONNECT, event->reason);
+    }
+    else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP)
+    {
+        // Lamp station received an IP address from home AP
+        ip_event_got_ip_t *event = (ip_event_got_ip_t *)event_data;
+        msg.event = NET_EVENT_STA_GOT_IP;
+        msg.ip_info = event->ip_info;
+        event_log_append(EVENT_LOG_WIFI_ONLINE, event->ip_info.ip.addr);
+    }
+    else
+    {
+        return;
+    }
 
-        printf("\nWIFI_EVENT_STA_DISCONNECTED\n");
+    post_network_message(&msg);
+}
 
-        sta_connected = 0;
+void shutdown_wifi(void)
+{
+    if (net_state != NET_STATE_OFF)
+    {
+        printf("\nWIFI CLOSING\n");
+    }
 
-        if(ap_credentials_available &&
-            connection_retries < MAX_CONNECTION_RETRIES){
-            // Reconnection attempt
-            if(ESP_OK == esp_wifi_connect()){
-                credentials_ok = 1;
-            }
-            connection_retries++;
-        }else if(credentials_ok &&
-            ap_credentials_available){
-            // Connection was successfull once
-            // Retrying until credentials are available
-            connection_retries = 0;
-            if(ESP_OK != esp_wifi_connect()){
-                // Extending delay time after failure;
-                TIME_DELAY_MILLIS(TIME_DELAY_RECONNECTION_MILLIS);
-            }
-        }/* else if(!credentials_ok){
-            if(network_task_working){
-                xTaskNotify(networkTask, WIFI_SHUTDOWN_EVENT, eSetBits);
-            }
-            if(ap_credentials_available){
-                reset_persistent_storage();
-            }
-        } */
+    close_provision();
+    provision_lingering = 0;
+    sta_switch_pending = 0;
+
+    close_station_servers();
 
-        TIME_DELAY_MILLIS(1000);
-        cap_sensor_active = 1;
+    // No reconnect attempt may fire on a stopped driver
+    deinit_reconnect_scheduler();
+    deinit_wifi(&wifi_event_handler);
+}
+
+// Forward a network led command to the led updater task
+static void notify_led_event(listener_event_t event)
+{
+    switch (event)
+    {
+    case RESULT_LED_OFF:
+        xTaskNotify(ledUpdaterTask, LED_OFF_EVENT, eSetBits);
+        break;
+    case RESULT_LED_LOW:
+        xTaskNotify(ledUpdaterTask, LED_LOW_EVENT, eSetBits);
+        break;
+    case RESULT_LED_MEDIUM:
+        xTaskNotify(ledUpdaterTask, LED_MEDIUM_EVENT, eSetBits);
+        break;
+    case RESULT_LED_HIGH:
+        xTaskNotify(ledUpdaterTask, LED_HIGH_EVENT, eSetBits);
+        break;
+    case RESULT_LED_NEXT:
+        xTaskNotify(ledUpdaterTask, LED_NEXT_NETWORK_EVENT, eSetBits);
+        break;
+    default:
+        break;
     }
-    else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP)
+}
+
+// Radio stays awake during broker sessions and sleeps longer the longer no broker shows up
+static void update_power_profile(void)
+{
+    wifi_power_profile_t profile;
+    if (listener_has_client(&listener_server))
     {
-        // Lamp station received an IP address from home AP
-        ip_event_got_ip_t* event = (ip_event_got_ip_t*) event_data;
-        if(event->ip_changed){
-            ip_info = event->ip_info;
-        }
+        broker_seen_tick = xTaskGetTickCount();
+        profile = WIFI_POWER_PROFILE_ACTIVE;
+    }
+    else if ((xTaskGetTickCount() - broker_seen_tick) * portTICK_PERIOD_MS < WIFI_POWER_IDLE_AFTER_MILLIS)
+    {
+        profile = WIFI_POWER_PROFILE_STANDBY;
+    }
+    else
+    {
+        profile = WIFI_POWER_PROFILE_IDLE;
+    }
+
+    if ((int)profile != power_profile && ESP_OK == wifi_set_power_profile(profile))
+    {
+        printf("\nPOWER PROFILE %d, THEORETICAL LATENCY %u ms\n", profile, wifi_power_profile_theoretical_latency(profile));
+        power_profile = profile;
+    }
+}
+
+// Stored credentials go to the station, the previous ones are kept until the new AP gives an IP
+static void switch_station_credentials(void)
+{
+    prev_ussid = ussid;
+    prev_upwd = upwd;
+    prev_pin_code = pinCode;
+
+    ussid = new_ussid;
+    upwd = new_upwd;
+    pinCode = new_pin_code;
+
+    // Full retry budget for the new AP, no cached link
+    link_cache_available = 0;
+    reconnect_reset();
+
+    if (ESP_OK == wifi_sta_switch_credentials(ussid.string_array, ussid.string_len,
+                                              upwd.string_array, upwd.string_len))
+    {
+        printf("\nSWITCHING STATION TO %s\n", ussid.string_array);
+        sta_switch_pending = 1;
+        return;
+    }
+
+    ussid = prev_ussid;
+    upwd = prev_upwd;
+    pinCode = prev_pin_code;
+}
+
+static esp_err_t revert_station_credentials(void)
+{
+    sta_switch_pending = 0;
+
+    ussid = prev_ussid;
+    upwd = prev_upwd;
+    pinCode = prev_pin_code;
+
+    reconnect_reset();
+    printf("\nREVERTING STATION TO %s\n", ussid.string_array);
+    return wifi_sta_switch_credentials(ussid.string_array, ussid.string_len,
+                                       upwd.string_array, upwd.string_len);
+}
+
+static esp_err_t start_station(void)
+{
+    static esp_err_t _err;
+
+    printf("\nSTATION START EVENT FIRED\n");
+
+    cap_sensor_resume_pending = 0;
+    cap_sensor_active = 0;
+    TIME_DELAY_MILLIS(1000); // Give time to cap sensor for deactivating
+
+    memset(&link_pending, 0, sizeof(link_pending));
+    if (!ap_credentials_available)
+    {
+        _err = ESP_ERR_INVALID_STATE;
+    }
+    else if (ESP_OK == (_err = init_reconnect_scheduler()) &&
+             ESP_OK == (_err = init_wifi_sta(&wifi_event_handler,
+                                             ussid.string_array, ussid.string_len,
+                                                   upwd.string_array, upwd.string_len,
+                                             link_cache_available ? &link_cache : NULL)))
+    {
+        printf("\nWIFI STA INIT%s\n", link_cache_available ? ", CACHED LINK" : "");
+        link_fast_path = link_cache_available;
+        return ESP_OK;
+    }
+
+    deinit_reconnect_scheduler();
+    schedule_cap_sensor_resume(0);
+    return _err;
+}
+
+static esp_err_t start_access_point(void)
+{
+    static esp_err_t _err;
+
+    printf("\nAP START EVENT FIRED\n");
+
+    shutdown_wifi();
+    if (ESP_OK == (_err = init_wifi_ap(&wifi_event_handler)))
+    {
+        // Send blink animation event
+        xTaskNotify(ledUpdaterTask, LED_BLINK_LOOP_START_EVENT, eSetBits);
+    }
+    return _err;
+}
+
+static esp_err_t open_provision(const net_event_msg_t *msg)
+{
+    printf("\nStation " MACSTR " joined softAP, AID=%d\n", MAC2STR(msg->station.mac), msg->station.aid);
+
+    // Initialize Wifi provisioning
+    if (!provision_open && ESP_OK == init_wifi_provision())
+    {
+        provision_open = 1;
+    }
+    return provision_open ? ESP_OK : ESP_FAIL;
+}
+
+// Station lost its AP, the next attempt runs on the backoff timer. Fails once the station was shut down.
+static esp_err_t reconnect_station(void)
+{
+    printf("\nWIFI_EVENT_STA_DISCONNECTED\n");
+
+    if (link_fast_path)
+    {
+        // Cached AP or lease is stale, drop it
+        link_fast_path = 0;
+        link_cache_available = 0;
+    }
 
-        printf("\nSTATION CONNECTED, IP: %s\n", ip4addr_ntoa(&ip_info.ip));
+    // Directed connect only for the first attempt, retries scan all channels and use DHCP
+    if (ESP_OK == wifi_sta_full_scan())
+    {
+        printf("\nFALLING BACK TO FULL SCAN\n");
+    }
+
+    schedule_cap_sensor_resume(CAP_SENSOR_RESUME_DISCONNECT_MILLIS);
+
+    if (ESP_ERR_TIMEOUT != reconnect_schedule())
+    {
+        return ESP_OK;
+    }
 
-        connection_retries = 0;
+    // Retry budget spent, go back to the previous AP or restart the station from scratch
+    printf("\nRECONNECT BUDGET SPENT\n");
+    if (sta_switch_pending && ESP_OK == revert_station_credentials())
+    {
+        return ESP_OK;
+    }
+
+    shutdown_wifi();
+    return ESP_FAIL;
+}
+
+// Station got an IP, rebinds the servers to it. Fails once the station was shut down.
+static esp_err_t bind_station_servers(const tcpip_adapter_ip_info_t *info)
+{
+    ip_info = *info;
+    printf("\nSTATION CONNECTED, IP: %s\n", ip4addr_ntoa(&ip_info.ip));
 
-        TIME_DELAY_MILLIS(500);
-        cap_sensor_active = 1;
+    reconnect_reset();
 
-        if(ESP_OK == init_discovery_server(ip_info.ip.addr, lampSeed) &&
-            ESP_OK == init_listener_server(ip_info.ip.addr))
+    // Standby until a broker had the time to find the lamp
+    broker_seen_tick = xTaskGetTickCount();
+    power_profile = -1;
+
+    schedule_cap_sensor_resume(CAP_SENSOR_RESUME_GOT_IP_MILLIS);
+
+    // Rebind to the new IP after a reconnect
+    close_station_servers();
+
+    if (ESP_OK != init_discovery_server(&discovery_server, ip_info.ip.addr, lampSeed) ||
+        ESP_OK != init_listener_server(&listener_server, ip_info.ip.addr, &group_server))
+    {
+        printf("\nSTATION SERVERS FAILED\n");
+        shutdown_wifi();
+        return ESP_FAIL;
+    }
+    sta_servers_up = 1;
+
+    // Passive discovery through mDNS, not required for broker control
+    if(ESP_OK != init_service_advertise(lampSeed)){
+        printf("\nSERVICE ADVERTISE FAILED\n");
+    }
+
+    // Multicast group commands, not required for broker control
+    if(ESP_OK != init_group_server(&group_server, ip_info.ip.addr)){
+        printf("\nGROUP SERVER FAILED\n");
+    }
+
+    // Cached lease was applied as static IP, DHCP renews it from here on
+    if (link_fast_path && ESP_OK != wifi_sta_link_confirmed())
+    {
+        printf("\nDHCP CLIENT RESTART FAILED\n");
+    }
+
+    // Cache AP and lease for the next boot
+    link_fast_path = 0;
+    link_pending.ip = ip_info.ip.addr;
+    link_pending.netmask = ip_info.netmask.addr;
+    link_pending.gw = ip_info.gw.addr;
+    if (link_pending.channel != 0 && link_cache_changed(&link_pending))
+    {
+        link_cache = link_pending;
+        link_cache_available = (ESP_OK == save_wifi_link_cache(&link_cache)) ? 1 : 0;
+    }
+
+    if (sta_switch_pending)
+    {
+        // Reprovisioned credentials work, persist them
+        sta_switch_pending = 0;
+        if (ESP_OK == save_user_ap_credentials(ussid.string_array, ussid.string_len,
+                                               upwd.string_array, upwd.string_len,
+                                               pinCode) &&
+            ESP_OK == storage_flush())
         {
-            sta_connected = 1;
-        }/* else{
-            reset_persistent_storage();
-            xTaskNotify(networkTask, WIFI_SHUTDOWN_EVENT, eSetBits);
-        } */
+            printf("\nREPROVISIONED CREDENTIALS STORED\n");
+        }
+        else
+        {
+            // Pending writes are retried behind the network task
+            printf("\nREPROVISIONED CREDENTIALS NOT STORED YET\n");
+        }
     }
+
+    return ESP_OK;
 }
 
-void shutdown_wifi(void)
+static esp_err_t start_reprovisioning(void)
 {
-    if (network_task_working)
+    static esp_err_t _err;
+
+    // Reprovisioning, the station keeps serving brokers next to the softAP
+    if (sta_switch_pending)
     {
-        printf("\nWIFI CLOSING\n");
-        if (is_provisioning)
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    if (ESP_OK == (_err = wifi_start_provisioning_ap()))
+    {
+        reprovision_start = xTaskGetTickCount();
+    }
+    return _err;
+}
+
+// Closes the softAP next to the station, switching to the received credentials if they were acked
+static void end_reprovisioning(void)
+{
+    close_provision();
+    wifi_stop_provisioning_ap();
+    power_profile = -1;
+
+    if (provision_lingering)
+    {
+        switch_station_credentials();
+    }
+    provision_lingering = 0;
+}
+
+// Applies the transition table, only ever called from the network task
+static void network_dispatch(const net_event_msg_t *msg)
+{
+    net_transition_t transition = net_state_transition(net_state, msg->event);
+    esp_err_t err = ESP_OK;
+
+    if (msg->event == NET_EVENT_SERVER_FAIL)
+    {
+        event_log_append(EVENT_LOG_SERVER_FAIL, net_state);
+    }
+
+    switch (transition.action)
+    {
+    case NET_ACTION_SHUTDOWN:
+        shutdown_wifi();
+        stop_led_animation(ledStopSem, ledAnimationSem);
+        break;
+    case NET_ACTION_START_AP:
+        err = start_access_point();
+        break;
+    case NET_ACTION_START_STA:
+        err = start_station();
+        break;
+    case NET_ACTION_OPEN_PROVISION:
+        err = open_provision(msg);
+        break;
+    case NET_ACTION_CLOSE_PROVISION:
+        // A lingering exchange is ended by the network task loop
+        printf("\nStation " MACSTR " left softAP, AID=%d\n", MAC2STR(msg->station.mac), msg->station.aid);
+        close_provision();
+        break;
+    case NET_ACTION_STA_CONNECT:
+        printf("\nCONNECTING TO WIFI\n");
+        esp_wifi_connect();
+        break;
+    case NET_ACTION_RECORD_LINK:
+        memcpy(link_pending.bssid, msg->link.bssid, sizeof(link_pending.bssid));
+        link_pending.channel = msg->link.channel;
+        break;
+    case NET_ACTION_RECONNECT:
+        err = reconnect_station();
+        break;
+    case NET_ACTION_BIND_SERVERS:
+        err = bind_station_servers(&msg->ip_info);
+        break;
+    case NET_ACTION_START_REPROVISION:
+        err = start_reprovisioning();
+        break;
+    case NET_ACTION_END_REPROVISION:
+        end_reprovisioning();
+        break;
+    case NET_ACTION_ABORT_REPROVISION:
+        // Station dropped before the new credentials could be tried, keep the current ones
+        provision_lingering = 0;
+        end_reprovisioning();
+        err = reconnect_station();
+        break;
+    default:
+        break;
+    }
+
+    net_state_t next = (ESP_OK == err) ? transition.next : transition.fail;
+    if (next != net_state)
+    {
+        printf("\nNETWORK %s -> %s (%s)\n", net_state_name(net_state), net_state_name(next), net_event_name(msg->event));
+        net_state = next;
+        xEventGroupClearBits(networkStateGroup, NET_STATE_BITS_ALL & ~net_state_bits(net_state));
+        xEventGroupSetBits(networkStateGroup, net_state_bits(net_state));
+    }
+}
+
+static void network_dispatch_event(net_event_t event)
+{
+    net_event_msg_t msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.event = event;
+    network_dispatch(&msg);
+}
+
+// Provisioning listen step, waits up to timeout_millis
+static void provisioning_step(uint32_t timeout_millis)
+{
+    static esp_err_t _err;
+
+    if (ESP_ERR_TIMEOUT == (_err = provision_listen(&new_ussid, &new_upwd, &new_pin_code, timeout_millis)))
+    {
+        // Retransmissions are acked inside provision_listen, end provisioning once the linger elapses
+        if (!provision_lingering ||
+            (xTaskGetTickCount() - provision_linger_start) * portTICK_PERIOD_MS < PROVISION_LINGER_MILLIS)
         {
-            deinit_wifi_provision();
+            return;
         }
-        is_provisioning = 0;
+    }
+    else if (_err == ESP_OK)
+    {
+        // Retrieved SSID and password, acknowledging before ending provisioning
+
+        printf("\nWifi Credentials retrieved!\n");
+        printf("\nSSID -> %s\nPassword -> %s\n", new_ussid.string_array, new_upwd.string_array);
+        printf("\nPIN CODE -> %u\n", new_pin_code);
+
+        event_log_append(EVENT_LOG_PROVISIONED, (net_state == NET_STATE_STA_REPROVISIONING) ? 1 : 0);
+
+        if (net_state == NET_STATE_STA_REPROVISIONING)
+        {
+            // Stored once the station got an IP on the new AP
+            provision_ack(PROVISION_ACK_OK);
+            provision_lingering = 1;
+            provision_linger_start = xTaskGetTickCount();
+            return;
+        }
+
+        if (ESP_OK != (_err = save_user_ap_credentials(new_ussid.string_array, new_ussid.string_len,
+                                                       new_upwd.string_array, new_upwd.string_len,
+                                                       new_pin_code)))
+        {
+            provision_ack(PROVISION_ACK_STORAGE_FAIL);
+            provision_lingering = 0;
+        }
+        else if (ESP_OK == (_err = storage_flush()))
+        {
+            // Acked once on flash, a power cut after the ack must not lose them
+            ussid = new_ussid;
+            upwd = new_upwd;
+            pinCode = new_pin_code;
+            ap_credentials_available = 1;
 
-        if(sta_connected){
-            close_discovery_server();
-            close_listener_server();
+            // New home AP, the cached link no longer applies
+            link_cache_available = 0;
+
+            provision_ack(PROVISION_ACK_OK);
+            provision_lingering = 1;
+            provision_linger_start = xTaskGetTickCount();
+            return;
+        }
+        else
+        {
+            // Refused credentials must not reach flash with a later retry, the cache goes back to the stored ones
+            if (ap_credentials_available)
+            {
+                save_user_ap_credentials(ussid.string_array, ussid.string_len,
+                                         upwd.string_array, upwd.string_len,
+                                         pinCode);
+            }
+            else
+            {
+                storage_data_reset();
+            }
+            provision_ack(PROVISION_ACK_STORAGE_FAIL);
+            provision_lingering = 0;
         }
-        sta_connected = 0;
+    }
 
-        deinit_wifi(&wifi_event_handler);
+    network_dispatch_event(NET_EVENT_PROVISION_DONE);
+}
+
+// Provisioning progress between driver events: listen, phone gone while lingering, softAP timeout
+static void provisioning_poll(uint32_t timeout_millis)
+{
+    if (provision_open)
+    {
+        provisioning_step(timeout_millis);
+    }
+    else if (provision_lingering)
+    {
+        // Provisioned phone left, no need to wait for retransmissions
+        network_dispatch_event(NET_EVENT_PROVISION_DONE);
+    }
+    else if (net_state == NET_STATE_STA_REPROVISIONING &&
+             (xTaskGetTickCount() - reprovision_start) * portTICK_PERIOD_MS >= REPROVISION_AP_TIMEOUT_MILLIS)
+    {
+        // Nobody provisioned, close the open softAP
+        network_dispatch_event(NET_EVENT_PROVISION_DONE);
+    }
+}
+
+// Replays the events coalesced by post_network_message(), once the queue they overflowed is drained.
+// The address of a coalesced got IP event is read back from the adapter, shutdown goes last
+static void network_replay_pending(void)
+{
+    EventBits_t pending = xEventGroupClearBits(networkPendingGroup, NET_PENDING_ALL) & NET_PENDING_ALL;
+    net_event_msg_t msg;
+
+    if (!pending)
+    {
+        return;
+    }
+
+    if ((pending & NET_PENDING_STA_DISCONNECTED) &&
+        (!(pending & NET_PENDING_STA_GOT_IP) || pending_link_event == NET_EVENT_STA_GOT_IP))
+    {
+        network_dispatch_event(NET_EVENT_STA_DISCONNECTED);
+        pending &= ~NET_PENDING_STA_DISCONNECTED;
+    }
+    if (pending & NET_PENDING_STA_GOT_IP)
+    {
+        memset(&msg, 0, sizeof(msg));
+        msg.event = NET_EVENT_STA_GOT_IP;
+        if (ESP_OK == tcpip_adapter_get_ip_info(TCPIP_ADAPTER_IF_STA, &msg.ip_info) && msg.ip_info.ip.addr != 0)
+        {
+            network_dispatch(&msg);
+        }
+    }
+    if (pending & NET_PENDING_STA_DISCONNECTED)
+    {
+        network_dispatch_event(NET_EVENT_STA_DISCONNECTED);
+    }
+    if (pending & NET_PENDING_SHUTDOWN)
+    {
+        network_dispatch_event(NET_EVENT_SHUTDOWN);
     }
-    network_task_working = 0;
 }
 
 static void network_task(void *params)
@@ -432,7 +1076,13 @@ static void network_task(void *params)
     is_managed = 0;
 
     static uint32_t networkNotificationValue;
-    static esp_err_t _err;
+    static net_event_msg_t msg;
+
+    // Pending state push, coalesced over LAMP_STATE_PUSH_COALESCE_MILLIS
+    static unsigned char state_push_pending;
+    state_push_pending = 0;
+    static TickType_t state_push_start;
+    state_push_start = 0;
 
     // Sleep execution, to help calibrating capacitive sensor
     TIME_DELAY_MILLIS(1000);
@@ -442,164 +1092,128 @@ static void network_task(void *params)
         if (xTaskNotifyWait(0x00,                      /* Don't clear any notification bits on entry. */
                             0xffffffffUL,              /* Reset the notification value to 0 on exit. */
                             &networkNotificationValue, /* Notified value */
-                            (TickType_t)20) == pdTRUE)
+                            0) == pdTRUE &&
+            networkNotificationValue & LAMP_STATE_PUSH_EVENT_WAIT && !state_push_pending)
         {
-            if (networkNotificationValue & WIFI_SHUTDOWN_EVENT_WAIT)
-            {
-                shutdown_wifi();
-                stop_led_animation(ledStopSem, ledAnimationSem);
-            }
-            else if (networkNotificationValue & WIFI_START_AP_EVENT_WAIT)
-            {
-                printf("\nAP START EVENT FIRED\n");
-                shutdown_wifi();
-                if (ESP_OK == init_wifi_ap(&wifi_event_handler))
-                {
-                    // Send blink animation event
-                    xTaskNotify(ledUpdaterTask, LED_BLINK_LOOP_START_EVENT, eSetBits);
-                    network_task_working = 1;
-                    continue;
-                }
-            }
-            else if (networkNotificationValue & WIFI_AP_STA_CONNECTED_EVENT_WAIT)
-            {
-                printf("\nAP STA CONNECTED EVENT FIRED\n");
-                if (event_ap_staconnected)
-                {
-                    printf("\nStation " MACSTR " joined softAP, AID=%d\n", MAC2STR(event_ap_staconnected->mac), event_ap_staconnected->aid);
-                    // Initialize Wifi provisioning
-                    if (!is_provisioning && network_task_working)
-                    {
-                        if (ESP_OK == init_wifi_provision())
-                        {
-                            is_provisioning = 1;
-                        }
-                    }
-                }
-            }
-            else if (networkNotificationValue & WIFI_AP_STA_DISCONNECTED_EVENT_WAIT)
-            {
-                printf("\nAP STA DISCONNECTED EVENT FIRED\n");
-                if (event_ap_stadisconnected)
-                {
-                    printf("\nStation " MACSTR " left softAP, AID=%d\n", MAC2STR(event_ap_stadisconnected->mac), event_ap_stadisconnected->aid);
-                    // Deinit Wifi provisioning
-                    if (is_provisioning)
-                    {
-                        deinit_wifi_provision();
-                    }
-                    is_provisioning = 0;
-                }
-            }
-            else if (networkNotificationValue & WIFI_START_STA_EVENT_WAIT)
-            {
-                printf("\nSTATION START EVENT FIRED\n");
+            // First state change of a burst, open the coalescing window
+            state_push_pending = 1;
+            state_push_start = xTaskGetTickCount();
+        }
 
-                cap_sensor_active = 0;
-                TIME_DELAY_MILLIS(1000); // Give time to cap sensor for deactivating
+        // Waits for the first queued event, then drains the queue. An image being received only
+        // polls it, the loop goes straight back to the listener
+        if (xQueueReceive(networkEventQueue, &msg, ota_update_in_progress() ? 0 : (TickType_t)20) == pdTRUE)
+        {
+            do
+            {
+                network_dispatch(&msg);
+            } while (xQueueReceive(networkEventQueue, &msg, 0) == pdTRUE);
+        }
+        network_replay_pending();
 
-                if (ap_credentials_available &&
-                    ESP_OK == init_wifi_sta(&wifi_event_handler,
-                                            ussid.string_array, ussid.string_len,
-                                            upwd.string_array, upwd.string_len))
-                {
-                    printf("\nWIFI STA INIT\n");
-                    network_task_working = 1;
-                }
-            }
+        if (cap_sensor_resume_pending &&
+            (int32_t)(xTaskGetTickCount() - cap_sensor_resume_tick) >= 0)
+        {
+            cap_sensor_resume_pending = 0;
+            cap_sensor_active = 1;
         }
 
-        if (sta_connected && network_task_working)
+        if (net_state == NET_STATE_STA_ONLINE || net_state == NET_STATE_STA_REPROVISIONING)
         {
             // Network Ops
 
             // Discovery Responder listen call
-            if(ESP_FAIL == discovery_listen(led_get_state(), is_managed, pinCode)){
+            if(ESP_FAIL == discovery_listen(&discovery_server, led_get_state(), is_managed, pinCode)){
                 printf("\nDISCOVERY SERVER FAILED\n");
-                xTaskNotify(networkTask, WIFI_SHUTDOWN_EVENT, eSetBits);
+                network_dispatch_event(NET_EVENT_SERVER_FAIL);
+                continue;
+            }
+
+            // Group commands listen call
+            listener_event_t group_event = group_listen(&group_server);
+            if(RESULT_FAIL == group_event){
+                printf("\nGROUP SERVER FAILED\n");
+                network_dispatch_event(NET_EVENT_SERVER_FAIL);
                 continue;
             }
+            if(RESULT_NO_ACTION != group_event){
+                // Applied within the radio frame, the reserved sequence mark is written behind by storage_task
+                notify_led_event(group_event);
+                uint32_t sequence_mark;
+                if(group_reserve_sequence(&group_server, &sequence_mark) && ESP_OK != save_group_sequence(sequence_mark)){
+                    // Reserved again with the next command
+                    printf("\nGROUP SEQUENCE MARK NOT STORED\n");
+                    group_server.reserved_sequence = group_server.last_sequence;
+                }
+            }
+
+            // Announce state changes through mDNS
+            service_advertise_update(led_get_state(), is_managed);
+
+            // Push coalesced state changes over the TLS session
+            if (state_push_pending &&
+                (xTaskGetTickCount() - state_push_start) * portTICK_PERIOD_MS >= LAMP_STATE_PUSH_COALESCE_MILLIS)
+            {
+                state_push_pending = 0;
+                if (listener_has_client(&listener_server) && ESP_OK != send_state_ping(&listener_server))
+                {
+                    network_dispatch_event(NET_EVENT_SERVER_FAIL);
+                    continue;
+                }
+            }
 
             is_managed = 0;
-            listener_event_t event = listener_listen();
+            listener_event_t event = listener_listen(&listener_server);
             switch (event)
             {
             case RESULT_FAIL:
                 printf("\nDISCOVERY SERVER FAILED\n");
-                xTaskNotify(networkTask, WIFI_SHUTDOWN_EVENT, eSetBits);
-                break;
+                network_dispatch_event(NET_EVENT_SERVER_FAIL);
+                continue;
             case RESULT_CLIENT_STALE:
                 is_managed = 1;
                 break;
-            case RESULT_LED_OFF:
+            case RESULT_GROUP_ASSIGNED:
                 is_managed = 1;
-                xTaskNotify(ledUpdaterTask, LED_OFF_EVENT, eSetBits);
-                if(ESP_OK != send_state_ping()){
-                    xTaskNotify(networkTask, WIFI_SHUTDOWN_EVENT, eSetBits);
+                if(ESP_OK != save_group_assignment(group_server.group_id, group_server.key) ||
+                   ESP_OK != storage_flush()){
+                    printf("\nGROUP ASSIGNMENT NOT STORED\n");
                 }
                 break;
+            case RESULT_LED_OFF:
             case RESULT_LED_LOW:
-                is_managed = 1;
-                xTaskNotify(ledUpdaterTask, LED_LOW_EVENT, eSetBits);
-                if(ESP_OK != send_state_ping()){
-                    xTaskNotify(networkTask, WIFI_SHUTDOWN_EVENT, eSetBits);
-                }
-                break;
             case RESULT_LED_MEDIUM:
-                is_managed = 1;
-                xTaskNotify(ledUpdaterTask, LED_MEDIUM_EVENT, eSetBits);
-                if(ESP_OK != send_state_ping()){
-                    xTaskNotify(networkTask, WIFI_SHUTDOWN_EVENT, eSetBits);
-                }
-                break;
             case RESULT_LED_HIGH:
-                is_managed = 1;
-                xTaskNotify(ledUpdaterTask, LED_HIGH_EVENT, eSetBits);
-                if(ESP_OK != send_state_ping()){
-                    xTaskNotify(networkTask, WIFI_SHUTDOWN_EVENT, eSetBits);
-                }
-                break;
             case RESULT_LED_NEXT:
                 is_managed = 1;
-                xTaskNotify(ledUpdaterTask, LED_NEXT_NETWORK_EVENT, eSetBits);
-                if(ESP_OK != send_state_ping()){
-                    xTaskNotify(networkTask, WIFI_SHUTDOWN_EVENT, eSetBits);
+                notify_led_event(event);
+                if(ESP_OK != send_state_ping(&listener_server)){
+                    network_dispatch_event(NET_EVENT_SERVER_FAIL);
+                    continue;
                 }
                 break;
             default:
                 break;
             }
+
+            // Radio power save follows the broker session
+            update_power_profile();
+
+            // Reprovisioning next to the station, without stalling broker commands
+            if (net_state == NET_STATE_STA_REPROVISIONING)
+            {
+                provisioning_poll(0);
+            }
         }
-        else if (ap_credentials_available && !network_task_working)
+        else if (net_state == NET_STATE_OFF && ap_credentials_available)
         {
             printf("\nAP CREDENTIALS SET, Starting STATION since it's not running\n");
-            xTaskNotify(networkTask, WIFI_START_STA_EVENT, eSetBits);
+            network_dispatch_event(NET_EVENT_START_STA);
         }
-        else if (is_provisioning && network_task_working)
+        else if (net_state == NET_STATE_AP || net_state == NET_STATE_AP_PROVISIONING)
         {
             // Wifi provisioning semi-blocking listen
-            printf("\nListening for provision...\n");
-            if (ESP_ERR_TIMEOUT == (_err = provision_listen(&ussid, &upwd, &pinCode)))
-            {
-                continue;
-            }
-            else if (_err == ESP_OK)
-            {
-                // Retrieved SSID and password, ending provisioning
-
-                if (ESP_OK == save_user_ap_ssid(ussid.string_array, ussid.string_len) &&
-                    ESP_OK == save_user_ap_password(upwd.string_array, upwd.string_len) &&
-                    ESP_OK == save_pin_code(pinCode))
-                {
-                    printf("\nWifi Credentials retrieved!\n");
-                    printf("\nSSID -> %s\nPassword -> %s\n", ussid.string_array, upwd.string_array);
-                    printf("\nPIN CODE -> %u\n", pinCode);
-                    ap_credentials_available = 1;
-                }
-            }
-            deinit_wifi_provision();
-            is_provisioning = 0;
-            xTaskNotify(networkTask, WIFI_SHUTDOWN_EVENT, eSetBits);
+            provisioning_poll(PROVISION_LISTEN_MILLIS);
         }
     }
 }
@@ -620,7 +1234,10 @@ void app_main()
     else
     {
 
-        network_task_working = 0;
+        // Network state machine, fed by the wifi event handler and the button task
+        networkStateGroup = xEventGroupCreate();
+        networkPendingGroup = xEventGroupCreate();
+        networkEventQueue = xQueueCreate(NETWORK_EVENT_QUEUE_LENGTH, sizeof(net_event_msg_t));
 
         if (!ledStopSem)
         {
@@ -668,17 +1285,62 @@ void app_main()
             printf("\nnvs_flash_init() error {%d}\n", _err);
         }
 
-        // Initialize packet table and lamp seed
-        if (RegisterNetworkPackets() && ESP_OK == get_lamp_seed(&lampSeed))
+        // Config is read from flash once, storage calls are served from RAM afterwards
+        if (ESP_OK != (_err = init_storage()))
         {
-            printf("\nLAMP SEED -> %u\n", lampSeed);
-            // Create button task
-            xTaskCreate(network_task,
-                        "network_task",
-                        NETWORK_TASK_STACK_DEPTH,
+            printf("\ninit_storage() error {%d}\n", _err);
+        }
+        else
+        {
+            // Write-behind flushes, kept out of the esp_timer task
+            xTaskCreate(storage_task,
+                        "storage_task",
+                        STORAGE_TASK_STACK_DEPTH,
                         NULL,
-                        NETWORK_TASK_PRIORITY,
-                        &networkTask);
+                        STORAGE_TASK_PRIORITY,
+                        &storageTask);
+        }
+
+        // Group key and sequence window survive reboots, replays of commands seen before are rejected
+        static uint32_t group_id;
+        static uint8_t group_key[GROUP_KEY_LENGTH];
+        static uint32_t group_sequence;
+        if (ESP_OK == get_group_config(&group_id, group_key, &group_sequence))
+        {
+            group_restore(&group_server, group_id, group_key, group_sequence);
+        }
+
+        // Packet table before any task that serializes packets, the event log task included
+        static unsigned char packets_registered;
+        packets_registered = RegisterNetworkPackets();
+
+        // Field event log, written behind by its own low priority task
+        if (ESP_OK != (_err = init_event_log()))
+        {
+            printf("\ninit_event_log() error {%d}\n", _err);
+        }
+        else
+        {
+            event_log_append(EVENT_LOG_BOOT, esp_reset_reason());
+            xTaskCreate(event_log_task,
+                        "event_log_task",
+                        EVENT_LOG_TASK_STACK_DEPTH,
+                        NULL,
+                        EVENT_LOG_TASK_PRIORITY,
+                        &eventLogTask);
+        }
+
+        // Counts the boot of an updated image still on trial, rolls it back when it used up its boots
+        if (ESP_OK != (_err = init_ota_update()))
+        {
+            printf("\ninit_ota_update() error {%d}\n", _err);
+        }
+
+        // Back to the last lamp state before networking starts, brokers need not re-push it after a power cut
+        static uint8_t lamp_state;
+        if (ESP_OK == get_lamp_state(&lamp_state) && ESP_OK == led_set_state(lamp_state))
+        {
+            printf("\nLAMP STATE RESTORED -> %u\n", lamp_state);
         }
 
         if (ESP_OK == get_user_ap_ssid_string(&ussid) &&
@@ -687,12 +1349,26 @@ void app_main()
         {
             printf("\nPIN CODE -> %u\n", pinCode);
             ap_credentials_available = 1;
-            xTaskNotify(networkTask, WIFI_START_STA_EVENT, eSetBits);
+            link_cache_available = (ESP_OK == get_wifi_link_cache(&link_cache)) ? 1 : 0;
+            // Station is started by the network task once it runs
             printf("\nWIFI credentials set\n");
         }
         else
         {
             ap_credentials_available = 0;
         }
+
+        // Initialize lamp seed
+        if (packets_registered && ESP_OK == get_lamp_seed(&lampSeed))
+        {
+            printf("\nLAMP SEED -> %u\n", lampSeed);
+            // Create button task
+            xTaskCreate(network_task,
+                        "network_task",
+                        NETWORK_TASK_STACK_DEPTH,
+                        NULL,
+                        NETWORK_TASK_PRIORITY,
+                        &networkTask);
+        }
     }
 }
@@ -0,0 +1,115 @@
+#!/usr/bin/env python
+
+# Packs the files of the assets folder into the image of the read-only asset partition,
+# read on the lamp by components/storage/asset_store.c.
+#
+# Usage: mkassets.py [output image] [partition table csv]
+
+import os, sys, struct, zlib
+
+__ASSETS_PATH = os.path.join(os.path.dirname(os.path.abspath(__file__)), "assets")
+__PARTITION_CSV = os.path.join(os.path.dirname(os.path.abspath(__file__)), "partition-table.csv")
+__IMAGE_PATH = os.path.join(os.getcwd(), "build", "assets.bin")
+
+ASSET_PARTITION_LABEL = "assets"
+
+# Same layout as asset_header_t and asset_entry_t
+__MAGIC = 0x53415456
+__VERSION = 1
+__HEADER_FORMAT = "<IHHII"
+__HEADER_CRC_FORMAT = "<I"
+__ENTRY_FORMAT = "<16sIIII"
+__NAME_LENGTH = 16
+__MAX_COUNT = 64
+__ALIGNMENT = 4
+
+# First free offset after the partition table, and gen_esp32part.py alignments
+__FIRST_OFFSET = 0x9000
+__APP_ALIGNMENT = 0x10000
+__DATA_ALIGNMENT = 0x1000
+
+
+def _parse_size(value: str) -> int:
+    value = value.strip()
+    if value.upper().endswith("K"):
+        return int(value[:-1], 0) * 1024
+    if value.upper().endswith("M"):
+        return int(value[:-1], 0) * 1024 * 1024
+    return int(value, 0)
+
+
+def partition_geometry(csv_path: str, label: str) -> tuple[int, int]:
+    """Offset and size of partition label, blank offsets placed as gen_esp32part.py does"""
+    offset = __FIRST_OFFSET
+    with open(csv_path) as csv:
+        for line in csv:
+            line = line.split("#")[0].strip()
+            if not line:
+                continue
+            fields = [field.strip() for field in line.split(",")]
+            alignment = __APP_ALIGNMENT if fields[1] == "app" else __DATA_ALIGNMENT
+            if fields[3]:
+                offset = int(fields[3], 0)
+            else:
+                offset = (offset + alignment - 1) // alignment * alignment
+            size = _parse_size(fields[4])
+            if fields[0] == label:
+                return offset, size
+            offset += size
+    raise KeyError(f"no {label} partition in {csv_path}")
+
+
+def _align(value: int) -> int:
+    return (value + __ALIGNMENT - 1) // __ALIGNMENT * __ALIGNMENT
+
+
+def build_image(paths: list[str]) -> bytes:
+    if len(paths) > __MAX_COUNT:
+        raise ValueError(f"more than {__MAX_COUNT} assets")
+
+    offset = struct.calcsize(__HEADER_FORMAT) + len(paths) * struct.calcsize(__ENTRY_FORMAT)
+    table = b""
+    data = b""
+    for path in paths:
+        name = os.path.basename(path).encode()
+        if len(name) > __NAME_LENGTH:
+            raise ValueError(f"asset name {name} longer than {__NAME_LENGTH} bytes")
+        with open(path, "rb") as asset:
+            content = asset.read()
+        table += struct.pack(__ENTRY_FORMAT, name, offset + len(data), len(content), zlib.crc32(content), 0xFFFFFFFF)
+        # Padding left erased
+        data += content + b"\xff" * (_align(len(content)) - len(content))
+
+    length = offset + len(data)
+    # The header CRC covers the fields before it and the table
+    header = struct.pack(__HEADER_FORMAT, __MAGIC, __VERSION, len(paths), length, 0)
+    header = header[: -struct.calcsize(__HEADER_CRC_FORMAT)]
+    crc = zlib.crc32(table, zlib.crc32(header))
+    return header + struct.pack(__HEADER_CRC_FORMAT, crc) + table + data
+
+
+def _run() -> int:
+    image_path = sys.argv[1] if len(sys.argv) > 1 else __IMAGE_PATH
+    csv_path = sys.argv[2] if len(sys.argv) > 2 else __PARTITION_CSV
+
+    paths = sorted(
+        os.path.join(__ASSETS_PATH, name)
+        for name in os.listdir(__ASSETS_PATH)
+        if os.path.isfile(os.path.join(__ASSETS_PATH, name))
+    )
+    image = build_image(paths)
+
+    _, size = partition_geometry(csv_path, ASSET_PARTITION_LABEL)
+    if len(image) > size:
+        print(f"assets image of {len(image)} bytes does not fit the {size} byte partition")
+        return 1
+
+    os.makedirs(os.path.dirname(os.path.abspath(image_path)), exist_ok=True)
+    with open(image_path, "wb") as out:
+        out.write(image)
+    print(f"{image_path}: {len(paths)} assets, {len(image)} of {size} bytes")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(_run())
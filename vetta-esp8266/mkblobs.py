@@ -0,0 +1,80 @@
+#!/usr/bin/env python
+
+# Packs a device TLS certificate and key into the image of the blob partition,
+# read on the lamp by components/storage/blob_store.c. The provisioned pair takes precedence
+# over the one in the asset partition.
+#
+# Usage: mkblobs.py <certificate> <key> [output image] [partition table csv]
+
+import os, sys, struct, zlib
+from mkassets import partition_geometry
+
+__PARTITION_CSV = os.path.join(os.path.dirname(os.path.abspath(__file__)), "partition-table.csv")
+__IMAGE_PATH = os.path.join(os.getcwd(), "build", "blobs.bin")
+
+BLOB_PARTITION_LABEL = "blobs"
+
+# Same layout as blob_header_t, the blob data follows the header in its slot
+__MAGIC = 0x4C425456
+__VERSION = 1
+__HEADER_FORMAT = "<IHHII"
+__HEADER_CRC_FORMAT = "<I"
+__HEADER_SIZE = 32
+__SLOT_SIZE = 4096
+__SLOT_COUNT = 2
+__ALIGNMENT = 4
+
+# Same values as blob_id_t
+BLOB_DEVICE_CERT = 0
+BLOB_DEVICE_KEY = 1
+BLOB_COUNT = 2
+
+
+def _slot(blob_id: int, content: bytes) -> bytes:
+    """First slot of blob_id holding content as sequence 1, the other slot stays erased"""
+    if len(content) > __SLOT_SIZE - __HEADER_SIZE:
+        raise ValueError(f"blob {blob_id} of {len(content)} bytes does not fit a slot")
+
+    sequence = 1
+    header = struct.pack(__HEADER_FORMAT, __MAGIC, blob_id, __VERSION, len(content), sequence)
+    # The CRC covers the header fields before it and the data
+    crc = zlib.crc32(content, zlib.crc32(header))
+    header += struct.pack(__HEADER_CRC_FORMAT, crc)
+    # Reserved bytes and the padding to whole words are left erased
+    header += b"\xff" * (__HEADER_SIZE - len(header))
+    data = content + b"\xff" * ((__ALIGNMENT - len(content) % __ALIGNMENT) % __ALIGNMENT)
+    return (header + data).ljust(__SLOT_SIZE * __SLOT_COUNT, b"\xff")
+
+
+def build_image(blobs: dict[int, bytes]) -> bytes:
+    return b"".join(_slot(blob_id, blobs[blob_id]) for blob_id in range(BLOB_COUNT))
+
+
+def _run() -> int:
+    if len(sys.argv) < 3:
+        print("usage: mkblobs.py <certificate> <key> [output image] [partition table csv]")
+        return 1
+
+    image_path = sys.argv[3] if len(sys.argv) > 3 else __IMAGE_PATH
+    csv_path = sys.argv[4] if len(sys.argv) > 4 else __PARTITION_CSV
+
+    blobs = {}
+    for blob_id, path in ((BLOB_DEVICE_CERT, sys.argv[1]), (BLOB_DEVICE_KEY, sys.argv[2])):
+        with open(path, "rb") as blob:
+            blobs[blob_id] = blob.read()
+    image = build_image(blobs)
+
+    offset, size = partition_geometry(csv_path, BLOB_PARTITION_LABEL)
+    if len(image) > size:
+        print(f"blobs image of {len(image)} bytes does not fit the {size} byte partition")
+        return 1
+
+    os.makedirs(os.path.dirname(os.path.abspath(image_path)), exist_ok=True)
+    with open(image_path, "wb") as out:
+        out.write(image)
+    print(f"{image_path}: {len(blobs)} blobs, flash at {hex(offset)}")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(_run())
@@ -0,0 +1,84 @@
+#!/usr/bin/env python
+
+# Signs firmware images for the OTA update received by components/network/ota_update.c.
+#
+# Usage: otasign.py keygen [private key]
+#            Creates the ECDSA P-256 signing key and writes its public half to assets/ota.pub
+#        otasign.py sign <version> [image] [private key]
+#            Writes the DER signature of the SHA-256 over the version (4 bytes, little endian) and the image
+#            to <image>.sig, sent in OTA_BEGIN with the version. Lamps refuse versions below their OTA_FIRMWARE_VERSION
+#
+# The private key stays off the lamps and out of the repository.
+
+import os, sys, struct, subprocess, tempfile
+from mkassets import partition_geometry
+
+__ROOT_PATH = os.path.dirname(os.path.abspath(__file__))
+__KEY_PATH = os.path.join(__ROOT_PATH, "ota_signing.pem")
+__PUBLIC_KEY_PATH = os.path.join(__ROOT_PATH, "assets", "ota.pub")
+__IMAGE_PATH = os.path.join(os.getcwd(), "build", "vetta-esp8266.bin")
+
+# Same limits as ota_update.h
+__SIGNATURE_MAX_SIZE = 80
+__PARTITION_CSV = os.path.join(__ROOT_PATH, "partition-table.csv")
+__ESP_IMAGE_MAGIC = 0xE9
+
+
+def _openssl(*args: str) -> int:
+    return subprocess.call(("openssl",) + args, stdout=sys.stdout)
+
+
+def _keygen(key_path: str) -> int:
+    if os.path.exists(key_path):
+        print(f"{key_path} exists, remove it to replace the key of the fleet")
+        return 1
+
+    _res = _openssl("ecparam", "-name", "prime256v1", "-genkey", "-noout", "-out", key_path)
+    if _res == 0:
+        _res = _openssl("ec", "-in", key_path, "-pubout", "-outform", "DER", "-out", __PUBLIC_KEY_PATH)
+    if _res == 0:
+        print(f"{key_path}: signing key, {__PUBLIC_KEY_PATH}: reflash the asset partition to install it")
+    return _res
+
+
+def _sign(version: int, image_path: str, key_path: str) -> int:
+    with open(image_path, "rb") as image:
+        content = image.read()
+    _, size = partition_geometry(__PARTITION_CSV, "ota_0")
+    if not content or content[0] != __ESP_IMAGE_MAGIC or len(content) > size:
+        print(f"{image_path} is not a firmware image fitting the {size} byte app partition")
+        return 1
+
+    if version < 0 or version > 0xFFFFFFFF:
+        print(f"{version} is not a 32 bit version")
+        return 1
+
+    # Signed message: version then image
+    signature_path = image_path + ".sig"
+    with tempfile.NamedTemporaryFile(suffix=".signed") as signed:
+        signed.write(struct.pack("<I", version) + content)
+        signed.flush()
+        _res = _openssl("dgst", "-sha256", "-sign", key_path, "-out", signature_path, signed.name)
+    if _res == 0 and os.path.getsize(signature_path) > __SIGNATURE_MAX_SIZE:
+        print(f"{signature_path} longer than {__SIGNATURE_MAX_SIZE} bytes, not an ECDSA P-256 key")
+        return 1
+    if _res == 0:
+        print(f"{signature_path}: {len(content)} byte image, version {version}")
+    return _res
+
+
+def _run() -> int:
+    if len(sys.argv) > 1 and sys.argv[1] == "keygen":
+        return _keygen(sys.argv[2] if len(sys.argv) > 2 else __KEY_PATH)
+    if len(sys.argv) > 2 and sys.argv[1] == "sign" and sys.argv[2].isdigit():
+        return _sign(
+            int(sys.argv[2]),
+            sys.argv[3] if len(sys.argv) > 3 else __IMAGE_PATH,
+            sys.argv[4] if len(sys.argv) > 4 else __KEY_PATH,
+        )
+    print("usage: otasign.py keygen [private key] | sign <version> [image] [private key]")
+    return 1
+
+
+if __name__ == "__main__":
+    sys.exit(_run())